@@ -0,0 +1,580 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_Algorithms_DynamicKDTreeN_hpp__
+#define __Thea_Algorithms_DynamicKDTreeN_hpp__
+
+#include "../Common.hpp"
+#include "../Array.hpp"
+#include "../Noncopyable.hpp"
+#include "Filter.hpp"
+#include "KDTreeN.hpp"
+#include "ProximityQueryStructureN.hpp"
+#include "RangeQueryStructure.hpp"
+
+namespace Thea {
+namespace Algorithms {
+
+/**
+ * A kd-tree that supports insertion and removal of elements, implemented as a forest of static kd-trees with the logarithmic
+ * method (Bentley and Saxe, "Decomposable searching problems I: Static-to-dynamic transformation", J. Algorithms 1980). Level
+ * <i>i</i> of the forest is either empty or holds a KDTreeN with at most 2^<i>i</i> elements. A new element is merged, along
+ * with all elements of the consecutive non-empty levels starting from level 0, into the first empty level. Each element is
+ * therefore rebuilt into O(log n) successively larger trees over its lifetime, and insertion takes amortized O(log^2 n) time.
+ *
+ * Removal is lazy: the element is marked as deleted and skipped by all queries. When more than half the elements of a level are
+ * deleted, only that level is rebuilt from its surviving elements, which keeps every level balanced and at least half full.
+ *
+ * Every element is identified by a non-negative handle, returned by insert(). Handles stay valid till the element is removed,
+ * after which they may be reused for new elements. All queries return handles in place of element indices. The queries have
+ * the same interface as those of KDTreeN, except that this structure cannot itself be passed as the query to another
+ * structure's kClosestPairs(). Each query makes one pass over the O(log n) levels, with the distance bound tightened by the
+ * results from previous levels.
+ *
+ * The tree requires BoundedTraitsN<T, N, ScalarT> to be defined for the element type, as for KDTreeN.
+ */
+template <typename T, int N, typename ScalarT = Real>
+class /* THEA_API */ DynamicKDTreeN
+: public RangeQueryStructure<T>,
+  public ProximityQueryStructureN<N, ScalarT>,
+  private Noncopyable
+{
+  private:
+    typedef ProximityQueryStructureN<N, ScalarT> ProximityQueryBaseT;
+
+  public:
+    THEA_DECL_SMART_POINTERS(DynamicKDTreeN)
+
+    typedef T Element;     ///< Type of elements in the kd-tree.
+    typedef T value_type;  ///< Type of elements in the kd-tree (STL convention).
+
+    typedef KDTreeN<T, N, ScalarT> StaticKDTree;                       ///< A static kd-tree on a level of the forest.
+    typedef typename ProximityQueryBaseT::VectorT VectorT;            ///< Vector in N-space.
+    typedef typename ProximityQueryBaseT::NeighborPair NeighborPair;  ///< Pair of neighboring elements.
+    typedef AxisAlignedBoxN<N, ScalarT> AxisAlignedBoxT;              ///< Axis-aligned box in N-space.
+
+    /** Constructor. */
+    DynamicKDTreeN() : num_live(0), max_build_threads(1) {}
+
+    /**
+     * Construct from a list of elements. InputIterator must dereference to type T. The elements are assigned consecutive
+     * handles starting from zero.
+     */
+    template <typename InputIterator>
+    DynamicKDTreeN(InputIterator begin, InputIterator end) : num_live(0), max_build_threads(1)
+    {
+      init(begin, end);
+    }
+
+    /** Destructor. */
+    ~DynamicKDTreeN() { clear(); }
+
+    /**
+     * Clear the tree and bulk-load a list of elements. InputIterator must dereference to type T. The elements are assigned
+     * consecutive handles starting from zero, and are placed in as few levels as possible (one per bit of their number).
+     */
+    template <typename InputIterator>
+    void init(InputIterator begin, InputIterator end)
+    {
+      clear();
+
+      Array<T> new_elems(begin, end);
+      Array<intx> new_handles(new_elems.size());
+      for (size_t i = 0; i < new_elems.size(); ++i)
+      {
+        new_handles[i] = (intx)i;
+        locations.push_back(Location());
+      }
+
+      // Split the elements among the levels corresponding to the set bits of their number, largest first
+      intx top_level = 0;
+      while (((size_t)2 << top_level) <= new_elems.size())
+        top_level++;
+
+      size_t next = 0;
+      for (intx k = top_level; k >= 0; --k)
+      {
+        size_t level_size = (size_t)1 << k;
+        if (new_elems.size() & level_size)
+        {
+          Array<T> level_elems(new_elems.begin() + next, new_elems.begin() + next + level_size);
+          Array<intx> level_handles(new_handles.begin() + next, new_handles.begin() + next + level_size);
+          buildLevel(k, level_elems, level_handles);
+          next += level_size;
+        }
+      }
+
+      num_live = (intx)new_elems.size();
+    }
+
+    /** Remove all elements from the tree. */
+    void clear()
+    {
+      for (size_t i = 0; i < levels.size(); ++i)
+        delete levels[i];
+
+      levels.clear();
+      locations.clear();
+      free_handles.clear();
+      num_live = 0;
+    }
+
+    /**
+     * Set the maximum number of threads used to build each static tree (see KDTreeN::setMaxBuildThreads()). Only large merges
+     * benefit from multiple threads.
+     */
+    void setMaxBuildThreads(intx max_build_threads_ = -1)
+    {
+      max_build_threads = max_build_threads_;
+      for (size_t i = 0; i < levels.size(); ++i)
+        levels[i]->tree.setMaxBuildThreads(max_build_threads);
+    }
+
+    /** Get the maximum number of threads used to build each static tree. */
+    intx getMaxBuildThreads() const { return max_build_threads; }
+
+    /** Check if the tree is empty. */
+    bool isEmpty() const { return num_live <= 0; }
+
+    /** Get the number of elements in the tree, excluding removed elements. */
+    intx numElements() const { return num_live; }
+
+    /** Get the number of levels (some of which may be empty) in the forest. */
+    intx numLevels() const { return (intx)levels.size(); }
+
+    /** Get the static kd-tree at a level of the forest. Elements of the tree that have been removed are not filtered out. */
+    StaticKDTree const & getLevel(intx level) const { return levels[(size_t)level]->tree; }
+
+    /** Check if a handle refers to an element currently in the tree. */
+    bool contains(intx handle) const
+    {
+      return handle >= 0 && handle < (intx)locations.size() && locations[(size_t)handle].level >= 0;
+    }
+
+    /** Get the element with a given handle, which must refer to an element currently in the tree. */
+    T const & getElement(intx handle) const
+    {
+      debugAssertM(contains(handle), "DynamicKDTreeN: Invalid element handle");
+
+      Location const & loc = locations[(size_t)handle];
+      return levels[(size_t)loc.level]->tree.getElements()[loc.index];
+    }
+
+    /** Get a bounding box for all the elements in the tree, including any removed elements that have not yet been purged. */
+    AxisAlignedBoxT getBounds() const
+    {
+      AxisAlignedBoxT bounds;
+      for (size_t i = 0; i < levels.size(); ++i)
+        if (!levels[i]->isEmpty())
+          bounds.merge(levels[i]->tree.getBounds());
+
+      return bounds;
+    }
+
+    /** Insert an element into the tree, and return its handle. Takes amortized O(log^2 n) time. */
+    intx insert(T const & elem)
+    {
+      intx handle;
+      if (free_handles.empty())
+      {
+        handle = (intx)locations.size();
+        locations.push_back(Location());
+      }
+      else
+      {
+        handle = free_handles.back();
+        free_handles.pop_back();
+      }
+
+      // Merge the new element and the elements of all consecutive non-empty levels from level 0 into the first empty level
+      Array<T> merged_elems(1, elem);
+      Array<intx> merged_handles(1, handle);
+
+      intx k = 0;
+      for ( ; k < (intx)levels.size() && !levels[(size_t)k]->isEmpty(); ++k)
+      {
+        levels[(size_t)k]->collectLive(merged_elems, merged_handles);
+        levels[(size_t)k]->clear();
+      }
+
+      buildLevel(k, merged_elems, merged_handles);
+      num_live++;
+
+      return handle;
+    }
+
+    /**
+     * Remove an element from the tree. The element is only marked as deleted, unless this makes more than half the elements of
+     * its level deleted, in which case the level is rebuilt from its remaining elements.
+     *
+     * @return True if the element was removed, false if the handle did not refer to an element in the tree.
+     */
+    bool remove(intx handle)
+    {
+      if (!contains(handle))
+        return false;
+
+      Location & loc = locations[(size_t)handle];
+      Level * level = levels[(size_t)loc.level];
+      level->deleted[(size_t)loc.index] = 1;
+      level->num_deleted++;
+      num_live--;
+
+      intx k = loc.level;
+      loc.level = -1;
+      free_handles.push_back(handle);
+
+      if (2 * level->num_deleted > level->numElements())
+      {
+        Array<T> live_elems;
+        Array<intx> live_handles;
+        level->collectLive(live_elems, live_handles);
+        level->clear();
+
+        if (!live_elems.empty())
+          buildLevel(k, live_elems, live_handles);
+      }
+
+      return true;
+    }
+
+    /**
+     * Get the minimum distance between this structure and a query object. If \a filter is not null, elements that it does not
+     * allow are ignored.
+     */
+    template <typename MetricT, typename QueryT>
+    double distance(QueryT const & query, double dist_bound = -1, Filter<T> const * filter = nullptr) const
+    {
+      double result = -1;
+      if (closestElement<MetricT>(query, dist_bound, &result, nullptr, filter) >= 0)
+        return result;
+      else
+        return -1;
+    }
+
+    /**
+     * Get the closest element in this structure to a query object, within a specified distance bound. The parameters are the
+     * same as for KDTreeN::closestElement().
+     *
+     * @return The handle of the closest element, if one was found, else a negative number.
+     */
+    template <typename MetricT, typename QueryT>
+    intx closestElement(QueryT const & query, double dist_bound = -1, double * dist = nullptr,
+                        VectorT * closest_point = nullptr, Filter<T> const * filter = nullptr) const
+    {
+      NeighborPair pair = closestPair<MetricT>(query, dist_bound, closest_point != nullptr, filter);
+
+      if (pair.isValid())
+      {
+        if (dist) *dist = MetricT::invertMonotoneApprox(pair.getMonotoneApproxDistance());
+        if (closest_point) *closest_point = pair.getTargetPoint();
+      }
+
+      return pair.getTargetIndex();
+    }
+
+    /**
+     * Get the closest pair of elements between this structure and another structure, whose separation is less than a specified
+     * upper bound. The parameters are the same as for KDTreeN::closestPair(). The target index of the returned pair is the
+     * handle of an element of this structure.
+     */
+    template <typename MetricT, typename QueryT>
+    NeighborPair closestPair(QueryT const & query, double dist_bound = -1, bool get_closest_points = false,
+                             Filter<T> const * filter = nullptr) const
+    {
+      NeighborPair best(-1);
+      for (size_t i = 0; i < levels.size(); ++i)
+      {
+        Level const * level = levels[i];
+        if (level->isEmpty()) continue;
+
+        LevelFilter level_filter(level, filter);
+        NeighborPair pair = level->tree.template closestPair<MetricT>(query, dist_bound, get_closest_points, &level_filter);
+        if (pair.isValid()
+         && (!best.isValid() || pair.getMonotoneApproxDistance() < best.getMonotoneApproxDistance()))
+        {
+          best = pair;
+          best.setTargetIndex(level->handles[(size_t)pair.getTargetIndex()]);
+          dist_bound = MetricT::invertMonotoneApprox(best.getMonotoneApproxDistance());
+        }
+      }
+
+      return best;
+    }
+
+    /**
+     * Get the k elements closest to a query object. The parameters are the same as for KDTreeN::kClosestPairs(). The index of
+     * each neighboring element of this structure in the returned pairs -- the target index, or the query index if
+     * \a use_as_query_index_and_swap is non-negative -- is its handle.
+     *
+     * @return The number of neighbors found (i.e. the size of \a k_closest_pairs).
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound = -1,
+                       bool get_closest_points = false, bool clear_set = true, intx use_as_query_index_and_swap = -1,
+                       Filter<T> const * filter = nullptr) const
+    {
+      if (clear_set) k_closest_pairs.clear();
+
+      // Indices from different levels can coincide, so each level is queried into a scratch set and the results are merged
+      BoundedNeighborPairSetT level_pairs(k_closest_pairs);
+      for (size_t i = 0; i < levels.size(); ++i)
+      {
+        Level const * level = levels[i];
+        if (level->isEmpty()) continue;
+
+        // Only neighbors closer than the current k'th neighbor can change the result
+        double level_dist_bound = dist_bound;
+        if (k_closest_pairs.size() > 0 && k_closest_pairs.size() >= k_closest_pairs.getCapacity())
+        {
+          double kth_dist = MetricT::invertMonotoneApprox(k_closest_pairs.last().getMonotoneApproxDistance());
+          if (level_dist_bound < 0 || kth_dist < level_dist_bound)
+            level_dist_bound = kth_dist;
+        }
+
+        LevelFilter level_filter(level, filter);
+        level_pairs.clear();
+        level->tree.template kClosestPairs<MetricT>(query, level_pairs, level_dist_bound, get_closest_points, true,
+                                                    use_as_query_index_and_swap, &level_filter);
+
+        for (int j = 0; j < level_pairs.size(); ++j)
+        {
+          NeighborPair pair = level_pairs[j];
+          if (use_as_query_index_and_swap >= 0)
+            pair.setQueryIndex(level->handles[(size_t)pair.getQueryIndex()]);
+          else
+            pair.setTargetIndex(level->handles[(size_t)pair.getTargetIndex()]);
+
+          k_closest_pairs.insert(pair);
+        }
+      }
+
+      return k_closest_pairs.size();
+    }
+
+    /**
+     * Get the k elements closest to a query object, ignoring elements not allowed by a filter. Equivalent to the other version
+     * of kClosestPairs() with default values for the internal parameters.
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound,
+                       bool get_closest_points, Filter<T> const * filter) const
+    {
+      return kClosestPairs<MetricT>(query, k_closest_pairs, dist_bound, get_closest_points, true, -1, filter);
+    }
+
+    /**
+     * Get all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and new objects are appended to the array.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQuery(RangeT const & range, Array<T> & result, bool discard_prior_results = true,
+                    Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      processRangeUntil<IntersectionTesterT>(range, RangeQueryFunctor(result), filter);
+    }
+
+    /**
+     * Get the handles of all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The handles of objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and handles of new objects are appended to the array.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQueryIndices(RangeT const & range, Array<intx> & result, bool discard_prior_results = true,
+                           Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      processRangeUntil<IntersectionTesterT>(range, RangeQueryIndicesFunctor(result), filter);
+    }
+
+    /**
+     * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
+     * (or be a function pointer with the equivalent signature)
+     * \code
+     * bool operator()(intx handle, T const & t)
+     * \endcode
+     * and will be passed the handle of each object contained in the range as well as a reference to the object itself. If the
+     * functor returns true on any object, the search will terminate immediately. To pass a functor by reference, wrap it in
+     * <tt>std::ref</tt>. If \a filter is not null, elements not allowed by it are ignored.
+     *
+     * @return The handle of the first object in the range for which the functor evaluated to true (the search stopped
+     *   immediately after processing this object), else a negative value.
+     */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(RangeT const & range, FunctorT functor, Filter<T> const * filter = nullptr) const
+    {
+      for (size_t i = 0; i < levels.size(); ++i)
+      {
+        Level const * level = levels[i];
+        if (level->isEmpty()) continue;
+
+        LevelFilter level_filter(level, filter);
+        intx index = level->tree.template processRangeUntil<IntersectionTesterT>(
+                         range, HandleFunctor<FunctorT>(level, &functor), &level_filter);
+        if (index >= 0)
+          return level->handles[(size_t)index];
+      }
+
+      return -1;
+    }
+
+  private:
+    /** Position of an element in the forest. */
+    struct Location
+    {
+      Location() : level(-1), index(-1) {}
+
+      intx level;  ///< Level containing the element, or negative if the element has been removed.
+      intx index;  ///< Index of the element in the static kd-tree of the level.
+    };
+
+    /** A level of the forest. */
+    struct Level
+    {
+      Level() : num_deleted(0) {}
+
+      /** Number of elements in the level, including deleted ones. */
+      intx numElements() const { return (intx)handles.size(); }
+
+      /** Check if the level has no elements at all. */
+      bool isEmpty() const { return handles.empty(); }
+
+      /** Append the elements that have not been deleted, and their handles, to a pair of arrays. */
+      void collectLive(Array<T> & elems, Array<intx> & elem_handles) const
+      {
+        T const * level_elems = tree.getElements();
+        for (size_t i = 0; i < handles.size(); ++i)
+          if (!deleted[i])
+          {
+            elems.push_back(level_elems[i]);
+            elem_handles.push_back(handles[i]);
+          }
+      }
+
+      /** Remove all elements from the level. */
+      void clear()
+      {
+        tree.clear(false);  // retain memory for the next merge into this level
+        handles.clear();
+        deleted.clear();
+        num_deleted = 0;
+      }
+
+      StaticKDTree tree;     ///< Static kd-tree on the elements of the level, in the same order as the handles.
+      Array<intx> handles;   ///< Handle of each element.
+      Array<uint8> deleted;  ///< Flags marking elements that have been removed.
+      intx num_deleted;      ///< Number of elements that have been removed.
+    };
+
+    /**
+     * Filter that rejects removed elements of a level, as well as elements rejected by a per-query filter (if not null). Relies
+     * on the static kd-tree passing its filters references to elements in the array returned by getElements().
+     */
+    class LevelFilter : public Filter<T>
+    {
+      public:
+        LevelFilter(Level const * level_, Filter<T> const * query_filter_)
+        : level(level_), level_elems(level_->tree.getElements()), query_filter(query_filter_) {}
+
+        bool allows(T const & t) const
+        {
+          return !level->deleted[(size_t)(&t - level_elems)] && (!query_filter || query_filter->allows(t));
+        }
+
+      private:
+        Level const * level;
+        T const * level_elems;
+        Filter<T> const * query_filter;
+    };
+
+    /** Wraps a functor for processRangeUntil(), converting element indices in a level to handles. */
+    template <typename FunctorT>
+    class HandleFunctor
+    {
+      public:
+        HandleFunctor(Level const * level_, FunctorT * functor_) : level(level_), functor(functor_) {}
+        bool operator()(intx index, T const & t) { return (*functor)(level->handles[(size_t)index], t); }
+
+      private:
+        Level const * level;
+        FunctorT * functor;
+    };
+
+    /** A functor to add results of a range query to an array. */
+    class RangeQueryFunctor
+    {
+      public:
+        RangeQueryFunctor(Array<T> & result_) : result(result_) {}
+        bool operator()(intx handle, T const & t) { result.push_back(t); return false; }
+
+      private:
+        Array<T> & result;
+    };
+
+    /** A functor to add the handles of results of a range query to an array. */
+    class RangeQueryIndicesFunctor
+    {
+      public:
+        RangeQueryIndicesFunctor(Array<intx> & result_) : result(result_) {}
+        bool operator()(intx handle, T const & t) { result.push_back(handle); return false; }
+
+      private:
+        Array<intx> & result;
+    };
+
+    /** Build a static kd-tree at a level, which must be empty, from a set of elements and their handles. */
+    void buildLevel(intx k, Array<T> const & elems, Array<intx> const & elem_handles)
+    {
+      while ((intx)levels.size() <= k)
+      {
+        levels.push_back(new Level);
+        levels.back()->tree.setMaxBuildThreads(max_build_threads);
+      }
+
+      Level * level = levels[(size_t)k];
+      level->tree.init(elems.begin(), elems.end(), -1, -1, false, false);
+      level->handles = elem_handles;
+      level->deleted.assign(elem_handles.size(), 0);
+      level->num_deleted = 0;
+
+      for (size_t i = 0; i < elem_handles.size(); ++i)
+      {
+        Location & loc = locations[(size_t)elem_handles[i]];
+        loc.level = k;
+        loc.index = (intx)i;
+      }
+    }
+
+    Array<Level *> levels;     ///< Levels of the forest. Level i holds at most 2^i elements.
+    Array<Location> locations;  ///< Position of the element with each handle.
+    Array<intx> free_handles;   ///< Handles of removed elements, available for reuse.
+    intx num_live;              ///< Number of elements that have not been removed.
+    intx max_build_threads;     ///< Maximum number of threads used to build each static tree.
+
+}; // class DynamicKDTreeN
+
+} // namespace Algorithms
+} // namespace Thea
+
+#endif
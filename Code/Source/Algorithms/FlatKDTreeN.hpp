@@ -0,0 +1,1309 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_Algorithms_FlatKDTreeN_hpp__
+#define __Thea_Algorithms_FlatKDTreeN_hpp__
+
+#include "../Common.hpp"
+#include "../Array.hpp"
+#include "../Math.hpp"
+#include "../MemoryMappedFile.hpp"
+#include "../Noncopyable.hpp"
+#include "BoundedTraitsN.hpp"
+#include "Filter.hpp"
+#include "KDTreeN.hpp"
+#include "ProximityQueryStructureN.hpp"
+#include "RangeQueryStructure.hpp"
+#include "RayQueryStructureN.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+namespace Thea {
+namespace Algorithms {
+
+/**
+ * Has boolean member <tt>value = true</tt> if objects of type T can be saved to disk as raw bytes and used in place after being
+ * mapped back into memory, else <tt>value = false</tt>. True by default for trivially copyable types and fixed-size Eigen
+ * matrices (including Thea's fixed-size vectors). Specialize for other types as required.
+ */
+template <typename T>
+struct IsBitwiseSerializable
+{
+  static bool const value = std::is_trivially_copyable<T>::value;
+};
+
+// Specialization for fixed-size Eigen matrices, which have no indirection but user-defined copy constructors.
+template <typename S, int R, int C, int O, int MR, int MC>
+struct IsBitwiseSerializable< Eigen::Matrix<S, R, C, O, MR, MC> >
+{
+  static bool const value = (R > 0 && C > 0 && std::is_trivially_copyable<S>::value);
+};
+
+/**
+ * A compact, read-only copy of a KDTreeN, laid out for cache-friendly traversal. The nodes are stored contiguously in a single
+ * array in depth-first order, so the low child of a node immediately follows it and only the position of the high child is
+ * stored, as a 32-bit offset. The elements are copied into a single array in the order in which they appear in the leaves, so
+ * the elements of every subtree occupy a contiguous range of this array and no per-node index lists are needed. Optionally,
+ * the bounding box of each node is quantized to 8 bits per coordinate relative to the box of its parent, which shrinks the
+ * bounds by a factor of 4 (for single-precision scalars) at the cost of slightly looser boxes.
+ *
+ * The flattened tree supports the same proximity, range and ray queries as KDTreeN, with optional per-query filters. It does
+ * not support transforms, the filter stack, or nearest neighbor acceleration. The elements are reordered with respect to the
+ * source tree: all indices passed to and returned from queries refer to the array returned by getElements(), and the index of
+ * the same element in the source tree can be obtained with getSourceIndex(). Since queries never modify the tree, they can be
+ * freely called from multiple threads at once.
+ *
+ * The tree can be saved to a binary file with save() and memory-mapped back with load(), which validates it against a hash of
+ * the source data. Loading is much faster than rebuilding the tree, and no memory is allocated per node.
+ *
+ * Like KDTreeN, the flattened tree requires BoundedTraitsN<T, N, ScalarT> to be defined for the element type. The number of
+ * elements and nodes must each be less than 2^32.
+ */
+template <typename T, int N, typename ScalarT = Real>
+class /* THEA_API */ FlatKDTreeN
+: public RangeQueryStructure<T>,
+  public ProximityQueryStructureN<N, ScalarT>,
+  public RayQueryStructureN<N, ScalarT>,
+  private Noncopyable
+{
+  private:
+    typedef ProximityQueryStructureN<N, ScalarT>  ProximityQueryBaseT;
+    typedef RayQueryStructureN<N, ScalarT>        RayQueryBaseT;
+
+  public:
+    THEA_DECL_SMART_POINTERS(FlatKDTreeN)
+
+    typedef T  Element;     ///< Type of elements in the kd-tree.
+    typedef T  value_type;  ///< Type of elements in the kd-tree (STL convention).
+
+    typedef typename ProximityQueryBaseT::VectorT              VectorT;                    ///< Vector in N-space.
+    typedef typename ProximityQueryBaseT::NeighborPair         NeighborPair;               ///< Pair of neighboring elements.
+    typedef AxisAlignedBoxN<N, ScalarT>                        AxisAlignedBoxT;            ///< Axis-aligned box in N-space.
+    typedef typename RayQueryBaseT::RayT                       RayT;                       ///< Ray in N-space.
+    typedef typename RayQueryBaseT::RayStructureIntersectionT  RayStructureIntersectionT;  /**< Ray intersection structure in
+                                                                                                N-space. */
+
+    /** A node of the flattened tree. */
+    struct Node
+    {
+      uint32 first_elem;  ///< Position of the first element of the subtree rooted at the node, in the element array.
+      uint32 num_elems;   ///< Number of elements in the subtree rooted at the node.
+      uint32 hi;          ///< Position of the high child in the node array, or 0 if the node is a leaf. The low child is next.
+
+      /** Check if the node is a leaf. */
+      bool isLeaf() const { return hi == 0; }
+
+    }; // struct Node
+
+    /** Full-precision bounding box of a node. */
+    struct FullBounds
+    {
+      ScalarT lo[N];  ///< Lower corner.
+      ScalarT hi[N];  ///< Upper corner.
+    };
+
+    /** Bounding box of a node, quantized to 8 bits per coordinate relative to the bounding box of its parent. */
+    struct QuantizedBounds
+    {
+      uint8 lo[N];  ///< Quantized lower corner.
+      uint8 hi[N];  ///< Quantized upper corner.
+    };
+
+    /** Default constructor, creates an empty tree. */
+    FlatKDTreeN() { clear(); }
+
+    /**
+     * Construct a flattened copy of a kd-tree. The source tree can be destroyed once this function returns.
+     *
+     * @param src The kd-tree to copy.
+     * @param quantize_bounds If true, node bounds are quantized to 8 bits per coordinate relative to their parents.
+     */
+    template <typename NodeAttributeT>
+    explicit FlatKDTreeN(KDTreeN<T, N, ScalarT, NodeAttributeT> const & src, bool quantize_bounds = false)
+    {
+      init(src, quantize_bounds);
+    }
+
+    /**
+     * Initialize the tree as a flattened copy of a kd-tree, discarding any prior data. The source tree can be destroyed once
+     * this function returns.
+     *
+     * @param src The kd-tree to copy.
+     * @param quantize_bounds If true, node bounds are quantized to 8 bits per coordinate relative to their parents.
+     */
+    template <typename NodeAttributeT>
+    void init(KDTreeN<T, N, ScalarT, NodeAttributeT> const & src, bool quantize_bounds = false)
+    {
+      initConverted(src, IdentityConverter(), quantize_bounds);
+    }
+
+    /**
+     * Initialize the tree as a flattened copy of a kd-tree on a different type of element, discarding any prior data. Each
+     * element of the source tree is converted to an element of this tree by a functor with the member function (or a function
+     * pointer with the equivalent signature)
+     * \code
+     * T operator()(S const & s)
+     * \endcode
+     * The converted element must occupy the same region of space as the original, since the node bounds are copied unchanged.
+     * This can be used to store compact, precomputed versions of elements that are expensive to access in the source tree. The
+     * source tree can be destroyed once this function returns.
+     *
+     * @param src The kd-tree to copy.
+     * @param convert The functor that converts each element of the source tree.
+     * @param quantize_bounds If true, node bounds are quantized to 8 bits per coordinate relative to their parents.
+     */
+    template <typename S, typename NodeAttributeT, typename ConverterT>
+    void initConverted(KDTreeN<S, N, ScalarT, NodeAttributeT> const & src, ConverterT convert, bool quantize_bounds = false)
+    {
+      clear();
+
+      alwaysAssertM((uint64)src.numElements() < (uint64)std::numeric_limits<uint32>::max()
+                 && (uint64)src.numNodes() < (uint64)std::numeric_limits<uint32>::max(),
+                    "FlatKDTreeN: Too many elements or nodes");
+
+      quantized = quantize_bounds;
+
+      typename KDTreeN<S, N, ScalarT, NodeAttributeT>::Node const * src_root = src.getRoot();
+      if (!src_root) return;
+
+      owned_nodes.reserve((size_t)src.numNodes());
+      if (quantized) owned_quantized_bounds.reserve((size_t)src.numNodes());
+      else           owned_full_bounds.reserve((size_t)src.numNodes());
+
+      owned_elems.reserve((size_t)src.numElements());
+      owned_source_indices.reserve((size_t)src.numElements());
+
+      // The root's bounds are stored separately at full precision, so its slot in the bounds arrays is a placeholder that keeps
+      // them parallel to the node array
+      root_bounds = src_root->getBounds();
+      if (quantized) owned_quantized_bounds.push_back(QuantizedBounds());
+      else           owned_full_bounds.push_back(FullBounds());
+
+      flatten(src, src_root, root_bounds, convert);
+      useOwnedData();
+    }
+
+    /** Clear the tree, releasing all memory and unmapping any file loaded with load(). */
+    void clear()
+    {
+      Array<Node>().swap(owned_nodes);
+      Array<FullBounds>().swap(owned_full_bounds);
+      Array<QuantizedBounds>().swap(owned_quantized_bounds);
+      Array<T>().swap(owned_elems);
+      Array<uint32>().swap(owned_source_indices);
+      mapped_file.reset();
+
+      useOwnedData();
+      root_bounds.setNull();
+      quantized = false;
+    }
+
+    /**
+     * Save the tree to a binary file that can later be memory-mapped by load(). The file stores the nodes, their bounds, and the
+     * source index of each element. If IsBitwiseSerializable<T>::value is true, the elements themselves are also stored;
+     * otherwise (e.g. for elements such as mesh triangles that refer to external data) they must be supplied again when the file
+     * is loaded. The file uses the native byte order and type sizes, and is not portable across platforms that differ in these.
+     *
+     * @param path The path of the file to write.
+     * @param source_hash A hash of the data from which the tree was built (e.g. the geometry of a mesh), which is checked by
+     *   load() to detect stale files.
+     *
+     * @return True on success, false on error.
+     */
+    bool save(std::string const & path, uint64 source_hash) const
+    {
+      bool has_elems = IsBitwiseSerializable<T>::value;
+
+      FileHeader header;
+      std::memset(&header, 0, sizeof(header));
+      std::memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+      header.endian_check = ENDIAN_CHECK;
+      header.version = FILE_VERSION;
+      header.dim = (uint32)N;
+      header.scalar_size = (uint32)sizeof(ScalarT);
+      header.node_size = (uint32)sizeof(Node);
+      header.elem_size = (uint32)(has_elems ? sizeof(T) : 0);
+      header.flags = (quantized ? FLAG_QUANTIZED : 0) | (has_elems ? FLAG_ELEMENTS : 0);
+      header.num_nodes = (uint64)num_nodes;
+      header.num_elems = (uint64)num_elems;
+      header.source_hash = source_hash;
+
+      if (num_nodes > 0)
+        for (intx i = 0; i < N; ++i)
+        {
+          header.root_lo[i] = (double)root_bounds.getLow()[i];
+          header.root_hi[i] = (double)root_bounds.getHigh()[i];
+        }
+
+      size_t bounds_size = (quantized ? sizeof(QuantizedBounds) : sizeof(FullBounds));
+      header.nodes_offset = alignFileOffset(sizeof(FileHeader));
+      header.bounds_offset = alignFileOffset(header.nodes_offset + header.num_nodes * sizeof(Node));
+      header.source_indices_offset = alignFileOffset(header.bounds_offset + header.num_nodes * bounds_size);
+      header.elems_offset = alignFileOffset(header.source_indices_offset + header.num_elems * sizeof(uint32));
+      header.file_size = header.elems_offset + (has_elems ? header.num_elems * sizeof(T) : 0);
+
+      std::ofstream out(path.c_str(), std::ios::binary);
+      if (!out)
+      {
+        THEA_ERROR << "FlatKDTreeN: Could not open file '" << path << "' for writing";
+        return false;
+      }
+
+      writeFileSection(out, &header, sizeof(header), 0);
+      writeFileSection(out, node_data, header.num_nodes * sizeof(Node), header.nodes_offset);
+      writeFileSection(out, quantized ? (void const *)quantized_bounds_data : (void const *)full_bounds_data,
+                       header.num_nodes * bounds_size, header.bounds_offset);
+      writeFileSection(out, source_index_data, header.num_elems * sizeof(uint32), header.source_indices_offset);
+      if (has_elems)
+        writeFileSection(out, elem_data, header.num_elems * sizeof(T), header.elems_offset);
+
+      out.flush();
+      if (!out)
+      {
+        THEA_ERROR << "FlatKDTreeN: Error writing file '" << path << '\'';
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+     * Load a tree saved with save(), discarding any prior data. The file is memory-mapped and the nodes, bounds and (if stored)
+     * elements are used in place, so there is no per-node allocation and the operating system pages in only the parts of the
+     * tree that are actually visited. The file must not be modified while the tree is in use.
+     *
+     * @param path The path of the file to load.
+     * @param expected_hash The hash of the data the tree should have been built from. If it does not match the hash passed to
+     *   save(), the file is considered stale and is not loaded.
+     * @param source_elems The elements of the source tree, in their original order (as returned by KDTreeN::getElements()).
+     *   Used, and required, only if the file does not store the elements themselves. In this case the elements are copied into
+     *   a single array owned by this tree.
+     * @param num_source_elems The number of elements in \a source_elems.
+     *
+     * @return True if the tree was successfully loaded, false if the file was missing, invalid or stale, in which case the tree
+     *   is left empty and should be rebuilt.
+     */
+    bool load(std::string const & path, uint64 expected_hash, T const * source_elems = nullptr, intx num_source_elems = 0)
+    {
+      clear();
+
+      MemoryMappedFile::Ptr file(new MemoryMappedFile);
+      if (!file->open(path))
+        return false;
+
+      if (file->size() < (int64)sizeof(FileHeader))
+      {
+        THEA_WARNING << "FlatKDTreeN: File '" << path << "' is too small to be a saved kd-tree";
+        return false;
+      }
+
+      FileHeader header;
+      std::memcpy(&header, file->data(), sizeof(header));
+
+      bool has_elems = ((header.flags & FLAG_ELEMENTS) != 0);
+      bool is_quantized = ((header.flags & FLAG_QUANTIZED) != 0);
+      size_t bounds_size = (is_quantized ? sizeof(QuantizedBounds) : sizeof(FullBounds));
+      size_t bounds_alignment = (is_quantized ? alignof(QuantizedBounds) : alignof(FullBounds));
+      if (std::memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) != 0
+       || header.endian_check != ENDIAN_CHECK
+       || header.version != FILE_VERSION
+       || header.dim != (uint32)N
+       || header.scalar_size != (uint32)sizeof(ScalarT)
+       || header.node_size != (uint32)sizeof(Node)
+       || header.elem_size != (uint32)(has_elems ? sizeof(T) : 0)
+       || (has_elems && !IsBitwiseSerializable<T>::value)
+       || header.file_size != (uint64)file->size()
+       || !isValidFileArray(header.nodes_offset, header.num_nodes, sizeof(Node), alignof(Node), header.file_size)
+       || !isValidFileArray(header.bounds_offset, header.num_nodes, bounds_size, bounds_alignment, header.file_size)
+       || !isValidFileArray(header.source_indices_offset, header.num_elems, sizeof(uint32), alignof(uint32), header.file_size)
+       || (has_elems && !isValidFileArray(header.elems_offset, header.num_elems, sizeof(T), alignof(T), header.file_size)))
+      {
+        THEA_WARNING << "FlatKDTreeN: File '" << path << "' is not a compatible saved kd-tree";
+        return false;
+      }
+
+      if (header.source_hash != expected_hash)
+      {
+        THEA_DEBUG << "FlatKDTreeN: Saved kd-tree '" << path << "' was built from different data, ignoring it";
+        return false;
+      }
+
+      // Queries trust the nodes and source indices, so check them once here. Children must follow their parents, so traversals
+      // always terminate.
+      uint8 const * base = file->data();
+      Node const * nodes = reinterpret_cast<Node const *>(base + header.nodes_offset);
+      for (uint64 i = 0; i < header.num_nodes; ++i)
+      {
+        Node const & node = nodes[i];
+        if ((!node.isLeaf() && (node.hi <= i + 1 || node.hi >= header.num_nodes))
+         || (uint64)node.first_elem + (uint64)node.num_elems > header.num_elems)
+        {
+          THEA_WARNING << "FlatKDTreeN: Saved kd-tree '" << path << "' has an invalid node " << i;
+          return false;
+        }
+      }
+
+      uint32 const * src_indices = reinterpret_cast<uint32 const *>(base + header.source_indices_offset);
+      if (has_elems)
+      {
+        // The source tree had as many elements as this one
+        for (uint64 i = 0; i < header.num_elems; ++i)
+          if (src_indices[i] >= header.num_elems)
+          {
+            THEA_WARNING << "FlatKDTreeN: Saved kd-tree '" << path << "' has an invalid source index at position " << i;
+            return false;
+          }
+      }
+      else
+      {
+        if (!source_elems || (uint64)num_source_elems < header.num_elems)
+        {
+          THEA_WARNING << "FlatKDTreeN: Saved kd-tree '" << path << "' does not store its elements, and no source elements were "
+                          "supplied";
+          return false;
+        }
+
+        owned_elems.resize((size_t)header.num_elems);
+        for (size_t i = 0; i < owned_elems.size(); ++i)
+        {
+          if ((intx)src_indices[i] >= num_source_elems)
+          {
+            THEA_WARNING << "FlatKDTreeN: Saved kd-tree '" << path << "' refers to more source elements than were supplied";
+            clear();
+            return false;
+          }
+
+          owned_elems[i] = source_elems[src_indices[i]];
+        }
+      }
+
+      node_data = nodes;
+      full_bounds_data = (is_quantized ? nullptr : reinterpret_cast<FullBounds const *>(base + header.bounds_offset));
+      quantized_bounds_data = (is_quantized ? reinterpret_cast<QuantizedBounds const *>(base + header.bounds_offset) : nullptr);
+      source_index_data = src_indices;
+      elem_data = (has_elems ? reinterpret_cast<T const *>(base + header.elems_offset)
+                             : (owned_elems.empty() ? nullptr : &owned_elems[0]));
+      num_nodes = (intx)header.num_nodes;
+      num_elems = (intx)header.num_elems;
+      quantized = is_quantized;
+
+      if (num_nodes > 0)
+      {
+        VectorT lo, hi;
+        for (intx i = 0; i < N; ++i) { lo[i] = (ScalarT)header.root_lo[i]; hi[i] = (ScalarT)header.root_hi[i]; }
+        root_bounds.set(lo, hi);
+      }
+
+      mapped_file = file;
+      return true;
+    }
+
+    /** Check if the tree data is used in-place from a file mapped by load(). */
+    bool isMapped() const { return (bool)mapped_file; }
+
+    /** Check if the tree is empty. */
+    bool isEmpty() const { return num_elems <= 0; }
+
+    /** Get the number of elements in the tree. */
+    intx numElements() const { return num_elems; }
+
+    /** Get a pointer to the array of elements in the tree, in depth-first leaf order. */
+    T const * getElements() const { return elem_data; }
+
+    /** Get the index, in the source tree, of the element at position \a index in the array returned by getElements(). */
+    intx getSourceIndex(intx index) const { return (intx)source_index_data[index]; }
+
+    /** Get the number of nodes in the tree. */
+    intx numNodes() const { return num_nodes; }
+
+    /** Get the array of nodes in depth-first order. The root, if the tree is non-empty, is the first node. */
+    Node const * getNodes() const { return node_data; }
+
+    /** Check if node bounds are quantized. */
+    bool hasQuantizedBounds() const { return quantized; }
+
+    /** Get the number of bytes used by the nodes and their bounding boxes, excluding the elements. */
+    size_t getNodeMemoryUsage() const
+    {
+      return (size_t)num_nodes * (sizeof(Node) + (quantized ? sizeof(QuantizedBounds) : sizeof(FullBounds)));
+    }
+
+    /** Get a bounding box for all the objects in the tree. */
+    AxisAlignedBoxT const & getBounds() const { return root_bounds; }
+
+    /**
+     * Get the bounding box of a node, given the bounding box of its parent (ignored if the bounds are not quantized, or the
+     * node is the root).
+     */
+    AxisAlignedBoxT getNodeBounds(intx node_index, AxisAlignedBoxT const & parent_bounds) const
+    {
+      if (node_index == 0)
+        return root_bounds;
+
+      AxisAlignedBoxT box;
+      if (quantized)
+        decode(quantized_bounds_data[node_index], parent_bounds, box);
+      else
+      {
+        FullBounds const & fb = full_bounds_data[node_index];
+        VectorT lo, hi;
+        for (intx i = 0; i < N; ++i) { lo[i] = fb.lo[i]; hi[i] = fb.hi[i]; }
+        box.set(lo, hi);
+      }
+
+      return box;
+    }
+
+    /**
+     * Get the minimum distance between this structure and a query object. If \a filter is not null, elements that it does not
+     * allow are ignored.
+     */
+    template <typename MetricT, typename QueryT>
+    double distance(QueryT const & query, double dist_bound = -1, Filter<T> const * filter = nullptr) const
+    {
+      double result = -1;
+      if (closestElement<MetricT>(query, dist_bound, &result, nullptr, filter) >= 0)
+        return result;
+      else
+        return -1;
+    }
+
+    /**
+     * Get the closest element in this structure to a query object, within a specified distance bound.
+     *
+     * @param query Query object.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param dist The distance to the query object is placed here. Ignored if null.
+     * @param closest_point The coordinates of the closest point are placed here. Ignored if null.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     *
+     * @return A non-negative handle to the closest element, if one was found, else a negative number.
+     */
+    template <typename MetricT, typename QueryT>
+    intx closestElement(QueryT const & query, double dist_bound = -1, double * dist = nullptr,
+                        VectorT * closest_point = nullptr, Filter<T> const * filter = nullptr) const
+    {
+      NeighborPair pair = closestPair<MetricT>(query, dist_bound, closest_point != nullptr, filter);
+
+      if (pair.isValid())
+      {
+        if (dist) *dist = MetricT::invertMonotoneApprox(pair.getMonotoneApproxDistance());
+        if (closest_point) *closest_point = pair.getTargetPoint();
+      }
+
+      return pair.getTargetIndex();
+    }
+
+    /**
+     * Get the closest pair of elements between this structure and another structure, whose separation is less than a specified
+     * upper bound.
+     *
+     * @param query Query object.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param get_closest_points If true, the coordinates of the closest pair of points on the respective elements is computed
+     *   and stored in the returned structure.
+     * @param filter If not null, elements of this structure not allowed by this filter are ignored.
+     *
+     * @return Non-negative handles to the closest pair of elements in their respective objects, if such a pair was found. Else
+     *   returns a pair of negative numbers.
+     */
+    template <typename MetricT, typename QueryT>
+    NeighborPair closestPair(QueryT const & query, double dist_bound = -1, bool get_closest_points = false,
+                             Filter<T> const * filter = nullptr) const
+    {
+      if (num_nodes <= 0) return NeighborPair(-1);
+
+      AxisAlignedBoxT query_bounds;
+      getObjectBounds(query, query_bounds);
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+      if (mon_approx_dist_bound >= 0)
+      {
+        double lower_bound = monotonePruningDistance<MetricT>(root_bounds, query, query_bounds);
+        if (lower_bound >= 0 && lower_bound > mon_approx_dist_bound)
+          return NeighborPair(-1);
+      }
+
+      NeighborPair pair(-1, -1, mon_approx_dist_bound);
+      closestPair<MetricT>(0, root_bounds, query, query_bounds, pair, get_closest_points, filter);
+
+      return pair;
+    }
+
+    /**
+     * Get the k elements closest to a query object. The returned elements are placed in a set of bounded size (k). The
+     * parameters have the same meaning as in KDTreeN::kClosestPairs().
+     *
+     * @return The number of neighbors found (i.e. the size of \a k_closest_pairs).
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound = -1,
+                       bool get_closest_points = false, bool clear_set = true, intx use_as_query_index_and_swap = -1,
+                       Filter<T> const * filter = nullptr) const
+    {
+      if (clear_set) k_closest_pairs.clear();
+
+      if (num_nodes <= 0) return 0;
+
+      AxisAlignedBoxT query_bounds;
+      getObjectBounds(query, query_bounds);
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+      if (mon_approx_dist_bound >= 0)
+      {
+        double lower_bound = monotonePruningDistance<MetricT>(root_bounds, query, query_bounds);
+        if (lower_bound >= 0)
+        {
+          if (lower_bound > mon_approx_dist_bound)
+            return 0;
+
+          if (!k_closest_pairs.isInsertable(NeighborPair(0, 0, lower_bound)))
+            return 0;
+        }
+      }
+
+      kClosestPairs<MetricT>(0, root_bounds, query, query_bounds, k_closest_pairs, dist_bound, get_closest_points,
+                             use_as_query_index_and_swap, filter);
+
+      return k_closest_pairs.size();
+    }
+
+    /**
+     * Get the k elements closest to a query object, ignoring elements not allowed by a filter. Equivalent to the other version
+     * of kClosestPairs() with default values for the internal parameters.
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound,
+                       bool get_closest_points, Filter<T> const * filter) const
+    {
+      return kClosestPairs<MetricT>(query, k_closest_pairs, dist_bound, get_closest_points, true, -1, filter);
+    }
+
+    /**
+     * Get all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and new objects are appended to the array.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQuery(RangeT const & range, Array<T> & result, bool discard_prior_results = true,
+                    Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      processRangeUntil<IntersectionTesterT>(range, RangeQueryFunctor(result), filter);
+    }
+
+    /**
+     * Get the indices of all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The indices of objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and indices of new objects are appended to the array.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQueryIndices(RangeT const & range, Array<intx> & result, bool discard_prior_results = true,
+                           Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      processRangeUntil<IntersectionTesterT>(range, RangeQueryIndicesFunctor(result), filter);
+    }
+
+    /**
+     * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
+     * (or be a function pointer with the equivalent signature)
+     * \code
+     * bool operator()(intx index, T const & t)
+     * \endcode
+     * and will be passed the index of each object contained in the range as well as a handle to the object itself. If the
+     * functor returns true on any object, the search will terminate immediately. To pass a functor by reference, wrap it in
+     * <tt>std::ref</tt>. If \a filter is not null, elements not allowed by it are ignored.
+     *
+     * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
+     *   immediately after processing this object), else a negative value.
+     */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(RangeT const & range, FunctorT functor, Filter<T> const * filter = nullptr) const
+    {
+      return num_nodes <= 0 ? -1 : processRangeUntil<IntersectionTesterT>(0, root_bounds, range, functor, filter);
+    }
+
+    // The ray query functions below ignore elements not allowed by \a filter, if it is not null.
+
+    template <typename RayIntersectionTesterT>
+    bool rayIntersects(RayT const & ray, Real max_time = -1, Filter<T> const * filter = nullptr) const
+    {
+      return rayIntersectionTime<RayIntersectionTesterT>(ray, max_time, filter) >= 0;
+    }
+
+    template <typename RayIntersectionTesterT>
+    Real rayIntersectionTime(RayT const & ray, Real max_time = -1, Filter<T> const * filter = nullptr) const
+    {
+      if (num_nodes > 0 && root_bounds.rayIntersects(ray, max_time))
+        return rayIntersectionTime<RayIntersectionTesterT>(0, root_bounds, ray, max_time, filter);
+
+      return -1;
+    }
+
+    template <typename RayIntersectionTesterT>
+    RayStructureIntersectionT rayStructureIntersection(RayT const & ray, Real max_time = -1,
+                                                       Filter<T> const * filter = nullptr) const
+    {
+      if (num_nodes > 0 && root_bounds.rayIntersects(ray, max_time))
+        return rayStructureIntersection<RayIntersectionTesterT>(0, root_bounds, ray, max_time, filter);
+
+      return RayStructureIntersectionT(-1);
+    }
+
+    /** Get the times taken by a batch of rays to hit the nearest objects in the tree, as in KDTreeN::rayIntersectionTimes(). */
+    template <typename RayIntersectionTesterT>
+    void rayIntersectionTimes(RayT const * rays, intx num_rays, Real * times, Real max_time = -1,
+                              Filter<T> const * filter = nullptr) const
+    {
+      for (intx i = 0; i < num_rays; ++i)
+        times[i] = rayIntersectionTime<RayIntersectionTesterT>(rays[i], max_time, filter);
+    }
+
+    /** Get the nearest intersections of a batch of rays with the tree, as in KDTreeN::rayStructureIntersections(). */
+    template <typename RayIntersectionTesterT>
+    void rayStructureIntersections(RayT const * rays, intx num_rays, RayStructureIntersectionT * isecs, Real max_time = -1,
+                                   Filter<T> const * filter = nullptr) const
+    {
+      for (intx i = 0; i < num_rays; ++i)
+        isecs[i] = rayStructureIntersection<RayIntersectionTesterT>(rays[i], max_time, filter);
+    }
+
+  private:
+    /** A functor that copies elements of the source tree unchanged. */
+    struct IdentityConverter
+    {
+      T const & operator()(T const & t) const { return t; }
+    };
+
+    /** A functor to add results of a range query to an array. */
+    class RangeQueryFunctor
+    {
+      public:
+        RangeQueryFunctor(Array<T> & result_) : result(result_) {}
+        bool operator()(intx index, T const & t) { result.push_back(t); return false; }
+
+      private:
+        Array<T> & result;
+    };
+
+    /** A functor to add the indices of results of a range query to an array. */
+    class RangeQueryIndicesFunctor
+    {
+      public:
+        RangeQueryIndicesFunctor(Array<intx> & result_) : result(result_) {}
+        bool operator()(intx index, T const & t) { result.push_back(index); return false; }
+
+      private:
+        Array<intx> & result;
+    };
+
+    /** Header of a saved tree. All offsets are in bytes from the start of the file. */
+    struct FileHeader
+    {
+      char magic[8];                 ///< Identifies the file format.
+      uint32 endian_check;           ///< Detects files saved with a different byte order.
+      uint32 version;                ///< Version of the file format.
+      uint32 dim;                    ///< Number of dimensions N.
+      uint32 scalar_size;            ///< Size of the scalar type, in bytes.
+      uint32 node_size;              ///< Size of a node, in bytes.
+      uint32 elem_size;              ///< Size of an element, in bytes, if elements are stored, else 0.
+      uint32 flags;                  ///< Bitwise OR of FLAG_QUANTIZED and FLAG_ELEMENTS.
+      uint32 padding;                ///< Unused.
+      uint64 num_nodes;              ///< Number of nodes.
+      uint64 num_elems;              ///< Number of elements.
+      uint64 source_hash;            ///< Hash of the data the tree was built from.
+      uint64 nodes_offset;           ///< Start of the node array.
+      uint64 bounds_offset;          ///< Start of the node bounds array.
+      uint64 source_indices_offset;  ///< Start of the source index array.
+      uint64 elems_offset;           ///< Start of the element array, if elements are stored.
+      uint64 file_size;              ///< Total size of the file.
+      double root_lo[N];             ///< Lower corner of the root bounds.
+      double root_hi[N];             ///< Upper corner of the root bounds.
+    };
+
+    static char const * const FILE_MAGIC;          ///< Identifies the file format.
+    static uint32 const ENDIAN_CHECK = 0x01020304;  ///< Value that reads differently with the wrong byte order.
+    static uint32 const FILE_VERSION = 1;           ///< Version of the file format.
+    static uint32 const FLAG_QUANTIZED = 0x01;      ///< Node bounds are quantized.
+    static uint32 const FLAG_ELEMENTS = 0x02;       ///< Elements are stored in the file.
+
+    /** Round a file offset up so that every section starts on a cache line. */
+    static uint64 alignFileOffset(uint64 offset) { return (offset + 63) & ~(uint64)63; }
+
+    /**
+     * Check if an array of \a count items of \a item_size bytes each, starting at a given offset, lies within a file of the
+     * given size, without overflowing, and starts at a multiple of \a alignment (the file is mapped at a page boundary).
+     */
+    static bool isValidFileArray(uint64 offset, uint64 count, uint64 item_size, uint64 alignment, uint64 file_size)
+    {
+      return offset <= file_size && offset % alignment == 0 && count <= (file_size - offset) / item_size;
+    }
+
+    /** Write a block of bytes at a given offset in a file, padding the file with zeros up to the offset. */
+    static void writeFileSection(std::ofstream & out, void const * data, uint64 num_bytes, uint64 offset)
+    {
+      static char const ZEROS[64] = { 0 };
+      uint64 pos = (uint64)out.tellp();
+      if (pos < offset)
+        out.write(ZEROS, (std::streamsize)(offset - pos));
+
+      if (num_bytes > 0)
+        out.write(static_cast<char const *>(data), (std::streamsize)num_bytes);
+    }
+
+    /** Make the data pointers refer to the arrays owned by this object. */
+    void useOwnedData()
+    {
+      node_data = (owned_nodes.empty() ? nullptr : &owned_nodes[0]);
+      full_bounds_data = (owned_full_bounds.empty() ? nullptr : &owned_full_bounds[0]);
+      quantized_bounds_data = (owned_quantized_bounds.empty() ? nullptr : &owned_quantized_bounds[0]);
+      elem_data = (owned_elems.empty() ? nullptr : &owned_elems[0]);
+      source_index_data = (owned_source_indices.empty() ? nullptr : &owned_source_indices[0]);
+      num_nodes = (intx)owned_nodes.size();
+      num_elems = (intx)owned_elems.size();
+    }
+
+    /**
+     * Recursively copy a subtree of the source tree. \a bounds is the bounding box of the source node, as it will be decoded
+     * during traversal of the flattened tree.
+     */
+    template <typename SourceTreeT, typename SourceNodeT, typename ConverterT>
+    void flatten(SourceTreeT const & src, SourceNodeT const * src_node, AxisAlignedBoxT const & bounds, ConverterT & convert)
+    {
+      uint32 index = (uint32)owned_nodes.size();
+      owned_nodes.push_back(Node());
+      owned_nodes[index].first_elem = (uint32)owned_elems.size();
+      owned_nodes[index].hi = 0;
+
+      if (src_node->isLeaf())
+      {
+        typename SourceTreeT::Element const * src_elems = src.getElements();
+        for (typename SourceNodeT::ElementIndexConstIterator ei = src_node->elementIndicesBegin();
+             ei != src_node->elementIndicesEnd(); ++ei)
+        {
+          owned_elems.push_back(convert(src_elems[*ei]));
+          owned_source_indices.push_back((uint32)*ei);
+        }
+      }
+      else
+      {
+        AxisAlignedBoxT lo_bounds = encodeBounds(src_node->getLowChild()->getBounds(), bounds);
+        flatten(src, src_node->getLowChild(), lo_bounds, convert);
+
+        owned_nodes[index].hi = (uint32)owned_nodes.size();
+        AxisAlignedBoxT hi_bounds = encodeBounds(src_node->getHighChild()->getBounds(), bounds);
+        flatten(src, src_node->getHighChild(), hi_bounds, convert);
+      }
+
+      owned_nodes[index].num_elems = (uint32)owned_elems.size() - owned_nodes[index].first_elem;
+    }
+
+    /**
+     * Append the bounds of a new child node, quantizing them relative to the (decoded) bounds of the parent if required, and
+     * return the bounds as they will be decoded during traversal.
+     */
+    AxisAlignedBoxT encodeBounds(AxisAlignedBoxT const & box, AxisAlignedBoxT const & parent_bounds)
+    {
+      if (!quantized)
+      {
+        FullBounds fb;
+        for (intx i = 0; i < N; ++i) { fb.lo[i] = box.getLow()[i]; fb.hi[i] = box.getHigh()[i]; }
+        owned_full_bounds.push_back(fb);
+
+        return box;
+      }
+
+      QuantizedBounds qb;
+      VectorT const & plo = parent_bounds.getLow();
+      VectorT ext = parent_bounds.getExtent();
+      for (intx i = 0; i < N; ++i)
+      {
+        if (ext[i] <= 0)
+        {
+          qb.lo[i] = 0;
+          qb.hi[i] = 255;
+          continue;
+        }
+
+        int q_lo = Math::clamp((int)std::floor(255 * ((box.getLow()[i]  - plo[i]) / ext[i])), 0, 255);
+        int q_hi = Math::clamp((int)std::ceil (255 * ((box.getHigh()[i] - plo[i]) / ext[i])), 0, 255);
+
+        // Make sure the decoded box contains the original, in spite of rounding
+        while (q_lo > 0   && decodeCoord(plo[i], ext[i], q_lo) > box.getLow()[i])  q_lo--;
+        while (q_hi < 255 && decodeCoord(plo[i], ext[i], q_hi) < box.getHigh()[i]) q_hi++;
+
+        qb.lo[i] = (uint8)q_lo;
+        qb.hi[i] = (uint8)q_hi;
+      }
+
+      owned_quantized_bounds.push_back(qb);
+
+      AxisAlignedBoxT decoded;
+      decode(qb, parent_bounds, decoded);
+      return decoded;
+    }
+
+    /** Decode a quantized coordinate. */
+    static ScalarT decodeCoord(ScalarT parent_lo, ScalarT parent_ext, int q)
+    {
+      return q <= 0 ? parent_lo : (q >= 255 ? parent_lo + parent_ext : parent_lo + q * (parent_ext / 255));
+    }
+
+    /** Decode quantized bounds relative to the bounds of the parent. */
+    static void decode(QuantizedBounds const & qb, AxisAlignedBoxT const & parent_bounds, AxisAlignedBoxT & box)
+    {
+      VectorT const & plo = parent_bounds.getLow();
+      VectorT ext = parent_bounds.getExtent();
+      VectorT lo, hi;
+      for (intx i = 0; i < N; ++i)
+      {
+        lo[i] = decodeCoord(plo[i], ext[i], qb.lo[i]);
+        hi[i] = decodeCoord(plo[i], ext[i], qb.hi[i]);
+      }
+
+      box.set(lo, hi);
+    }
+
+    /** Get the bounding box for an object, if it is bounded. */
+    template < typename U, typename std::enable_if< IsBoundedN<U, N>::value, int >::type = 0 >
+    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    {
+      BoundedTraitsN<U, N, ScalarT>::getBounds(u, bounds);
+    }
+
+    /** Returns a null bounding box for unbounded objects. */
+    template < typename U, typename std::enable_if< !IsBoundedN<U, N>::value, int >::type = 0 >
+    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    {
+      bounds.setNull();
+    }
+
+    /**
+     * Get a lower bound on (the monotone approximation to) the distance between a node's bounding box and a bounded query
+     * object, or a negative value if no such lower bound can be calculated.
+     */
+    template < typename MetricT, typename QueryT, typename std::enable_if< IsBoundedN<QueryT, N>::value, int >::type = 0 >
+    static double monotonePruningDistance(AxisAlignedBoxT const & node_bounds, QueryT const & query,
+                                          AxisAlignedBoxT const & query_bounds)
+    {
+      if (!query_bounds.isNull())
+        return MetricT::template monotoneApproxDistance<N, ScalarT>(query_bounds, node_bounds);
+      else
+        return -1;
+    }
+
+    /**
+     * Get a lower bound on (the monotone approximation to) the distance between a node's bounding box and an unbounded query
+     * object. \a query_bounds is ignored.
+     */
+    template < typename MetricT, typename QueryT, typename std::enable_if< !IsBoundedN<QueryT, N>::value, int >::type = 0 >
+    static double monotonePruningDistance(AxisAlignedBoxT const & node_bounds, QueryT const & query,
+                                          AxisAlignedBoxT const & query_bounds)
+    {
+      return MetricT::template monotoneApproxDistance<N, ScalarT>(query, node_bounds);
+    }
+
+    /** Check if an element passes the per-query filter (if not null). */
+    static bool elementPassesFilter(T const & elem, Filter<T> const * filter)
+    {
+      return !filter || filter->allows(elem);
+    }
+
+    /** Recursively look for the closest element to a query object. */
+    template <typename MetricT, typename QueryT>
+    void closestPair(uint32 index, AxisAlignedBoxT const & bounds, QueryT const & query, AxisAlignedBoxT const & query_bounds,
+                     NeighborPair & pair, bool get_closest_points, Filter<T> const * filter) const
+    {
+      Node const & node = node_data[index];
+      if (node.isLeaf())
+        closestPairLeaf<MetricT>(node, query, pair, get_closest_points, filter);
+      else
+      {
+        // Figure out which child is closer
+        uint32 n[2] = { index + 1, node.hi };
+        AxisAlignedBoxT b[2] = { getNodeBounds(n[0], bounds), getNodeBounds(n[1], bounds) };
+        double mad[2] = { monotonePruningDistance<MetricT>(b[0], query, query_bounds),
+                          monotonePruningDistance<MetricT>(b[1], query, query_bounds) };
+
+        // The smaller non-negative value should be first
+        if (mad[1] >= 0 && (mad[0] < 0 || mad[0] > mad[1]))
+        {
+          std::swap(n[0], n[1]);
+          std::swap(b[0], b[1]);
+          std::swap(mad[0], mad[1]);
+        }
+
+        for (int i = 0; i < 2; ++i)
+          if (pair.getMonotoneApproxDistance() < 0 || mad[i] <= pair.getMonotoneApproxDistance())
+            closestPair<MetricT>(n[i], b[i], query, query_bounds, pair, get_closest_points, filter);
+      }
+    }
+
+    /** Search the elements of a leaf for the one closest to a query object that is a proximity query structure. */
+    template < typename MetricT, typename QueryT,
+               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void closestPairLeaf(Node const & leaf, QueryT const & query, NeighborPair & pair, bool get_closest_points,
+                         Filter<T> const * filter) const
+    {
+      for (uint32 i = leaf.first_elem, end = leaf.first_elem + leaf.num_elems; i < end; ++i)
+      {
+        T const & elem = elem_data[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        double dist_bound = (pair.getMonotoneApproxDistance() >= 0
+                           ? MetricT::invertMonotoneApprox(pair.getMonotoneApproxDistance()) : -1);
+        NeighborPair swapped = query.template closestPair<MetricT>(elem, dist_bound, get_closest_points);
+        if (swapped.isValid()
+         && (pair.getMonotoneApproxDistance() < 0 || swapped.getMonotoneApproxDistance() <= pair.getMonotoneApproxDistance()))
+        {
+          pair = swapped.swapped();
+          pair.setTargetIndex((intx)i);
+        }
+      }
+    }
+
+    /** Search the elements of a leaf for the one closest to a query object that is not a proximity query structure. */
+    template < typename MetricT, typename QueryT,
+               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void closestPairLeaf(Node const & leaf, QueryT const & query, NeighborPair & pair, bool get_closest_points,
+                         Filter<T> const * filter) const
+    {
+      VectorT qp = VectorT::Zero(), tp = VectorT::Zero();  // initialize to squash uninitialized variable warning
+
+      for (uint32 i = leaf.first_elem, end = leaf.first_elem + leaf.num_elems; i < end; ++i)
+      {
+        T const & elem = elem_data[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        double mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+        if (pair.getMonotoneApproxDistance() < 0 || mad <= pair.getMonotoneApproxDistance())
+          pair = NeighborPair(0, (intx)i, mad, qp, tp);
+      }
+    }
+
+    /** Recursively look for the k closest elements to a query object. */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    void kClosestPairs(uint32 index, AxisAlignedBoxT const & bounds, QueryT const & query,
+                       AxisAlignedBoxT const & query_bounds, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound,
+                       bool get_closest_points, intx use_as_query_index_and_swap, Filter<T> const * filter) const
+    {
+      Node const & node = node_data[index];
+      if (node.isLeaf())
+        kClosestPairsLeaf<MetricT>(node, query, k_closest_pairs, dist_bound, get_closest_points, use_as_query_index_and_swap,
+                                   filter);
+      else
+      {
+        // Figure out which child is closer
+        uint32 n[2] = { index + 1, node.hi };
+        AxisAlignedBoxT b[2] = { getNodeBounds(n[0], bounds), getNodeBounds(n[1], bounds) };
+        double mad[2] = { monotonePruningDistance<MetricT>(b[0], query, query_bounds),
+                          monotonePruningDistance<MetricT>(b[1], query, query_bounds) };
+
+        // The smaller non-negative value should be first
+        if (mad[1] >= 0 && (mad[0] < 0 || mad[0] > mad[1]))
+        {
+          std::swap(n[0], n[1]);
+          std::swap(b[0], b[1]);
+          std::swap(mad[0], mad[1]);
+        }
+
+        double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+        for (int i = 0; i < 2; ++i)
+        {
+          if ((mon_approx_dist_bound < 0 || mad[i] <= mon_approx_dist_bound)
+            && k_closest_pairs.isInsertable(NeighborPair(0, 0, mad[i])))
+          {
+            kClosestPairs<MetricT>(n[i], b[i], query, query_bounds, k_closest_pairs, dist_bound, get_closest_points,
+                                   use_as_query_index_and_swap, filter);
+          }
+        }
+      }
+    }
+
+    /** Search the elements of a leaf for the k nearest neighbors of a query object that is a proximity query structure. */
+    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSetT,
+               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void kClosestPairsLeaf(Node const & leaf, QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs,
+                           double dist_bound, bool get_closest_points, intx use_as_query_index_and_swap,
+                           Filter<T> const * filter) const
+    {
+      for (uint32 i = leaf.first_elem, end = leaf.first_elem + leaf.num_elems; i < end; ++i)
+      {
+        T const & elem = elem_data[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        query.template kClosestPairs<MetricT>(elem, k_closest_pairs, dist_bound, get_closest_points, false, (intx)i);
+      }
+    }
+
+    /** Search the elements of a leaf for the k nearest neighbors of a query object that is not a proximity query structure. */
+    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSetT,
+               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void kClosestPairsLeaf(Node const & leaf, QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs,
+                           double dist_bound, bool get_closest_points, intx use_as_query_index_and_swap,
+                           Filter<T> const * filter) const
+    {
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+
+      std::equal_to<NeighborPair> eq_comp;
+      VectorT qp, tp;
+
+      for (uint32 i = leaf.first_elem, end = leaf.first_elem + leaf.num_elems; i < end; ++i)
+      {
+        T const & elem = elem_data[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        // Check if the element is already in the set of neighbors or not
+        NeighborPair pair = (use_as_query_index_and_swap >= 0 ? NeighborPair((intx)i, use_as_query_index_and_swap)
+                                                              : NeighborPair(0, (intx)i));
+        if (k_closest_pairs.contains(pair, eq_comp))  // already found
+          continue;
+
+        double mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+        if (mon_approx_dist_bound < 0 || mad <= mon_approx_dist_bound)
+        {
+          pair.setMonotoneApproxDistance(mad);
+
+          if (get_closest_points)
+          {
+            if (use_as_query_index_and_swap >= 0)
+            {
+              pair.setQueryPoint(tp);
+              pair.setTargetPoint(qp);
+            }
+            else
+            {
+              pair.setQueryPoint(qp);
+              pair.setTargetPoint(tp);
+            }
+          }
+
+          k_closest_pairs.insert(pair);
+        }
+      }
+    }
+
+    /** Apply a functor to all elements of a subtree within a range, until the functor returns true. */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(uint32 index, AxisAlignedBoxT const & bounds, RangeT const & range, FunctorT & functor,
+                           Filter<T> const * filter) const
+    {
+      // Early exit if the range and node are disjoint
+      if (!IntersectionTesterT::template intersects<N, ScalarT>(range, bounds))
+        return -1;
+
+      Node const & node = node_data[index];
+      bool contained = range.contains(bounds);
+      if (contained || node.isLeaf())
+      {
+        // The elements of the subtree are contiguous, so a contained subtree can be processed without descending further
+        for (uint32 i = node.first_elem, end = node.first_elem + node.num_elems; i < end; ++i)
+        {
+          T const & elem = elem_data[i];
+          if (!elementPassesFilter(elem, filter))
+            continue;
+
+          if (contained || IntersectionTesterT::template intersects<N, ScalarT>(elem, range))
+            if (functor((intx)i, elem))
+              return (intx)i;
+        }
+      }
+      else  // not leaf
+      {
+        intx result = processRangeUntil<IntersectionTesterT>(index + 1, getNodeBounds(index + 1, bounds), range, functor,
+                                                             filter);
+        if (result >= 0) return result;
+        return processRangeUntil<IntersectionTesterT>(node.hi, getNodeBounds(node.hi, bounds), range, functor, filter);
+      }
+
+      return -1;
+    }
+
+    /**
+     * Check if the ray intersection time \a new_time represents a closer, or equally close, valid hit than the previous best
+     * time \a old_time.
+     */
+    static bool improvedRayTime(Real new_time, Real old_time)
+    {
+      return (new_time >= 0 && (old_time < 0 || new_time <= old_time));
+    }
+
+    /** Get the time taken for a ray to hit the nearest object in a subtree, in the forward direction. */
+    template <typename RayIntersectionTesterT>
+    Real rayIntersectionTime(uint32 index, AxisAlignedBoxT const & bounds, RayT const & ray, Real max_time,
+                             Filter<T> const * filter) const
+    {
+      Node const & node = node_data[index];
+      if (node.isLeaf())
+      {
+        Real best_time = max_time;
+        bool found = false;
+        for (uint32 i = node.first_elem, end = node.first_elem + node.num_elems; i < end; ++i)
+        {
+          T const & elem = elem_data[i];
+          if (!elementPassesFilter(elem, filter))
+            continue;
+
+          Real time = RayIntersectionTesterT::template rayIntersectionTime<N, ScalarT>(ray, elem, best_time);
+          if (improvedRayTime(time, best_time))
+          {
+            best_time = time;
+            found = true;
+          }
+        }
+
+        return found ? best_time : -1;
+      }
+      else  // not leaf
+      {
+        // Figure out which child will be hit first
+        uint32 n[2] = { index + 1, node.hi };
+        AxisAlignedBoxT b[2] = { getNodeBounds(n[0], bounds), getNodeBounds(n[1], bounds) };
+        Real t[2] = { b[0].rayIntersectionTime(ray, max_time), b[1].rayIntersectionTime(ray, max_time) };
+
+        if (t[0] < 0 && t[1] < 0)
+          return -1;
+
+        if (improvedRayTime(t[1], t[0]))
+        {
+          std::swap(n[0], n[1]);
+          std::swap(b[0], b[1]);
+          std::swap(t[0], t[1]);
+        }
+
+        Real best_time = max_time;
+        bool found = false;
+        for (int i = 0; i < 2; ++i)
+        {
+          if (improvedRayTime(t[i], best_time))
+          {
+            Real time = rayIntersectionTime<RayIntersectionTesterT>(n[i], b[i], ray, best_time, filter);
+            if (improvedRayTime(time, best_time))
+            {
+              best_time = time;
+              found = true;
+            }
+          }
+        }
+
+        return found ? best_time : -1;
+      }
+    }
+
+    /** Get the nearest intersection of a ray with a subtree, in the forward direction. */
+    template <typename RayIntersectionTesterT>
+    RayStructureIntersectionT rayStructureIntersection(uint32 index, AxisAlignedBoxT const & bounds, RayT const & ray,
+                                                       Real max_time, Filter<T> const * filter) const
+    {
+      Node const & node = node_data[index];
+      if (node.isLeaf())
+      {
+        RayStructureIntersectionT best_isec(max_time);
+        bool found = false;
+        for (uint32 i = node.first_elem, end = node.first_elem + node.num_elems; i < end; ++i)
+        {
+          T const & elem = elem_data[i];
+          if (!elementPassesFilter(elem, filter))
+            continue;
+
+          RayIntersectionN<N, ScalarT> isec = RayIntersectionTesterT::template rayIntersection<N, ScalarT>(ray, elem,
+                                                                                                           best_isec.getTime());
+          if (improvedRayTime(isec.getTime(), best_isec.getTime()))
+          {
+            best_isec = RayStructureIntersectionT(isec, (intx)i);
+            found = true;
+          }
+        }
+
+        return found ? best_isec : RayStructureIntersectionT(-1);
+      }
+      else  // not leaf
+      {
+        // Figure out which child will be hit first
+        uint32 n[2] = { index + 1, node.hi };
+        AxisAlignedBoxT b[2] = { getNodeBounds(n[0], bounds), getNodeBounds(n[1], bounds) };
+        Real t[2] = { b[0].rayIntersectionTime(ray, max_time), b[1].rayIntersectionTime(ray, max_time) };
+
+        if (t[0] < 0 && t[1] < 0)
+          return RayStructureIntersectionT(-1);
+
+        if (improvedRayTime(t[1], t[0]))
+        {
+          std::swap(n[0], n[1]);
+          std::swap(b[0], b[1]);
+          std::swap(t[0], t[1]);
+        }
+
+        RayStructureIntersectionT best_isec(max_time);
+        bool found = false;
+        for (int i = 0; i < 2; ++i)
+        {
+          if (improvedRayTime(t[i], best_isec.getTime()))
+          {
+            RayStructureIntersectionT isec = rayStructureIntersection<RayIntersectionTesterT>(n[i], b[i], ray,
+                                                                                              best_isec.getTime(), filter);
+            if (improvedRayTime(isec.getTime(), best_isec.getTime()))
+            {
+              best_isec = isec;
+              found = true;
+            }
+          }
+        }
+
+        return found ? best_isec : RayStructureIntersectionT(-1);
+      }
+    }
+
+    Array<Node> owned_nodes;                             ///< Nodes in depth-first order, unless mapped from a file.
+    Array<FullBounds> owned_full_bounds;                 ///< Full-precision node bounds, unless quantized or mapped.
+    Array<QuantizedBounds> owned_quantized_bounds;       ///< Quantized node bounds, unless not quantized or mapped.
+    Array<T> owned_elems;                                ///< Elements in depth-first leaf order, unless mapped.
+    Array<uint32> owned_source_indices;                  ///< Index of each element in the source tree, unless mapped.
+    MemoryMappedFile::Ptr mapped_file;                   ///< File from which the tree was loaded, if any.
+
+    Node const * node_data;                              ///< Nodes in depth-first order.
+    FullBounds const * full_bounds_data;                 ///< Full-precision node bounds, if not quantized.
+    QuantizedBounds const * quantized_bounds_data;       ///< Quantized node bounds, if quantized.
+    T const * elem_data;                                 ///< Elements, in depth-first leaf order.
+    uint32 const * source_index_data;                    ///< Index of each element in the source tree.
+    intx num_nodes;                                      ///< Number of nodes.
+    intx num_elems;                                      ///< Number of elements.
+    AxisAlignedBoxT root_bounds;                         ///< Bounding box of the root.
+    bool quantized;                                      ///< Are node bounds quantized?
+
+}; // class FlatKDTreeN
+
+template <typename T, int N, typename ScalarT>
+char const * const FlatKDTreeN<T, N, ScalarT>::FILE_MAGIC = "THEAFKDT";
+
+} // namespace Algorithms
+} // namespace Thea
+
+#endif
@@ -0,0 +1,977 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_Algorithms_HashGridN_hpp__
+#define __Thea_Algorithms_HashGridN_hpp__
+
+#include "../Common.hpp"
+#include "../Array.hpp"
+#include "../AxisAlignedBoxN.hpp"
+#include "../Math.hpp"
+#include "../Noncopyable.hpp"
+#include "../System.hpp"
+#include "../ThreadGroup.hpp"
+#include "BoundedTraitsN.hpp"
+#include "Filter.hpp"
+#include "KDTreeN.hpp"
+#include "PointTraitsN.hpp"
+#include "ProximityQueryStructureN.hpp"
+#include "RangeQueryStructure.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+namespace Thea {
+namespace Algorithms {
+
+/**
+ * A uniform grid on a set of points in N-space, supporting range and proximity queries. On point sets of fairly uniform
+ * density, such as samples of a surface, fixed-radius queries on the grid only have to examine the few cells overlapping the
+ * query, which is faster than descending a kd-tree.
+ *
+ * Only non-empty cells consume memory. Each cell is hashed to a slot of a table with about as many slots as points, and all
+ * points are stored in a single array sorted by slot (with the parallel radix sort used by the Morton build of KDTreeN), so the
+ * points of a cell are contiguous in memory and the table just holds the offset of each slot in the array. Cells that collide
+ * in the same slot share its range of the array and are told apart by their cell keys, which are stored alongside the points.
+ *
+ * If the cell size is not specified, it is chosen so that each non-empty cell holds about getTargetElementsPerCell() points on
+ * average. The density is measured over the non-empty cells, so the selection adapts to points distributed over a
+ * lower-dimensional subspace (e.g. a surface in 3-space). For fixed-radius queries, a cell size close to the query radius is
+ * usually best and can be passed to init() explicitly.
+ *
+ * HashGridN implements the same range and proximity query interface as KDTreeN, and can replace it as a template argument, e.g.
+ * for the precomputed sample structure of the classes in MeshFeatures. Unlike KDTreeN, the elements must be points
+ * (IsPointN<T, N> must be true), queries cannot be proximity query structures, and transforms and filter stacks are not
+ * supported (individual queries still accept filters). Nearest neighbor queries search rings of cells of increasing size around
+ * the query, which requires the metric to be no smaller than the L-infinity distance, as is the case for MetricL2.
+ */
+template <typename T, int N, typename ScalarT = Real>
+class /* THEA_API */ HashGridN
+: public RangeQueryStructure<T>,
+  public ProximityQueryStructureN<N, ScalarT>,
+  private Noncopyable
+{
+  private:
+    typedef RangeQueryStructure<T>                RangeQueryBaseT;
+    typedef ProximityQueryStructureN<N, ScalarT>  ProximityQueryBaseT;
+
+    static_assert(IsPointN<T, N>::value, "HashGridN: Elements must be points");
+
+  public:
+    THEA_DECL_SMART_POINTERS(HashGridN)
+
+    typedef T                                           Element;          ///< Type of elements in the grid.
+    typedef T                                           value_type;       ///< Type of elements in the grid (STL convention).
+    typedef typename ProximityQueryBaseT::VectorT       VectorT;          ///< Vector in N-space.
+    typedef AxisAlignedBoxN<N, ScalarT>                 AxisAlignedBoxT;  ///< Axis-aligned box in N-space.
+    typedef typename ProximityQueryBaseT::NeighborPair  NeighborPair;     ///< A pair of neighboring elements.
+
+    /** Default target for the mean number of elements in a non-empty cell, when the cell size is selected automatically. */
+    static intx const DEFAULT_ELEMS_PER_CELL = 4;
+
+  private:
+    /** A functor to add results of a range query to an array. */
+    class RangeQueryFunctor
+    {
+      public:
+        RangeQueryFunctor(Array<T> & result_) : result(result_) {}
+        bool operator()(intx index, T & t) { result.push_back(t); return false; }
+
+      private:
+        Array<T> & result;
+    };
+
+    /** A functor to add the indices of results of a range query to an array. */
+    class RangeQueryIndicesFunctor
+    {
+      public:
+        RangeQueryIndicesFunctor(Array<intx> & result_) : result(result_) {}
+        bool operator()(intx index, T & t) { result.push_back(index); return false; }
+
+      private:
+        Array<intx> & result;
+    };
+
+  public:
+    /** Default constructor. */
+    HashGridN() : num_elems(0), cell_size(0), inv_cell_size(0), slot_mask(0), target_elems_per_cell(DEFAULT_ELEMS_PER_CELL),
+                  max_build_threads(1)
+    {}
+
+    /**
+     * Construct from a list of elements. InputIterator must dereference to type T.
+     *
+     * @param begin Points to the first element to be added.
+     * @param end Points to one position beyond the last element to be added.
+     * @param cell_size_ The side length of each (hypercubical) cell. Use a non-positive argument to auto-select a suitable
+     *   value.
+     */
+    template <typename InputIterator>
+    HashGridN(InputIterator begin, InputIterator end, ScalarT cell_size_ = -1)
+    : num_elems(0), cell_size(0), inv_cell_size(0), slot_mask(0), target_elems_per_cell(DEFAULT_ELEMS_PER_CELL),
+      max_build_threads(1)
+    {
+      init(begin, end, cell_size_);
+    }
+
+    /**
+     * Construct from a list of elements. InputIterator must dereference to type T. Any previous data is discarded.
+     *
+     * @param begin Points to the first element to be added.
+     * @param end Points to one position beyond the last element to be added.
+     * @param cell_size_ The side length of each (hypercubical) cell. Use a non-positive argument to auto-select a suitable
+     *   value.
+     */
+    template <typename InputIterator>
+    void init(InputIterator begin, InputIterator end, ScalarT cell_size_ = -1)
+    {
+      clear();
+
+      elems.assign(begin, end);
+      alwaysAssertM((uint64)elems.size() < (uint64)std::numeric_limits<uint32>::max(),
+                    "HashGridN: Number of elements must be less than 2^32");
+
+      num_elems = (intx)elems.size();
+      if (num_elems <= 0) return;
+
+      intx num_threads = (max_build_threads < 0 ? System::concurrency() : max_build_threads);
+
+      Array<VectorT> positions(elems.size());
+      for (size_t i = 0; i < elems.size(); ++i)
+      {
+        positions[i] = PointTraitsN<T, N, ScalarT>::getPosition(elems[i]);
+        bounds.merge(positions[i]);
+      }
+
+      setCellSize(cell_size_ > 0 ? cell_size_ : autoCellSize(positions, num_threads));
+
+      // The table has the smallest power-of-two number of slots that is at least the number of elements
+      int num_slot_bits = 1;
+      while (((uint64)1 << num_slot_bits) < (uint64)num_elems) ++num_slot_bits;
+      slot_mask = ((uint64)1 << num_slot_bits) - 1;
+
+      // Sort the elements by slot
+      Array<uint64> cell_keys(elems.size()), slot_keys(elems.size());
+      entry_indices.resize(elems.size());
+      runBlocks(KeyWorker(this, &positions[0], &cell_keys[0], &slot_keys[0], &entry_indices[0]), num_threads);
+
+      KDTreeNInternal::RadixSorter<uint32>::sort(&slot_keys[0], &entry_indices[0], elems.size(), num_slot_bits, num_threads);
+
+      slot_starts.resize((size_t)slot_mask + 2);
+      size_t e = 0;
+      for (uint64 s = 0; s <= slot_mask + 1; ++s)
+      {
+        while (e < elems.size() && slot_keys[e] < s) ++e;
+        slot_starts[(size_t)s] = (uint32)e;
+      }
+
+      // Store the positions and cell keys in sorted order, so that each cell is contiguous in memory
+      entry_positions.resize(elems.size());
+      entry_cells.resize(elems.size());
+      runBlocks(GatherWorker(this, &positions[0], &cell_keys[0]), num_threads);
+    }
+
+    /** Clear the grid. */
+    void clear()
+    {
+      num_elems = 0;
+      elems.clear();
+      bounds.setNull();
+      cell_size = inv_cell_size = 0;
+      slot_mask = 0;
+      slot_starts.clear();
+      entry_positions.clear();
+      entry_indices.clear();
+      entry_cells.clear();
+    }
+
+    /** Check if the grid is empty. */
+    bool isEmpty() const { return num_elems <= 0; }
+
+    /** Get the number of elements in the grid. The elements themselves can be obtained with getElements(). */
+    intx numElements() const { return num_elems; }
+
+    /** Get a pointer to an array of the elements in the grid. The number of elements can be obtained with numElements(). */
+    T const * getElements() const { return elems.empty() ? nullptr : &elems[0]; }
+
+    /**
+     * Get a pointer to the element with a given index. The element is not modified by the grid, and modifying its position
+     * invalidates the grid.
+     */
+    T * getElement(intx index) { return &elems[(size_t)index]; }
+
+    /** Get a bounding box for all the elements in the grid. */
+    AxisAlignedBoxT const & getBounds() const { return bounds; }
+
+    /** Get the side length of each cell of the grid. */
+    ScalarT getCellSize() const { return cell_size; }
+
+    /**
+     * Set the mean number of elements in a non-empty cell that the automatic selection of the cell size in init() aims for. The
+     * default is DEFAULT_ELEMS_PER_CELL.
+     */
+    void setTargetElementsPerCell(intx target) { target_elems_per_cell = std::max(target, (intx)1); }
+
+    /** Get the mean number of elements in a non-empty cell that the automatic selection of the cell size aims for. */
+    intx getTargetElementsPerCell() const { return target_elems_per_cell; }
+
+    /**
+     * Set the maximum number of threads used to construct the grid in init(). If the value is 1 (the default), the grid is built
+     * serially. If it is negative, the number of threads is set to the hardware concurrency. The grid does not depend on the
+     * number of threads.
+     */
+    void setMaxBuildThreads(intx max_build_threads_ = -1) { max_build_threads = max_build_threads_; }
+
+    /**
+     * Get the maximum number of threads used to construct the grid in init(). A negative value implies the hardware
+     * concurrency.
+     */
+    intx getMaxBuildThreads() const { return max_build_threads; }
+
+    /**
+     * Get the minimum distance between this structure and a query object. If \a filter is not null, elements that it does not
+     * allow are ignored.
+     */
+    template <typename MetricT, typename QueryT>
+    double distance(QueryT const & query, double dist_bound = -1, Filter<T> const * filter = nullptr) const
+    {
+      double result = -1;
+      if (closestElement<MetricT>(query, dist_bound, &result, nullptr, filter) >= 0)
+        return result;
+      else
+        return -1;
+    }
+
+    /**
+     * Get the closest element in this structure to a query object, within a specified distance bound.
+     *
+     * @param query Query object. BoundedTraitsN<QueryT, N, ScalarT> must be defined.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param dist The distance to the query object is placed here. Ignored if null.
+     * @param closest_point The coordinates of the closest point are placed here. Ignored if null.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     *
+     * @return A non-negative handle to the closest element, if one was found, else a negative number.
+     */
+    template <typename MetricT, typename QueryT>
+    intx closestElement(QueryT const & query, double dist_bound = -1, double * dist = nullptr,
+                        VectorT * closest_point = nullptr, Filter<T> const * filter = nullptr) const
+    {
+      NeighborPair pair = closestPair<MetricT>(query, dist_bound, closest_point != nullptr, filter);
+
+      if (pair.isValid())
+      {
+        if (dist) *dist = MetricT::invertMonotoneApprox(pair.getMonotoneApproxDistance());
+        if (closest_point) *closest_point = pair.getTargetPoint();
+      }
+
+      return pair.getTargetIndex();
+    }
+
+    /**
+     * Get the closest pair of elements between this structure and a query object, whose separation is less than a specified
+     * upper bound.
+     *
+     * @param query Query object. BoundedTraitsN<QueryT, N, ScalarT> must be defined.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param get_closest_points If true, the coordinates of the closest pair of points on the respective elements is computed
+     *   and stored in the returned structure.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     *
+     * @return Non-negative handles to the closest pair of elements in their respective objects, if such a pair was found. Else
+     *   returns a pair of negative numbers.
+     */
+    template <typename MetricT, typename QueryT>
+    NeighborPair closestPair(QueryT const & query, double dist_bound = -1, bool get_closest_points = false,
+                             Filter<T> const * filter = nullptr) const
+    {
+      BoundedSortedArrayN<1, NeighborPair> pair;
+      if (kClosestPairs<MetricT>(query, pair, dist_bound, get_closest_points, true, -1, filter) <= 0)
+        return NeighborPair(-1);
+
+      return pair[0];
+    }
+
+    /**
+     * Get the k elements closest to a query object. The returned elements are placed in a set of bounded size (k). The template
+     * type BoundedNeighborPairSetT should typically be BoundedSortedArray<NeighborPair> or BoundedSortedArrayN<k, NeighborPair>
+     * if only a few neighbors are requested.
+     *
+     * @param query Query object. Must not be a proximity query structure. BoundedTraitsN<QueryT, N, ScalarT> must be defined.
+     * @param k_closest_pairs The k (or fewer) nearest neighbors are placed here.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param get_closest_points If true, the coordinates of the closest pair of points on each pair of neighboring elements is
+     *   computed and stored in the returned pairs.
+     * @param clear_set If true (default), this function discards prior data in \a k_closest_pairs. This is chiefly for internal
+     *   use and the default value of true should normally be left as is.
+     * @param use_as_query_index_and_swap If non-negative, the supplied index is used as the index of the query object (instead
+     *   of the default 0), following which query and target indices/points are swapped in the returned pairs of neighbors. This
+     *   is chiefly for internal use and the default value of -1 should normally be left as is.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     *
+     * @return The number of neighbors found (i.e. the size of \a k_closest_pairs).
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound = -1,
+                       bool get_closest_points = false, bool clear_set = true, intx use_as_query_index_and_swap = -1,
+                       Filter<T> const * filter = nullptr) const
+    {
+      static_assert(!std::is_base_of<ProximityQueryBaseT, QueryT>::value,
+                    "HashGridN: Proximity query structures are not supported as queries");
+
+      if (clear_set) k_closest_pairs.clear();
+
+      if (num_elems <= 0) return 0;
+
+      NeighborSearch<MetricT, QueryT, BoundedNeighborPairSetT> search(this, query, k_closest_pairs, dist_bound,
+                                                                     get_closest_points, use_as_query_index_and_swap, filter);
+
+      AxisAlignedBoxT query_bounds;
+      BoundedTraitsN<QueryT, N, ScalarT>::getBounds(query, query_bounds);
+
+      // Range of cells overlapping the query, which may extend outside the grid, and the distance from the query to the
+      // boundary of this range, which bounds the distance to cells farther away
+      intx qlo[N], qhi[N];
+      double edge_gap = -1;
+      for (intx i = 0; i < N; ++i)
+      {
+        qlo[i] = unclippedCell(query_bounds.getLow()[i], i);
+        qhi[i] = unclippedCell(query_bounds.getHigh()[i], i);
+
+        double lo_gap = query_bounds.getLow()[i] - (bounds.getLow()[i] + qlo[i] * (double)cell_size);
+        double hi_gap = bounds.getLow()[i] + (qhi[i] + 1) * (double)cell_size - query_bounds.getHigh()[i];
+        double gap = std::max(std::min(lo_gap, hi_gap), 0.0);
+        if (edge_gap < 0 || gap < edge_gap) edge_gap = gap;
+      }
+
+      // Search rings of cells of increasing (Chebyshev) distance from the query's range of cells. Rings before the first one to
+      // overlap the grid, and after the last one, are empty.
+      intx first_ring = 0, last_ring = 0;
+      for (intx i = 0; i < N; ++i)
+      {
+        first_ring = std::max(first_ring, std::max(-qhi[i], qlo[i] - (dims[i] - 1)));
+        last_ring = std::max(last_ring, std::max(qhi[i], dims[i] - 1 - qlo[i]));
+      }
+
+      double fudge = 1.0e-4 * cell_size;
+      intx num_cells_searched = 0;
+      for (intx r = first_ring; r <= last_ring; ++r)
+      {
+        if (r > 0)
+        {
+          double lower_bound = MetricT::computeMonotoneApprox(std::max((r - 1) * (double)cell_size + edge_gap - fudge, 0.0));
+          if (search.mon_approx_dist_bound >= 0 && lower_bound > search.mon_approx_dist_bound)
+            break;
+
+          if (!k_closest_pairs.isInsertable(NeighborPair(0, 0, lower_bound)))
+            break;
+        }
+
+        // If the rings have grown larger than the number of elements, it's cheaper to just test every element
+        intx num_ring_cells = numClippedCells(qlo, qhi, r) - (r > 0 ? numClippedCells(qlo, qhi, r - 1) : 0);
+        num_cells_searched += num_ring_cells;
+        if (num_cells_searched > 2 * num_elems)
+        {
+          search.check_duplicates = search.check_duplicates || r > first_ring;
+          for (size_t j = 0; j < entry_positions.size(); ++j)
+            search.testEntry(j);
+
+          break;
+        }
+
+        searchRing(qlo, qhi, r, search);
+      }
+
+      return k_closest_pairs.size();
+    }
+
+    /**
+     * Get the k elements closest to a query object, ignoring elements not allowed by a filter. Equivalent to the other version
+     * of kClosestPairs() with default values for the internal parameters.
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound,
+                       bool get_closest_points, Filter<T> const * filter) const
+    {
+      return kClosestPairs<MetricT>(query, k_closest_pairs, dist_bound, get_closest_points, true, -1, filter);
+    }
+
+    /**
+     * Get all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and new objects are appended to the array (this is useful for range queries over a
+     *   union of simpler ranges).
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQuery(RangeT const & range, Array<T> & result, bool discard_prior_results = true,
+                    Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      const_cast<HashGridN *>(this)->processRangeUntilImpl<IntersectionTesterT, T>(range, RangeQueryFunctor(result), filter);
+    }
+
+    /**
+     * Get the indices of all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The indices of objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and indices of new objects are appended to the array (this is useful for range
+     *   queries over a union of simpler ranges).
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQueryIndices(RangeT const & range, Array<intx> & result, bool discard_prior_results = true,
+                           Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      const_cast<HashGridN *>(this)->processRangeUntilImpl<IntersectionTesterT, T>(range, RangeQueryIndicesFunctor(result),
+                                                                                    filter);
+    }
+
+    /**
+     * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
+     * (or be a function pointer with the equivalent signature)
+     * \code
+     * bool operator()(intx index, T const & t)
+     * \endcode
+     * and will be passed the index of each object contained in the range as well as a handle to the object itself. If the
+     * functor returns true on any object, the search will terminate immediately (this is useful for searching for a particular
+     * object). To pass a functor by reference, wrap it in <tt>std::ref</tt>.
+     *
+     * BoundedTraitsN<RangeT, N, ScalarT> must be defined, and the IntersectionTesterT class must support intersection tests
+     * between VectorT and RangeT. If \a filter is not null, elements not allowed by it are ignored.
+     *
+     * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
+     *   immediately after processing this object), else a negative value.
+     */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(RangeT const & range, FunctorT functor, Filter<T> const * filter = nullptr) const
+    {
+      return const_cast<HashGridN *>(this)->processRangeUntilImpl<IntersectionTesterT, T const>(range, functor, filter);
+    }
+
+    /**
+     * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
+     * (or be a function pointer with the equivalent signature)
+     * \code
+     * bool operator()(intx index, T [const] & t)
+     * \endcode
+     * and will be passed the index of each object contained in the range as well as a handle to the object itself. If the
+     * functor returns true on any object, the search will terminate immediately (this is useful for searching for a particular
+     * object). To pass a functor by reference, wrap it in <tt>std::ref</tt>.
+     *
+     * BoundedTraitsN<RangeT, N, ScalarT> must be defined, and the IntersectionTesterT class must support intersection tests
+     * between VectorT and RangeT. If \a filter is not null, elements not allowed by it are ignored.
+     *
+     * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
+     *   immediately after processing this object), else a negative value.
+     */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(RangeT const & range, FunctorT functor, Filter<T> const * filter = nullptr)
+    {
+      return processRangeUntilImpl<IntersectionTesterT, T>(range, functor, filter);
+    }
+
+  private:
+    static intx const MAX_CELL_COORDINATE = (intx)1 << 40;  ///< Bound on unclipped cell coordinates, to avoid overflow.
+
+    /** Searches the cells of a grid for the neighbors of a query object. */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    struct NeighborSearch
+    {
+      NeighborSearch(HashGridN const * grid_, QueryT const & query_, BoundedNeighborPairSetT & k_closest_pairs_,
+                     double dist_bound, bool get_closest_points_, intx use_as_query_index_and_swap_,
+                     Filter<T> const * filter_)
+      : grid(grid_), query(query_), k_closest_pairs(k_closest_pairs_),
+        mon_approx_dist_bound(dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1),
+        get_closest_points(get_closest_points_), use_as_query_index_and_swap(use_as_query_index_and_swap_), filter(filter_),
+        check_duplicates(!k_closest_pairs_.isEmpty())
+      {}
+
+      /** Test an entry of the sorted array of elements. */
+      void testEntry(size_t entry)
+      {
+        intx index = (intx)grid->entry_indices[entry];
+        if (filter && !filter->allows(grid->elems[(size_t)index]))
+          return;
+
+        NeighborPair pair = (use_as_query_index_and_swap >= 0 ? NeighborPair(index, use_as_query_index_and_swap)
+                                                              : NeighborPair(0, index));
+        if (check_duplicates && k_closest_pairs.contains(pair, std::equal_to<NeighborPair>()))
+          return;
+
+        VectorT qp, tp;
+        double mad = MetricT::template closestPoints<N, ScalarT>(grid->entry_positions[entry], query, tp, qp);
+        if (mon_approx_dist_bound < 0 || mad <= mon_approx_dist_bound)
+        {
+          pair.setMonotoneApproxDistance(mad);
+
+          if (get_closest_points)
+          {
+            if (use_as_query_index_and_swap >= 0)
+            {
+              pair.setQueryPoint(tp);
+              pair.setTargetPoint(qp);
+            }
+            else
+            {
+              pair.setQueryPoint(qp);
+              pair.setTargetPoint(tp);
+            }
+          }
+
+          k_closest_pairs.insert(pair);
+        }
+      }
+
+      /** Test all elements in a cell. Always returns false, so the search continues to the next cell. */
+      bool operator()(uint64 cell_key)
+      {
+        uint64 slot = grid->cellSlot(cell_key);
+        for (uint32 j = grid->slot_starts[(size_t)slot], end = grid->slot_starts[(size_t)slot + 1]; j < end; ++j)
+          if (grid->entry_cells[j] == cell_key)
+            testEntry(j);
+
+        return false;
+      }
+
+      HashGridN const * grid;
+      QueryT const & query;
+      BoundedNeighborPairSetT & k_closest_pairs;
+      double mon_approx_dist_bound;
+      bool get_closest_points;
+      intx use_as_query_index_and_swap;
+      Filter<T> const * filter;
+      bool check_duplicates;
+
+    }; // struct NeighborSearch
+
+    /** Tests the elements of cells for intersection with a range, until a functor returns true. */
+    template <typename IntersectionTesterT, typename FunctorArgT, typename RangeT, typename FunctorT>
+    struct RangeSearch
+    {
+      RangeSearch(HashGridN * grid_, RangeT const & range_, FunctorT & functor_, Filter<T> const * filter_)
+      : grid(grid_), range(range_), functor(functor_), filter(filter_), result(-1)
+      {}
+
+      /** Test an entry of the sorted array of elements. Returns true if the functor returned true. */
+      bool testEntry(size_t entry)
+      {
+        intx index = (intx)grid->entry_indices[entry];
+        T & elem = grid->elems[(size_t)index];
+
+        if (filter && !filter->allows(elem))
+          return false;
+
+        if (IntersectionTesterT::template intersects<N, ScalarT>(grid->entry_positions[entry], range)
+         && functor(index, static_cast<FunctorArgT &>(elem)))
+        {
+          result = index;
+          return true;
+        }
+
+        return false;
+      }
+
+      /** Test all elements in a cell. Returns true if the search should stop. */
+      bool operator()(uint64 cell_key)
+      {
+        uint64 slot = grid->cellSlot(cell_key);
+        for (uint32 j = grid->slot_starts[(size_t)slot], end = grid->slot_starts[(size_t)slot + 1]; j < end; ++j)
+          if (grid->entry_cells[j] == cell_key && testEntry(j))
+            return true;
+
+        return false;
+      }
+
+      HashGridN * grid;
+      RangeT const & range;
+      FunctorT & functor;
+      Filter<T> const * filter;
+      intx result;
+
+    }; // struct RangeSearch
+
+    /** Computes the cell and slot keys of a block of elements. */
+    class KeyWorker
+    {
+      public:
+        KeyWorker(HashGridN const * grid_, VectorT const * positions_, uint64 * cell_keys_, uint64 * slot_keys_,
+                  uint32 * indices_)
+        : grid(grid_), positions(positions_), cell_keys(cell_keys_), slot_keys(slot_keys_), indices(indices_)
+        {}
+
+        void operator()(size_t begin, size_t end)
+        {
+          for (size_t i = begin; i < end; ++i)
+          {
+            cell_keys[i] = grid->cellKey(positions[i]);
+            slot_keys[i] = grid->cellSlot(cell_keys[i]);
+            indices[i] = (uint32)i;
+          }
+        }
+
+      private:
+        HashGridN const * grid;
+        VectorT const * positions;
+        uint64 * cell_keys;
+        uint64 * slot_keys;
+        uint32 * indices;
+
+    }; // class KeyWorker
+
+    /** Copies the positions and cell keys of a block of elements to their sorted locations. */
+    class GatherWorker
+    {
+      public:
+        GatherWorker(HashGridN * grid_, VectorT const * positions_, uint64 const * cell_keys_)
+        : grid(grid_), positions(positions_), cell_keys(cell_keys_)
+        {}
+
+        void operator()(size_t begin, size_t end)
+        {
+          for (size_t j = begin; j < end; ++j)
+          {
+            uint32 index = grid->entry_indices[j];
+            grid->entry_positions[j] = positions[index];
+            grid->entry_cells[j] = cell_keys[index];
+          }
+        }
+
+      private:
+        HashGridN * grid;
+        VectorT const * positions;
+        uint64 const * cell_keys;
+
+    }; // class GatherWorker
+
+    /** Runs a worker on one block of a range of elements, as a thread. */
+    template <typename WorkerT>
+    class BlockRunner
+    {
+      public:
+        BlockRunner(WorkerT * worker_, size_t begin_, size_t end_) : worker(worker_), begin(begin_), end(end_) {}
+        void operator()() { (*worker)(begin, end); }
+
+      private:
+        WorkerT * worker;
+        size_t begin, end;
+
+    }; // class BlockRunner
+
+    /** Run a worker over all elements, split into contiguous blocks processed in parallel if there is more than one thread. */
+    template <typename WorkerT>
+    void runBlocks(WorkerT worker, intx num_threads) const
+    {
+      static size_t const MIN_ELEMS_PER_THREAD = 65536;
+
+      size_t n = elems.size();
+      size_t num_blocks = std::max((size_t)1, std::min((size_t)std::max(num_threads, (intx)1), n / MIN_ELEMS_PER_THREAD));
+      if (num_blocks <= 1)
+      {
+        worker(0, n);
+        return;
+      }
+
+      ThreadGroup pool;
+      for (size_t b = 0; b < num_blocks; ++b)
+        pool.addThread(new std::thread(BlockRunner<WorkerT>(&worker, b * n / num_blocks, (b + 1) * n / num_blocks)));
+
+      pool.joinAll();
+    }
+
+    /**
+     * Set the size of the cells and the dimensions of the grid. The size is increased if necessary, so that the number of cells
+     * does not overflow 64-bit cell keys.
+     */
+    void setCellSize(double s)
+    {
+      static double const MAX_CELLS = 4.0e18;
+
+      if (!(s > 0) || !std::isfinite(s)) s = 1;
+
+      for (;;)
+      {
+        double num_cells = 1;
+        for (intx i = 0; i < N; ++i)
+          num_cells *= std::floor(bounds.getExtent()[i] / s) + 1;
+
+        if (num_cells <= MAX_CELLS) break;
+        s *= 2;
+      }
+
+      cell_size = (ScalarT)s;
+      inv_cell_size = 1 / cell_size;
+
+      uint64 stride = 1;
+      for (intx i = 0; i < N; ++i)
+      {
+        dims[i] = (intx)std::floor(bounds.getExtent()[i] * inv_cell_size) + 1;
+        strides[i] = stride;
+        stride *= (uint64)dims[i];
+      }
+    }
+
+    /**
+     * Select a cell size for which the non-empty cells hold getTargetElementsPerCell() elements on average. Starting from the
+     * size that achieves this for elements spread over the full volume of the bounding box, each iteration measures the mean
+     * occupancy of the non-empty cells and rescales the size, using the rate at which the occupancy changed in the previous
+     * iteration as an estimate of the dimension of the subspace that the elements lie in.
+     */
+    double autoCellSize(Array<VectorT> const & positions, intx num_threads)
+    {
+      static int const MAX_ITERATIONS = 6;
+      static double const TOLERANCE = 1.5;
+
+      double target = (double)target_elems_per_cell;
+
+      intx dim = 0;
+      double volume = 1;
+      for (intx i = 0; i < N; ++i)
+        if (bounds.getExtent()[i] > 0)
+        {
+          volume *= bounds.getExtent()[i];
+          dim++;
+        }
+
+      if (dim == 0) return 1;  // all elements coincide
+
+      double s = std::pow(volume * std::min(target, (double)num_elems) / num_elems, 1.0 / dim);
+      double dim_estimate = (double)dim, prev_s = -1, prev_occupancy = -1;
+
+      Array<uint64> cell_keys(positions.size()), slot_keys(positions.size());
+      Array<uint32> indices(positions.size());
+      for (int iter = 0; iter < MAX_ITERATIONS; ++iter)
+      {
+        setCellSize(s);
+        s = cell_size;
+
+        runBlocks(KeyWorker(this, &positions[0], &cell_keys[0], &slot_keys[0], &indices[0]), num_threads);
+        double occupancy = num_elems / (double)countDistinct(cell_keys);
+        if (occupancy >= target / TOLERANCE && occupancy <= target * TOLERANCE)
+          break;
+
+        if (prev_s > 0 && s != prev_s && occupancy != prev_occupancy)
+          dim_estimate = Math::clamp(std::log(occupancy / prev_occupancy) / std::log(s / prev_s), 1.0, (double)N);
+
+        prev_s = s;
+        prev_occupancy = occupancy;
+        s *= std::pow(target / occupancy, 1.0 / dim_estimate);
+      }
+
+      return s;
+    }
+
+    /** Count the number of distinct values in an array of keys, using a linear-probing hash table. */
+    static size_t countDistinct(Array<uint64> const & keys)
+    {
+      static uint64 const EMPTY = std::numeric_limits<uint64>::max();
+
+      size_t table_size = 16;
+      while (table_size < 2 * keys.size()) table_size *= 2;
+
+      Array<uint64> table(table_size, EMPTY);
+      size_t num_distinct = 0;
+      for (size_t i = 0; i < keys.size(); ++i)
+      {
+        size_t s = (size_t)(hash(keys[i]) & (table_size - 1));
+        while (table[s] != EMPTY && table[s] != keys[i])
+          s = (s + 1) & (table_size - 1);
+
+        if (table[s] == EMPTY)
+        {
+          table[s] = keys[i];
+          num_distinct++;
+        }
+      }
+
+      return num_distinct;
+    }
+
+    /** Mix the bits of a 64-bit key (the finalizer of MurmurHash3). */
+    static uint64 hash(uint64 x)
+    {
+      x ^= x >> 33;
+      x *= 0xff51afd7ed558ccdULL;
+      x ^= x >> 33;
+      x *= 0xc4ceb93e1a85ec53ULL;
+      x ^= x >> 33;
+      return x;
+    }
+
+    /** Get the slot of the table that a cell maps to. */
+    uint64 cellSlot(uint64 cell_key) const { return hash(cell_key) & slot_mask; }
+
+    /** Get the cell coordinate of a value along a dimension, without clipping it to the grid. */
+    intx unclippedCell(ScalarT x, intx dim) const
+    {
+      // Same arithmetic as cellKey(), so a point and the bounds of a range containing it are placed consistently
+      double c = std::floor((double)((x - bounds.getLow()[dim]) * inv_cell_size));
+      return (intx)Math::clamp(c, (double)-MAX_CELL_COORDINATE, (double)MAX_CELL_COORDINATE);
+    }
+
+    /** Get the key of the cell containing a point. The point must lie within the bounds of the grid. */
+    uint64 cellKey(VectorT const & p) const
+    {
+      uint64 key = 0;
+      for (intx i = 0; i < N; ++i)
+      {
+        intx c = Math::clamp((intx)((p[i] - bounds.getLow()[i]) * inv_cell_size), (intx)0, dims[i] - 1);
+        key += (uint64)c * strides[i];
+      }
+
+      return key;
+    }
+
+    /**
+     * Get the number of cells of the grid within Chebyshev distance \a r of a range of cells (which may extend outside the
+     * grid).
+     */
+    intx numClippedCells(intx const * lo, intx const * hi, intx r) const
+    {
+      double count = 1;
+      for (intx i = 0; i < N; ++i)
+      {
+        intx a = std::max(lo[i] - r, (intx)0), b = std::min(hi[i] + r, dims[i] - 1);
+        if (a > b) return 0;
+        count *= (double)(b - a + 1);
+      }
+
+      return (intx)std::min(count, (double)std::numeric_limits<intx>::max() / 2);
+    }
+
+    /**
+     * Apply a visitor to the key of every cell of the grid in a box of cells, clipped to the grid, until it returns true.
+     * Returns true if the visitor did.
+     */
+    template <typename VisitorT> bool visitCells(intx const * lo, intx const * hi, VisitorT & visitor) const
+    {
+      intx a[N], b[N], c[N];
+      for (intx i = 0; i < N; ++i)
+      {
+        a[i] = std::max(lo[i], (intx)0);
+        b[i] = std::min(hi[i], dims[i] - 1);
+        if (a[i] > b[i]) return false;
+        c[i] = a[i];
+      }
+
+      for (;;)
+      {
+        uint64 key = 0;
+        for (intx i = 0; i < N; ++i)
+          key += (uint64)c[i] * strides[i];
+
+        if (visitor(key))
+          return true;
+
+        intx d = 0;
+        for ( ; d < N; ++d)
+        {
+          if (++c[d] <= b[d]) break;
+          c[d] = a[d];
+        }
+
+        if (d == N) return false;
+      }
+    }
+
+    /**
+     * Apply a visitor to every cell of the grid at Chebyshev distance exactly \a r from a range of cells. The shell is
+     * partitioned into the pairs of opposite faces perpendicular to each dimension d, with each face excluding its intersection
+     * with the faces of lower dimensions.
+     */
+    template <typename VisitorT> void searchRing(intx const * qlo, intx const * qhi, intx r, VisitorT & visitor) const
+    {
+      if (r == 0)
+      {
+        visitCells(qlo, qhi, visitor);
+        return;
+      }
+
+      intx lo[N], hi[N];
+      for (intx d = 0; d < N; ++d)
+      {
+        for (intx i = 0; i < N; ++i)
+        {
+          lo[i] = qlo[i] - (i < d ? r - 1 : r);
+          hi[i] = qhi[i] + (i < d ? r - 1 : r);
+        }
+
+        lo[d] = hi[d] = qlo[d] - r;
+        visitCells(lo, hi, visitor);
+
+        lo[d] = hi[d] = qhi[d] + r;
+        visitCells(lo, hi, visitor);
+      }
+    }
+
+    /** Apply a functor to all elements in a range, until it returns true (implementation of processRangeUntil()). */
+    template <typename IntersectionTesterT, typename FunctorArgT, typename RangeT, typename FunctorT>
+    intx processRangeUntilImpl(RangeT const & range, FunctorT functor, Filter<T> const * filter)
+    {
+      if (num_elems <= 0) return -1;
+
+      RangeSearch<IntersectionTesterT, FunctorArgT, RangeT, FunctorT> search(this, range, functor, filter);
+
+      AxisAlignedBoxT range_bounds;
+      BoundedTraitsN<RangeT, N, ScalarT>::getBounds(range, range_bounds);
+
+      intx lo[N], hi[N];
+      for (intx i = 0; i < N; ++i)
+      {
+        lo[i] = unclippedCell(range_bounds.getLow()[i], i);
+        hi[i] = unclippedCell(range_bounds.getHigh()[i], i);
+      }
+
+      // If the range covers more cells than there are elements, it's cheaper to test every element
+      if (numClippedCells(lo, hi, 0) > num_elems)
+      {
+        for (size_t j = 0; j < entry_positions.size(); ++j)
+          if (search.testEntry(j))
+            break;
+      }
+      else
+        visitCells(lo, hi, search);
+
+      return search.result;
+    }
+
+    intx num_elems;                   ///< Number of elements in the grid.
+    Array<T> elems;                   ///< Elements in the grid, in the order they were supplied.
+    AxisAlignedBoxT bounds;           ///< Bounding box of the elements, whose low corner is the origin of the grid.
+    ScalarT cell_size;                ///< Side length of each cell.
+    ScalarT inv_cell_size;            ///< Reciprocal of the cell size.
+    intx dims[N];                     ///< Number of cells along each dimension.
+    uint64 strides[N];                ///< Multipliers of cell coordinates, whose sum is the key of a cell.
+    uint64 slot_mask;                 ///< Number of slots in the hash table, minus one.
+    Array<uint32> slot_starts;        ///< Offset of the elements of each slot in the sorted arrays (plus the total at the end).
+    Array<VectorT> entry_positions;   ///< Positions of elements, sorted by slot.
+    Array<uint32> entry_indices;      ///< Indices of elements, sorted by slot.
+    Array<uint64> entry_cells;        ///< Keys of the cells containing elements, sorted by slot.
+    intx target_elems_per_cell;       ///< Mean number of elements in non-empty cells aimed for by automatic cell sizing.
+    intx max_build_threads;           ///< Maximum number of threads used to construct the grid.
+
+}; // class HashGridN
+
+} // namespace Algorithms
+} // namespace Thea
+
+#endif
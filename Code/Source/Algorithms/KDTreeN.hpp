@@ -19,9 +19,12 @@
 #include "../AffineTransformN.hpp"
 #include "../Array.hpp"
 #include "../AttributedObject.hpp"
+#include "../BoundedSortedArrayN.hpp"
 #include "../Math.hpp"
 #include "../Noncopyable.hpp"
 #include "../Random.hpp"
+#include "../System.hpp"
+#include "../ThreadGroup.hpp"
 #include "../Transformable.hpp"
 #include "BoundedTraitsN.hpp"
 #include "Filter.hpp"
@@ -29,10 +32,14 @@
 #include "RangeQueryStructure.hpp"
 #include "RayQueryStructureN.hpp"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstring>
 #include <functional>
+#include <limits>
+#include <queue>
 #include <type_traits>
+#include <utility>
 
 namespace Thea {
 namespace Algorithms {
@@ -63,7 +70,7 @@ class SampleFilter : public Filter< ElementSample<N, ScalarT> >
 {
   public:
     /** Constructor. */
-    SampleFilter(Filter<T> * base_filter_) : base_filter(base_filter_) {}
+    SampleFilter(Filter<T> const * base_filter_) : base_filter(base_filter_) {}
 
     bool allows(ElementSample<N, ScalarT> const & sample) const
     {
@@ -72,12 +79,297 @@ class SampleFilter : public Filter< ElementSample<N, ScalarT> >
     }
 
   private:
-    Filter<T> * base_filter;  ///< The underlying element filter.
+    Filter<T> const * base_filter;  ///< The underlying element filter.
 
 }; // struct SampleFilter
 
+/**
+ * Sorts an array of values by 64-bit keys, with a least-significant-digit radix sort on 8-bit digits. The histogram and scatter
+ * steps of each pass are split among threads, each handling a contiguous block of the input, which keeps the sort stable.
+ * Passes on digits that are the same for all keys are skipped.
+ */
+template <typename ValueT>
+class RadixSorter
+{
+  public:
+    /**
+     * Sort \a num_items values by their keys. Only the lowest \a num_key_bits bits of the keys are considered. On return, both
+     * \a keys and \a values are in sorted order.
+     */
+    static void sort(uint64 * keys, ValueT * values, size_t num_items, int num_key_bits, intx num_threads)
+    {
+      static size_t const MIN_ITEMS_PER_THREAD = 65536;
+
+      if (num_items <= 1) return;
+
+      size_t num_blocks = std::max((size_t)1, std::min((size_t)std::max(num_threads, (intx)1),
+                                                       num_items / MIN_ITEMS_PER_THREAD));
+      Array<uint64> key_scratch(num_items);
+      Array<ValueT> value_scratch(num_items);
+      Array<size_t> counts(num_blocks * NUM_BUCKETS);
+
+      uint64 * src_keys = keys, * dst_keys = key_scratch.data();
+      ValueT * src_values = values, * dst_values = value_scratch.data();
+
+      for (int shift = 0; shift < num_key_bits; shift += DIGIT_BITS)
+      {
+        Pass pass(src_keys, src_values, dst_keys, dst_values, num_items, num_blocks, shift, counts.data());
+
+        runBlocks(pass, num_blocks, false);
+        if (!pass.computeOffsets())
+          continue;  // all keys have the same digit
+
+        runBlocks(pass, num_blocks, true);
+        std::swap(src_keys, dst_keys);
+        std::swap(src_values, dst_values);
+      }
+
+      if (src_keys != keys)
+      {
+        std::copy(src_keys, src_keys + num_items, keys);
+        std::copy(src_values, src_values + num_items, values);
+      }
+    }
+
+  private:
+    static int const DIGIT_BITS = 8;
+    static size_t const NUM_BUCKETS = (size_t)1 << DIGIT_BITS;
+
+    /** A single pass of the sort, on one digit. */
+    class Pass
+    {
+      public:
+        Pass(uint64 const * src_keys_, ValueT const * src_values_, uint64 * dst_keys_, ValueT * dst_values_, size_t num_items_,
+             size_t num_blocks_, int shift_, size_t * counts_)
+        : src_keys(src_keys_), src_values(src_values_), dst_keys(dst_keys_), dst_values(dst_values_), num_items(num_items_),
+          num_blocks(num_blocks_), shift(shift_), counts(counts_)
+        {}
+
+        /** Count the digits in a block of the input. */
+        void histogram(size_t block)
+        {
+          size_t * block_counts = counts + block * NUM_BUCKETS;
+          std::fill(block_counts, block_counts + NUM_BUCKETS, 0);
+
+          for (size_t i = blockBegin(block), end = blockBegin(block + 1); i < end; ++i)
+            block_counts[digit(src_keys[i])]++;
+        }
+
+        /**
+         * Convert the per-block counts to the output offset of each block for each digit. Returns false if all keys have the
+         * same digit, in which case the pass need not scatter anything.
+         */
+        bool computeOffsets()
+        {
+          // The digit is shared by all keys only if its count, summed over all blocks, is the total number of keys
+          for (size_t d = 0; d < NUM_BUCKETS; ++d)
+          {
+            size_t digit_count = 0;
+            for (size_t b = 0; b < num_blocks; ++b)
+              digit_count += counts[b * NUM_BUCKETS + d];
+
+            if (digit_count == num_items)
+              return false;
+
+            if (digit_count > 0)
+              break;  // some other digit must occur too
+          }
+
+          size_t offset = 0;
+          for (size_t d = 0; d < NUM_BUCKETS; ++d)
+            for (size_t b = 0; b < num_blocks; ++b)
+            {
+              size_t c = counts[b * NUM_BUCKETS + d];
+              counts[b * NUM_BUCKETS + d] = offset;
+              offset += c;
+            }
+
+          return true;
+        }
+
+        /** Move a block of the input to its sorted positions in the output. */
+        void scatter(size_t block)
+        {
+          size_t * offsets = counts + block * NUM_BUCKETS;
+          for (size_t i = blockBegin(block), end = blockBegin(block + 1); i < end; ++i)
+          {
+            size_t pos = offsets[digit(src_keys[i])]++;
+            dst_keys[pos] = src_keys[i];
+            dst_values[pos] = src_values[i];
+          }
+        }
+
+      private:
+        size_t blockBegin(size_t block) const { return num_items * block / num_blocks; }
+        size_t digit(uint64 key) const { return (size_t)((key >> shift) & (NUM_BUCKETS - 1)); }
+
+        uint64 const * src_keys;
+        ValueT const * src_values;
+        uint64 * dst_keys;
+        ValueT * dst_values;
+        size_t num_items;
+        size_t num_blocks;
+        int shift;
+        size_t * counts;
+
+    }; // class Pass
+
+    /** Runs one step of a pass on a block. */
+    class BlockWorker
+    {
+      public:
+        BlockWorker(Pass * pass_, size_t block_, bool scatter_) : pass(pass_), block(block_), do_scatter(scatter_) {}
+
+        void operator()()
+        {
+          if (do_scatter)
+            pass->scatter(block);
+          else
+            pass->histogram(block);
+        }
+
+      private:
+        Pass * pass;
+        size_t block;
+        bool do_scatter;
+
+    }; // class BlockWorker
+
+    /** Run one step of a pass on all blocks, in parallel if there is more than one block. */
+    static void runBlocks(Pass & pass, size_t num_blocks, bool scatter)
+    {
+      if (num_blocks <= 1)
+      {
+        BlockWorker(&pass, 0, scatter)();
+        return;
+      }
+
+      ThreadGroup pool;
+      for (size_t b = 0; b < num_blocks; ++b)
+        pool.addThread(new std::thread(BlockWorker(&pass, b, scatter)));
+
+      pool.joinAll();
+    }
+
+}; // class RadixSorter
+
+
 } // namespace KDTreeNInternal
 
+/** Policies for choosing how a kd-tree node is split into two children (enum class). */
+struct KDTreeSplitPolicy
+{
+  /** Supported values. */
+  enum Value
+  {
+    MEDIAN,         ///< Split at the median of element minimum coordinates, along the longest dimension of the node (default).
+    OBJECT_MEDIAN,  ///< Split at the median of element centers, along the longest dimension of the bounding box of the centers.
+    SAH,            /**< Split by the binned surface area heuristic, which minimizes the expected cost of tracing rays through the
+                         tree. */
+    MORTON          /**< Sort the element centers along a Morton (Z-order) curve with a parallel radix sort, and split each node
+                         at the highest bit in which the Morton codes of its elements differ. The tree is less balanced than with
+                         the median policies, but is built much faster, which suits very large point clouds. */
+  };
+
+  THEA_ENUM_CLASS_BODY(KDTreeSplitPolicy)
+
+  THEA_ENUM_CLASS_STRINGS_BEGIN(KDTreeSplitPolicy)
+    THEA_ENUM_CLASS_STRING(MEDIAN,         "median")
+    THEA_ENUM_CLASS_STRING(OBJECT_MEDIAN,  "object-median")
+    THEA_ENUM_CLASS_STRING(SAH,            "sah")
+    THEA_ENUM_CLASS_STRING(MORTON,         "morton")
+  THEA_ENUM_CLASS_STRINGS_END(KDTreeSplitPolicy)
+};
+
+/**
+ * Aggregate statistics of the centers of a set of elements: their number, their sum, and the sum of their squared norms. If the
+ * node attribute type of a KDTreeN is (or is derived from) this class, the tree maintains the statistics of every subtree as it
+ * is built or refitted, and aggregate range queries such as KDTreeN::rangeAggregate() account for subtrees lying entirely
+ * inside the range without visiting their elements. The sums are accumulated in double precision.
+ */
+template <int N, typename ScalarT = Real>
+class KDTreeAggregateN
+{
+  public:
+    typedef Vector<N, ScalarT> VectorT;        ///< Vector in N-space.
+    typedef Vector<N, double>  DoubleVectorT;  ///< Double-precision vector in N-space.
+
+    /** Constructor, initializes the statistics of an empty set. */
+    KDTreeAggregateN() { clear(); }
+
+    /** Reset to the statistics of an empty set. */
+    void clear()
+    {
+      num_elems = 0;
+      sum_squared_norms = 0;
+      for (intx i = 0; i < N; ++i) sum[i] = 0;
+    }
+
+    /** Add a point to the set. */
+    void add(VectorT const & p)
+    {
+      num_elems++;
+      for (intx i = 0; i < N; ++i)
+      {
+        double x = (double)p[i];
+        sum[i] += x;
+        sum_squared_norms += x * x;
+      }
+    }
+
+    /** Add all the points of another set to this one. */
+    void merge(KDTreeAggregateN const & other)
+    {
+      num_elems += other.num_elems;
+      sum_squared_norms += other.sum_squared_norms;
+      for (intx i = 0; i < N; ++i) sum[i] += other.sum[i];
+    }
+
+    /** Get the number of points in the set. */
+    intx numElements() const { return num_elems; }
+
+    /** Get the sum of the points. */
+    DoubleVectorT getSum() const
+    {
+      DoubleVectorT s;
+      for (intx i = 0; i < N; ++i) s[i] = sum[i];
+      return s;
+    }
+
+    /** Get the sum of the squared norms of the points. */
+    double getSumSquaredNorms() const { return sum_squared_norms; }
+
+    /** Get the centroid of the points, or the origin if the set is empty. */
+    VectorT getCentroid() const
+    {
+      VectorT c = VectorT::Zero();
+      if (num_elems > 0)
+        for (intx i = 0; i < N; ++i) c[i] = (ScalarT)(sum[i] / num_elems);
+
+      return c;
+    }
+
+    /** Get the sum of the squared distances of the points from a given point. */
+    double sumSquaredDistances(VectorT const & p) const
+    {
+      double dot = 0, sqlen = 0;
+      for (intx i = 0; i < N; ++i)
+      {
+        dot += sum[i] * (double)p[i];
+        sqlen += (double)p[i] * (double)p[i];
+      }
+
+      return std::max(sum_squared_norms - 2 * dot + num_elems * sqlen, 0.0);
+    }
+
+  private:
+    intx num_elems;            ///< Number of points.
+    double sum[N];             ///< Sum of the points.
+    double sum_squared_norms;  ///< Sum of the squared norms of the points.
+
+}; // class KDTreeAggregateN
+
+
 template <int N, typename ScalarT>
 class IsPointN< KDTreeNInternal::ElementSample<N, ScalarT>, N >
 {
@@ -123,6 +415,7 @@ class /* THEA_API */ KDTreeN
 
   public:
     typedef size_t ElementIndex;  ///< Index of an element in the kd-tree.
+    typedef KDTreeSplitPolicy SplitPolicy;  ///< Policy for splitting a node into two children.
     typedef typename ProximityQueryBaseT::NeighborPair NeighborPair;  ///< A pair of neighboring elements.
     typedef typename TransformableBaseT::Transform Transform;  ///< Transform applied to the kd-tree.
 
@@ -335,6 +628,24 @@ class /* THEA_API */ KDTreeN
         Array<intx> & result;
     };
 
+    /** A functor to add pairs of intersecting elements of two trees to an array, until a maximum number have been found. */
+    class IntersectingPairsFunctor
+    {
+      public:
+        IntersectingPairsFunctor(Array< std::pair<intx, intx> > & result_, intx max_pairs_)
+        : result(result_), max_pairs(max_pairs_) {}
+
+        bool operator()(intx query_index, intx target_index)
+        {
+          result.push_back(std::make_pair(query_index, target_index));
+          return max_pairs >= 0 && (intx)result.size() >= max_pairs;
+        }
+
+      private:
+        Array< std::pair<intx, intx> > & result;
+        intx max_pairs;
+    };
+
   public:
     THEA_DECL_SMART_POINTERS(KDTreeN)
 
@@ -348,6 +659,14 @@ class /* THEA_API */ KDTreeN
     typedef typename RayQueryBaseT::RayStructureIntersectionT  RayStructureIntersectionT;  /**< Ray intersection structure in
                                                                                                 N-space. */
 
+    typedef KDTreeAggregateN<N, ScalarT> Aggregate;  ///< Aggregate statistics of element centers, returned by rangeAggregate().
+
+    /**
+     * True if the node attribute type is, or is derived from, KDTreeAggregateN<N, ScalarT>. In this case the tree maintains the
+     * aggregate statistics of every subtree in its node attributes.
+     */
+    static bool const HAS_NODE_AGGREGATES = std::is_base_of<Aggregate, NodeAttributeT>::value;
+
     typedef KDTreeNInternal::ElementSample<N, ScalarT> ElementSample;  /**< A point sample drawn from a kd-tree element, used
                                                                             for accelerating nearest neighbor queries. */
     typedef KDTreeN<ElementSample, N, ScalarT> NearestNeighborAccelerationStructure;  /**< Structure to speed up nearest
@@ -412,6 +731,55 @@ class /* THEA_API */ KDTreeN
 
     }; // Node
 
+    /**
+     * %Options for approximate nearest neighbor queries (see approxKClosestPairs()). The default options return exact results.
+     */
+    class ApproxQueryOptions
+    {
+      public:
+        /**
+         * Set the approximation factor. A node is searched only if it may contain an element closer than 1 / (1 + \a epsilon)
+         * times the distance to the current k'th nearest neighbor, so every returned neighbor is within a factor (1 + \a epsilon)
+         * of the true distance to the corresponding exact neighbor. Must be non-negative. Zero (default) disables approximation.
+         */
+        ApproxQueryOptions & setEpsilon(double epsilon_) { epsilon = epsilon_; return *this; }
+
+        /** Get the approximation factor. */
+        double getEpsilon() const { return epsilon; }
+
+        /**
+         * Set the maximum number of leaves to search. The search stops as soon as this many leaves have been visited, even if
+         * some unvisited nodes may contain closer elements. A negative value (default) places no limit on the number of leaves.
+         */
+        ApproxQueryOptions & setMaxLeaves(intx max_leaves_) { max_leaves = max_leaves_; return *this; }
+
+        /** Get the maximum number of leaves to search, or a negative value if there is no limit. */
+        intx getMaxLeaves() const { return max_leaves; }
+
+        /** Construct with default values. */
+        ApproxQueryOptions() : epsilon(0), max_leaves(-1) {}
+
+        /** Get a set of options with default values. */
+        static ApproxQueryOptions const & defaults() { static ApproxQueryOptions const def; return def; }
+
+      private:
+        double epsilon;   ///< Approximation factor.
+        intx max_leaves;  ///< Maximum number of leaves to search.
+
+    }; // class ApproxQueryOptions
+
+    /** Statistics on the work done by a query. */
+    struct QueryStats
+    {
+      intx num_nodes_visited;   ///< Number of nodes (including leaves) that were visited.
+      intx num_leaves_visited;  ///< Number of leaves whose elements were examined.
+      intx num_elems_tested;    ///< Number of elements whose distance to the query was computed.
+
+      /** Constructor. */
+      QueryStats() : num_nodes_visited(0), num_leaves_visited(0), num_elems_tested(0) {}
+
+    }; // struct QueryStats
+
   protected:
     typedef MemoryPool<Node> NodePool;  ///< A pool for quickly allocating kd-tree nodes.
     typedef MemoryPool<ElementIndex> IndexPool;  ///< A pool for quickly allocating element indices.
@@ -423,8 +791,9 @@ class /* THEA_API */ KDTreeN
   public:
     /** Default constructor. */
     KDTreeN()
-    : root(nullptr), num_elems(0), num_nodes(0), max_depth(0), max_elems_per_leaf(0), accelerate_nn_queries(false),
-      valid_acceleration_structure(false), acceleration_structure(nullptr), valid_bounds(true)
+    : root(nullptr), num_elems(0), num_nodes(0), max_depth(0), max_elems_per_leaf(0), split_policy(SplitPolicy::MEDIAN),
+      max_build_threads(1), build_traversal_cost(-1), accelerate_nn_queries(false), valid_acceleration_structure(false),
+      acceleration_structure(nullptr), valid_bounds(true)
     {}
 
     /**
@@ -442,8 +811,9 @@ class /* THEA_API */ KDTreeN
     template <typename InputIterator>
     KDTreeN(InputIterator begin, InputIterator end, intx max_depth_ = -1, intx max_elems_per_leaf_ = -1,
             bool save_memory = false)
-    : root(nullptr), num_elems(0), num_nodes(0), max_depth(0), max_elems_per_leaf(0), accelerate_nn_queries(false),
-      valid_acceleration_structure(false), acceleration_structure(nullptr), valid_bounds(true)
+    : root(nullptr), num_elems(0), num_nodes(0), max_depth(0), max_elems_per_leaf(0), split_policy(SplitPolicy::MEDIAN),
+      max_build_threads(1), build_traversal_cost(-1), accelerate_nn_queries(false), valid_acceleration_structure(false),
+      acceleration_structure(nullptr), valid_bounds(true)
     {
       init(begin, end, max_elems_per_leaf_, max_depth_, save_memory, false /* no previous data to deallocate */);
     }
@@ -475,7 +845,7 @@ class /* THEA_API */ KDTreeN
       if (deallocate_previous_memory)
       {
         for (InputIterator ii = begin; ii != end; ++ii, ++num_elems)
-          if (elementPassesFilters(*ii))
+          if (elementPassesFilters(*ii, nullptr))
             elems.push_back(*ii);
       }
       else
@@ -502,7 +872,7 @@ class /* THEA_API */ KDTreeN
           if (resized)
           {
             for (InputIterator ii = begin; ii != end; ++ii)
-              if (elementPassesFilters(*ii))
+              if (elementPassesFilters(*ii, nullptr))
               {
                 elems.push_back(*ii);
                 ++num_elems;
@@ -512,7 +882,7 @@ class /* THEA_API */ KDTreeN
           {
             typename ElementArray::iterator ei = elems.begin();
             for (InputIterator ii = begin; ii != end; ++ii)
-              if (elementPassesFilters(*ii))
+              if (elementPassesFilters(*ii, nullptr))
               {
                 *(ei++) = *ii;
                 ++num_elems;
@@ -532,7 +902,7 @@ class /* THEA_API */ KDTreeN
       intx est_depth = Math::binaryTreeDepth(num_elems, max_elems_per_leaf, SPLIT_FRACTION);
       max_depth = max_depth_;
       if (max_depth < 0)
-        max_depth = est_depth;
+        max_depth = (split_policy == SplitPolicy::MORTON ? 2 * est_depth : est_depth);  // Morton splits are not balanced
       else if (max_depth < est_depth)
         est_depth = max_depth;
 
@@ -541,7 +911,7 @@ class /* THEA_API */ KDTreeN
       // Each index is stored at most once at each level
       size_t BUFFER_SAFETY_MARGIN = 10;
       size_t index_buffer_capacity = num_elems + BUFFER_SAFETY_MARGIN;
-      if (!save_memory)
+      if (!save_memory && split_policy != SplitPolicy::MORTON)  // Morton-ordered nodes share the root's indices
         index_buffer_capacity *= (size_t)(1 + est_depth);  // reserve space for all levels at once
 
       if (deallocate_previous_memory || index_buffer_capacity > 1.3 * index_pool.getBufferCapacity())
@@ -582,7 +952,13 @@ class /* THEA_API */ KDTreeN
       // Expand the bounding box slightly to handle numerical error
       root->bounds.scaleCentered(BOUNDS_EXPANSION_FACTOR);
 
-      if (save_memory)
+      intx num_build_threads = (max_build_threads < 0 ? System::concurrency() : max_build_threads);
+
+      if (split_policy == SplitPolicy::MORTON)
+      {
+        createTreeMorton(root, save_memory, num_build_threads);
+      }
+      else if (save_memory)
       {
         // Estimate the maximum number of indices that will need to be held in the scratch pool at any time during depth-first
         // traversal with earliest-possible deallocation. This is
@@ -597,11 +973,20 @@ class /* THEA_API */ KDTreeN
         IndexPool tmp_index_pool;
         tmp_index_pool.init(est_max_path_indices + BUFFER_SAFETY_MARGIN);
 
-        createTree(root, true, &tmp_index_pool, &index_pool);
+        if (num_build_threads > 1)
+          createTreeParallel(root, true, &tmp_index_pool, &index_pool, num_build_threads, deallocate_previous_memory);
+        else
+          createTree(root, true, &tmp_index_pool, &index_pool);
       }
       else
-        createTree(root, false, &index_pool, nullptr);
+      {
+        if (num_build_threads > 1)
+          createTreeParallel(root, false, &index_pool, nullptr, num_build_threads, deallocate_previous_memory);
+        else
+          createTree(root, false, &index_pool, nullptr);
+      }
 
+      updateNodeAggregates(root);
       invalidateBounds();
     }
 
@@ -655,6 +1040,91 @@ class /* THEA_API */ KDTreeN
       return accelerate_nn_queries;
     }
 
+    /**
+     * Set the policy for splitting nodes when the tree is constructed by init() (default SplitPolicy::MEDIAN). The median split
+     * is well-suited to proximity queries on points. For ray queries on extended objects such as triangles, SplitPolicy::SAH
+     * typically produces trees that are much faster to traverse. For very large point sets where build time dominates,
+     * SplitPolicy::MORTON builds the tree fastest. The change takes effect at the next call to init().
+     *
+     * @see expectedTraversalCost()
+     */
+    void setSplitPolicy(SplitPolicy split_policy_) { split_policy = split_policy_; }
+
+    /** Get the policy for splitting nodes when the tree is constructed. */
+    SplitPolicy getSplitPolicy() const { return split_policy; }
+
+    /**
+     * Get the expected cost of tracing a random ray through the tree, according to the surface area heuristic. This is the sum,
+     * over all nodes, of the probability that a ray hitting the root also hits the node (the ratio of their surface areas),
+     * times the cost of processing the node:  traversal_cost for an internal node, and  intersection_cost times the number
+     * of elements for a leaf. Useful for comparing split policies on a particular dataset.
+     */
+    double expectedTraversalCost(double traversal_cost = 1, double intersection_cost = 1) const
+    {
+      if (!root) return 0;
+
+      double root_area = boxSurfaceArea(root->bounds);
+      if (root_area <= 0)
+        return intersection_cost * num_elems;
+
+      return expectedTraversalCost(root, root_area, traversal_cost, intersection_cost);
+    }
+
+    /**
+     * Set the maximum number of threads used to construct the tree in init(). If the value is 1 (the default), the tree is
+     * built serially. If it is negative, the number of threads is set to the hardware concurrency. In parallel mode, the upper
+     * levels of the tree are split serially, and the remaining subtrees are built as independent tasks by a pool of worker
+     * threads, each with its own memory pools. The resulting tree is identical to the one built serially.
+     */
+    void setMaxBuildThreads(intx max_build_threads_ = -1) { max_build_threads = max_build_threads_; }
+
+    /**
+     * Get the maximum number of threads used to construct the tree in init(). A negative value implies the hardware
+     * concurrency.
+     *
+     * @see setMaxBuildThreads()
+     */
+    intx getMaxBuildThreads() const { return max_build_threads; }
+
+    /**
+     * Recompute the bounding boxes of all nodes from the current state of the elements, keeping the structure of the tree
+     * unchanged. Use this when the geometry of the elements changes but their number and order do not, e.g. when elements refer
+     * to mesh vertices that have moved. Refitting takes linear time with no sorting, so it is much faster than rebuilding the
+     * tree with init(), but queries can become slower as the elements drift from their original positions. Subtrees are refitted
+     * in parallel, with the same number of threads as construction (see setMaxBuildThreads()).
+     *
+     * @param compute_quality If true, the expected traversal cost (see expectedTraversalCost()) of the refitted tree is divided
+     *   by that of the tree as it was built, and the ratio is returned. Values well above 1 (say, 1.5) suggest that the tree
+     *   should be rebuilt.
+     *
+     * @return The ratio of the current to the original expected traversal cost if \a compute_quality is true, else a negative
+     *   value.
+     */
+    double refit(bool compute_quality = false)
+    {
+      return refitElements(NullElementUpdater(), compute_quality);
+    }
+
+    /**
+     * Replace the elements of the tree with a sequence of new values, and refit the tree as in refit(). InputIterator must
+     * dereference to type T. The sequence must have exactly as many elements as the tree, in the order in which they were
+     * originally passed to init().
+     */
+    template <typename InputIterator>
+    double refit(InputIterator begin, InputIterator end, bool compute_quality = false)
+    {
+      intx i = 0;
+      for ( ; begin != end; ++begin, ++i)
+      {
+        alwaysAssertM(i < num_elems, "KDTreeN: Too many elements passed to refit()");
+        elems[(size_t)i] = *begin;
+      }
+
+      alwaysAssertM(i == num_elems, "KDTreeN: Too few elements passed to refit()");
+
+      return refit(compute_quality);
+    }
+
     /** Get the auxiliary structure to accelerate nearest neighbor queries, if available. */
     template <typename MetricT> NearestNeighborAccelerationStructure const * getNearestNeighborAccelerationStructure() const
     {
@@ -703,8 +1173,10 @@ class /* THEA_API */ KDTreeN
 
       node_pool.clear(deallocate_all_memory);
       index_pool.clear(deallocate_all_memory);
+      clearBuildPools(deallocate_all_memory);
 
       root = nullptr;
+      build_traversal_cost = -1;
 
       invalidateBounds();
     }
@@ -751,7 +1223,10 @@ class /* THEA_API */ KDTreeN
      *
      * The filter must persist until it is popped off. Must be matched with popFilter().
      *
-     * @see popFilter()
+     * @note The filter stack is shared by all queries on the tree, so it cannot be changed while other threads are querying the
+     *   tree. To filter elements differently in concurrent queries, pass a filter to each query function instead.
+     *
+     * @see popFilter(), prepareForConcurrentQueries()
      */
     void pushFilter(Filter<T> * filter)
     {
@@ -782,11 +1257,39 @@ class /* THEA_API */ KDTreeN
       }
     }
 
-    /** Get the minimum distance between this structure and a query object. */
-    template <typename MetricT, typename QueryT> double distance(QueryT const & query, double dist_bound = -1) const
+    /** Get the number of filters currently on the filter stack. */
+    intx numFilters() const { return (intx)filters.size(); }
+
+    /**
+     * Eagerly compute all data that is otherwise computed lazily on the first query after the tree is modified, viz. the
+     * bounding box and the structure that accelerates nearest neighbor queries (if enabled). After this function returns, and
+     * until the tree is next modified (e.g. by init(), clear(), setTransform(), pushFilter() or popFilter()), const queries on
+     * the tree do not change any shared state, and hence can be safely called from multiple threads at once. Elements can be
+     * filtered differently in each query by passing a filter to the query function.
+     *
+     * @note The metric is used only to build the nearest neighbor acceleration structure, which is then shared by queries with
+     *   any metric. It is irrelevant if nearest neighbor acceleration is disabled.
+     */
+    template <typename MetricT> void prepareForConcurrentQueries()
+    {
+      updateBounds();
+
+      if (hasNearestNeighborAcceleration() && root)
+      {
+        buildAccelerationStructure<MetricT>();
+        acceleration_structure->template prepareForConcurrentQueries<MetricT>();
+      }
+    }
+
+    /**
+     * Get the minimum distance between this structure and a query object. If \a filter is not null, elements that it does not
+     * allow are ignored, in addition to those rejected by the filters on the stack.
+     */
+    template <typename MetricT, typename QueryT>
+    double distance(QueryT const & query, double dist_bound = -1, Filter<T> const * filter = nullptr) const
     {
       double result = -1;
-      if (closestElement<MetricT>(query, dist_bound, &result) >= 0)
+      if (closestElement<MetricT>(query, dist_bound, &result, nullptr, filter) >= 0)
         return result;
       else
         return -1;
@@ -799,14 +1302,16 @@ class /* THEA_API */ KDTreeN
      * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
      * @param dist The distance to the query object is placed here. Ignored if null.
      * @param closest_point The coordinates of the closest point are placed here. Ignored if null.
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
      *
      * @return A non-negative handle to the closest element, if one was found, else a negative number.
      */
     template <typename MetricT, typename QueryT>
     intx closestElement(QueryT const & query, double dist_bound = -1, double * dist = nullptr,
-                        VectorT * closest_point = nullptr) const
+                        VectorT * closest_point = nullptr, Filter<T> const * filter = nullptr) const
     {
-      NeighborPair pair = closestPair<MetricT>(query, dist_bound, closest_point != nullptr);
+      NeighborPair pair = closestPair<MetricT>(query, dist_bound, closest_point != nullptr, filter);
 
       if (pair.isValid())
       {
@@ -825,12 +1330,15 @@ class /* THEA_API */ KDTreeN
      * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
      * @param get_closest_points If true, the coordinates of the closest pair of points on the respective elements is computed
      *   and stored in the returned structure.
+     * @param filter If not null, elements of this structure not allowed by this filter are ignored, in addition to those
+     *   rejected by the filters on the stack.
      *
      * @return Non-negative handles to the closest pair of elements in their respective objects, if such a pair was found. Else
      *   returns a pair of negative numbers.
      */
     template <typename MetricT, typename QueryT>
-    NeighborPair closestPair(QueryT const & query, double dist_bound = -1, bool get_closest_points = false) const
+    NeighborPair closestPair(QueryT const & query, double dist_bound = -1, bool get_closest_points = false,
+                             Filter<T> const * filter = nullptr) const
     {
       if (!root) return NeighborPair(-1);
 
@@ -846,7 +1354,7 @@ class /* THEA_API */ KDTreeN
       }
 
       // If acceleration is enabled, set an upper limit to the distance to the nearest object
-      double accel_bound = accelerationBound<MetricT>(query, dist_bound);
+      double accel_bound = accelerationBound<MetricT>(query, dist_bound, filter);
       if (accel_bound >= 0)
       {
         double fudge = 0.001 * getBoundsWorldSpace(*root).getExtent().norm();
@@ -854,7 +1362,7 @@ class /* THEA_API */ KDTreeN
       }
 
       NeighborPair pair(-1, -1, mon_approx_dist_bound);
-      closestPair<MetricT>(root, query, query_bounds, pair, get_closest_points);
+      closestPair<MetricT>(root, query, query_bounds, pair, get_closest_points, filter);
 
       return pair;
     }
@@ -874,6 +1382,8 @@ class /* THEA_API */ KDTreeN
      * @param use_as_query_index_and_swap If non-negative, the supplied index is used as the index of the query object (instead
      *   of the default 0), following which query and target indices/points are swapped in the returned pairs of neighbors. This
      *   is chiefly for internal use and the default value of -1 should normally be left as is.
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
      *
      * @return The number of neighbors found (i.e. the size of \a k_closest_pairs).
      *
@@ -882,7 +1392,8 @@ class /* THEA_API */ KDTreeN
      */
     template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
     intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound = -1,
-                       bool get_closest_points = false, bool clear_set = true, intx use_as_query_index_and_swap = -1) const
+                       bool get_closest_points = false, bool clear_set = true, intx use_as_query_index_and_swap = -1,
+                       Filter<T> const * filter = nullptr) const
     {
       if (clear_set) k_closest_pairs.clear();
 
@@ -906,64 +1417,484 @@ class /* THEA_API */ KDTreeN
       }
 
       kClosestPairs<MetricT>(root, query, query_bounds, k_closest_pairs, dist_bound, get_closest_points,
-                             use_as_query_index_and_swap);
+                             use_as_query_index_and_swap, filter);
 
       return k_closest_pairs.size();
     }
 
     /**
-     * Get all objects intersecting a range.
-     *
-     * @param range The range to search in.
-     * @param result The objects intersecting the range are stored here.
-     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
-     *   the previous results are retained and new objects are appended to the array (this is useful for range queries over a
-     *   union of simpler ranges).
+     * Get the k elements closest to a query object, ignoring elements not allowed by a filter (in addition to those rejected by
+     * the filters on the stack). Equivalent to the other version of kClosestPairs() with default values for the internal
+     * parameters.
      */
-    template <typename IntersectionTesterT, typename RangeT>
-    void rangeQuery(RangeT const & range, Array<T> & result, bool discard_prior_results = true) const
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound,
+                       bool get_closest_points, Filter<T> const * filter) const
     {
-      if (discard_prior_results) result.clear();
-      if (root) const_cast<KDTreeN *>(this)->processRangeUntil<IntersectionTesterT>(range, RangeQueryFunctor(result));
+      return kClosestPairs<MetricT>(query, k_closest_pairs, dist_bound, get_closest_points, true, -1, filter);
     }
 
     /**
-     * Get the indices of all objects intersecting a range.
+     * Get the k elements closest to a query object, optionally within a given distance. Unlike the other versions of
+     * kClosestPairs(), which maintain the neighbors in a sorted array at a cost of O(k) per insertion, the neighbors found so
+     * far are kept in a max-heap with O(log k) insertions, so this version is much faster for large k (hundreds or more). With
+     * \a dist_bound set, it returns the k nearest neighbors within that distance, or all neighbors within it if there are fewer
+     * than k.
      *
-     * @param range The range to search in.
-     * @param result The indices of objects intersecting the range are stored here.
-     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
-     *   the previous results are retained and indices of new objects are appended to the array (this is useful for range
-     *   queries over a union of simpler ranges).
+     * The neighbors are returned in caller-provided storage, which is cleared but retains its capacity, so reusing the same
+     * array for a sequence of queries avoids allocating memory for each query.
+     *
+     * @param query Query object. BoundedTraitsN<QueryT, N, ScalarT> must be defined. The query cannot be another proximity
+     *   query structure.
+     * @param k The maximum number of neighbors to return.
+     * @param k_closest_pairs Used to return the k (or fewer) nearest neighbors. The query index of each pair is 0 and the
+     *   target index is the index of the neighboring element.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param sort If true, the neighbors are sorted in order of increasing distance. Else, they are returned in an unspecified
+     *   order, which saves O(k log k) time.
+     * @param get_closest_points If true, the coordinates of the closest pair of points on each pair of neighboring elements is
+     *   computed and stored in the returned pairs.
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
+     *
+     * @return The number of neighbors found (i.e. the size of \a k_closest_pairs).
      */
-    template <typename IntersectionTesterT, typename RangeT>
-    void rangeQueryIndices(RangeT const & range, Array<intx> & result, bool discard_prior_results = true) const
+    template <typename MetricT, typename QueryT>
+    intx kClosestPairs(QueryT const & query, intx k, Array<NeighborPair> & k_closest_pairs, double dist_bound = -1,
+                       bool sort = true, bool get_closest_points = false, Filter<T> const * filter = nullptr) const
     {
-      if (discard_prior_results) result.clear();
-      if (root) const_cast<KDTreeN *>(this)->processRangeUntil<IntersectionTesterT>(range, RangeQueryIndicesFunctor(result));
+      k_closest_pairs.clear();
+      if (!root || k <= 0) return 0;
+
+      if ((intx)k_closest_pairs.capacity() < k)
+        k_closest_pairs.reserve((size_t)std::min(k, num_elems));
+
+      AxisAlignedBoxT query_bounds;
+      getObjectBounds(query, query_bounds);
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+      double lower_bound = monotonePruningDistance<MetricT>(root, query, query_bounds);
+      if (mon_approx_dist_bound >= 0 && lower_bound > mon_approx_dist_bound)
+        return 0;
+
+      kClosestPairsHeap<MetricT>(root, lower_bound, query, query_bounds, k, k_closest_pairs, mon_approx_dist_bound,
+                                 get_closest_points, filter);
+
+      if (sort)
+        std::sort_heap(k_closest_pairs.begin(), k_closest_pairs.end(), NeighborPairDistanceLess());
+
+      return (intx)k_closest_pairs.size();
     }
 
     /**
-     * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
-     * (or be a function pointer with the equivalent signature)
-     * \code
-     * bool operator()(intx index, T const & t)
-     * \endcode
-     * and will be passed the index of each object contained in the range as well as a handle to the object itself. If the
-     * functor returns true on any object, the search will terminate immediately (this is useful for searching for a particular
-     * object). To pass a functor by reference, wrap it in <tt>std::ref</tt>.
+     * Get the k elements approximately closest to a query object, with a best-bin-first search. Nodes are searched in order of
+     * increasing distance from the query, held in a priority queue, and the search is cut short according to \a options: with
+     * approximation factor epsilon each returned neighbor is at most (1 + epsilon) times farther than the exact neighbor of the
+     * same rank, and with a limit on the number of leaves the search simply stops when the limit is reached. The latter is the
+     * more effective control for high-dimensional data, where exact search degenerates to examining nearly every element. With
+     * the default options, the results are exact.
      *
-     * The RangeT class should support intersection queries with AxisAlignedBoxT and containment queries with VectorT and
-     * AxisAlignedBoxT.
+     * @param query Query object. Must not be a proximity query structure. BoundedTraitsN<QueryT, N, ScalarT> must be defined.
+     * @param k_closest_pairs The k (or fewer) approximate nearest neighbors are placed here. Any prior data is discarded.
+     * @param options Controls the approximation.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param get_closest_points If true, the coordinates of the closest pair of points on each pair of neighboring elements is
+     *   computed and stored in the returned pairs.
+     * @param stats If not null, statistics on the work done by the search are stored here.
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
      *
-     * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
-     *   immediately after processing this object), else a negative value.
+     * @return The number of neighbors found (i.e. the size of \a k_closest_pairs).
      */
-    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
-    intx processRangeUntil(RangeT const & range, FunctorT functor) const
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx approxKClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs,
+                             ApproxQueryOptions const & options = ApproxQueryOptions::defaults(), double dist_bound = -1,
+                             bool get_closest_points = false, QueryStats * stats = nullptr,
+                             Filter<T> const * filter = nullptr) const
     {
-      return root ? const_cast<KDTreeN *>(this)->processRangeUntil<IntersectionTesterT, T const>(root, range, functor) : -1;
-    }
+      static_assert(!std::is_base_of<ProximityQueryBaseT, QueryT>::value,
+                    "KDTreeN: Approximate queries do not support proximity query structures as queries");
+      alwaysAssertM(options.getEpsilon() >= 0, "KDTreeN: Approximation factor must be non-negative");
+
+      k_closest_pairs.clear();
+      if (stats) *stats = QueryStats();
+
+      if (!root) return 0;
+
+      AxisAlignedBoxT query_bounds;
+      getObjectBounds(query, query_bounds);
+
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+      double root_mad = monotonePruningDistance<MetricT>(root, query, query_bounds);
+      if (mon_approx_dist_bound >= 0 && root_mad > mon_approx_dist_bound)
+        return 0;
+
+      // Min-heap of unexplored subtrees, keyed by their distance from the query
+      typedef std::pair<double, Node const *> QueueEntry;
+      struct QueueEntryGreater
+      {
+        bool operator()(QueueEntry const & a, QueueEntry const & b) const { return a.first > b.first; }
+      };
+      std::priority_queue<QueueEntry, Array<QueueEntry>, QueueEntryGreater> queue;
+      queue.push(QueueEntry(root_mad, root));
+
+      // Subtrees farther than this cannot contain a sufficiently closer neighbor
+      double prune_mad = mon_approx_dist_bound;
+      double inv_approx_factor = 1.0 / (1.0 + options.getEpsilon());
+
+      intx num_leaves = 0;
+      while (!queue.empty())
+      {
+        QueueEntry entry = queue.top();
+        queue.pop();
+
+        if (prune_mad >= 0 && entry.first > prune_mad)
+          break;  // all remaining subtrees are at least as far
+
+        // Descend to a leaf, always taking the closer child and queuing the farther one
+        Node const * node = entry.second;
+        if (stats) stats->num_nodes_visited++;
+
+        while (node->lo)
+        {
+          Node const * n[2] = { node->lo, node->hi };
+          double mad[2] = { monotonePruningDistance<MetricT>(n[0], query, query_bounds),
+                            monotonePruningDistance<MetricT>(n[1], query, query_bounds) };
+          if (mad[1] < mad[0])
+          {
+            std::swap(n[0], n[1]);
+            std::swap(mad[0], mad[1]);
+          }
+
+          if (prune_mad < 0 || mad[1] <= prune_mad)
+            queue.push(QueueEntry(mad[1], n[1]));
+
+          if (prune_mad >= 0 && mad[0] > prune_mad)
+          {
+            node = nullptr;
+            break;
+          }
+
+          node = n[0];
+          if (stats) stats->num_nodes_visited++;
+        }
+
+        if (!node) continue;
+
+        approxKClosestPairsLeaf<MetricT>(node, query, k_closest_pairs, mon_approx_dist_bound, get_closest_points, stats,
+                                         filter);
+        num_leaves++;
+
+        // Tighten the pruning bound by the approximation factor
+        if (k_closest_pairs.size() > 0 && k_closest_pairs.size() >= k_closest_pairs.getCapacity())
+        {
+          double kth_dist = MetricT::invertMonotoneApprox(k_closest_pairs.last().getMonotoneApproxDistance());
+          prune_mad = MetricT::computeMonotoneApprox(inv_approx_factor * kth_dist);
+          if (mon_approx_dist_bound >= 0 && mon_approx_dist_bound < prune_mad)
+            prune_mad = mon_approx_dist_bound;
+        }
+
+        if (options.getMaxLeaves() >= 0 && num_leaves >= options.getMaxLeaves())
+          break;
+      }
+
+      if (stats) stats->num_leaves_visited = num_leaves;
+
+      return k_closest_pairs.size();
+    }
+
+    /**
+     * Get the element approximately closest to a query object. The parameters are the same as for closestElement() and
+     * approxKClosestPairs().
+     *
+     * @return A non-negative handle to the approximately closest element, if one was found, else a negative number.
+     */
+    template <typename MetricT, typename QueryT>
+    intx approxClosestElement(QueryT const & query, ApproxQueryOptions const & options = ApproxQueryOptions::defaults(),
+                              double dist_bound = -1, double * dist = nullptr, VectorT * closest_point = nullptr,
+                              QueryStats * stats = nullptr, Filter<T> const * filter = nullptr) const
+    {
+      BoundedSortedArrayN<1, NeighborPair> nbr;
+      if (approxKClosestPairs<MetricT>(query, nbr, options, dist_bound, closest_point != nullptr, stats, filter) <= 0)
+        return -1;
+
+      if (dist) *dist = MetricT::invertMonotoneApprox(nbr[0].getMonotoneApproxDistance());
+      if (closest_point) *closest_point = nbr[0].getTargetPoint();
+
+      return nbr[0].getTargetIndex();
+    }
+
+    /**
+     * Find the k nearest neighbors in another kd-tree of every element of this tree. Each leaf of this tree searches \a target
+     * for the neighbors of all its elements together, pruning target nodes by their distance from the leaf and from each
+     * element. For large sets of similar size this is considerably faster than an independent kClosestPairs() query for each
+     * element, since nearby elements share most of their traversal.
+     *
+     * @param target The kd-tree in which to look for neighbors.
+     * @param k_closest_pairs Used to return the neighbors. This array is resized to numElements(), and its i'th entry receives
+     *   the k (or fewer) nearest neighbors of the i'th element of this tree (in the array returned by getElements()). The query
+     *   index of each pair is the index of the element in this tree, and the target index is the index of the neighbor in
+     *   \a target. Existing entries are cleared and reused, so a set type with runtime capacity (e.g. BoundedSortedArray) can
+     *   be given its capacity by presizing the array. New entries are default-constructed.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param get_closest_points If true, the coordinates of the closest pair of points on each pair of neighboring elements is
+     *   computed and stored in the returned pairs.
+     * @param filter If not null, elements of this tree not allowed by this filter are ignored (they get no neighbors), in
+     *   addition to those rejected by the filters on the stack.
+     * @param target_filter If not null, elements of \a target not allowed by this filter are ignored, in addition to those
+     *   rejected by the filters on its stack.
+     *
+     * @return The total number of pairs of neighbors found.
+     */
+    template <typename MetricT, typename E, typename S, typename A, typename BoundedNeighborPairSetT>
+    intx allKClosestPairs(KDTreeN<E, N, S, A> const & target, Array<BoundedNeighborPairSetT> & k_closest_pairs,
+                          double dist_bound = -1, bool get_closest_points = false, Filter<T> const * filter = nullptr,
+                          Filter<E> const * target_filter = nullptr) const
+    {
+      k_closest_pairs.resize((size_t)num_elems);
+      for (size_t i = 0; i < k_closest_pairs.size(); ++i)
+        k_closest_pairs[i].clear();
+
+      if (!root || !target.root) return 0;
+
+      DualTreeState<E, S, A> state(*this, target, filter, target_filter, get_closest_points);
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+      allKClosestPairs<MetricT>(root, target.root, state, mon_approx_dist_bound, k_closest_pairs);
+
+      intx num_found = 0;
+      for (size_t i = 0; i < k_closest_pairs.size(); ++i)
+        num_found += (intx)k_closest_pairs[i].size();
+
+      return num_found;
+    }
+
+    /**
+     * Get the closest pair of elements between this tree and another kd-tree, with a dual-tree traversal that prunes pairs of
+     * nodes farther apart than the closest pair found so far. Unlike closestPair(), which searches \a target afresh for each
+     * element of this tree, the traversal descends both trees together.
+     *
+     * @param target The other kd-tree.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param get_closest_points If true, the coordinates of the closest pair of points on the respective elements is computed
+     *   and stored in the returned structure.
+     * @param filter If not null, elements of this tree not allowed by this filter are ignored, in addition to those rejected by
+     *   the filters on the stack.
+     * @param target_filter If not null, elements of \a target not allowed by this filter are ignored, in addition to those
+     *   rejected by the filters on its stack.
+     *
+     * @return A pair whose query index is an element of this tree and whose target index is an element of \a target, if a pair
+     *   was found. Else returns a pair of negative numbers.
+     */
+    template <typename MetricT, typename E, typename S, typename A>
+    NeighborPair dualTreeClosestPair(KDTreeN<E, N, S, A> const & target, double dist_bound = -1,
+                                     bool get_closest_points = false, Filter<T> const * filter = nullptr,
+                                     Filter<E> const * target_filter = nullptr) const
+    {
+      NeighborPair pair(-1, -1, (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1));
+      if (!root || !target.root) return NeighborPair(-1);
+
+      DualTreeState<E, S, A> state(*this, target, filter, target_filter, get_closest_points);
+      dualTreeClosestPair<MetricT>(root, target.root, state, pair);
+
+      return pair.isValid() ? pair : NeighborPair(-1);
+    }
+
+    /**
+     * Get the directed Hausdorff distance from this tree to another kd-tree, i.e. the largest distance from an element of this
+     * tree to its nearest element in \a target. The symmetric Hausdorff distance is the larger of the two directed distances.
+     * Each leaf of this tree searches \a target for the nearest neighbors of all its elements at once, and the search stops as
+     * soon as no element of the leaf can be farther from \a target than the largest distance found so far.
+     *
+     * @param target The other kd-tree.
+     * @param filter If not null, elements of this tree not allowed by this filter are ignored, in addition to those rejected by
+     *   the filters on the stack.
+     * @param target_filter If not null, elements of \a target not allowed by this filter are ignored, in addition to those
+     *   rejected by the filters on its stack.
+     *
+     * @return The directed Hausdorff distance, or a negative value if either tree has no (unfiltered) elements.
+     */
+    template <typename MetricT, typename E, typename S, typename A>
+    double hausdorffDistance(KDTreeN<E, N, S, A> const & target, Filter<T> const * filter = nullptr,
+                             Filter<E> const * target_filter = nullptr) const
+    {
+      if (!root || !target.root) return -1;
+
+      DualTreeState<E, S, A> state(*this, target, filter, target_filter, false);
+      double mon_approx_max_min = -1;
+      hausdorffDistance<MetricT>(root, target.root, state, mon_approx_max_min);
+
+      return mon_approx_max_min >= 0 ? MetricT::invertMonotoneApprox(mon_approx_max_min) : -1;
+    }
+
+    /**
+     * Apply a functor to all pairs of intersecting elements of this tree and another kd-tree, until the functor returns true.
+     * Both trees are descended together, and a pair of nodes is skipped if their bounding boxes, in world space (i.e. after
+     * applying the transform of each tree, if any), are disjoint. Pairs of elements are checked with the exact test provided by
+     * IntersectionTesterT, e.g. a triangle-triangle test for two MeshKDTree's. The functor should provide the member function
+     * (or be a function pointer with the equivalent signature)
+     * \code
+     * bool operator()(intx query_index, intx target_index)
+     * \endcode
+     * and will be passed the index of an element of this tree and the index of an element of \a target that intersect. If the
+     * functor returns true, the search will terminate immediately. To pass a functor by reference, wrap it in
+     * <tt>std::ref</tt>.
+     *
+     * @param target The other kd-tree.
+     * @param functor The functor to apply to each intersecting pair.
+     * @param filter If not null, elements of this tree not allowed by this filter are ignored, in addition to those rejected by
+     *   the filters on the stack.
+     * @param target_filter If not null, elements of \a target not allowed by this filter are ignored, in addition to those
+     *   rejected by the filters on its stack.
+     *
+     * @return True if the functor evaluated to true on some pair (the search stopped immediately after processing this pair),
+     *   else false.
+     */
+    template <typename IntersectionTesterT, typename E, typename S, typename A, typename FunctorT>
+    bool processIntersectingPairsUntil(KDTreeN<E, N, S, A> const & target, FunctorT functor,
+                                       Filter<T> const * filter = nullptr, Filter<E> const * target_filter = nullptr) const
+    {
+      if (!root || !target.root) return false;
+
+      AxisAlignedBoxT q_bounds = getBoundsWorldSpace(*root), t_bounds = target.getBoundsWorldSpace(*target.root);
+      if (!q_bounds.intersects(t_bounds)) return false;
+
+      DualTreeState<E, S, A> state(*this, target, filter, target_filter, false);
+      return intersectingPairs<IntersectionTesterT>(root, q_bounds, target.root, t_bounds, state, functor);
+    }
+
+    /**
+     * Get the pairs of intersecting elements of this tree and another kd-tree. See processIntersectingPairsUntil() for details
+     * of the search.
+     *
+     * @param target The other kd-tree.
+     * @param pairs Used to return the intersecting pairs. Each pair consists of the index of an element of this tree and the
+     *   index of an element of \a target. Existing entries are cleared.
+     * @param max_pairs If non-negative, the search stops after this many pairs have been found.
+     * @param filter If not null, elements of this tree not allowed by this filter are ignored, in addition to those rejected by
+     *   the filters on the stack.
+     * @param target_filter If not null, elements of \a target not allowed by this filter are ignored, in addition to those
+     *   rejected by the filters on its stack.
+     *
+     * @return The number of pairs found.
+     */
+    template <typename IntersectionTesterT, typename E, typename S, typename A>
+    intx intersectingPairs(KDTreeN<E, N, S, A> const & target, Array< std::pair<intx, intx> > & pairs, intx max_pairs = -1,
+                           Filter<T> const * filter = nullptr, Filter<E> const * target_filter = nullptr) const
+    {
+      pairs.clear();
+      if (max_pairs != 0)
+        processIntersectingPairsUntil<IntersectionTesterT>(target, IntersectingPairsFunctor(pairs, max_pairs), filter,
+                                                           target_filter);
+
+      return (intx)pairs.size();
+    }
+
+    /**
+     * Check if any element of this tree intersects any element of another kd-tree. The search stops at the first intersecting
+     * pair found. See processIntersectingPairsUntil() for details.
+     */
+    template <typename IntersectionTesterT, typename E, typename S, typename A>
+    bool intersects(KDTreeN<E, N, S, A> const & target, Filter<T> const * filter = nullptr,
+                    Filter<E> const * target_filter = nullptr) const
+    {
+      Array< std::pair<intx, intx> > pairs;
+      return intersectingPairs<IntersectionTesterT>(target, pairs, 1, filter, target_filter) > 0;
+    }
+
+    /**
+     * Check if some element of this tree is within a given distance of some element of another kd-tree, taking the transforms
+     * of both trees into account. Unlike dualTreeClosestPair(), which finds the minimum separation of the two trees, the search
+     * stops as soon as any pair within the distance is found, so the check is usually much faster, especially if the trees are
+     * far apart (the root bounding boxes alone suffice) or overlap substantially (a close pair is found almost immediately).
+     *
+     * @param target The other kd-tree.
+     * @param max_dist The distance threshold. Pairs separated by exactly this distance are considered to be within it.
+     * @param pair If not null, used to return the first pair found within the distance, including the closest pair of points
+     *   on its two elements. This is not in general the closest pair of elements of the two trees. Unchanged if no such pair
+     *   exists.
+     * @param filter If not null, elements of this tree not allowed by this filter are ignored, in addition to those rejected by
+     *   the filters on the stack.
+     * @param target_filter If not null, elements of \a target not allowed by this filter are ignored, in addition to those
+     *   rejected by the filters on its stack.
+     */
+    template <typename MetricT, typename E, typename S, typename A>
+    bool withinDistance(KDTreeN<E, N, S, A> const & target, double max_dist, NeighborPair * pair = nullptr,
+                        Filter<T> const * filter = nullptr, Filter<E> const * target_filter = nullptr) const
+    {
+      if (!root || !target.root || max_dist < 0) return false;
+
+      DualTreeState<E, S, A> state(*this, target, filter, target_filter, pair != nullptr);
+      double mon_approx_max_dist = MetricT::computeMonotoneApprox(max_dist);
+      if (state.template nodeDistance<MetricT>(root, target.root) > mon_approx_max_dist)
+        return false;
+
+      return withinDistance<MetricT>(root, target.root, state, mon_approx_max_dist, pair);
+    }
+
+    /**
+     * Get all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and new objects are appended to the array (this is useful for range queries over a
+     *   union of simpler ranges).
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQuery(RangeT const & range, Array<T> & result, bool discard_prior_results = true,
+                    Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      if (root)
+        const_cast<KDTreeN *>(this)->processRangeUntil<IntersectionTesterT>(range, RangeQueryFunctor(result), filter);
+    }
+
+    /**
+     * Get the indices of all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The indices of objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and indices of new objects are appended to the array (this is useful for range
+     *   queries over a union of simpler ranges).
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQueryIndices(RangeT const & range, Array<intx> & result, bool discard_prior_results = true,
+                           Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      if (root)
+        const_cast<KDTreeN *>(this)->processRangeUntil<IntersectionTesterT>(range, RangeQueryIndicesFunctor(result), filter);
+    }
+
+    /**
+     * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
+     * (or be a function pointer with the equivalent signature)
+     * \code
+     * bool operator()(intx index, T const & t)
+     * \endcode
+     * and will be passed the index of each object contained in the range as well as a handle to the object itself. If the
+     * functor returns true on any object, the search will terminate immediately (this is useful for searching for a particular
+     * object). To pass a functor by reference, wrap it in <tt>std::ref</tt>.
+     *
+     * The RangeT class should support intersection queries with AxisAlignedBoxT and containment queries with VectorT and
+     * AxisAlignedBoxT.
+     *
+     * If \a filter is not null, elements not allowed by it are ignored, in addition to those rejected by the filters on the
+     * stack.
+     *
+     * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
+     *   immediately after processing this object), else a negative value.
+     */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(RangeT const & range, FunctorT functor, Filter<T> const * filter = nullptr) const
+    {
+      return root ? const_cast<KDTreeN *>(this)->processRangeUntil<IntersectionTesterT, T const>(root, range, functor, filter)
+                  : -1;
+    }
 
     /**
      * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
@@ -978,21 +1909,78 @@ class /* THEA_API */ KDTreeN
      * The RangeT class should support intersection queries with AxisAlignedBoxT and containment queries with VectorT and
      * AxisAlignedBoxT.
      *
+     * If \a filter is not null, elements not allowed by it are ignored, in addition to those rejected by the filters on the
+     * stack.
+     *
      * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
      *   immediately after processing this object), else a negative value.
      */
     template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
-    intx processRangeUntil(RangeT const & range, FunctorT functor)
+    intx processRangeUntil(RangeT const & range, FunctorT functor, Filter<T> const * filter = nullptr)
+    {
+      return root ? processRangeUntil<IntersectionTesterT, T>(root, range, functor, filter) : -1;
+    }
+
+    /**
+     * Get aggregate statistics (number, sum and sum of squared norms) of the centers of all elements intersecting a range. For
+     * point elements, the centers are the points themselves. If the tree has a transform, the centers are transformed to world
+     * space.
+     *
+     * If the tree maintains node aggregates (see HAS_NODE_AGGREGATES), subtrees lying entirely inside the range are accounted
+     * for by their aggregates, so only the leaves straddling the boundary of the range are visited. This does not apply if the
+     * tree has a transform or if any element filter (\a filter, or one on the filter stack) is active, in which case every
+     * element in the range is visited as in processRangeUntil().
+     *
+     * The RangeT class should support intersection queries with AxisAlignedBoxT and containment queries with AxisAlignedBoxT.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    Aggregate rangeAggregate(RangeT const & range, Filter<T> const * filter = nullptr) const
+    {
+      Aggregate result;
+      if (root)
+      {
+        bool use_node_aggregates = (HAS_NODE_AGGREGATES && !TransformableBaseT::hasTransform() && !filter && filters.empty());
+        rangeAggregate<IntersectionTesterT>(root, range, filter, use_node_aggregates, result);
+      }
+
+      return result;
+    }
+
+    /** Get the number of elements intersecting a range. See rangeAggregate() for details. */
+    template <typename IntersectionTesterT, typename RangeT>
+    intx rangeCount(RangeT const & range, Filter<T> const * filter = nullptr) const
+    {
+      return rangeAggregate<IntersectionTesterT>(range, filter).numElements();
+    }
+
+    /** Get the sum of the centers of the elements intersecting a range. See rangeAggregate() for details. */
+    template <typename IntersectionTesterT, typename RangeT>
+    typename Aggregate::DoubleVectorT rangeSum(RangeT const & range, Filter<T> const * filter = nullptr) const
+    {
+      return rangeAggregate<IntersectionTesterT>(range, filter).getSum();
+    }
+
+    /**
+     * Get the centroid of the centers of the elements intersecting a range, or the origin if there are no such elements. See
+     * rangeAggregate() for details.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    VectorT rangeCentroid(RangeT const & range, Filter<T> const * filter = nullptr) const
     {
-      return root ? processRangeUntil<IntersectionTesterT, T>(root, range, functor) : -1;
+      return rangeAggregate<IntersectionTesterT>(range, filter).getCentroid();
     }
 
-    template <typename RayIntersectionTesterT> bool rayIntersects(RayT const & ray, Real max_time = -1) const
+    // The ray query functions below ignore elements not allowed by \a filter, if it is not null, in addition to those rejected
+    // by the filters on the stack.
+
+    template <typename RayIntersectionTesterT>
+    bool rayIntersects(RayT const & ray, Real max_time = -1, Filter<T> const * filter = nullptr) const
     {
-      return rayIntersectionTime<RayIntersectionTesterT>(ray, max_time) >= 0;
+      return rayIntersectionTime<RayIntersectionTesterT>(ray, max_time, filter) >= 0;
     }
 
-    template <typename RayIntersectionTesterT> Real rayIntersectionTime(RayT const & ray, Real max_time = -1) const
+    template <typename RayIntersectionTesterT>
+    Real rayIntersectionTime(RayT const & ray, Real max_time = -1, Filter<T> const * filter = nullptr) const
     {
       if (root)
       {
@@ -1000,12 +1988,12 @@ class /* THEA_API */ KDTreeN
         {
           RayT tr_ray = toObjectSpace(ray);
           if (root->bounds.rayIntersects(tr_ray, max_time))
-            return rayIntersectionTime<RayIntersectionTesterT>(root, tr_ray, max_time);
+            return rayIntersectionTime<RayIntersectionTesterT>(root, tr_ray, max_time, filter);
         }
         else
         {
           if (root->bounds.rayIntersects(ray, max_time))
-            return rayIntersectionTime<RayIntersectionTesterT>(root, ray, max_time);
+            return rayIntersectionTime<RayIntersectionTesterT>(root, ray, max_time, filter);
         }
       }
 
@@ -1013,7 +2001,8 @@ class /* THEA_API */ KDTreeN
     }
 
     template <typename RayIntersectionTesterT>
-    RayStructureIntersectionT rayStructureIntersection(RayT const & ray, Real max_time = -1) const
+    RayStructureIntersectionT rayStructureIntersection(RayT const & ray, Real max_time = -1,
+                                                       Filter<T> const * filter = nullptr) const
     {
       if (root)
       {
@@ -1022,7 +2011,7 @@ class /* THEA_API */ KDTreeN
           RayT tr_ray = toObjectSpace(ray);
           if (root->bounds.rayIntersects(tr_ray, max_time))
           {
-            RayStructureIntersectionT isec = rayStructureIntersection<RayIntersectionTesterT>(root, tr_ray, max_time);
+            RayStructureIntersectionT isec = rayStructureIntersection<RayIntersectionTesterT>(root, tr_ray, max_time, filter);
             if (isec.isValid() && isec.hasNormal())
               isec.setNormal(normalToWorldSpace(isec.getNormal()));
 
@@ -1032,53 +2021,335 @@ class /* THEA_API */ KDTreeN
         else
         {
           if (root->bounds.rayIntersects(ray, max_time))
-            return rayStructureIntersection<RayIntersectionTesterT>(root, ray, max_time);
+            return rayStructureIntersection<RayIntersectionTesterT>(root, ray, max_time, filter);
         }
       }
 
       return RayStructureIntersectionT(-1);
     }
 
-  private:
-    /** Comparator for sorting elements along an axis. */
-    struct ObjectLess
+    /**
+     * Get the times taken by a batch of rays to hit the nearest objects in the tree, in the forward direction. The results are
+     * the same as calling rayIntersectionTime() on each ray, but coherent rays (e.g. rays with a common origin and similar
+     * directions) are traced through the tree together in packets of up to RAY_PACKET_SIZE, which amortizes the cost of
+     * traversal. Rays in a packet that diverge from the rest are completed individually.
+     *
+     * @param rays The array of query rays.
+     * @param num_rays The number of rays in the array.
+     * @param times Used to return the hit time of each ray, or a negative value if the ray misses the tree. Must have space
+     *   for  num_rays entries.
+     * @param max_time The maximum hit time for every ray, or a negative value for no limit.
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
+     */
+    template <typename RayIntersectionTesterT>
+    void rayIntersectionTimes(RayT const * rays, intx num_rays, Real * times, Real max_time = -1,
+                              Filter<T> const * filter = nullptr) const
     {
-      intx coord;
-      KDTreeN const * tree;
+      RayPacket packet;
+      for (intx i = 0; i < num_rays; i += RAY_PACKET_SIZE)
+      {
+        int packet_size = (int)std::min(num_rays - i, (intx)RAY_PACKET_SIZE);
+        tracePacket<RayIntersectionTesterT>(rays + i, packet_size, max_time, filter, packet, false);
 
-      /** Constructor. Axis 0 = X, 1 = Y, 2 = Z. */
-      ObjectLess(intx coord_, KDTreeN const * tree_) : coord(coord_), tree(tree_) {}
+        for (int j = 0; j < packet_size; ++j)
+          times[i + j] = packet.found[j] ? packet.isecs[j].getTime() : -1;
+      }
+    }
 
-      /** Less-than operator, along the specified axis. */
-      bool operator()(ElementIndex a, ElementIndex b)
+    /**
+     * Get the nearest intersections of a batch of rays with the tree, in the forward direction. The results are the same as
+     * calling rayStructureIntersection() on each ray, but coherent rays are traced through the tree together in packets of up
+     * to RAY_PACKET_SIZE. Rays in a packet that diverge from the rest are completed individually.
+     *
+     * @param rays The array of query rays.
+     * @param num_rays The number of rays in the array.
+     * @param isecs Used to return the nearest intersection of each ray. An invalid intersection (negative time) is returned for
+     *   a ray that misses the tree. Must have space for  num_rays entries.
+     * @param max_time The maximum hit time for every ray, or a negative value for no limit.
+     * @param filter If not null, elements not allowed by this filter are ignored, in addition to those rejected by the filters
+     *   on the stack.
+     */
+    template <typename RayIntersectionTesterT>
+    void rayStructureIntersections(RayT const * rays, intx num_rays, RayStructureIntersectionT * isecs,
+                                   Real max_time = -1, Filter<T> const * filter = nullptr) const
+    {
+      RayPacket packet;
+      for (intx i = 0; i < num_rays; i += RAY_PACKET_SIZE)
       {
-        // Compare object min coords
-        return BoundedTraitsT::getLow(tree->elems[a], coord)
-             < BoundedTraitsT::getLow(tree->elems[b], coord);
+        int packet_size = (int)std::min(num_rays - i, (intx)RAY_PACKET_SIZE);
+        tracePacket<RayIntersectionTesterT>(rays + i, packet_size, max_time, filter, packet, true);
+
+        for (int j = 0; j < packet_size; ++j)
+        {
+          if (packet.found[j])
+          {
+            isecs[i + j] = packet.isecs[j];
+            if (TransformableBaseT::hasTransform() && isecs[i + j].hasNormal())
+              isecs[i + j].setNormal(normalToWorldSpace(isecs[i + j].getNormal()));
+          }
+          else
+            isecs[i + j] = RayStructureIntersectionT(-1);
+        }
       }
+    }
+
+    /** Maximum number of rays traced together by rayIntersectionTimes() and rayStructureIntersections(). */
+    static int const RAY_PACKET_SIZE = 8;
+
+  private:
+    /**
+     * A packet of rays traced together through the tree. Ray origins, reciprocal directions and current hit times are stored in
+     * structure-of-arrays layout so that box tests over the whole packet are straight-line loops the compiler can vectorize.
+     */
+    struct RayPacket
+    {
+      RayT rays[RAY_PACKET_SIZE];                    ///< The rays, in object space.
+      ScalarT origin[N][RAY_PACKET_SIZE];            ///< Ray origins, one array per coordinate.
+      ScalarT inv_dir[N][RAY_PACKET_SIZE];           ///< Reciprocals of ray directions, one array per coordinate.
+      ScalarT max_t[RAY_PACKET_SIZE];                ///< Current upper limit on the hit time of each ray.
+      RayStructureIntersectionT isecs[RAY_PACKET_SIZE];  ///< Nearest intersection of each ray found so far.
+      bool found[RAY_PACKET_SIZE];                   ///< Whether each ray has hit something yet.
+      int size;                                      ///< Number of rays in the packet.
+      Real max_time;                                 ///< The maximum hit time requested by the caller.
+      Filter<T> const * filter;                      ///< Per-query element filter, if not null.
+      bool compute_isecs;                            ///< Compute full intersection information, and not just hit times?
     };
 
-    // Allow the comparator unrestricted access to the kd-tree.
-    friend struct ObjectLess;
+    /** Trace a packet of rays through the tree, from the root. */
+    template <typename RayIntersectionTesterT>
+    void tracePacket(RayT const * rays, int size, Real max_time, Filter<T> const * filter, RayPacket & packet,
+                     bool compute_isecs) const
+    {
+      packet.size = size;
+      packet.max_time = max_time;
+      packet.filter = filter;
+      packet.compute_isecs = compute_isecs;
 
-    typedef Array<Filter<T> *> FilterStack;  ///< A stack of element filters.
-    typedef Array<SampleFilter> SampleFilterStack;  ///< A stack of point sample filters.
+      for (int j = 0; j < RAY_PACKET_SIZE; ++j)
+      {
+        packet.found[j] = false;
 
-  protected:
-    /** Get the inverse of the transform applied to the kd-tree. */
-    AffineTransformN<N, ScalarT> const & getTransformInverse() const { return transform_inverse; }
+        if (j >= size)  // unused lanes never hit anything
+        {
+          for (intx k = 0; k < N; ++k) { packet.origin[k][j] = 0; packet.inv_dir[k][j] = 0; }
+          packet.max_t[j] = -1;
+          continue;
+        }
 
-    /** Get the transpose of the inverse of the linear part of the transform applied to the kd-tree. */
-    Matrix<N, N, ScalarT> const & getTransformInverseTranspose() const { return transform_inverse_transpose; }
+        packet.rays[j] = TransformableBaseT::hasTransform() ? toObjectSpace(rays[j]) : rays[j];
+        VectorT const & o = packet.rays[j].getOrigin();
+        VectorT const & d = packet.rays[j].getDirection();
+        for (intx k = 0; k < N; ++k)
+        {
+          // Replace zero direction components with tiny ones, so that slab tests are free of NaNs and still conservative
+          static ScalarT const MIN_DIR = (ScalarT)1.0e-30;
+          ScalarT dk = (std::abs(d[k]) < MIN_DIR ? (d[k] < 0 ? -MIN_DIR : MIN_DIR) : d[k]);
 
-    /** Get the main memory pool for nodes. */
-    NodePool & getNodePool() { return node_pool; }
+          packet.origin[k][j] = o[k];
+          packet.inv_dir[k][j] = 1 / dk;
+        }
 
-    /** Get the main memory pool for indices. */
-    IndexPool & getIndexPool() { return index_pool; }
+        packet.max_t[j] = (max_time >= 0 ? (ScalarT)max_time : std::numeric_limits<ScalarT>::infinity());
+      }
 
-  private:
-    /** Move the set of element indices for a leaf from the end of the main index pool to an index pool for leaves. */
+      if (root)
+        tracePacket<RayIntersectionTesterT>(root, packet);
+    }
+
+    /**
+     * Test a packet of rays against a box. Sets the entry time of each ray into the box in  entry_times, and returns a bitmask
+     * of the rays that hit the box before their current maximum hit times.
+     */
+    static uint32 packetHitsBox(RayPacket const & packet, AxisAlignedBoxT const & box, ScalarT * entry_times)
+    {
+      ScalarT t_near[RAY_PACKET_SIZE], t_far[RAY_PACKET_SIZE];
+      for (int j = 0; j < RAY_PACKET_SIZE; ++j)
+      {
+        t_near[j] = 0;
+        t_far[j] = packet.max_t[j];
+      }
+
+      for (intx k = 0; k < N; ++k)
+      {
+        ScalarT lo = box.getLow()[k], hi = box.getHigh()[k];
+        for (int j = 0; j < RAY_PACKET_SIZE; ++j)
+        {
+          ScalarT t0 = (lo - packet.origin[k][j]) * packet.inv_dir[k][j];
+          ScalarT t1 = (hi - packet.origin[k][j]) * packet.inv_dir[k][j];
+          ScalarT t_min = (t0 < t1 ? t0 : t1), t_max = (t0 < t1 ? t1 : t0);
+          t_near[j] = (t_min > t_near[j] ? t_min : t_near[j]);
+          t_far[j]  = (t_max < t_far[j]  ? t_max : t_far[j]);
+        }
+      }
+
+      uint32 mask = 0;
+      for (int j = 0; j < RAY_PACKET_SIZE; ++j)
+      {
+        entry_times[j] = t_near[j];
+        mask |= ((uint32)(t_near[j] <= t_far[j]) << j);
+      }
+
+      return mask;
+    }
+
+    /** Trace the rays of a packet that hit a node, through the subtree rooted at the node. */
+    template <typename RayIntersectionTesterT>
+    void tracePacket(Node const * start, RayPacket & packet) const
+    {
+      // Minimum number of rays hitting a node for the packet to continue together, else they are traced individually
+      static int const MIN_PACKET_RAYS = 2;
+
+      ScalarT entry_times[RAY_PACKET_SIZE];
+      uint32 mask = packetHitsBox(packet, start->bounds, entry_times);
+      if (!mask) return;
+
+      int num_active = 0;
+      for (int j = 0; j < packet.size; ++j)
+        if (mask & (1 << j)) num_active++;
+
+      if (!start->lo)  // leaf
+      {
+        for (int j = 0; j < packet.size; ++j)
+          if (mask & (1 << j))
+            rayLeafIntersection<RayIntersectionTesterT>(start, packet, j);
+      }
+      else if (num_active < MIN_PACKET_RAYS)  // the packet has diverged
+      {
+        for (int j = 0; j < packet.size; ++j)
+        {
+          if (!(mask & (1 << j))) continue;
+
+          Real max_time = packet.found[j] ? packet.isecs[j].getTime() : packet.max_time;
+          RayStructureIntersectionT isec = packet.compute_isecs
+                                         ? rayStructureIntersection<RayIntersectionTesterT>(start, packet.rays[j], max_time,
+                                                                                            packet.filter)
+                                         : RayStructureIntersectionT(rayIntersectionTime<RayIntersectionTesterT>(
+                                                                         start, packet.rays[j], max_time, packet.filter));
+          if (improvedRayTime(isec.getTime(), max_time))
+            updatePacketHit(packet, j, isec);
+        }
+      }
+      else
+      {
+        // Visit first the child that is nearer for the majority of rays
+        ScalarT lo_times[RAY_PACKET_SIZE], hi_times[RAY_PACKET_SIZE];
+        uint32 lo_mask = packetHitsBox(packet, start->lo->bounds, lo_times);
+        uint32 hi_mask = packetHitsBox(packet, start->hi->bounds, hi_times);
+
+        int lo_first_votes = 0;
+        for (int j = 0; j < packet.size; ++j)
+        {
+          if ((lo_mask & (1 << j)) && (!(hi_mask & (1 << j)) || lo_times[j] <= hi_times[j])) lo_first_votes++;
+          else if (hi_mask & (1 << j)) lo_first_votes--;
+        }
+
+        if (lo_first_votes >= 0)
+        {
+          if (lo_mask) tracePacket<RayIntersectionTesterT>(start->lo, packet);
+          if (hi_mask) tracePacket<RayIntersectionTesterT>(start->hi, packet);
+        }
+        else
+        {
+          if (hi_mask) tracePacket<RayIntersectionTesterT>(start->hi, packet);
+          if (lo_mask) tracePacket<RayIntersectionTesterT>(start->lo, packet);
+        }
+      }
+    }
+
+    /** Intersect a single ray of a packet with the elements of a leaf. */
+    template <typename RayIntersectionTesterT>
+    void rayLeafIntersection(Node const * leaf, RayPacket & packet, int j) const
+    {
+      for (size_t i = 0; i < leaf->num_elems; ++i)
+      {
+        ElementIndex index = leaf->elems[i];
+        Element const & elem = elems[index];
+
+        if (!elementPassesFilters(elem, packet.filter))
+          continue;
+
+        Real max_time = packet.found[j] ? packet.isecs[j].getTime() : packet.max_time;
+        if (packet.compute_isecs)
+        {
+          RayIntersectionN<N, ScalarT> isec = RayIntersectionTesterT::template rayIntersection<N, ScalarT>(packet.rays[j], elem,
+                                                                                                           max_time);
+          if (improvedRayTime(isec.getTime(), max_time))
+            updatePacketHit(packet, j, RayStructureIntersectionT(isec, (intx)index));
+        }
+        else
+        {
+          Real time = RayIntersectionTesterT::template rayIntersectionTime<N, ScalarT>(packet.rays[j], elem, max_time);
+          if (improvedRayTime(time, max_time))
+            updatePacketHit(packet, j, RayStructureIntersectionT(time));
+        }
+      }
+    }
+
+    /** Record a new nearest hit for a ray of a packet, and tighten the ray's time limit for culling further nodes. */
+    static void updatePacketHit(RayPacket & packet, int j, RayStructureIntersectionT const & isec)
+    {
+      packet.isecs[j] = isec;
+      packet.found[j] = true;
+      packet.max_t[j] = (ScalarT)isec.getTime();
+    }
+
+    /** Comparator for sorting elements along an axis. */
+    struct ObjectLess
+    {
+      intx coord;
+      KDTreeN const * tree;
+
+      /** Constructor. Axis 0 = X, 1 = Y, 2 = Z. */
+      ObjectLess(intx coord_, KDTreeN const * tree_) : coord(coord_), tree(tree_) {}
+
+      /** Less-than operator, along the specified axis. */
+      bool operator()(ElementIndex a, ElementIndex b)
+      {
+        // Compare object min coords
+        return BoundedTraitsT::getLow(tree->elems[a], coord)
+             < BoundedTraitsT::getLow(tree->elems[b], coord);
+      }
+    };
+
+    /** Comparator for sorting elements by their centers along an axis. */
+    struct CenterLess
+    {
+      intx coord;
+      KDTreeN const * tree;
+
+      /** Constructor. Axis 0 = X, 1 = Y, 2 = Z. */
+      CenterLess(intx coord_, KDTreeN const * tree_) : coord(coord_), tree(tree_) {}
+
+      /** Less-than operator, along the specified axis. */
+      bool operator()(ElementIndex a, ElementIndex b)
+      {
+        return BoundedTraitsT::getCenter(tree->elems[a])[coord] < BoundedTraitsT::getCenter(tree->elems[b])[coord];
+      }
+    };
+
+    // Allow the comparators unrestricted access to the kd-tree.
+    friend struct ObjectLess;
+    friend struct CenterLess;
+
+    typedef Array<Filter<T> *> FilterStack;  ///< A stack of element filters.
+    typedef Array<SampleFilter> SampleFilterStack;  ///< A stack of point sample filters.
+
+  protected:
+    /** Get the inverse of the transform applied to the kd-tree. */
+    AffineTransformN<N, ScalarT> const & getTransformInverse() const { return transform_inverse; }
+
+    /** Get the transpose of the inverse of the linear part of the transform applied to the kd-tree. */
+    Matrix<N, N, ScalarT> const & getTransformInverseTranspose() const { return transform_inverse_transpose; }
+
+    /** Get the main memory pool for nodes. */
+    NodePool & getNodePool() { return node_pool; }
+
+    /** Get the main memory pool for indices. */
+    IndexPool & getIndexPool() { return index_pool; }
+
+  private:
+    /** Move the set of element indices for a leaf from the end of the main index pool to an index pool for leaves. */
     void moveIndicesToLeafPool(Node * leaf, IndexPool * main_index_pool, IndexPool * leaf_index_pool)
     {
       if (leaf)
@@ -1100,6 +2371,17 @@ class /* THEA_API */ KDTreeN
      * @note To use this function with a node accessed via getRoot(), you'll have to const_cast it to a non-const type first.
      */
     void createTree(Node * start, bool save_memory, IndexPool * main_index_pool, IndexPool * leaf_index_pool)
+    {
+      createTree(start, save_memory, main_index_pool, leaf_index_pool, &node_pool, &num_nodes);
+    }
+
+  private:
+    /**
+     * Recursively construct a (sub-)tree, allocating new nodes from \a subtree_node_pool and adding the number of new nodes to
+     * \a subtree_num_nodes. See the overload above for the other parameters.
+     */
+    void createTree(Node * start, bool save_memory, IndexPool * main_index_pool, IndexPool * leaf_index_pool,
+                    NodePool * subtree_node_pool, intx * subtree_num_nodes)
     {
       // Assume the start node is fully constructed at this stage.
       //
@@ -1107,7 +2389,7 @@ class /* THEA_API */ KDTreeN
       // leaf pool, since we don't yet know if this node will turn out to be a leaf). In this case, after the function finishes,
       // the node's indices will be deallocated from the main index pool (and possibly moved to the leaf pool).
 
-      if (!start || start->depth >= max_depth || (intx)start->num_elems <= max_elems_per_leaf)
+      if (isLeafOnConstruction(start))
       {
         if (save_memory)
           moveIndicesToLeafPool(start, main_index_pool, leaf_index_pool);
@@ -1115,26 +2397,57 @@ class /* THEA_API */ KDTreeN
         return;
       }
 
-      // Find a splitting plane
-#define THEA_KDTREEN_SPLIT_LONGEST
-#ifdef THEA_KDTREEN_SPLIT_LONGEST
-      intx coord = Math::maxAxis(start->bounds.getExtent());  // split longest dimension
-#else
-      intx coord = (intx)(start->depth % N);  // cycle between dimensions
-#endif
+      splitNode(start, main_index_pool, subtree_node_pool, subtree_num_nodes);
 
-      // Split elements into lower and upper halves
-      size_t mid = start->num_elems / 2;
-      std::nth_element(start->elems, start->elems + mid, start->elems + start->num_elems, ObjectLess(coord, this));
+      // Recurse on the high child first, since its indices are at the end of the main index pool and can be freed first if
+      // necessary
+      createTree(start->hi, save_memory, main_index_pool, leaf_index_pool, subtree_node_pool, subtree_num_nodes);
+
+      // Recurse on the low child next, if we are in memory-saving mode its indices are now the last valid entries in the main
+      // index pool
+      createTree(start->lo, save_memory, main_index_pool, leaf_index_pool, subtree_node_pool, subtree_num_nodes);
+
+      // If we are in memory-saving mode, deallocate the indices stored at this node, which are currently the last entries in
+      // the main index pool
+      if (save_memory)
+      {
+        main_index_pool->free(start->num_elems);
+        start->num_elems = 0;
+        start->elems = nullptr;
+      }
+    }
+
+    /** Check if a node, while the tree is being constructed, should be a leaf and not be split further. */
+    bool isLeafOnConstruction(Node const * node) const
+    {
+      return !node || node->depth >= max_depth || (intx)node->num_elems <= max_elems_per_leaf;
+    }
+
+    /**
+     * Split the elements of a node between two new children, allocated from \a subtree_node_pool. The element indices of the
+     * children are allocated from \a main_index_pool, those of the high child after those of the low child.
+     */
+    void splitNode(Node * start, IndexPool * main_index_pool, NodePool * subtree_node_pool, intx * subtree_num_nodes)
+    {
+      // Reorder the element indices so that the first num_lo go to the low child and the rest to the high child
+      size_t num_lo = 0;
+      switch (split_policy)
+      {
+        case SplitPolicy::OBJECT_MEDIAN: num_lo = partitionObjectMedian(start); break;
+        case SplitPolicy::SAH:           num_lo = partitionSAH(start); break;
+        default:                         num_lo = partitionMedian(start);
+      }
+
+      size_t mid = start->num_elems - num_lo;  // number of elements in the high child
 
       // Create child nodes
-      start->lo = node_pool.alloc(1);
+      start->lo = subtree_node_pool->alloc(1);
       start->lo->init(start->depth + 1);
-      num_nodes++;
 
-      start->hi = node_pool.alloc(1);
+      start->hi = subtree_node_pool->alloc(1);
       start->hi->init(start->depth + 1);
-      num_nodes++;
+
+      *subtree_num_nodes += 2;
 
       // THEA_CONSOLE << "num_nodes = " << num_nodes;
 
@@ -1142,7 +2455,7 @@ class /* THEA_API */ KDTreeN
       start->lo->elems = main_index_pool->alloc(start->num_elems - mid);
       start->hi->elems = main_index_pool->alloc(mid);
 
-      // Add first half of array (elems less than median) to low child
+      // Add first part of array (elems below the split) to low child
       AxisAlignedBoxT elem_bounds;
       bool lo_first = true;
       for (ElementIndex i = 0; i < start->num_elems - mid; ++i)
@@ -1161,7 +2474,7 @@ class /* THEA_API */ KDTreeN
           start->lo->bounds.merge(elem_bounds);
       }
 
-      // Add second half of array (elems greater than median) to high child
+      // Add second part of array (elems above the split) to high child
       bool hi_first = true;
       for (ElementIndex i = start->num_elems - mid; i < start->num_elems; ++i)
       {
@@ -1182,342 +2495,1725 @@ class /* THEA_API */ KDTreeN
       // Expand the bounding boxes slightly to handle numerical error
       start->lo->bounds.scaleCentered(BOUNDS_EXPANSION_FACTOR);
       start->hi->bounds.scaleCentered(BOUNDS_EXPANSION_FACTOR);
+    }
 
-      // Recurse on the high child first, since its indices are at the end of the main index pool and can be freed first if
-      // necessary
-      createTree(start->hi, save_memory, main_index_pool, leaf_index_pool);
+    /**
+     * Partition the elements of a node at the median of their minimum coordinates along the longest dimension of the node, and
+     * return the number of elements in the lower part.
+     */
+    size_t partitionMedian(Node * start)
+    {
+      // Find a splitting plane
+#define THEA_KDTREEN_SPLIT_LONGEST
+#ifdef THEA_KDTREEN_SPLIT_LONGEST
+      intx coord = Math::maxAxis(start->bounds.getExtent());  // split longest dimension
+#else
+      intx coord = (intx)(start->depth % N);  // cycle between dimensions
+#endif
 
-      // Recurse on the low child next, if we are in memory-saving mode its indices are now the last valid entries in the main
-      // index pool
-      createTree(start->lo, save_memory, main_index_pool, leaf_index_pool);
+      // Split elements into lower and upper halves
+      size_t mid = start->num_elems / 2;
+      std::nth_element(start->elems, start->elems + mid, start->elems + start->num_elems, ObjectLess(coord, this));
 
-      // If we are in memory-saving mode, deallocate the indices stored at this node, which are currently the last entries in
-      // the main index pool
-      if (save_memory)
-      {
-        main_index_pool->free(start->num_elems);
-        start->num_elems = 0;
-        start->elems = nullptr;
-      }
+      return start->num_elems - mid;
     }
 
-    /** Mark that the bounding box requires an update. */
-    void invalidateBounds()
+    /**
+     * Partition the elements of a node at the median of their centers along the longest dimension of the bounding box of the
+     * centers, and return the number of elements in the lower part.
+     */
+    size_t partitionObjectMedian(Node * start)
     {
-      valid_bounds = false;
+      AxisAlignedBoxT center_bounds;
+      for (size_t i = 0; i < start->num_elems; ++i)
+        center_bounds.merge(BoundedTraitsT::getCenter(elems[start->elems[i]]));
+
+      intx coord = Math::maxAxis(center_bounds.getExtent());
+
+      size_t mid = start->num_elems / 2;
+      std::nth_element(start->elems, start->elems + mid, start->elems + start->num_elems, CenterLess(coord, this));
+
+      return start->num_elems - mid;
     }
 
-    /** Recompute the bounding box if it has been invalidated. */
-    void updateBounds() const
+    /**
+     * Partition the elements of a node by binning their centers along each axis, and choosing the bin boundary that minimizes
+     * the surface area heuristic. Returns the number of elements in the lower part. Falls back to the object median if all
+     * centers fall in a single bin.
+     */
+    size_t partitionSAH(Node * start)
     {
-      if (valid_bounds) return;
+      static int const NUM_BINS = 16;
 
-      if (root)
+      AxisAlignedBoxT center_bounds;
+      for (size_t i = 0; i < start->num_elems; ++i)
+        center_bounds.merge(BoundedTraitsT::getCenter(elems[start->elems[i]]));
+
+      VectorT center_lo = center_bounds.getLow();
+      VectorT center_ext = center_bounds.getExtent();
+
+      // Accumulate element counts and bounds in the bins of every axis
+      size_t bin_counts[N][NUM_BINS];
+      AxisAlignedBoxT bin_bounds[N][NUM_BINS];
+      for (intx j = 0; j < N; ++j)
+        std::fill(bin_counts[j], bin_counts[j] + NUM_BINS, 0);
+
+      AxisAlignedBoxT elem_bounds;
+      for (size_t i = 0; i < start->num_elems; ++i)
       {
-        bounds = TransformableBaseT::hasTransform()
-               ? root->bounds.transformAndBound(TransformableBaseT::getTransform())
-               : root->bounds;
+        T const & elem = elems[start->elems[i]];
+        BoundedTraitsT::getBounds(elem, elem_bounds);
+        VectorT c = BoundedTraitsT::getCenter(elem);
+
+        for (intx j = 0; j < N; ++j)
+        {
+          if (center_ext[j] <= 0) continue;
+
+          int b = sahBin(c[j], center_lo[j], center_ext[j], NUM_BINS);
+          bin_counts[j][b]++;
+          bin_bounds[j][b].merge(elem_bounds);
+        }
       }
-      else
+
+      // Sweep the bins of each axis to find the cheapest split. The cost of splitting after bin b is proportional to
+      // area(lo) * count(lo) + area(hi) * count(hi).
+      intx best_coord = -1;
+      int best_bin = -1;
+      double best_cost = -1;
+      for (intx j = 0; j < N; ++j)
       {
-        bounds = AxisAlignedBoxT();
-      }
+        if (center_ext[j] <= 0) continue;
 
-      valid_bounds = true;
-    }
+        double hi_cost[NUM_BINS];  // hi_cost[b] is the cost of the upper part, starting at bin b + 1
+        AxisAlignedBoxT acc_bounds;
+        size_t acc_count = 0;
+        for (int b = NUM_BINS - 1; b > 0; --b)
+        {
+          acc_bounds.merge(bin_bounds[j][b]);
+          acc_count += bin_counts[j][b];
+          hi_cost[b - 1] = boxSurfaceArea(acc_bounds) * acc_count;
+        }
 
-    /** Check if an element passes all filters currently on the stack. */
-    bool elementPassesFilters(T const & elem) const
-    {
-      if (filters.empty()) return true;  // early exit
+        acc_bounds.setNull();
+        acc_count = 0;
+        for (int b = 0; b < NUM_BINS - 1; ++b)
+        {
+          acc_bounds.merge(bin_bounds[j][b]);
+          acc_count += bin_counts[j][b];
+          if (acc_count <= 0 || acc_count >= start->num_elems)
+            continue;
 
-      for (typename FilterStack::const_iterator fi = filters.begin(); fi != filters.end(); ++fi)
-        if (!(*fi)->allows(elem))
-          return false;
+          double cost = boxSurfaceArea(acc_bounds) * acc_count + hi_cost[b];
+          if (best_cost < 0 || cost < best_cost)
+          {
+            best_coord = j;
+            best_bin = b;
+            best_cost = cost;
+          }
+        }
+      }
 
-      return true;
+      if (best_coord < 0)  // all centers in one bin
+        return partitionObjectMedian(start);
+
+      ElementIndex * split = std::partition(start->elems, start->elems + start->num_elems,
+                                            SAHBinLess(best_coord, center_lo[best_coord], center_ext[best_coord], NUM_BINS,
+                                                       best_bin, this));
+
+      return (size_t)(split - start->elems);
     }
 
-    /** Get the bounding box for an object, if it is bounded. */
-    template < typename U, typename std::enable_if< IsBoundedN<U, N>::value, int >::type = 0 >
-    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    /** Get the bin of a center coordinate  c, in a range of length  ext starting at  lo divided into  num_bins bins. */
+    static int sahBin(ScalarT c, ScalarT lo, ScalarT ext, int num_bins)
     {
-      BoundedTraitsN<U, N, ScalarT>::getBounds(u, bounds);
+      int b = (int)(num_bins * ((c - lo) / ext));
+      return b < 0 ? 0 : (b >= num_bins ? num_bins - 1 : b);
     }
 
-    /** Returns a null bounding box for unbounded objects. */
-    template < typename U, typename std::enable_if< !IsBoundedN<U, N>::value, int >::type = 0 >
-    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    /** Checks if an element's center falls in or below a bin along an axis, for partitioning with the SAH. */
+    struct SAHBinLess
     {
-      bounds.setNull();
-    }
+      intx coord;
+      ScalarT lo, ext;
+      int num_bins, max_bin;
+      KDTreeN const * tree;
+
+      /** Constructor. */
+      SAHBinLess(intx coord_, ScalarT lo_, ScalarT ext_, int num_bins_, int max_bin_, KDTreeN const * tree_)
+      : coord(coord_), lo(lo_), ext(ext_), num_bins(num_bins_), max_bin(max_bin_), tree(tree_) {}
+
+      /** Test an element. */
+      bool operator()(ElementIndex a) const
+      {
+        return sahBin(BoundedTraitsT::getCenter(tree->elems[a])[coord], lo, ext, num_bins) <= max_bin;
+      }
+    };
+
+    friend struct SAHBinLess;
 
     /**
-     * Get a lower bound on (the monotone approximation to) the distance between the bounding box of a kd-tree node and a
-     * bounded query object, or a negative value if no such lower bound can be calculated.
+     * Get a measure of the surface area of a box in N-space, proportional to the probability that a random ray hitting an
+     * enclosing box also hits this one.
      */
-    template < typename MetricT, typename QueryT, typename std::enable_if< IsBoundedN<QueryT, N>::value, int >::type = 0 >
-    double monotonePruningDistance(Node const * node, QueryT const & query, AxisAlignedBoxT query_bounds) const
+    static double boxSurfaceArea(AxisAlignedBoxT const & box)
     {
-      if (node && !query_bounds.isNull())
-        return MetricT::template monotoneApproxDistance<N, ScalarT>(query_bounds, getBoundsWorldSpace(*node));
+      if (box.isNull()) return 0;
+
+      VectorT ext = box.getExtent();
+      if (N == 1) return 1;
+      if (N == 2) return (double)ext[0] + (double)ext[1];
+
+      double area = 0;
+      for (intx i = 0; i < N; ++i)
+        for (intx j = i + 1; j < N; ++j)
+          area += (double)ext[i] * (double)ext[j];
+
+      return area;
+    }
+
+    /** Recursively compute the expected ray traversal cost of a subtree. */
+    double expectedTraversalCost(Node const * start, double root_area, double traversal_cost, double intersection_cost) const
+    {
+      double p = boxSurfaceArea(start->bounds) / root_area;
+      if (!start->lo)  // leaf
+        return p * intersection_cost * (double)start->num_elems;
+
+      return p * traversal_cost
+           + expectedTraversalCost(start->lo, root_area, traversal_cost, intersection_cost)
+           + expectedTraversalCost(start->hi, root_area, traversal_cost, intersection_cost);
+    }
+
+    /**
+     * Recompute the bounds of a subtree bottom-up from its elements, after applying \a updater to each element. Returns the
+     * tight bounding box of the subtree, before it is expanded to handle numerical error.
+     */
+    template <typename ElementUpdaterT>
+    AxisAlignedBoxT refitSubtree(Node * start, ElementUpdaterT const & updater)
+    {
+      AxisAlignedBoxT tight_bounds;
+      if (!start->lo)  // leaf
+      {
+        AxisAlignedBoxT elem_bounds;
+        for (size_t i = 0; i < start->num_elems; ++i)
+        {
+          T & elem = elems[start->elems[i]];
+          updater(elem);
+          BoundedTraitsT::getBounds(elem, elem_bounds);
+          tight_bounds.merge(elem_bounds);
+        }
+      }
+      else
+      {
+        tight_bounds = refitSubtree(start->lo, updater);
+        tight_bounds.merge(refitSubtree(start->hi, updater));
+      }
+
+      setRefittedBounds(start, tight_bounds);
+      return tight_bounds;
+    }
+
+    /** Set the bounds of a refitted node, expanding them slightly as in construction to handle numerical error. */
+    static void setRefittedBounds(Node * node, AxisAlignedBoxT const & tight_bounds)
+    {
+      node->bounds = tight_bounds;
+      if (!tight_bounds.isNull())
+        node->bounds.scaleCentered(BOUNDS_EXPANSION_FACTOR);
+    }
+
+    /** Refits a set of disjoint subtrees. Every subtree task is handled by exactly one refitter. */
+    template <typename ElementUpdaterT>
+    class SubtreeRefitter
+    {
+      public:
+        /** Constructor. */
+        SubtreeRefitter(KDTreeN * tree_, Array<Node *> const * tasks_, Array<AxisAlignedBoxT> * task_bounds_,
+                        std::atomic<size_t> * next_task_, ElementUpdaterT const * updater_)
+        : tree(tree_), tasks(tasks_), task_bounds(task_bounds_), next_task(next_task_), updater(updater_)
+        {}
+
+        /** Main function, called once per thread. */
+        void operator()()
+        {
+          for (size_t t = (*next_task)++; t < tasks->size(); t = (*next_task)++)
+            (*task_bounds)[t] = tree->refitSubtree((*tasks)[t], *updater);
+        }
+
+      private:
+        KDTreeN * tree;
+        Array<Node *> const * tasks;
+        Array<AxisAlignedBoxT> * task_bounds;
+        std::atomic<size_t> * next_task;
+        ElementUpdaterT const * updater;
+
+    }; // class SubtreeRefitter
+
+    /**
+     * Refit the tree in parallel. The subtrees rooted at a fixed depth (and any shallower leaves) are distributed among the
+     * threads, and the nodes above them are then refitted serially.
+     */
+    template <typename ElementUpdaterT>
+    void refitParallel(ElementUpdaterT const & updater, intx num_threads)
+    {
+      static intx const TASKS_PER_THREAD = 4;
+      intx task_depth = 0;
+      while ((intx)1 << task_depth < TASKS_PER_THREAD * num_threads)
+        task_depth++;
+
+      Array<Node *> tasks;
+      collectRefitTasks(root, task_depth, tasks);
+
+      Array<AxisAlignedBoxT> task_bounds(tasks.size());
+      std::atomic<size_t> next_task(0);
+      size_t num_workers = std::min((size_t)num_threads, tasks.size());
+      ThreadGroup pool;
+      for (size_t i = 0; i < num_workers; ++i)
+        pool.addThread(new std::thread(SubtreeRefitter<ElementUpdaterT>(this, &tasks, &task_bounds, &next_task, &updater)));
+
+      pool.joinAll();
+
+      size_t next_bounds = 0;
+      refitUpperLevels(root, task_depth, task_bounds, next_bounds);
+    }
+
+    /** Collect, in depth-first order, the nodes at depth \a task_depth and the leaves above it. */
+    static void collectRefitTasks(Node * start, intx task_depth, Array<Node *> & tasks)
+    {
+      if (!start->lo || start->depth >= task_depth)
+        tasks.push_back(start);
+      else
+      {
+        collectRefitTasks(start->lo, task_depth, tasks);
+        collectRefitTasks(start->hi, task_depth, tasks);
+      }
+    }
+
+    /**
+     * Refit the nodes above the subtrees collected by collectRefitTasks(), given the tight bounds of the subtrees in the same
+     * depth-first order. Returns the tight bounds of the subtree rooted at \a start.
+     */
+    static AxisAlignedBoxT refitUpperLevels(Node * start, intx task_depth, Array<AxisAlignedBoxT> const & task_bounds,
+                                            size_t & next_bounds)
+    {
+      if (!start->lo || start->depth >= task_depth)
+        return task_bounds[next_bounds++];
+
+      AxisAlignedBoxT tight_bounds = refitUpperLevels(start->lo, task_depth, task_bounds, next_bounds);
+      tight_bounds.merge(refitUpperLevels(start->hi, task_depth, task_bounds, next_bounds));
+
+      setRefittedBounds(start, tight_bounds);
+      return tight_bounds;
+    }
+
+    /**
+     * Builds a set of disjoint subtrees of a tree under construction, each with its own memory pools. Used for parallel
+     * construction. Every subtree task is handled by exactly one builder, and a builder may process several tasks one after the
+     * other.
+     */
+    class SubtreeBuilder
+    {
+      public:
+        /** Constructor. */
+        SubtreeBuilder(KDTreeN * tree_, Array<Node *> const * tasks_, std::atomic<size_t> * next_task_, bool save_memory_,
+                       NodePool * subtree_node_pool_, IndexPool * subtree_index_pool_, size_t scratch_capacity_,
+                       intx * subtree_num_nodes_)
+        : tree(tree_), tasks(tasks_), next_task(next_task_), save_memory(save_memory_),
+          subtree_node_pool(subtree_node_pool_), subtree_index_pool(subtree_index_pool_), scratch_capacity(scratch_capacity_),
+          subtree_num_nodes(subtree_num_nodes_)
+        {}
+
+        /** Main function, called once per thread. */
+        void operator()()
+        {
+          if (save_memory)
+          {
+            // Each subtree is built depth-first in a private scratch pool, from which it is fully freed after construction
+            IndexPool scratch_pool;
+            scratch_pool.init(scratch_capacity);
+
+            for (size_t t = (*next_task)++; t < tasks->size(); t = (*next_task)++)
+            {
+              Node * task = (*tasks)[t];
+              ElementIndex * task_elems = scratch_pool.alloc(task->num_elems);
+              std::memcpy(task_elems, task->elems, task->num_elems * sizeof(ElementIndex));
+              task->elems = task_elems;
+
+              tree->createTree(task, true, &scratch_pool, subtree_index_pool, subtree_node_pool, subtree_num_nodes);
+            }
+          }
+          else
+          {
+            for (size_t t = (*next_task)++; t < tasks->size(); t = (*next_task)++)
+              tree->createTree((*tasks)[t], false, subtree_index_pool, nullptr, subtree_node_pool, subtree_num_nodes);
+          }
+        }
+
+      private:
+        KDTreeN * tree;
+        Array<Node *> const * tasks;
+        std::atomic<size_t> * next_task;
+        bool save_memory;
+        NodePool * subtree_node_pool;
+        IndexPool * subtree_index_pool;
+        size_t scratch_capacity;
+        intx * subtree_num_nodes;
+
+    }; // class SubtreeBuilder
+
+    friend class SubtreeBuilder;
+
+    /**
+     * Construct the tree in parallel. The upper levels are split serially, till the remaining subtrees are small enough to be
+     * distributed as tasks among \a num_threads worker threads. Each worker allocates nodes, and indices of elements in its
+     * subtrees, from its own pools, which are retained by the tree till it is cleared. The structure of the resulting tree is
+     * identical to that produced by createTree(). The parameters have the same meaning as in createTree().
+     */
+    void createTreeParallel(Node * root_, bool save_memory, IndexPool * main_index_pool, IndexPool * leaf_index_pool,
+                            intx num_threads, bool deallocate_previous_memory)
+    {
+      // Generate a few tasks per thread for better load balancing, but don't bother with very small subtrees
+      static size_t const MIN_TASK_ELEMS = 2048;
+      static size_t const TASKS_PER_THREAD = 4;
+      size_t task_elems = std::max(MIN_TASK_ELEMS, (size_t)num_elems / (TASKS_PER_THREAD * (size_t)num_threads));
+
+      Array<Node *> tasks, upper_inner_nodes;
+      splitUpperLevels(root_, save_memory, main_index_pool, leaf_index_pool, task_elems, tasks, upper_inner_nodes);
+
+      if (tasks.size() <= 1)
+      {
+        // Not worth the overhead of threading
+        if (!tasks.empty())
+        {
+          Node * task = tasks[0];
+          if (save_memory)
+          {
+            // The subtree's indices may not be last in the main pool, so shift them to the end
+            ElementIndex * task_elems_copy = main_index_pool->alloc(task->num_elems);
+            std::memcpy(task_elems_copy, task->elems, task->num_elems * sizeof(ElementIndex));
+            task->elems = task_elems_copy;
+          }
+
+          createTree(task, save_memory, main_index_pool, leaf_index_pool);
+        }
+      }
+      else
+      {
+        // Size the per-worker pools for the largest possible task
+        static double const SPLIT_FRACTION = 0.5;
+        static size_t const BUFFER_SAFETY_MARGIN = 10;
+        intx est_task_depth = std::min(Math::binaryTreeDepth((intx)task_elems, (int)max_elems_per_leaf, SPLIT_FRACTION),
+                                       (int)max_depth);
+        size_t node_capacity = (size_t)(1 << est_task_depth) + BUFFER_SAFETY_MARGIN;
+        size_t index_capacity = (task_elems + BUFFER_SAFETY_MARGIN) * (save_memory ? 1 : (size_t)(1 + est_task_depth));
+        size_t scratch_capacity = (size_t)(task_elems * (1 + 1 / (1 - SPLIT_FRACTION))) + BUFFER_SAFETY_MARGIN;
+
+        size_t num_workers = std::min((size_t)num_threads, tasks.size());
+        while (build_node_pools.size() < num_workers)
+        {
+          build_node_pools.push_back(new NodePool);
+          build_index_pools.push_back(new IndexPool);
+        }
+
+        for (size_t i = 0; i < num_workers; ++i)
+        {
+          if (deallocate_previous_memory || node_capacity > 1.3 * build_node_pools[i]->getBufferCapacity())
+            build_node_pools[i]->init(node_capacity);
+
+          if (deallocate_previous_memory || index_capacity > 1.3 * build_index_pools[i]->getBufferCapacity())
+            build_index_pools[i]->init(index_capacity);
+        }
+
+        std::atomic<size_t> next_task(0);
+        Array<intx> worker_num_nodes(num_workers, 0);
+        ThreadGroup pool;
+        for (size_t i = 0; i < num_workers; ++i)
+        {
+          pool.addThread(new std::thread(SubtreeBuilder(this, &tasks, &next_task, save_memory, build_node_pools[i],
+                                                        build_index_pools[i], scratch_capacity, &worker_num_nodes[i])));
+        }
+
+        pool.joinAll();
+
+        for (size_t i = 0; i < num_workers; ++i)
+          num_nodes += worker_num_nodes[i];
+      }
+
+      // In memory-saving mode, only the leaves retain indices. The scratch storage of the upper levels is released with the
+      // main index pool.
+      if (save_memory)
+      {
+        for (size_t i = 0; i < upper_inner_nodes.size(); ++i)
+        {
+          upper_inner_nodes[i]->num_elems = 0;
+          upper_inner_nodes[i]->elems = nullptr;
+        }
+      }
+    }
+
+    /**
+     * Serially split the upper levels of the tree under construction, collecting subtrees with at most \a task_elems elements
+     * that still need to be split, as well as the internal nodes that are created. Unlike createTree(), no indices are freed from
+     * \a main_index_pool in memory-saving mode: instead, the indices of leaves are copied to \a leaf_index_pool.
+     */
+    void splitUpperLevels(Node * start, bool save_memory, IndexPool * main_index_pool, IndexPool * leaf_index_pool,
+                          size_t task_elems, Array<Node *> & tasks, Array<Node *> & upper_inner_nodes)
+    {
+      if (isLeafOnConstruction(start))
+      {
+        if (save_memory && start)
+        {
+          ElementIndex * leaf_indices_start = leaf_index_pool->alloc(start->num_elems);
+          std::memcpy(leaf_indices_start, start->elems, start->num_elems * sizeof(ElementIndex));
+          start->elems = leaf_indices_start;
+        }
+
+        return;
+      }
+
+      if (start->num_elems <= task_elems)
+      {
+        tasks.push_back(start);
+        return;
+      }
+
+      splitNode(start, main_index_pool, &node_pool, &num_nodes);
+      upper_inner_nodes.push_back(start);
+
+      splitUpperLevels(start->hi, save_memory, main_index_pool, leaf_index_pool, task_elems, tasks, upper_inner_nodes);
+      splitUpperLevels(start->lo, save_memory, main_index_pool, leaf_index_pool, task_elems, tasks, upper_inner_nodes);
+    }
+
+    /** Clear the additional memory pools used for parallel construction, optionally deallocating them. */
+    void clearBuildPools(bool deallocate_all_memory)
+    {
+      for (size_t i = 0; i < build_node_pools.size(); ++i)
+      {
+        if (deallocate_all_memory)
+        {
+          delete build_node_pools[i];
+          delete build_index_pools[i];
+        }
+        else
+        {
+          build_node_pools[i]->clear(false);
+          build_index_pools[i]->clear(false);
+        }
+      }
+
+      if (deallocate_all_memory)
+      {
+        build_node_pools.clear();
+        build_index_pools.clear();
+      }
+    }
+
+    /**
+     * Construct the tree by sorting the elements along a Morton (Z-order) curve through their centers, and splitting each node at
+     * the highest bit in which the Morton codes of its first and last elements differ. All nodes reference consecutive ranges of
+     * the root's index array, so no indices are copied. In memory-saving mode, internal nodes simply drop their references. The
+     * codes are computed and sorted in parallel if \a num_threads > 1.
+     */
+    void createTreeMorton(Node * root_, bool save_memory, intx num_threads)
+    {
+      static size_t const MIN_PARALLEL_ELEMS = 4096;
+
+      size_t n = root_->num_elems;
+      if (n < MIN_PARALLEL_ELEMS)
+        num_threads = 1;
+
+      // Quantize each coordinate of the center to as many bits as fit in 63 bits for all axes
+      static int const MAX_CODE_BITS = 63;
+      int num_axes = std::min(N, MAX_CODE_BITS);
+      int bits_per_axis = std::min(21, MAX_CODE_BITS / num_axes);
+
+      AxisAlignedBoxT center_bounds;
+      for (size_t i = 0; i < n; ++i)
+        center_bounds.merge(BoundedTraitsT::getCenter(elems[root_->elems[i]]));
+
+      VectorT scale;
+      VectorT ext = center_bounds.getExtent();
+      ScalarT max_cell = (ScalarT)(((uint64)1 << bits_per_axis) - 1);
+      for (intx i = 0; i < N; ++i)
+        scale[i] = (ext[i] > 0 ? max_cell / ext[i] : 0);
+
+      Array<uint64> codes(n);
+      if (num_threads > 1)
+      {
+        ThreadGroup pool;
+        for (intx t = 0; t < num_threads; ++t)
+        {
+          size_t begin = n * (size_t)t / (size_t)num_threads, end = n * (size_t)(t + 1) / (size_t)num_threads;
+          pool.addThread(new std::thread(MortonEncoder(this, center_bounds.getLow(), scale, num_axes, bits_per_axis,
+                                                       root_->elems, codes.data(), begin, end)));
+        }
+
+        pool.joinAll();
+      }
+      else
+        MortonEncoder(this, center_bounds.getLow(), scale, num_axes, bits_per_axis, root_->elems, codes.data(), 0, n)();
+
+      KDTreeNInternal::RadixSorter<ElementIndex>::sort(codes.data(), root_->elems, n, num_axes * bits_per_axis, num_threads);
+
+      splitMorton(root_, codes.data(), save_memory);
+
+      // Compute the node bounds bottom-up
+      if (num_threads > 1)
+        refitParallel(NullElementUpdater(), num_threads);
+      else
+        refitSubtree(root_, NullElementUpdater());
+    }
+
+    /** Get the Morton code of a point, given the low corner and per-axis quantization scale of the bounding box of all points. */
+    static uint64 mortonCode(VectorT const & p, VectorT const & lo, VectorT const & scale, int num_axes, int bits_per_axis)
+    {
+      uint64 max_cell = ((uint64)1 << bits_per_axis) - 1;
+      uint64 cells[N];
+      for (int i = 0; i < num_axes; ++i)
+      {
+        ScalarT c = (p[i] - lo[i]) * scale[i];
+        cells[i] = (c <= 0 ? 0 : std::min((uint64)c, max_cell));
+      }
+
+      if (N == 3 && bits_per_axis == 21)
+        return (spreadBits3(cells[0]) << 2) | (spreadBits3(cells[1]) << 1) | spreadBits3(cells[2]);
+
+      // Interleave the bits of the cells, from the most significant bit of the first axis down
+      uint64 code = 0;
+      for (int b = bits_per_axis - 1; b >= 0; --b)
+        for (int i = 0; i < num_axes; ++i)
+          code = (code << 1) | ((cells[i] >> b) & 1);
+
+      return code;
+    }
+
+    /** Spread the lowest 21 bits of a number so that there are two zero bits between every pair of consecutive bits. */
+    static uint64 spreadBits3(uint64 x)
+    {
+      x &= 0x1fffff;
+      x = (x | (x << 32)) & 0x001f00000000ffffULL;
+      x = (x | (x << 16)) & 0x001f0000ff0000ffULL;
+      x = (x | (x <<  8)) & 0x100f00f00f00f00fULL;
+      x = (x | (x <<  4)) & 0x10c30c30c30c30c3ULL;
+      x = (x | (x <<  2)) & 0x1249249249249249ULL;
+      return x;
+    }
+
+    /** Computes the Morton codes of the centers of a contiguous block of elements. */
+    class MortonEncoder
+    {
+      public:
+        /** Constructor. */
+        MortonEncoder(KDTreeN const * tree_, VectorT const & lo_, VectorT const & scale_, int num_axes_, int bits_per_axis_,
+                      ElementIndex const * indices_, uint64 * codes_, size_t begin_, size_t end_)
+        : tree(tree_), lo(lo_), scale(scale_), num_axes(num_axes_), bits_per_axis(bits_per_axis_), indices(indices_),
+          codes(codes_), begin(begin_), end(end_)
+        {}
+
+        /** Main function, called once per thread. */
+        void operator()()
+        {
+          for (size_t i = begin; i < end; ++i)
+            codes[i] = mortonCode(BoundedTraitsT::getCenter(tree->elems[indices[i]]), lo, scale, num_axes, bits_per_axis);
+        }
+
+      private:
+        KDTreeN const * tree;
+        VectorT lo;
+        VectorT scale;
+        int num_axes;
+        int bits_per_axis;
+        ElementIndex const * indices;
+        uint64 * codes;
+        size_t begin;
+        size_t end;
+
+    }; // class MortonEncoder
+
+    /**
+     * Recursively split a node whose elements are sorted by the Morton codes \a codes, which are aligned with the node's
+     * element indices. Nodes whose elements all have the same code are split in the middle.
+     */
+    void splitMorton(Node * start, uint64 const * codes, bool save_memory)
+    {
+      if (isLeafOnConstruction(start))
+        return;
+
+      size_t n = start->num_elems;
+      size_t num_lo = n / 2;
+      uint64 diff = codes[0] ^ codes[n - 1];
+      if (diff != 0)
+      {
+        // Isolate the highest differing bit. All codes in the range share the bits above it, and the first code with this bit
+        // set starts the high child.
+        while (diff & (diff - 1))
+          diff &= diff - 1;
+
+        uint64 first_hi = (codes[0] | diff) & ~(diff - 1);
+        num_lo = (size_t)(std::lower_bound(codes, codes + n, first_hi) - codes);
+      }
+
+      start->lo = node_pool.alloc(1);
+      start->lo->init(start->depth + 1);
+      start->lo->num_elems = num_lo;
+      start->lo->elems = start->elems;
+
+      start->hi = node_pool.alloc(1);
+      start->hi->init(start->depth + 1);
+      start->hi->num_elems = n - num_lo;
+      start->hi->elems = start->elems + num_lo;
+
+      num_nodes += 2;
+
+      splitMorton(start->lo, codes, save_memory);
+      splitMorton(start->hi, codes + num_lo, save_memory);
+
+      if (save_memory)
+      {
+        start->num_elems = 0;
+        start->elems = nullptr;
+      }
+    }
+
+  protected:
+    /** Mark that the bounding box requires an update. */
+    void invalidateBounds()
+    {
+      valid_bounds = false;
+    }
+
+    /** Recompute the bounding box if it has been invalidated. */
+    void updateBounds() const
+    {
+      if (valid_bounds) return;
+
+      if (root)
+      {
+        bounds = TransformableBaseT::hasTransform()
+               ? root->bounds.transformAndBound(TransformableBaseT::getTransform())
+               : root->bounds;
+      }
+      else
+      {
+        bounds = AxisAlignedBoxT();
+      }
+
+      valid_bounds = true;
+    }
+
+    /** An element updater for refitElements() that does nothing. */
+    struct NullElementUpdater
+    {
+      void operator()(T & elem) const {}
+    };
+
+    /**
+     * Apply a functor to every element, and then refit the tree as in refit(). The functor is called as
+     * <tt>updater(T & elem)</tt> exactly once per element, and may be called from several threads at once, but never on the same
+     * element. Useful for updating properties cached by the elements, e.g. the planes of triangles whose vertices have moved.
+     */
+    template <typename ElementUpdaterT>
+    double refitElements(ElementUpdaterT const & updater, bool compute_quality)
+    {
+      if (!root) return compute_quality ? 1 : -1;
+
+      // Record the cost of the tree as built, before its bounds are first overwritten
+      if (build_traversal_cost < 0)
+        build_traversal_cost = expectedTraversalCost();
+
+      static intx const MIN_PARALLEL_REFIT_ELEMS = 4096;
+      intx num_threads = (max_build_threads < 0 ? System::concurrency() : max_build_threads);
+      if (num_threads > 1 && num_elems >= MIN_PARALLEL_REFIT_ELEMS)
+        refitParallel(updater, num_threads);
+      else
+        refitSubtree(root, updater);
+
+      updateNodeAggregates(root);
+      clearAccelerationStructure(false);  // the samples may have moved
+      invalidateBounds();
+
+      if (!compute_quality)
+        return -1;
+
+      return build_traversal_cost > 0 ? expectedTraversalCost() / build_traversal_cost : 1;
+    }
+
+    /** Check if an element passes all filters currently on the stack, as well as the per-query filter (if not null). */
+    bool elementPassesFilters(T const & elem, Filter<T> const * query_filter) const
+    {
+      if (query_filter && !query_filter->allows(elem))
+        return false;
+
+      if (filters.empty()) return true;  // early exit
+
+      for (typename FilterStack::const_iterator fi = filters.begin(); fi != filters.end(); ++fi)
+        if (!(*fi)->allows(elem))
+          return false;
+
+      return true;
+    }
+
+    /** Get the bounding box for an object, if it is bounded. */
+    template < typename U, typename std::enable_if< IsBoundedN<U, N>::value, int >::type = 0 >
+    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    {
+      BoundedTraitsN<U, N, ScalarT>::getBounds(u, bounds);
+    }
+
+    /** Returns a null bounding box for unbounded objects. */
+    template < typename U, typename std::enable_if< !IsBoundedN<U, N>::value, int >::type = 0 >
+    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    {
+      bounds.setNull();
+    }
+
+    /**
+     * Get a lower bound on (the monotone approximation to) the distance between the bounding box of a kd-tree node and a
+     * bounded query object, or a negative value if no such lower bound can be calculated.
+     */
+    template < typename MetricT, typename QueryT, typename std::enable_if< IsBoundedN<QueryT, N>::value, int >::type = 0 >
+    double monotonePruningDistance(Node const * node, QueryT const & query, AxisAlignedBoxT query_bounds) const
+    {
+      if (node && !query_bounds.isNull())
+        return MetricT::template monotoneApproxDistance<N, ScalarT>(query_bounds, getBoundsWorldSpace(*node));
       else
         return -1;
     }
 
     /**
-     * Get a lower bound on (the monotone approximation to) the distance between the bounding box of a kd-tree node and an
-     * unbounded query object, or a negative value if no such lower bound can be calculated. \a query_bounds is ignored.
+     * Get a lower bound on (the monotone approximation to) the distance between the bounding box of a kd-tree node and an
+     * unbounded query object, or a negative value if no such lower bound can be calculated. \a query_bounds is ignored.
+     */
+    template < typename MetricT, typename QueryT, typename std::enable_if< !IsBoundedN<QueryT, N>::value, int >::type = 0 >
+    double monotonePruningDistance(Node const * node, QueryT const & query, AxisAlignedBoxT query_bounds) const
+    {
+      // Assume the following specialization exists
+      return node ? MetricT::template monotoneApproxDistance<N, ScalarT>(query, getBoundsWorldSpace(*node)) : -1;
+    }
+
+    /** Get a bounding box for a node, in world space. */
+    AxisAlignedBoxT getBoundsWorldSpace(Node const & node) const
+    {
+      return TransformableBaseT::hasTransform()
+           ? node.bounds.transformAndBound(TransformableBaseT::getTransform())
+           : node.bounds;
+    }
+
+    /**
+     * Recursively look for the closest pair of points between two elements. Only pairs separated by less than the current
+     * minimum distance (as stored in \a pair) will be considered. If \a get_closest_points is true, the positions of the
+     * closest pair of points will be stored in \a pair, not just the distance between them. Elements not allowed by \a filter
+     * (if not null) are ignored.
+     */
+    template <typename MetricT, typename QueryT>
+    void closestPair(Node const * start, QueryT const & query, AxisAlignedBoxT const & query_bounds, NeighborPair & pair,
+                     bool get_closest_points, Filter<T> const * filter) const
+    {
+      if (!start->lo)  // leaf
+        closestPairLeaf<MetricT>(start, query, pair, get_closest_points, filter);
+      else  // not leaf
+      {
+        // Figure out which child is closer (optimize for point queries?)
+        Node const * n[2] = { start->lo, start->hi };
+        double mad[2] = { monotonePruningDistance<MetricT>(n[0], query, query_bounds),
+                          monotonePruningDistance<MetricT>(n[1], query, query_bounds) };
+
+        // The smaller non-negative value should be first
+        if (mad[1] >= 0 && (mad[0] < 0 || mad[0] > mad[1]))
+        {
+          std::swap(n[0], n[1]);
+          std::swap(mad[0], mad[1]);
+        }
+
+        for (int i = 0; i < 2; ++i)
+          if (pair.getMonotoneApproxDistance() < 0 || mad[i] <= pair.getMonotoneApproxDistance())
+            closestPair<MetricT>(n[i], query, query_bounds, pair, get_closest_points, filter);
+      }
+    }
+
+  private:
+    /**
+     * Search the elements in a leaf node for the one closest to another element, when the latter is a proximity query
+     * structure.
+     */
+    template < typename MetricT, typename QueryT,
+               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void closestPairLeaf(
+      Node const * leaf,
+      QueryT const & query,
+      NeighborPair & pair,
+      bool get_closest_points,
+      Filter<T> const * filter) const
+    {
+      for (size_t i = 0; i < leaf->num_elems; ++i)
+      {
+        ElementIndex index = leaf->elems[i];
+        Element const & elem = elems[index];
+
+        if (!elementPassesFilters(elem, filter))
+          continue;
+
+        NeighborPair swapped;
+        if (TransformableBaseT::hasTransform())
+          swapped = query.template closestPair<MetricT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
+                                                        pair.getMonotoneApproxDistance(), get_closest_points);
+        else
+          swapped = query.template closestPair<MetricT>(elem, pair.getMonotoneApproxDistance(), get_closest_points);
+
+        if (swapped.isValid())
+        {
+          pair = swapped.swapped();
+          pair.setTargetIndex((intx)index);
+        }
+      }
+    }
+
+    /**
+     * Search the elements in a leaf node for the one closest to another element, when the latter is NOT a proximity query
+     * structure.
+     */
+    template < typename MetricT, typename QueryT,
+               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void closestPairLeaf(
+      Node const * leaf,
+      QueryT const & query,
+      NeighborPair & pair,
+      bool get_closest_points,
+      Filter<T> const * filter) const
+    {
+      VectorT qp = VectorT::Zero(), tp = VectorT::Zero();  // initialize to squash uninitialized variable warning
+      double mad;
+
+      for (size_t i = 0; i < leaf->num_elems; ++i)
+      {
+        ElementIndex index = leaf->elems[i];
+        Element const & elem = elems[index];
+
+        if (!elementPassesFilters(elem, filter))
+          continue;
+
+        if (TransformableBaseT::hasTransform())
+          mad = MetricT::template closestPoints<N, ScalarT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
+                                                            query, tp, qp);
+        else
+          mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+
+        if (pair.getMonotoneApproxDistance() < 0 || mad <= pair.getMonotoneApproxDistance())
+          pair = NeighborPair(0, (intx)index, mad, qp, tp);
+      }
+    }
+
+  protected:
+    /**
+     * Recursively look for the k closest elements to a query object. Only elements at less than the specified maximum distance
+     * \a dist_bound will be considered. If \a get_closest_points is true, the positions of the closest pair of points will be
+     * stored with each pair, not just the distance between them. Elements not allowed by \a filter (if not null) are ignored.
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSet>
+    void kClosestPairs(Node const * start, QueryT const & query, AxisAlignedBoxT const & query_bounds,
+                       BoundedNeighborPairSet & k_closest_pairs, double dist_bound, bool get_closest_points,
+                       intx use_as_query_index_and_swap, Filter<T> const * filter) const
+    {
+      if (!start->lo)  // leaf
+        kClosestPairsLeaf<MetricT>(start, query, k_closest_pairs, dist_bound, get_closest_points, use_as_query_index_and_swap,
+                                   filter);
+      else  // not leaf
+      {
+        // Figure out which child is closer (optimize for point queries?)
+        Node const * n[2] = { start->lo, start->hi };
+        double mad[2] = { monotonePruningDistance<MetricT>(n[0], query, query_bounds),
+                          monotonePruningDistance<MetricT>(n[1], query, query_bounds) };
+
+        // The smaller non-negative value should be first
+        if (mad[1] >= 0 && (mad[0] < 0 || mad[0] > mad[1]))
+        {
+          std::swap(n[0], n[1]);
+          std::swap(mad[0], mad[1]);
+        }
+
+        double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+        for (int i = 0; i < 2; ++i)
+        {
+          if ((mon_approx_dist_bound < 0 || mad[i] <= mon_approx_dist_bound)
+            && k_closest_pairs.isInsertable(NeighborPair(0, 0, mad[i])))
+          {
+            kClosestPairs<MetricT>(n[i], query, query_bounds, k_closest_pairs, dist_bound, get_closest_points,
+                                   use_as_query_index_and_swap, filter);
+          }
+        }
+      }
+    }
+
+  private:
+    /**
+     * Search the elements in a leaf node for the k nearest neighbors of an object, when the latter is a proximity query
+     * structure of compatible type.
+     */
+    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSet,
+               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void kClosestPairsLeaf(
+      Node const * leaf,
+      QueryT const & query,
+      BoundedNeighborPairSet & k_closest_pairs,
+      double dist_bound,
+      bool get_closest_points,
+      intx use_as_query_index_and_swap,
+      Filter<T> const * filter) const
+    {
+      for (size_t i = 0; i < leaf->num_elems; ++i)
+      {
+        ElementIndex index = leaf->elems[i];
+        Element const & elem = elems[index];
+
+        if (!elementPassesFilters(elem, filter))
+          continue;
+
+        if (TransformableBaseT::hasTransform())
+          query.template kClosestPairs<MetricT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
+                                                                      k_closest_pairs, dist_bound, get_closest_points, false,
+                                                                      (intx)index);
+        else
+          query.template kClosestPairs<MetricT>(elem, k_closest_pairs, dist_bound, get_closest_points, false, (intx)index);
+      }
+    }
+
+    /**
+     * Search the elements in a leaf node for the one closest to another element, when the latter is NOT a proximity query
+     * structure.
      */
-    template < typename MetricT, typename QueryT, typename std::enable_if< !IsBoundedN<QueryT, N>::value, int >::type = 0 >
-    double monotonePruningDistance(Node const * node, QueryT const & query, AxisAlignedBoxT query_bounds) const
+    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSet,
+               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void kClosestPairsLeaf(
+      Node const * leaf,
+      QueryT const & query,
+      BoundedNeighborPairSet & k_closest_pairs,
+      double dist_bound,
+      bool get_closest_points,
+      intx use_as_query_index_and_swap,
+      Filter<T> const * filter) const
     {
-      // Assume the following specialization exists
-      return node ? MetricT::template monotoneApproxDistance<N, ScalarT>(query, getBoundsWorldSpace(*node)) : -1;
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+
+      std::equal_to<NeighborPair> eq_comp;
+      VectorT qp, tp;
+      double mad;
+
+      for (size_t i = 0; i < leaf->num_elems; ++i)
+      {
+        ElementIndex index = leaf->elems[i];
+        Element const & elem = elems[index];
+
+        if (!elementPassesFilters(elem, filter))
+          continue;
+
+        // Check if the element is already in the set of neighbors or not
+        NeighborPair pair = (use_as_query_index_and_swap >= 0 ? NeighborPair((intx)index, use_as_query_index_and_swap)
+                                                              : NeighborPair(0, (intx)index));
+        if (k_closest_pairs.contains(pair, eq_comp))  // already found
+          continue;
+
+        if (TransformableBaseT::hasTransform())
+          mad = MetricT::template closestPoints<N, ScalarT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
+                                                            query, tp, qp);
+        else
+          mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+
+        if (mon_approx_dist_bound < 0 || mad <= mon_approx_dist_bound)
+        {
+          pair.setMonotoneApproxDistance(mad);
+
+          if (get_closest_points)
+          {
+            if (use_as_query_index_and_swap >= 0)
+            {
+              pair.setQueryPoint(tp);
+              pair.setTargetPoint(qp);
+            }
+            else
+            {
+              pair.setQueryPoint(qp);
+              pair.setTargetPoint(tp);
+            }
+          }
+
+          k_closest_pairs.insert(pair);
+        }
+      }
     }
 
-    /** Get a bounding box for a node, in world space. */
-    AxisAlignedBoxT getBoundsWorldSpace(Node const & node) const
+    /** Compares neighbor pairs by (the monotone approximation to) their separation. */
+    struct NeighborPairDistanceLess
     {
-      return TransformableBaseT::hasTransform()
-           ? node.bounds.transformAndBound(TransformableBaseT::getTransform())
-           : node.bounds;
-    }
+      bool operator()(NeighborPair const & a, NeighborPair const & b) const
+      { return a.getMonotoneApproxDistance() < b.getMonotoneApproxDistance(); }
+    };
 
     /**
-     * Recursively look for the closest pair of points between two elements. Only pairs separated by less than the current
-     * minimum distance (as stored in \a pair) will be considered. If \a get_closest_points is true, the positions of the
-     * closest pair of points will be stored in \a pair, not just the distance between them.
+     * Recursively look for the k closest elements to a query object, maintaining the neighbors found so far in a max-heap.
+     * \a mad is a lower bound on the (monotone approximation to the) distance between the node and the query, or negative if
+     * unknown. Only elements within \a mon_approx_dist_bound (if it is non-negative) are considered.
      */
     template <typename MetricT, typename QueryT>
-    void closestPair(Node const * start, QueryT const & query, AxisAlignedBoxT const & query_bounds, NeighborPair & pair,
-                     bool get_closest_points) const
+    void kClosestPairsHeap(Node const * start, double mad, QueryT const & query, AxisAlignedBoxT const & query_bounds, intx k,
+                           Array<NeighborPair> & heap, double mon_approx_dist_bound, bool get_closest_points,
+                           Filter<T> const * filter) const
     {
-      if (!start->lo)  // leaf
-        closestPairLeaf<MetricT>(start, query, pair, get_closest_points);
-      else  // not leaf
+      // The distance an element must beat to be inserted
+      double bound = ((intx)heap.size() >= k ? heap.front().getMonotoneApproxDistance() : mon_approx_dist_bound);
+      if (bound >= 0 && mad > bound)
+        return;
+
+      if (start->lo)
       {
-        // Figure out which child is closer (optimize for point queries?)
+        // Visit the closer child first
         Node const * n[2] = { start->lo, start->hi };
-        double mad[2] = { monotonePruningDistance<MetricT>(n[0], query, query_bounds),
-                          monotonePruningDistance<MetricT>(n[1], query, query_bounds) };
-
-        // The smaller non-negative value should be first
-        if (mad[1] >= 0 && (mad[0] < 0 || mad[0] > mad[1]))
+        double child_mad[2] = { monotonePruningDistance<MetricT>(n[0], query, query_bounds),
+                                monotonePruningDistance<MetricT>(n[1], query, query_bounds) };
+        if (child_mad[1] >= 0 && (child_mad[0] < 0 || child_mad[0] > child_mad[1]))
         {
           std::swap(n[0], n[1]);
-          std::swap(mad[0], mad[1]);
+          std::swap(child_mad[0], child_mad[1]);
         }
 
         for (int i = 0; i < 2; ++i)
-          if (pair.getMonotoneApproxDistance() < 0 || mad[i] <= pair.getMonotoneApproxDistance())
-            closestPair<MetricT>(n[i], query, query_bounds, pair, get_closest_points);
+          kClosestPairsHeap<MetricT>(n[i], child_mad[i], query, query_bounds, k, heap, mon_approx_dist_bound,
+                                     get_closest_points, filter);
+
+        return;
+      }
+
+      // Each leaf is searched at most once, so the elements found here are not already in the heap
+      VectorT qp = VectorT::Zero(), tp = VectorT::Zero();
+      for (size_t i = 0; i < start->num_elems; ++i)
+      {
+        ElementIndex index = start->elems[i];
+        Element const & elem = elems[index];
+
+        if (!elementPassesFilters(elem, filter))
+          continue;
+
+        double elem_mad = TransformableBaseT::hasTransform()
+                        ? MetricT::template closestPoints<N, ScalarT>(
+                              makeTransformedObject(&elem, &TransformableBaseT::getTransform()), query, tp, qp)
+                        : MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+        if (bound >= 0 && elem_mad > bound)
+          continue;
+
+        NeighborPair pair = (get_closest_points ? NeighborPair(0, (intx)index, elem_mad, qp, tp)
+                                                : NeighborPair(0, (intx)index, elem_mad));
+        if ((intx)heap.size() >= k)
+        {
+          if (elem_mad >= heap.front().getMonotoneApproxDistance())
+            continue;
+
+          std::pop_heap(heap.begin(), heap.end(), NeighborPairDistanceLess());
+          heap.back() = pair;
+        }
+        else
+          heap.push_back(pair);
+
+        std::push_heap(heap.begin(), heap.end(), NeighborPairDistanceLess());
+        if ((intx)heap.size() >= k)
+          bound = heap.front().getMonotoneApproxDistance();
       }
     }
 
   private:
-    /**
-     * Search the elements in a leaf node for the one closest to another element, when the latter is a proximity query
-     * structure.
-     */
-    template < typename MetricT, typename QueryT,
-               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
-    void closestPairLeaf(
-      Node const * leaf,
-      QueryT const & query,
-      NeighborPair & pair,
-      bool get_closest_points) const
+    /** Test the elements of a leaf node as approximate nearest neighbors of a query object. */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSet>
+    void approxKClosestPairsLeaf(Node const * leaf, QueryT const & query, BoundedNeighborPairSet & k_closest_pairs,
+                                 double mon_approx_dist_bound, bool get_closest_points, QueryStats * stats,
+                                 Filter<T> const * filter) const
     {
+      // Each leaf is searched at most once, so the elements found here are not already in the set
+      VectorT qp = VectorT::Zero(), tp = VectorT::Zero();
+      double mad;
+
       for (size_t i = 0; i < leaf->num_elems; ++i)
       {
         ElementIndex index = leaf->elems[i];
         Element const & elem = elems[index];
 
-        if (!elementPassesFilters(elem))
+        if (!elementPassesFilters(elem, filter))
           continue;
 
-        NeighborPair swapped;
         if (TransformableBaseT::hasTransform())
-          swapped = query.template closestPair<MetricT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
-                                                        pair.getMonotoneApproxDistance(), get_closest_points);
+          mad = MetricT::template closestPoints<N, ScalarT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
+                                                            query, tp, qp);
         else
-          swapped = query.template closestPair<MetricT>(elem, pair.getMonotoneApproxDistance(), get_closest_points);
+          mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+
+        if (stats) stats->num_elems_tested++;
+
+        if (mon_approx_dist_bound >= 0 && mad > mon_approx_dist_bound)
+          continue;
+
+        NeighborPair pair(0, (intx)index, mad);
+        if (get_closest_points)
+        {
+          pair.setQueryPoint(qp);
+          pair.setTargetPoint(tp);
+        }
+
+        k_closest_pairs.insert(pair);
+      }
+    }
+
+    /**
+     * Data shared by the recursive steps of a dual-tree traversal of this tree (the query tree) and another kd-tree (the target
+     * tree).
+     */
+    template <typename E, typename S, typename A>
+    struct DualTreeState
+    {
+      typedef KDTreeN<E, N, S, A> TargetT;
+
+      DualTreeState(KDTreeN const & query_tree_, TargetT const & target_tree_, Filter<T> const * query_filter,
+                    Filter<E> const * target_filter, bool get_closest_points_)
+      : query_tree(query_tree_), target_tree(target_tree_), get_closest_points(get_closest_points_)
+      {
+        // Evaluate the filters once per element, instead of once per pair of elements
+        if (query_filter || !query_tree.filters.empty())
+        {
+          query_allowed.resize((size_t)query_tree.num_elems);
+          for (intx i = 0; i < query_tree.num_elems; ++i)
+            query_allowed[(size_t)i] = query_tree.elementPassesFilters(query_tree.elems[(size_t)i], query_filter);
+        }
+
+        if (target_filter || !target_tree.filters.empty())
+        {
+          target_allowed.resize((size_t)target_tree.num_elems);
+          for (intx i = 0; i < target_tree.num_elems; ++i)
+            target_allowed[(size_t)i] = target_tree.elementPassesFilters(target_tree.elems[(size_t)i], target_filter);
+        }
+      }
+
+      /** Check if an element of the query tree is allowed by the filters. */
+      bool queryAllowed(ElementIndex i) const { return query_allowed.empty() || query_allowed[(size_t)i]; }
+
+      /** Check if an element of the target tree is allowed by the filters. */
+      bool targetAllowed(typename TargetT::ElementIndex i) const { return target_allowed.empty() || target_allowed[(size_t)i]; }
+
+      /** Get (the monotone approximation to) the distance between the bounding boxes of a query node and a target node. */
+      template <typename MetricT>
+      double nodeDistance(Node const * q, typename TargetT::Node const * t) const
+      {
+        return MetricT::template monotoneApproxDistance<N, ScalarT>(query_tree.getBoundsWorldSpace(*q),
+                                                                    target_tree.getBoundsWorldSpace(*t));
+      }
+
+      /**
+       * Get (the monotone approximation to) the distance between an element of the query tree and an element of the target
+       * tree, and the closest pair of points on them.
+       */
+      template <typename MetricT>
+      double elementDistance(ElementIndex i, typename TargetT::ElementIndex j, VectorT & qp, VectorT & tp) const
+      {
+        T const & q = query_tree.elems[(size_t)i];
+        E const & t = target_tree.elems[(size_t)j];
+
+        if (query_tree.hasTransform())
+        {
+          if (target_tree.hasTransform())
+            return MetricT::template closestPoints<N, ScalarT>(makeTransformedObject(&q, &query_tree.getTransform()),
+                                                               makeTransformedObject(&t, &target_tree.getTransform()), qp, tp);
+          else
+            return MetricT::template closestPoints<N, ScalarT>(makeTransformedObject(&q, &query_tree.getTransform()), t, qp, tp);
+        }
+        else
+        {
+          if (target_tree.hasTransform())
+            return MetricT::template closestPoints<N, ScalarT>(q, makeTransformedObject(&t, &target_tree.getTransform()), qp, tp);
+          else
+            return MetricT::template closestPoints<N, ScalarT>(q, t, qp, tp);
+        }
+      }
+
+      /** Check if an element of the query tree intersects an element of the target tree. */
+      template <typename IntersectionTesterT>
+      bool elementsIntersect(ElementIndex i, typename TargetT::ElementIndex j) const
+      {
+        T const & q = query_tree.elems[(size_t)i];
+        E const & t = target_tree.elems[(size_t)j];
+
+        if (query_tree.hasTransform())
+        {
+          if (target_tree.hasTransform())
+            return IntersectionTesterT::template intersects<N, ScalarT>(
+                       makeTransformedObject(&q, &query_tree.getTransform()),
+                       makeTransformedObject(&t, &target_tree.getTransform()));
+          else
+            return IntersectionTesterT::template intersects<N, ScalarT>(makeTransformedObject(&q, &query_tree.getTransform()), t);
+        }
+        else
+        {
+          if (target_tree.hasTransform())
+            return IntersectionTesterT::template intersects<N, ScalarT>(q, makeTransformedObject(&t, &target_tree.getTransform()));
+          else
+            return IntersectionTesterT::template intersects<N, ScalarT>(q, t);
+        }
+      }
+
+      /** Get the bounding box, in world space, of an element of the query tree. */
+      AxisAlignedBoxT queryElementBounds(ElementIndex i) const
+      {
+        AxisAlignedBoxT bounds;
+        getObjectBounds(query_tree.elems[(size_t)i], bounds);
+        return query_tree.hasTransform() ? bounds.transformAndBound(query_tree.getTransform()) : bounds;
+      }
+
+      /** Get (the monotone approximation to) the distance between a box in world space and the bounds of a target node. */
+      template <typename MetricT>
+      double boxDistance(AxisAlignedBoxT const & q_bounds, typename TargetT::Node const * t) const
+      {
+        return MetricT::template monotoneApproxDistance<N, ScalarT>(q_bounds, target_tree.getBoundsWorldSpace(*t));
+      }
+
+      /**
+       * Get an upper bound on (the monotone approximation to) the distance from any element of a query leaf to its k'th
+       * nearest neighbor, given the neighbors found so far, or a negative value if no such bound is yet known.
+       */
+      template <typename BoundedNeighborPairSetT>
+      double leafNeighborBound(Node const * q, Array<BoundedNeighborPairSetT> const & k_closest_pairs) const
+      {
+        double bound = 0;
+        for (size_t i = 0; i < q->num_elems; ++i)
+        {
+          ElementIndex index = q->elems[i];
+          if (!queryAllowed(index)) continue;
+
+          BoundedNeighborPairSetT const & nbrs = k_closest_pairs[(size_t)index];
+          if (nbrs.size() <= 0 || nbrs.size() < nbrs.getCapacity())
+            return -1;
+
+          bound = std::max(bound, nbrs.last().getMonotoneApproxDistance());
+        }
+
+        return bound;
+      }
+
+      /** Compute the bounding boxes, in world space, of the elements of a query leaf. */
+      void cacheLeafElementBounds(Node const * q)
+      {
+        leaf_elem_bounds.resize(q->num_elems);
+        for (size_t i = 0; i < q->num_elems; ++i)
+        {
+          getObjectBounds(query_tree.elems[q->elems[i]], leaf_elem_bounds[i]);
+          if (query_tree.hasTransform())
+            leaf_elem_bounds[i] = leaf_elem_bounds[i].transformAndBound(query_tree.getTransform());
+        }
+      }
+
+      KDTreeN const & query_tree;
+      TargetT const & target_tree;
+      bool get_closest_points;
+      Array<bool> query_allowed;   ///< Flags for elements of the query tree allowed by the filters (empty if all are allowed).
+      Array<bool> target_allowed;  ///< Flags for elements of the target tree allowed by the filters (empty if all are allowed).
+      Array<AxisAlignedBoxT> leaf_elem_bounds;  ///< Bounding boxes of the elements of the current query leaf, in world space.
+
+    }; // struct DualTreeState
+
+    template <typename E, int N2, typename S, typename A> friend class KDTreeN;
+
+    /**
+     * Choose whether to split the query node or the target node of a pair in a dual-tree traversal. Leaves are never split,
+     * otherwise the node with the larger bounding box is split.
+     */
+    template <typename QueryNodeT, typename TargetNodeT>
+    static bool splitQueryNode(QueryNodeT const * q, TargetNodeT const * t)
+    {
+      if (q->isLeaf()) return false;
+      if (t->isLeaf()) return true;
+
+      return q->getBounds().getExtent().squaredNorm() >= t->getBounds().getExtent().squaredNorm();
+    }
+
+    /**
+     * Recursively find the k nearest neighbors in a target tree of the elements of a query subtree. \a mon_approx_dist_bound
+     * is an upper bound on the (monotone approximation to the) distance between neighbors, or negative if there is no bound.
+     *
+     * The query subtree is descended to its leaves, each of which searches the target tree for the neighbors of all its
+     * elements together. Splitting the target tree as well, when its nodes are larger, performs far worse in practice: the
+     * k'th-neighbor bounds of large query nodes stay loose until every one of their elements has k neighbors, so little is
+     * pruned.
+     */
+    template <typename MetricT, typename E, typename S, typename A, typename BoundedNeighborPairSetT>
+    void allKClosestPairs(Node const * q, typename KDTreeN<E, N, S, A>::Node const * target_root,
+                          DualTreeState<E, S, A> & state, double mon_approx_dist_bound,
+                          Array<BoundedNeighborPairSetT> & k_closest_pairs) const
+    {
+      if (q->lo)
+      {
+        allKClosestPairs<MetricT>(q->lo, target_root, state, mon_approx_dist_bound, k_closest_pairs);
+        allKClosestPairs<MetricT>(q->hi, target_root, state, mon_approx_dist_bound, k_closest_pairs);
+        return;
+      }
+
+      state.cacheLeafElementBounds(q);
+
+      AxisAlignedBoxT q_bounds = getBoundsWorldSpace(*q);
+      double mad = state.template boxDistance<MetricT>(q_bounds, target_root);
+      if (mon_approx_dist_bound >= 0 && mad > mon_approx_dist_bound)
+        return;
+
+      double leaf_bound = state.leafNeighborBound(q, k_closest_pairs);
+      leafKClosestPairs<MetricT>(q, q_bounds, target_root, mad, state, mon_approx_dist_bound, leaf_bound, k_closest_pairs);
+    }
+
+    /**
+     * Recursively find the k nearest neighbors in a target subtree of the elements of a query leaf. \a leaf_bound is the
+     * largest distance from an element of the leaf to its k'th nearest neighbor found so far (negative if some element does not
+     * yet have k neighbors), and is updated as neighbors are found.
+     */
+    template <typename MetricT, typename E, typename S, typename A, typename BoundedNeighborPairSetT>
+    void leafKClosestPairs(Node const * q, AxisAlignedBoxT const & q_bounds, typename KDTreeN<E, N, S, A>::Node const * t,
+                           double mad, DualTreeState<E, S, A> & state, double mon_approx_dist_bound, double & leaf_bound,
+                           Array<BoundedNeighborPairSetT> & k_closest_pairs) const
+    {
+      if (leaf_bound >= 0 && mad > leaf_bound)
+        return;
+
+      if (t->isLeaf())
+      {
+        AxisAlignedBoxT t_bounds = state.target_tree.getBoundsWorldSpace(*t);
+        VectorT qp = VectorT::Zero(), tp = VectorT::Zero();
+
+        for (size_t i = 0; i < q->num_elems; ++i)
+        {
+          ElementIndex qi = q->elems[i];
+          if (!state.queryAllowed(qi)) continue;
+
+          // Skip the element if the target leaf is too far from it to contain a new neighbor
+          BoundedNeighborPairSetT & nbrs = k_closest_pairs[(size_t)qi];
+          if (!nbrs.isInsertable(NeighborPair(0, 0, MetricT::template monotoneApproxDistance<N, ScalarT>(
+                                                          state.leaf_elem_bounds[i], t_bounds))))
+            continue;
+
+          // Each pair of leaves is visited at most once, so the pairs found here are not already in the set
+          for (intx j = 0; j < t->numElementIndices(); ++j)
+          {
+            typename KDTreeN<E, N, S, A>::ElementIndex ti = t->elementIndicesBegin()[j];
+            if (!state.targetAllowed(ti)) continue;
+
+            double elem_mad = state.template elementDistance<MetricT>(qi, ti, qp, tp);
+            if (mon_approx_dist_bound >= 0 && elem_mad > mon_approx_dist_bound)
+              continue;
+
+            NeighborPair pair((intx)qi, (intx)ti, elem_mad);
+            if (!nbrs.isInsertable(pair))
+              continue;
+
+            if (state.get_closest_points)
+            {
+              pair.setQueryPoint(qp);
+              pair.setTargetPoint(tp);
+            }
+
+            nbrs.insert(pair);
+          }
+        }
+
+        leaf_bound = state.leafNeighborBound(q, k_closest_pairs);
+        return;
+      }
+
+      // Visit the closer target child first, to tighten the bound sooner
+      typename KDTreeN<E, N, S, A>::Node const * n[2] = { t->getLowChild(), t->getHighChild() };
+      double child_mad[2] = { state.template boxDistance<MetricT>(q_bounds, n[0]),
+                              state.template boxDistance<MetricT>(q_bounds, n[1]) };
+      if (child_mad[1] < child_mad[0])
+      {
+        std::swap(n[0], n[1]);
+        std::swap(child_mad[0], child_mad[1]);
+      }
+
+      for (int i = 0; i < 2; ++i)
+        if (mon_approx_dist_bound < 0 || child_mad[i] <= mon_approx_dist_bound)
+          leafKClosestPairs<MetricT>(q, q_bounds, n[i], child_mad[i], state, mon_approx_dist_bound, leaf_bound,
+                                     k_closest_pairs);
+    }
+
+    /**
+     * Recursively look for the closest pair of elements between a query subtree and a target subtree. Only pairs separated by
+     * less than the current minimum distance (as stored in \a pair) will be considered.
+     */
+    template <typename MetricT, typename E, typename S, typename A>
+    void dualTreeClosestPair(Node const * q, typename KDTreeN<E, N, S, A>::Node const * t, DualTreeState<E, S, A> & state,
+                             NeighborPair & pair) const
+    {
+      typedef typename KDTreeN<E, N, S, A>::Node TargetNode;
 
-        if (swapped.isValid())
+      if (!q->lo && t->isLeaf())  // both leaves
+      {
+        VectorT qp = VectorT::Zero(), tp = VectorT::Zero();
+
+        for (size_t i = 0; i < q->num_elems; ++i)
         {
-          pair = swapped.swapped();
-          pair.setTargetIndex((intx)index);
+          ElementIndex qi = q->elems[i];
+          if (!state.queryAllowed(qi)) continue;
+
+          for (intx j = 0; j < t->numElementIndices(); ++j)
+          {
+            typename KDTreeN<E, N, S, A>::ElementIndex ti = t->elementIndicesBegin()[j];
+            if (!state.targetAllowed(ti)) continue;
+
+            double mad = state.template elementDistance<MetricT>(qi, ti, qp, tp);
+            if (pair.getMonotoneApproxDistance() < 0 || mad <= pair.getMonotoneApproxDistance())
+              pair = (state.get_closest_points ? NeighborPair((intx)qi, (intx)ti, mad, qp, tp)
+                                               : NeighborPair((intx)qi, (intx)ti, mad));
+          }
         }
+
+        return;
+      }
+
+      // Split one of the nodes, and visit the two resulting pairs in order of increasing separation
+      Node const * qn[2] = { q, q };
+      TargetNode const * tn[2] = { t, t };
+      if (splitQueryNode(q, t))
+      {
+        qn[0] = q->lo;
+        qn[1] = q->hi;
+      }
+      else
+      {
+        tn[0] = t->getLowChild();
+        tn[1] = t->getHighChild();
+      }
+
+      double mad[2] = { state.template nodeDistance<MetricT>(qn[0], tn[0]), state.template nodeDistance<MetricT>(qn[1], tn[1]) };
+      if (mad[1] < mad[0])
+      {
+        std::swap(qn[0], qn[1]);
+        std::swap(tn[0], tn[1]);
+        std::swap(mad[0], mad[1]);
       }
+
+      for (int i = 0; i < 2; ++i)
+        if (pair.getMonotoneApproxDistance() < 0 || mad[i] <= pair.getMonotoneApproxDistance())
+          dualTreeClosestPair<MetricT>(qn[i], tn[i], state, pair);
     }
 
     /**
-     * Search the elements in a leaf node for the one closest to another element, when the latter is NOT a proximity query
-     * structure.
+     * Recursively apply a functor to the pairs of intersecting elements of a query subtree and a target subtree, until the
+     * functor returns true. \a q_bounds and \a t_bounds are the bounding boxes of the two nodes in world space, which must
+     * intersect.
+     *
+     * @return True if the functor returned true on some pair, else false.
      */
-    template < typename MetricT, typename QueryT,
-               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
-    void closestPairLeaf(
-      Node const * leaf,
-      QueryT const & query,
-      NeighborPair & pair,
-      bool get_closest_points) const
+    template <typename IntersectionTesterT, typename E, typename S, typename A, typename FunctorT>
+    bool intersectingPairs(Node const * q, AxisAlignedBoxT const & q_bounds, typename KDTreeN<E, N, S, A>::Node const * t,
+                           AxisAlignedBoxT const & t_bounds, DualTreeState<E, S, A> & state, FunctorT & functor) const
     {
-      VectorT qp = VectorT::Zero(), tp = VectorT::Zero();  // initialize to squash uninitialized variable warning
-      double mad;
+      typedef typename KDTreeN<E, N, S, A>::Node TargetNode;
 
-      for (size_t i = 0; i < leaf->num_elems; ++i)
+      if (!q->lo && t->isLeaf())  // both leaves
       {
-        ElementIndex index = leaf->elems[i];
-        Element const & elem = elems[index];
+        for (size_t i = 0; i < q->num_elems; ++i)
+        {
+          ElementIndex qi = q->elems[i];
+          if (!state.queryAllowed(qi)) continue;
 
-        if (!elementPassesFilters(elem))
-          continue;
+          // Only elements overlapping the target leaf can intersect its elements
+          if (!state.queryElementBounds(qi).intersects(t_bounds))
+            continue;
 
-        if (TransformableBaseT::hasTransform())
-          mad = MetricT::template closestPoints<N, ScalarT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
-                                                            query, tp, qp);
-        else
-          mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+          for (intx j = 0; j < t->numElementIndices(); ++j)
+          {
+            typename KDTreeN<E, N, S, A>::ElementIndex ti = t->elementIndicesBegin()[j];
+            if (!state.targetAllowed(ti)) continue;
 
-        if (pair.getMonotoneApproxDistance() < 0 || mad <= pair.getMonotoneApproxDistance())
-          pair = NeighborPair(0, (intx)index, mad, qp, tp);
+            if (state.template elementsIntersect<IntersectionTesterT>(qi, ti))
+              if (functor((intx)qi, (intx)ti))
+                return true;
+          }
+        }
+
+        return false;
+      }
+
+      // Split one of the nodes, and recurse into the resulting pairs whose bounds intersect
+      if (splitQueryNode(q, t))
+      {
+        Node const * qn[2] = { q->lo, q->hi };
+        for (int i = 0; i < 2; ++i)
+        {
+          AxisAlignedBoxT child_bounds = getBoundsWorldSpace(*qn[i]);
+          if (child_bounds.intersects(t_bounds)
+           && intersectingPairs<IntersectionTesterT>(qn[i], child_bounds, t, t_bounds, state, functor))
+            return true;
+        }
+      }
+      else
+      {
+        TargetNode const * tn[2] = { t->getLowChild(), t->getHighChild() };
+        for (int i = 0; i < 2; ++i)
+        {
+          AxisAlignedBoxT child_bounds = state.target_tree.getBoundsWorldSpace(*tn[i]);
+          if (child_bounds.intersects(q_bounds)
+           && intersectingPairs<IntersectionTesterT>(q, q_bounds, tn[i], child_bounds, state, functor))
+            return true;
+        }
       }
+
+      return false;
     }
 
-  protected:
     /**
-     * Recursively look for the k closest elements to a query object. Only elements at less than the specified maximum distance
-     * \a dist_bound will be considered. If \a get_closest_points is true, the positions of the closest pair of points will be
-     * stored with each pair, not just the distance between them.
+     * Recursively look for a pair of elements of a query subtree and a target subtree separated by no more than
+     * \a mon_approx_max_dist (a monotone approximation to the distance threshold). The bounding boxes of the two nodes are
+     * assumed to be within this distance.
+     *
+     * @return True if such a pair was found, in which case it is stored in \a pair (if not null).
      */
-    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSet>
-    void kClosestPairs(Node const * start, QueryT const & query, AxisAlignedBoxT const & query_bounds,
-                       BoundedNeighborPairSet & k_closest_pairs, double dist_bound, bool get_closest_points,
-                       intx use_as_query_index_and_swap) const
+    template <typename MetricT, typename E, typename S, typename A>
+    bool withinDistance(Node const * q, typename KDTreeN<E, N, S, A>::Node const * t, DualTreeState<E, S, A> & state,
+                        double mon_approx_max_dist, NeighborPair * pair) const
     {
-      if (!start->lo)  // leaf
-        kClosestPairsLeaf<MetricT>(start, query, k_closest_pairs, dist_bound, get_closest_points, use_as_query_index_and_swap);
-      else  // not leaf
+      typedef typename KDTreeN<E, N, S, A>::Node TargetNode;
+
+      if (!q->lo && t->isLeaf())  // both leaves
       {
-        // Figure out which child is closer (optimize for point queries?)
-        Node const * n[2] = { start->lo, start->hi };
-        double mad[2] = { monotonePruningDistance<MetricT>(n[0], query, query_bounds),
-                          monotonePruningDistance<MetricT>(n[1], query, query_bounds) };
+        VectorT qp = VectorT::Zero(), tp = VectorT::Zero();
 
-        // The smaller non-negative value should be first
-        if (mad[1] >= 0 && (mad[0] < 0 || mad[0] > mad[1]))
+        for (size_t i = 0; i < q->num_elems; ++i)
         {
-          std::swap(n[0], n[1]);
-          std::swap(mad[0], mad[1]);
-        }
+          ElementIndex qi = q->elems[i];
+          if (!state.queryAllowed(qi)) continue;
 
-        double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
-        for (int i = 0; i < 2; ++i)
-        {
-          if ((mon_approx_dist_bound < 0 || mad[i] <= mon_approx_dist_bound)
-            && k_closest_pairs.isInsertable(NeighborPair(0, 0, mad[i])))
+          for (intx j = 0; j < t->numElementIndices(); ++j)
           {
-            kClosestPairs<MetricT>(n[i], query, query_bounds, k_closest_pairs, dist_bound, get_closest_points,
-                                   use_as_query_index_and_swap);
+            typename KDTreeN<E, N, S, A>::ElementIndex ti = t->elementIndicesBegin()[j];
+            if (!state.targetAllowed(ti)) continue;
+
+            double mad = state.template elementDistance<MetricT>(qi, ti, qp, tp);
+            if (mad <= mon_approx_max_dist)
+            {
+              if (pair) *pair = NeighborPair((intx)qi, (intx)ti, mad, qp, tp);
+              return true;
+            }
           }
         }
+
+        return false;
+      }
+
+      // Split one of the nodes, and visit the two resulting pairs in order of increasing separation, since the closer pair is
+      // more likely to yield an early exit
+      Node const * qn[2] = { q, q };
+      TargetNode const * tn[2] = { t, t };
+      if (splitQueryNode(q, t))
+      {
+        qn[0] = q->lo;
+        qn[1] = q->hi;
+      }
+      else
+      {
+        tn[0] = t->getLowChild();
+        tn[1] = t->getHighChild();
+      }
+
+      double mad[2] = { state.template nodeDistance<MetricT>(qn[0], tn[0]), state.template nodeDistance<MetricT>(qn[1], tn[1]) };
+      if (mad[1] < mad[0])
+      {
+        std::swap(qn[0], qn[1]);
+        std::swap(tn[0], tn[1]);
+        std::swap(mad[0], mad[1]);
       }
+
+      for (int i = 0; i < 2; ++i)
+        if (mad[i] <= mon_approx_max_dist && withinDistance<MetricT>(qn[i], tn[i], state, mon_approx_max_dist, pair))
+          return true;
+
+      return false;
     }
 
-  private:
     /**
-     * Search the elements in a leaf node for the k nearest neighbors of an object, when the latter is a proximity query
-     * structure of compatible type.
+     * Recursively compute (the monotone approximation to) the directed Hausdorff distance from a query subtree to a target
+     * tree, updating the largest nearest-neighbor distance found so far, \a mon_approx_max_min (negative if none has been
+     * found yet).
      */
-    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSet,
-               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
-    void kClosestPairsLeaf(
-      Node const * leaf,
-      QueryT const & query,
-      BoundedNeighborPairSet & k_closest_pairs,
-      double dist_bound,
-      bool get_closest_points,
-      intx use_as_query_index_and_swap) const
+    template <typename MetricT, typename E, typename S, typename A>
+    void hausdorffDistance(Node const * q, typename KDTreeN<E, N, S, A>::Node const * target_root,
+                           DualTreeState<E, S, A> & state, double & mon_approx_max_min) const
     {
-      for (size_t i = 0; i < leaf->num_elems; ++i)
+      if (q->lo)
       {
-        ElementIndex index = leaf->elems[i];
-        Element const & elem = elems[index];
+        hausdorffDistance<MetricT>(q->lo, target_root, state, mon_approx_max_min);
+        hausdorffDistance<MetricT>(q->hi, target_root, state, mon_approx_max_min);
+        return;
+      }
 
-        if (!elementPassesFilters(elem))
-          continue;
+      // Search the target for the nearest neighbors of all elements of the leaf at once
+      Array<ElementIndex> leaf_elems;
+      Array<double> nn_mad;
+      for (size_t i = 0; i < q->num_elems; ++i)
+        if (state.queryAllowed(q->elems[i]))
+        {
+          leaf_elems.push_back(q->elems[i]);
+          nn_mad.push_back(-1);
+        }
 
-        if (TransformableBaseT::hasTransform())
-          query.template kClosestPairs<MetricT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
-                                                                      k_closest_pairs, dist_bound, get_closest_points, false,
-                                                                      (intx)index);
-        else
-          query.template kClosestPairs<MetricT>(elem, k_closest_pairs, dist_bound, get_closest_points, false, (intx)index);
-      }
+      if (leaf_elems.empty())
+        return;
+
+      hausdorffLeaf<MetricT>(q, leaf_elems, nn_mad, target_root, state, mon_approx_max_min);
+
+      for (size_t i = 0; i < nn_mad.size(); ++i)
+        if (nn_mad[i] > mon_approx_max_min)
+          mon_approx_max_min = nn_mad[i];
     }
 
     /**
-     * Search the elements in a leaf node for the one closest to another element, when the latter is NOT a proximity query
-     * structure.
+     * Recursively update the nearest-neighbor distances of the elements of a query leaf, from a target subtree. The search is
+     * abandoned when no element of the leaf can have a nearest-neighbor distance larger than \a mon_approx_max_min, since then
+     * the leaf cannot increase the Hausdorff distance.
      */
-    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSet,
-               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
-    void kClosestPairsLeaf(
-      Node const * leaf,
-      QueryT const & query,
-      BoundedNeighborPairSet & k_closest_pairs,
-      double dist_bound,
-      bool get_closest_points,
-      intx use_as_query_index_and_swap) const
+    template <typename MetricT, typename E, typename S, typename A>
+    void hausdorffLeaf(Node const * q, Array<ElementIndex> const & leaf_elems, Array<double> & nn_mad,
+                       typename KDTreeN<E, N, S, A>::Node const * t, DualTreeState<E, S, A> & state,
+                       double mon_approx_max_min) const
     {
-      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
-
-      std::equal_to<NeighborPair> eq_comp;
-      VectorT qp, tp;
-      double mad;
+      typedef typename KDTreeN<E, N, S, A>::Node TargetNode;
 
-      for (size_t i = 0; i < leaf->num_elems; ++i)
+      // The largest nearest-neighbor distance any element of the leaf can still have
+      double leaf_bound = 0;
+      for (size_t i = 0; i < nn_mad.size(); ++i)
       {
-        ElementIndex index = leaf->elems[i];
-        Element const & elem = elems[index];
-
-        if (!elementPassesFilters(elem))
-          continue;
-
-        // Check if the element is already in the set of neighbors or not
-        NeighborPair pair = (use_as_query_index_and_swap >= 0 ? NeighborPair((intx)index, use_as_query_index_and_swap)
-                                                              : NeighborPair(0, (intx)index));
-        if (k_closest_pairs.contains(pair, eq_comp))  // already found
-          continue;
+        if (nn_mad[i] < 0) { leaf_bound = -1; break; }
+        leaf_bound = std::max(leaf_bound, nn_mad[i]);
+      }
 
-        if (TransformableBaseT::hasTransform())
-          mad = MetricT::template closestPoints<N, ScalarT>(makeTransformedObject(&elem, &TransformableBaseT::getTransform()),
-                                                            query, tp, qp);
-        else
-          mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+      if (leaf_bound >= 0 && (leaf_bound <= mon_approx_max_min || state.template nodeDistance<MetricT>(q, t) > leaf_bound))
+        return;
 
-        if (mon_approx_dist_bound < 0 || mad <= mon_approx_dist_bound)
+      if (t->isLeaf())
+      {
+        VectorT qp, tp;
+        for (size_t i = 0; i < leaf_elems.size(); ++i)
         {
-          pair.setMonotoneApproxDistance(mad);
+          // An element already closer to the target than the current Hausdorff distance cannot change the result
+          if (nn_mad[i] >= 0 && nn_mad[i] <= mon_approx_max_min)
+            continue;
 
-          if (get_closest_points)
+          for (intx j = 0; j < t->numElementIndices(); ++j)
           {
-            if (use_as_query_index_and_swap >= 0)
-            {
-              pair.setQueryPoint(tp);
-              pair.setTargetPoint(qp);
-            }
-            else
-            {
-              pair.setQueryPoint(qp);
-              pair.setTargetPoint(tp);
-            }
-          }
+            typename KDTreeN<E, N, S, A>::ElementIndex ti = t->elementIndicesBegin()[j];
+            if (!state.targetAllowed(ti)) continue;
 
-          k_closest_pairs.insert(pair);
+            double mad = state.template elementDistance<MetricT>(leaf_elems[i], ti, qp, tp);
+            if (nn_mad[i] < 0 || mad < nn_mad[i])
+              nn_mad[i] = mad;
+          }
         }
+
+        return;
       }
+
+      TargetNode const * n[2] = { t->getLowChild(), t->getHighChild() };
+      if (state.template nodeDistance<MetricT>(q, n[1]) < state.template nodeDistance<MetricT>(q, n[0]))
+        std::swap(n[0], n[1]);
+
+      hausdorffLeaf<MetricT>(q, leaf_elems, nn_mad, n[0], state, mon_approx_max_min);
+      hausdorffLeaf<MetricT>(q, leaf_elems, nn_mad, n[1], state, mon_approx_max_min);
     }
 
   protected:
@@ -1534,11 +4230,13 @@ class /* THEA_API */ KDTreeN
      * The RangeT class should support intersection queries with AxisAlignedBoxT and containment queries with VectorT and
      * AxisAlignedBoxT.
      *
+     * Elements not allowed by \a filter (if not null) are ignored.
+     *
      * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
      *   immediately after processing this object), else a negative value.
      */
     template <typename IntersectionTesterT, typename FunctorArgT, typename RangeT, typename FunctorT>
-    intx processRangeUntil(Node const * start, RangeT const & range, FunctorT functor)
+    intx processRangeUntil(Node const * start, RangeT const & range, FunctorT functor, Filter<T> const * filter)
     {
       // Early exit if the range and node are disjoint
       AxisAlignedBoxT tr_start_bounds = getBoundsWorldSpace(*start);
@@ -1554,7 +4252,7 @@ class /* THEA_API */ KDTreeN
           ElementIndex index = start->elems[i];
           Element & elem = elems[index];
 
-          if (!elementPassesFilters(elem))
+          if (!elementPassesFilters(elem, filter))
             continue;
 
           if (functor(static_cast<intx>(index), static_cast<FunctorArgT &>(elem)))
@@ -1568,7 +4266,7 @@ class /* THEA_API */ KDTreeN
           ElementIndex index = start->elems[i];
           Element & elem = elems[index];
 
-          if (!elementPassesFilters(elem))
+          if (!elementPassesFilters(elem, filter))
             continue;
 
           bool intersects = TransformableBaseT::hasTransform()
@@ -1582,15 +4280,115 @@ class /* THEA_API */ KDTreeN
       }
       else  // not leaf
       {
-        intx index = processRangeUntil<IntersectionTesterT, FunctorArgT>(start->lo, range, functor);
+        intx index = processRangeUntil<IntersectionTesterT, FunctorArgT>(start->lo, range, functor, filter);
         if (index >= 0) return index;
-        return processRangeUntil<IntersectionTesterT, FunctorArgT>(start->hi, range, functor);
+        return processRangeUntil<IntersectionTesterT, FunctorArgT>(start->hi, range, functor, filter);
       }
 
       return -1;
     }
 
-  private:
+    /**
+     * Recursively accumulate the aggregate statistics of the elements of a subtree that intersect a range. If
+     * \a use_node_aggregates is true, the precomputed aggregates of subtrees contained in the range are used directly.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeAggregate(Node const * start, RangeT const & range, Filter<T> const * filter, bool use_node_aggregates,
+                        Aggregate & result) const
+    {
+      AxisAlignedBoxT tr_start_bounds = getBoundsWorldSpace(*start);
+      if (!IntersectionTesterT::template intersects<N, ScalarT>(range, tr_start_bounds))
+        return;
+
+      if (range.contains(tr_start_bounds))
+      {
+        if (use_node_aggregates)
+        {
+          result.merge(*getNodeAggregate(*start, std::integral_constant<bool, HAS_NODE_AGGREGATES>()));
+          return;
+        }
+
+        // If there are element references at this node, all of them are in the range
+        if (start->num_elems > 0)
+        {
+          for (size_t i = 0; i < start->num_elems; ++i)
+          {
+            T const & elem = elems[start->elems[i]];
+            if (elementPassesFilters(elem, filter))
+              result.add(getCenterWorldSpace(elem));
+          }
+
+          return;
+        }
+      }
+
+      if (!start->lo)  // leaf
+      {
+        for (size_t i = 0; i < start->num_elems; ++i)
+        {
+          T const & elem = elems[start->elems[i]];
+          if (!elementPassesFilters(elem, filter))
+            continue;
+
+          bool intersects = TransformableBaseT::hasTransform()
+                          ? IntersectionTesterT::template intersects<N, ScalarT>(
+                                makeTransformedObject(&elem, &TransformableBaseT::getTransform()), range)
+                          : IntersectionTesterT::template intersects<N, ScalarT>(elem, range);
+          if (intersects)
+            result.add(getCenterWorldSpace(elem));
+        }
+      }
+      else
+      {
+        rangeAggregate<IntersectionTesterT>(start->lo, range, filter, use_node_aggregates, result);
+        rangeAggregate<IntersectionTesterT>(start->hi, range, filter, use_node_aggregates, result);
+      }
+    }
+
+    /** Get the center of an element, in world space. */
+    VectorT getCenterWorldSpace(T const & elem) const
+    {
+      return TransformableBaseT::hasTransform() ? VectorT(TransformableBaseT::getTransform() * BoundedTraitsT::getCenter(elem))
+                                                : BoundedTraitsT::getCenter(elem);
+    }
+
+    /** Get the aggregate statistics stored at a node, if the tree maintains them. */
+    static Aggregate const * getNodeAggregate(Node const & node, std::true_type) { return &node.attr(); }
+
+    /** Returns null, since the tree does not maintain node aggregates. */
+    static Aggregate const * getNodeAggregate(Node const & node, std::false_type) { return nullptr; }
+
+    /** Get the aggregate statistics stored at a node, if the tree maintains them. */
+    static Aggregate * getNodeAggregate(Node & node, std::true_type) { return &node.attr(); }
+
+    /** Returns null, since the tree does not maintain node aggregates. */
+    static Aggregate * getNodeAggregate(Node & node, std::false_type) { return nullptr; }
+
+    /** Recompute the aggregate statistics of a subtree bottom-up, if the tree maintains node aggregates. */
+    void updateNodeAggregates(Node * start)
+    {
+      if (!start) return;
+
+      Aggregate * aggregate = getNodeAggregate(*start, std::integral_constant<bool, HAS_NODE_AGGREGATES>());
+      if (!aggregate) return;
+
+      aggregate->clear();
+      if (!start->lo)  // leaf
+      {
+        for (size_t i = 0; i < start->num_elems; ++i)
+          aggregate->add(BoundedTraitsT::getCenter(elems[start->elems[i]]));
+      }
+      else
+      {
+        updateNodeAggregates(start->lo);
+        updateNodeAggregates(start->hi);
+
+        aggregate->merge(*getNodeAggregate(*start->lo, std::integral_constant<bool, HAS_NODE_AGGREGATES>()));
+        aggregate->merge(*getNodeAggregate(*start->hi, std::integral_constant<bool, HAS_NODE_AGGREGATES>()));
+      }
+    }
+
+  protected:
     /** Transform a ray to local/object space. */
     RayT toObjectSpace(RayT const & ray) const
     {
@@ -1612,10 +4410,12 @@ class /* THEA_API */ KDTreeN
       return (new_time >= 0 && (old_time < 0 || new_time <= old_time));
     }
 
-  protected:
-    /** Get the time taken for a ray to hit the nearest object in a node, in the forward direction. */
+    /**
+     * Get the time taken for a ray to hit the nearest object in a node, in the forward direction. Elements not allowed by
+     * \a filter (if not null) are ignored.
+     */
     template <typename RayIntersectionTesterT>
-    Real rayIntersectionTime(Node const * start, RayT const & ray, Real max_time) const
+    Real rayIntersectionTime(Node const * start, RayT const & ray, Real max_time, Filter<T> const * filter) const
     {
       if (!start->lo)  // leaf
       {
@@ -1626,7 +4426,7 @@ class /* THEA_API */ KDTreeN
           ElementIndex index = start->elems[i];
           Element const & elem = elems[index];
 
-          if (!elementPassesFilters(elem))
+          if (!elementPassesFilters(elem, filter))
             continue;
 
           Real time = RayIntersectionTesterT::template rayIntersectionTime<N, ScalarT>(ray, elem, best_time);
@@ -1661,7 +4461,7 @@ class /* THEA_API */ KDTreeN
         {
           if (improvedRayTime(t[i], best_time))
           {
-            Real time = rayIntersectionTime<RayIntersectionTesterT>(n[i], ray, best_time);
+            Real time = rayIntersectionTime<RayIntersectionTesterT>(n[i], ray, best_time, filter);
             if (improvedRayTime(time, best_time))
             {
               best_time = time;
@@ -1674,9 +4474,13 @@ class /* THEA_API */ KDTreeN
       }
     }
 
-    /** Get the nearest intersection of a ray with a node in the forward direction. */
+    /**
+     * Get the nearest intersection of a ray with a node in the forward direction. Elements not allowed by \a filter (if not
+     * null) are ignored.
+     */
     template <typename RayIntersectionTesterT>
-    RayStructureIntersectionT rayStructureIntersection(Node const * start, RayT const & ray, Real max_time) const
+    RayStructureIntersectionT rayStructureIntersection(Node const * start, RayT const & ray, Real max_time,
+                                                       Filter<T> const * filter) const
     {
       if (!start->lo)  // leaf
       {
@@ -1687,7 +4491,7 @@ class /* THEA_API */ KDTreeN
           ElementIndex index = start->elems[i];
           Element const & elem = elems[index];
 
-          if (!elementPassesFilters(elem))
+          if (!elementPassesFilters(elem, filter))
             continue;
 
           RayIntersectionN<N, ScalarT> isec = RayIntersectionTesterT::template rayIntersection<N, ScalarT>(ray, elem,
@@ -1723,7 +4527,8 @@ class /* THEA_API */ KDTreeN
         {
           if (improvedRayTime(t[i], best_isec.getTime()))
           {
-            RayStructureIntersectionT isec = rayStructureIntersection<RayIntersectionTesterT>(n[i], ray, best_isec.getTime());
+            RayStructureIntersectionT isec = rayStructureIntersection<RayIntersectionTesterT>(n[i], ray, best_isec.getTime(),
+                                                                                              filter);
             if (improvedRayTime(isec.getTime(), best_isec.getTime()))
             {
               best_isec = isec;
@@ -1790,34 +4595,44 @@ class /* THEA_API */ KDTreeN
       }
     }
 
-    /** Get an upper bound on the distance to a query object, using the acceleration structure if it exists. */
+    /**
+     * Get an upper bound on the distance to a query object, using the acceleration structure if it exists. Only samples of
+     * elements allowed by \a filter (if not null) are considered.
+     */
     template <typename MetricT, typename QueryT>
-    double accelerationBound(QueryT const & query, double dist_bound) const
+    double accelerationBound(QueryT const & query, double dist_bound, Filter<T> const * filter) const
     {
       NearestNeighborAccelerationStructure const * accel = getNearestNeighborAccelerationStructure<MetricT>();
-      return accel ? accel->template distance<MetricT>(query, dist_bound) : -1;
+      if (!accel) return -1;
+
+      SampleFilter sample_filter(filter);
+      return accel->template distance<MetricT>(query, dist_bound, filter ? &sample_filter : nullptr);
     }
 
     /**
      * Get an upper bound on the distance to a query kd-tree, using the acceleration structures of both the query and of this
-     * object if they exist.
+     * object if they exist. Only elements (and samples of elements) of this object allowed by \a filter (if not null) are
+     * considered.
      */
     template <typename MetricT, typename E, typename S, typename A, typename B>
-    double accelerationBound(KDTreeN<E, N, S, A> const & query, double dist_bound) const
+    double accelerationBound(KDTreeN<E, N, S, A> const & query, double dist_bound, Filter<T> const * filter) const
     {
       NearestNeighborAccelerationStructure const * accel = getNearestNeighborAccelerationStructure<MetricT>();
       if (accel)
       {
+        SampleFilter sample_filter(filter);
+        SampleFilter const * accel_filter = (filter ? &sample_filter : nullptr);
+
         if (query.hasNearestNeighborAcceleration())
         {
           typename KDTreeN<E, N, S, A>::NearestNeighborAccelerationStructure const * query_accel
               = query.template getNearestNeighborAccelerationStructure<MetricT>();
 
           if (query_accel)
-            return accel->template distance<MetricT>(*query_accel, dist_bound);
+            return accel->template distance<MetricT>(*query_accel, dist_bound, accel_filter);
         }
 
-        return accel->template distance<MetricT>(query, dist_bound);
+        return accel->template distance<MetricT>(query, dist_bound, accel_filter);
       }
       else
       {
@@ -1827,7 +4642,7 @@ class /* THEA_API */ KDTreeN
               = query.template getNearestNeighborAccelerationStructure<MetricT>();
 
           if (query_accel)
-            return distance<MetricT>(*query_accel, dist_bound);
+            return distance<MetricT>(*query_accel, dist_bound, filter);
         }
 
         return -1;
@@ -1848,6 +4663,12 @@ class /* THEA_API */ KDTreeN
     intx max_depth;
     intx max_elems_per_leaf;
 
+    SplitPolicy split_policy;
+    intx max_build_threads;
+    double build_traversal_cost;  // expected traversal cost of the tree as built, recorded when it is first refitted
+    Array<NodePool *> build_node_pools;  // per-thread node pools used in parallel construction
+    Array<IndexPool *> build_index_pools;  // per-thread index pools used in parallel construction
+
     AffineTransformN<N, ScalarT> transform_inverse;
     Matrix<N, N, ScalarT> transform_inverse_transpose;
 
@@ -63,6 +63,7 @@ class ShapeDiameter
     : kdtree(new KDTree), precomp_kdtree(nullptr), scale(normalization_scale)
     {
       kdtree->add(const_cast<Mesh &>(mesh));  // safe -- the kd-tree won't be used to modify the mesh
+      kdtree->setSplitPolicy(KDTree::SplitPolicy::SAH);  // trees built only for ray casting
       kdtree->init();
 
       if (scale <= 0)
@@ -86,6 +87,7 @@ class ShapeDiameter
     : kdtree(new KDTree), precomp_kdtree(nullptr), scale(normalization_scale)
     {
       kdtree->add(const_cast<Graphics::MeshGroup<Mesh> &>(mesh_group));  // safe -- the kd-tree won't be used to modify the mesh
+      kdtree->setSplitPolicy(KDTree::SplitPolicy::SAH);  // trees built only for ray casting
       kdtree->init();
 
       if (scale <= 0)
@@ -207,18 +209,24 @@ class ShapeDiameter
         Vector3(-0.270612f, -0.809654f,  0.520797f),
       };
 
+      // The cone rays share an origin, so trace them together as a batch
+      Ray3 rays[NUM_RAYS];
+      for (int i = 0; i < NUM_RAYS; ++i)
+        rays[i] = Ray3(position + offset, rot * CONE_DIRS[i]);
+
+      RayStructureIntersection3 isecs[NUM_RAYS];
+      if (precomp_kdtree)
+        precomp_kdtree->template rayStructureIntersections<RayIntersectionTester>(rays, NUM_RAYS, isecs);
+      else
+        kdtree->template rayStructureIntersections<RayIntersectionTester>(rays, NUM_RAYS, isecs);
+
       double values[NUM_RAYS];
       double weights[NUM_RAYS];
       int num_values = 0;
       for (int i = 0; i < NUM_RAYS; ++i)
       {
-        Vector3 dir = rot * CONE_DIRS[i];
-        Ray3 ray(position + offset, dir);
-        RayStructureIntersection3 isec = precomp_kdtree
-                                       ? precomp_kdtree->template rayStructureIntersection<RayIntersectionTester>(ray)
-                                       : kdtree->template rayStructureIntersection<RayIntersectionTester>(ray);
-
-        if (isec.isValid() && (!only_hit_interior_surfaces || isec.getNormal().dot(dir) >= 0))
+        RayStructureIntersection3 const & isec = isecs[i];
+        if (isec.isValid() && (!only_hit_interior_surfaces || isec.getNormal().dot(rays[i].getDirection()) >= 0))
         {
           values[num_values] = isec.getTime();
           weights[num_values] = CONE_DIRS[i][2];  // cos(angle) is just the z-component
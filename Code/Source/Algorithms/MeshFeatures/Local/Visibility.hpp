@@ -55,6 +55,7 @@ class Visibility
     : kdtree(new KDTree), precomp_kdtree(nullptr)
     {
       kdtree->add(const_cast<Mesh &>(mesh));  // safe -- the kd-tree won't be used to modify the mesh
+      kdtree->setSplitPolicy(KDTree::SplitPolicy::SAH);  // trees built only for ray casting
       kdtree->init();
       scale = kdtree->getBounds().getExtent().norm();
     }
@@ -69,6 +70,7 @@ class Visibility
     : kdtree(new KDTree), precomp_kdtree(nullptr)
     {
       kdtree->add(const_cast<Graphics::MeshGroup<Mesh> &>(mesh_group));  // safe -- the kd-tree won't be used to modify the mesh
+      kdtree->setSplitPolicy(KDTree::SplitPolicy::SAH);  // trees built only for ray casting
       kdtree->init();
       scale = kdtree->getBounds().getExtent().norm();
     }
@@ -108,19 +110,26 @@ class Visibility
       if (num_rays <= 0)  // 0 is probably user error, snap it to default as well though this should not be relied upon
         num_rays = DEFAULT_NUM_RAYS;
 
+      // The rays share an origin, so trace them together as a batch
+      Array<Ray3> rays((size_t)num_rays);
       Vector3 u;
-      intx num_escaped = 0;
       for (intx i = 0; i < num_rays; ++i)
       {
         Random::common().sphere(u[0], u[1], u[2]);
         Vector3 offset = 0.001f * scale * u;
-        Ray3 ray = Ray3(position + offset, u);
+        rays[(size_t)i] = Ray3(position + offset, u);
+      }
+
+      Array<Real> hit_times((size_t)num_rays);
+      if (precomp_kdtree)
+        precomp_kdtree->template rayIntersectionTimes<RayIntersectionTester>(&rays[0], num_rays, &hit_times[0]);
+      else
+        kdtree->template rayIntersectionTimes<RayIntersectionTester>(&rays[0], num_rays, &hit_times[0]);
 
-        bool hit = precomp_kdtree ? precomp_kdtree->template rayIntersects<RayIntersectionTester>(ray)
-                                  : kdtree->template rayIntersects<RayIntersectionTester>(ray);
-        if (!hit)
+      intx num_escaped = 0;
+      for (intx i = 0; i < num_rays; ++i)
+        if (hit_times[(size_t)i] < 0)
           num_escaped++;
-      }
 
       return (double)num_escaped / num_rays;
     }
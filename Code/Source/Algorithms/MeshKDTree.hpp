@@ -16,7 +16,9 @@
 #define __Thea_Algorithms_MeshKDTree_hpp__
 
 #include "../Common.hpp"
+#include "../Crypto.hpp"
 #include "../Graphics/MeshGroup.hpp"
+#include "FlatKDTreeN.hpp"
 #include "KDTreeN.hpp"
 #include "MeshTriangles.hpp"
 
@@ -24,7 +26,94 @@ namespace Thea {
 namespace Algorithms {
 
 /**
- * A kd-tree on mesh triangles. Implemented for general, DCEL and display meshes.
+ * A compact, self-contained copy of a triangle, storing one vertex, the two edges from it and the unit normal. Used by
+ * MeshKDTree to run ray and point queries without dereferencing mesh vertices.
+ */
+class PackedTriangle3
+{
+  public:
+    /** Default constructor. Does not initialize anything. */
+    PackedTriangle3() {}
+
+    /** Copy a triangle. */
+    template <typename VertexTripleT>
+    explicit PackedTriangle3(Triangle3<VertexTripleT> const & tri)
+    : v0(tri.getVertex(0)), edge01(tri.getEdge01()), edge02(tri.getEdge02()), normal(tri.getNormal())
+    {}
+
+    /** Get a vertex of the triangle. */
+    Vector3 getVertex(int i) const { return i == 0 ? v0 : (i == 1 ? Vector3(v0 + edge01) : Vector3(v0 + edge02)); }
+
+    /** Get the unit normal of the triangle. */
+    Vector3 const & getNormal() const { return normal; }
+
+    /** Get the point on the triangle closest to a given point. */
+    Vector3 closestPoint(Vector3 const & p) const
+    {
+      // From Christer Ericson, "Real-Time Collision Detection", Morgan-Kaufman, 2005. Locate the Voronoi region of the point,
+      // using only the first vertex and the two edges from it.
+      Vector3 ap = p - v0;
+      Real d1 = edge01.dot(ap), d2 = edge02.dot(ap);
+      if (d1 <= 0 && d2 <= 0) return v0;
+
+      Vector3 bp = ap - edge01;
+      Real d3 = edge01.dot(bp), d4 = edge02.dot(bp);
+      if (d3 >= 0 && d4 <= d3) return v0 + edge01;
+
+      Real vc = d1 * d4 - d3 * d2;
+      if (vc <= 0 && d1 >= 0 && d3 <= 0) return v0 + (d1 / (d1 - d3)) * edge01;
+
+      Vector3 cp = ap - edge02;
+      Real d5 = edge01.dot(cp), d6 = edge02.dot(cp);
+      if (d6 >= 0 && d5 <= d6) return v0 + edge02;
+
+      Real vb = d5 * d2 - d1 * d6;
+      if (vb <= 0 && d2 >= 0 && d6 <= 0) return v0 + (d2 / (d2 - d6)) * edge02;
+
+      Real va = d3 * d6 - d5 * d4;
+      if (va <= 0 && d4 >= d3 && d5 >= d6) return v0 + edge01 + ((d4 - d3) / ((d4 - d3) + (d5 - d6))) * (edge02 - edge01);
+
+      Real denom = va + vb + vc;
+      if (denom <= 0) return v0;  // degenerate triangle
+
+      return v0 + (vb / denom) * edge01 + (vc / denom) * edge02;
+    }
+
+    /** Get the squared distance of the triangle from a point. */
+    Real squaredDistance(Vector3 const & p) const { return (closestPoint(p) - p).squaredNorm(); }
+
+    /** Get the distance of the triangle from a point. */
+    Real distance(Vector3 const & p) const { return std::sqrt(squaredDistance(p)); }
+
+    /** Get the time taken for a ray to hit the triangle, or a negative value if it does not hit within \a max_time. */
+    Real rayIntersectionTime(Ray3 const & ray, Real max_time = -1) const
+    {
+      Real t = Triangle3Internal::rayTriangleIntersectionTime(ray, v0, edge01, edge02);
+      return (max_time >= 0 && t > max_time) ? -1 : t;
+    }
+
+    /** Get the intersection of a ray with the triangle, including the normal at the point of intersection. */
+    RayIntersection3 rayIntersection(Ray3 const & ray, Real max_time = -1) const
+    {
+      Real t = rayIntersectionTime(ray, max_time);
+      return t >= 0 ? RayIntersection3(t, &normal) : RayIntersection3(-1);
+    }
+
+  private:
+    Vector3 v0;      ///< The first vertex.
+    Vector3 edge01;  ///< The second vertex minus the first.
+    Vector3 edge02;  ///< The third vertex minus the first.
+    Vector3 normal;  ///< The unit normal.
+
+}; // class PackedTriangle3
+
+/**
+ * A kd-tree on mesh triangles. Implemented for general, DCEL, display and compact meshes.
+ *
+ * Optionally (see enablePackedTriangles()), the tree also keeps a flattened copy of itself (FlatKDTreeN) whose leaves store
+ * compact PackedTriangle3 records contiguously, instead of referring to triangles whose vertices live in the mesh. Ray and
+ * point queries on the tree then stream through this copy without chasing pointers into the mesh, which is considerably faster
+ * for large meshes, at the cost of about 48 bytes per triangle plus the flattened nodes.
  *
  * @see GeneralMesh, DCELMesh, DisplayMesh
  */
@@ -43,6 +132,14 @@ class MeshKDTree : public Algorithms::KDTreeN< Triangle3< MeshVertexTriple<MeshT
     typedef typename Triangles::VertexTriple VertexTriple;    ///< A triple of mesh vertices.
     typedef typename Triangles::Triangle Triangle;            ///< The triangle defined by a triple of mesh vertices.
     typedef typename Triangles::TriangleArray TriangleArray;  ///< An array of mesh triangles.
+    typedef FlatKDTreeN<Triangle, 3, Real> FlatKDTree;        ///< A flattened, serializable kd-tree on mesh triangles.
+    typedef typename BaseT::VectorT VectorT;                  ///< Vector in 3-space.
+    typedef typename BaseT::NeighborPair NeighborPair;        ///< Pair of neighboring elements.
+    typedef typename BaseT::RayT RayT;                        ///< Ray in 3-space.
+    typedef typename BaseT::RayStructureIntersectionT RayStructureIntersectionT;  ///< Ray intersection structure in 3-space.
+
+    /** Default constructor. */
+    MeshKDTree() : use_packed_triangles(false) {}
 
     /**
      * Add a mesh to the kd-tree. The mesh is converted to triangles which are cached internally. The tree is <b>not</b>
@@ -102,6 +199,68 @@ class MeshKDTree : public Algorithms::KDTreeN< Triangle3< MeshVertexTriple<MeshT
       TriangleArray const & tri_array = tris.getTriangles();
       BaseT::init(tri_array.begin(), tri_array.end(), max_depth, max_elems_in_leaf, save_memory, deallocate_previous_memory);
       tris.clear();
+      updatePackedTriangles();
+    }
+
+    /**
+     * Recompute the bounding boxes of the tree after the vertices of the meshes have moved, keeping the structure of the tree
+     * unchanged. The properties cached by each triangle (plane, centroid etc) are first updated from the new vertex positions.
+     * The connectivity of the meshes must not have changed since the tree was built. See KDTreeN::refit() for details and the
+     * meaning of the parameter and return value.
+     */
+    double refit(bool compute_quality = false)
+    {
+      double quality = BaseT::refitElements(TriangleUpdater(), compute_quality);
+      updatePackedTriangles();
+      return quality;
+    }
+
+    /**
+     * Get a hash of the geometry of the triangles cached by the tree (i.e. added since the last call to init()), in order. Used
+     * to check that a saved tree was built from the same meshes.
+     */
+    uint64 getCachedTrianglesHash() const
+    {
+      TriangleArray const & tri_array = tris.getTriangles();
+      uint64 num_tris = (uint64)tri_array.size();
+      uint64 h = Crypto::fnv1a64(&num_tris, sizeof(num_tris));
+      for (size_t i = 0; i < tri_array.size(); ++i)
+        for (int j = 0; j < 3; ++j)
+        {
+          Vector3 v = tri_array[i].getVertex(j);
+          h = Crypto::fnv1a64(v.data(), 3 * sizeof(Real), h);
+        }
+
+      return h;
+    }
+
+    /**
+     * Initialize a flattened kd-tree on the cached triangles (i.e. those added since the last call to init()), reusing a copy
+     * saved in a file if possible. If the file exists and was built from the same triangles, it is memory-mapped into \a flat
+     * and this tree is not built at all. Else, this tree is built as in init(), copied into \a flat, and saved to the file for
+     * next time. In either case, the triangle cache is cleared.
+     *
+     * @param flat The flattened tree to initialize.
+     * @param path The path of the saved flattened tree.
+     * @param quantize_bounds If the tree must be rebuilt, whether to quantize the bounds of the flattened tree.
+     *
+     * @return True if the flattened tree was loaded from the file, false if it had to be rebuilt.
+     */
+    bool initFlat(FlatKDTree & flat, std::string const & path, bool quantize_bounds = false)
+    {
+      TriangleArray const & tri_array = tris.getTriangles();
+      uint64 hash = getCachedTrianglesHash();
+      if (flat.load(path, hash, tri_array.empty() ? nullptr : &tri_array[0], (intx)tri_array.size()))
+      {
+        tris.clear();
+        return true;
+      }
+
+      init();
+      flat.init(*this, quantize_bounds);
+      flat.save(path, hash);
+
+      return false;
     }
 
     /**
@@ -112,10 +271,196 @@ class MeshKDTree : public Algorithms::KDTreeN< Triangle3< MeshVertexTriple<MeshT
     {
       BaseT::clear(deallocate_all_memory);
       tris.clear();
+      packed.clear();
+    }
+
+    /**
+     * Run ray and point queries on a compact copy of the triangles, laid out contiguously in the leaves of a flattened copy of
+     * the tree, instead of on the mesh triangles themselves. The copy is built immediately if the tree has already been
+     * initialized, and is updated by every subsequent call to init() and refit().
+     *
+     * The copy is used by rayIntersects(), rayIntersectionTime(), rayStructureIntersection(), the batched
+     * rayIntersectionTimes() and rayStructureIntersections() and, if the query is a point and the tree has no transform, by
+     * distance(), closestElement() and closestPair(). The returned element indices refer, as usual, to the array returned by
+     * getElements(). Queries with a filter, or while the filter stack is not empty, fall back to the regular tree since the
+     * filters apply to mesh triangles. The RayIntersectionTesterT and MetricT arguments of the queries must support
+     * PackedTriangle3 (the default RayIntersectionTester and MetricL2 do).
+     *
+     * @note Only the functions above, called directly on this class, are rerouted: they hide, and do not override, the
+     *   functions of KDTreeN. Calls through a reference or pointer to the base KDTreeN, all other queries (e.g.
+     *   kClosestPairs(), range queries and queries against another tree), and the batched ray queries when the copy is not
+     *   used, run on the regular tree. Since the flattened copy does not trace rays in packets, the batched ray queries trace
+     *   each ray individually on it.
+     */
+    void enablePackedTriangles()
+    {
+      if (use_packed_triangles) return;
+
+      use_packed_triangles = true;
+      updatePackedTriangles();
+    }
+
+    /** Stop using a compact copy of the triangles for queries, and release its memory. See enablePackedTriangles(). */
+    void disablePackedTriangles()
+    {
+      use_packed_triangles = false;
+      packed.clear();
+    }
+
+    /** Check if queries use a compact copy of the triangles. See enablePackedTriangles(). */
+    bool hasPackedTriangles() const { return use_packed_triangles; }
+
+    // The proximity and ray query functions below run on the packed triangles if possible (see enablePackedTriangles()), and
+    // otherwise behave exactly like the corresponding functions of KDTreeN.
+
+    template <typename MetricT, typename QueryT>
+    double distance(QueryT const & query, double dist_bound = -1, Filter<Triangle> const * filter = nullptr) const
+    {
+      double result = -1;
+      if (closestElement<MetricT>(query, dist_bound, &result, nullptr, filter) >= 0)
+        return result;
+      else
+        return -1;
+    }
+
+    template <typename MetricT, typename QueryT>
+    intx closestElement(QueryT const & query, double dist_bound = -1, double * dist = nullptr,
+                        VectorT * closest_point = nullptr, Filter<Triangle> const * filter = nullptr) const
+    {
+      NeighborPair pair = closestPair<MetricT>(query, dist_bound, closest_point != nullptr, filter);
+
+      if (pair.isValid())
+      {
+        if (dist) *dist = MetricT::invertMonotoneApprox(pair.getMonotoneApproxDistance());
+        if (closest_point) *closest_point = pair.getTargetPoint();
+      }
+
+      return pair.getTargetIndex();
+    }
+
+    template <typename MetricT, typename QueryT>
+    NeighborPair closestPair(QueryT const & query, double dist_bound = -1, bool get_closest_points = false,
+                             Filter<Triangle> const * filter = nullptr) const
+    {
+      return closestPair<MetricT>(query, dist_bound, get_closest_points, filter,
+                                  std::integral_constant<bool, IsPointN<QueryT, 3>::value>());
+    }
+
+    template <typename RayIntersectionTesterT>
+    bool rayIntersects(RayT const & ray, Real max_time = -1, Filter<Triangle> const * filter = nullptr) const
+    {
+      return rayIntersectionTime<RayIntersectionTesterT>(ray, max_time, filter) >= 0;
+    }
+
+    template <typename RayIntersectionTesterT>
+    Real rayIntersectionTime(RayT const & ray, Real max_time = -1, Filter<Triangle> const * filter = nullptr) const
+    {
+      if (!usePackedTriangles(filter))
+        return BaseT::template rayIntersectionTime<RayIntersectionTesterT>(ray, max_time, filter);
+
+      return packed.template rayIntersectionTime<RayIntersectionTesterT>(
+                 this->hasTransform() ? this->toObjectSpace(ray) : ray, max_time);
+    }
+
+    template <typename RayIntersectionTesterT>
+    RayStructureIntersectionT rayStructureIntersection(RayT const & ray, Real max_time = -1,
+                                                       Filter<Triangle> const * filter = nullptr) const
+    {
+      if (!usePackedTriangles(filter))
+        return BaseT::template rayStructureIntersection<RayIntersectionTesterT>(ray, max_time, filter);
+
+      RayStructureIntersectionT isec = packed.template rayStructureIntersection<RayIntersectionTesterT>(
+                                           this->hasTransform() ? this->toObjectSpace(ray) : ray, max_time);
+      if (isec.isValid())
+      {
+        isec.setElementIndex(packed.getSourceIndex(isec.getElementIndex()));
+        if (this->hasTransform() && isec.hasNormal())
+          isec.setNormal(this->normalToWorldSpace(isec.getNormal()));
+      }
+
+      return isec;
+    }
+
+    template <typename RayIntersectionTesterT>
+    void rayIntersectionTimes(RayT const * rays, intx num_rays, Real * times, Real max_time = -1,
+                              Filter<Triangle> const * filter = nullptr) const
+    {
+      if (!usePackedTriangles(filter))
+      {
+        BaseT::template rayIntersectionTimes<RayIntersectionTesterT>(rays, num_rays, times, max_time, filter);
+        return;
+      }
+
+      for (intx i = 0; i < num_rays; ++i)
+        times[i] = rayIntersectionTime<RayIntersectionTesterT>(rays[i], max_time);
+    }
+
+    template <typename RayIntersectionTesterT>
+    void rayStructureIntersections(RayT const * rays, intx num_rays, RayStructureIntersectionT * isecs, Real max_time = -1,
+                                   Filter<Triangle> const * filter = nullptr) const
+    {
+      if (!usePackedTriangles(filter))
+      {
+        BaseT::template rayStructureIntersections<RayIntersectionTesterT>(rays, num_rays, isecs, max_time, filter);
+        return;
+      }
+
+      for (intx i = 0; i < num_rays; ++i)
+        isecs[i] = rayStructureIntersection<RayIntersectionTesterT>(rays[i], max_time);
     }
 
   private:
+    /** Converts a mesh triangle to a packed triangle. */
+    struct TrianglePacker
+    {
+      PackedTriangle3 operator()(Triangle const & tri) const { return PackedTriangle3(tri); }
+    };
+
+    /** Check if a query with the given filter can use the packed triangles. */
+    bool usePackedTriangles(Filter<Triangle> const * filter) const
+    {
+      return use_packed_triangles && !filter && BaseT::numFilters() <= 0;
+    }
+
+    /** Rebuild the packed copy of the triangles from the tree, if it is enabled. */
+    void updatePackedTriangles()
+    {
+      if (use_packed_triangles)
+        packed.initConverted(*this, TrianglePacker());
+    }
+
+    /** Get the closest pair of elements between the tree and a point query, using the packed triangles if possible. */
+    template <typename MetricT, typename QueryT>
+    NeighborPair closestPair(QueryT const & query, double dist_bound, bool get_closest_points,
+                             Filter<Triangle> const * filter, std::true_type /* query is a point */) const
+    {
+      if (!usePackedTriangles(filter) || this->hasTransform())
+        return BaseT::template closestPair<MetricT>(query, dist_bound, get_closest_points, filter);
+
+      NeighborPair pair = packed.template closestPair<MetricT>(query, dist_bound, get_closest_points);
+      if (pair.isValid())
+        pair.setTargetIndex(packed.getSourceIndex(pair.getTargetIndex()));
+
+      return pair;
+    }
+
+    /** Get the closest pair of elements between the tree and a non-point query object. */
+    template <typename MetricT, typename QueryT>
+    NeighborPair closestPair(QueryT const & query, double dist_bound, bool get_closest_points,
+                             Filter<Triangle> const * filter, std::false_type /* query is not a point */) const
+    {
+      return BaseT::template closestPair<MetricT>(query, dist_bound, get_closest_points, filter);
+    }
+
+    /** Updates the cached properties of a triangle after its vertices have moved. */
+    struct TriangleUpdater
+    {
+      void operator()(Triangle & tri) const { tri.update(); }
+    };
+
     Triangles tris;  ///< Internal cache of triangles used to initialize the tree.
+    bool use_packed_triangles;  ///< Run queries on the packed copy of the triangles?
+    FlatKDTreeN<PackedTriangle3, 3, Real> packed;  ///< Flattened copy of the tree storing packed triangles.
 
 }; // class MeshKDTree
 
@@ -218,6 +218,82 @@ class MeshVertexTriple<MeshT, typename std::enable_if< Graphics::IsDisplayMesh<M
 
 }; // class MeshVertexTriple<DisplayMesh>
 
+/**
+ * A set of three vertices of a single face of a compact mesh.
+ *
+ * @see CompactMesh
+ */
+template <typename MeshT>
+class MeshVertexTriple<MeshT, typename std::enable_if< Graphics::IsCompactMesh<MeshT>::value >::type>
+{
+  public:
+    typedef MeshT  Mesh;                   ///< The mesh type.
+    typedef intx   MeshVertexHandle;       ///< A handle to a vertex of the mesh.
+    typedef intx   MeshVertexConstHandle;  ///< A const handle to a vertex of the mesh.
+    typedef intx   MeshFaceHandle;         ///< A handle to a face of the mesh.
+    typedef intx   MeshFaceConstHandle;    ///< A const handle to a face of the mesh.
+
+    /** Default constructor. */
+    MeshVertexTriple() {}
+
+    /** Constructs the triple from three mesh vertices. */
+    template <typename IntegerT>
+    MeshVertexTriple(IntegerT vi0, IntegerT vi1, IntegerT vi2, Mesh * mesh_, intx face_index_)
+    : mesh(mesh_), face_index(face_index_)
+    {
+      typename Mesh::PositionArray const & mv = mesh->getPositions();
+      vertices[0] = mv[(size_t)vi0];
+      vertices[1] = mv[(size_t)vi1];
+      vertices[2] = mv[(size_t)vi2];
+
+      vertex_indices[0] = (intx)vi0;
+      vertex_indices[1] = (intx)vi1;
+      vertex_indices[2] = (intx)vi2;
+    }
+
+    /** Get the position of any one of the three vertices. */
+    Vector3 const & getVertex(int i) const
+    {
+      debugAssertM(i >= 0 && i < 3, "Compact mesh triangle: Vertex index must be 0, 1 or 2");
+      return vertices[i];
+    }
+
+    /**
+     * Get the normal at one of the three vertices. If the compact mesh does not have explicit vertex normals, the normal of the
+     * triangle is returned.
+     */
+    Vector3 getVertexNormal(int i) const
+    {
+      if (mesh->hasNormals())
+        return mesh->getNormal(vertex_indices[i]);
+      else
+        return (vertices[1] - vertices[0]).cross(vertices[2] - vertices[0]).normalized();
+    }
+
+    /** Get the index of any one of the three mesh vertices. */
+    MeshVertexHandle getMeshVertex(int i) const
+    {
+      debugAssertM(i >= 0 && i < 3, "Compact mesh triangle: Vertex index out of bounds");
+      return vertex_indices[i];
+    }
+
+    /** Get the index, in the source mesh, of the associated mesh face from which the vertices were obtained. */
+    intx getMeshFaceIndex() const { return face_index; }
+
+    /** Get the index, in the source mesh, of the associated mesh face from which the vertices were obtained. */
+    MeshFaceHandle getMeshFace() const { return face_index; }
+
+    /** Get the parent mesh. */
+    Mesh * getMesh() const { return mesh; }
+
+  private:
+    Vector3 vertices[3];     ///< The positions of the vertices of the mesh triangle.
+    Mesh * mesh;             ///< The mesh containing the triangle.
+    intx vertex_indices[3];  ///< The indices of the vertices of the mesh triangle.
+    intx face_index;         ///< The index of the face containing the triangle.
+
+}; // class MeshVertexTriple<CompactMesh>
+
 namespace MeshTrianglesInternal {
 
 // Add a face of a general mesh to a set of triangles.
@@ -439,12 +515,82 @@ buildTriangleList(MeshT & mesh, Array<TriangleT> & tris)
   }
 }
 
+// Add a face of a compact mesh to a set of triangles.
+template <typename MeshT, typename TriangleT>
+typename std::enable_if< Graphics::IsCompactMesh<MeshT>::value >::type
+addFace(MeshT & mesh, typename MeshT::Face & face, Array<TriangleT> & tris)
+{
+  typedef typename TriangleT::VertexTriple VertexTriple;
+
+  intx f = face.getIndex();
+  uint32 const * fv = mesh.getFaceVertices(f);
+  intx num_verts = mesh.numFaceVertices(f);
+
+  if (num_verts == 3)
+    tris.push_back(TriangleT(VertexTriple(fv[0], fv[1], fv[2], &mesh, f)));
+  else if (num_verts == 4)
+  {
+    typename MeshT::PositionArray const & positions = mesh.getPositions();
+
+    intx i0, j0, k0;
+    intx i1, j1, k1;
+    int num_tris = Polygon3::triangulateQuad(positions[fv[0]], positions[fv[1]], positions[fv[2]], positions[fv[3]],
+                                             i0, j0, k0, i1, j1, k1);
+
+    if (num_tris > 0)
+    {
+      tris.push_back(TriangleT(VertexTriple(fv[i0], fv[j0], fv[k0], &mesh, f)));
+
+      if (num_tris > 1)
+        tris.push_back(TriangleT(VertexTriple(fv[i1], fv[j1], fv[k1], &mesh, f)));
+    }
+  }
+  else
+  {
+    Polygon3 poly;
+    Array<intx> tri_indices;
+
+    for (intx i = 0; i < num_verts; ++i)
+      poly.addVertex(mesh.getPosition((intx)fv[i]), (intx)fv[i]);
+
+    poly.triangulate(tri_indices);
+    for (size_t j = 0; j < tri_indices.size(); j += 3)
+      tris.push_back(TriangleT(VertexTriple(tri_indices[j], tri_indices[j + 1], tri_indices[j + 2], &mesh, f)));
+  }
+}
+
+// Convert the faces of a compact mesh to a set of triangles.
+template <typename MeshT, typename TriangleT>
+typename std::enable_if< Graphics::IsCompactMesh<MeshT>::value >::type
+buildTriangleList(MeshT & mesh, Array<TriangleT> & tris)
+{
+  typedef typename TriangleT::VertexTriple VertexTriple;
+
+  // Fast path for triangle meshes
+  if (mesh.numTriangles() == mesh.numFaces())
+  {
+    typename MeshT::IndexArray const & indices = mesh.getFaceVertexIndices();
+    tris.reserve(tris.size() + indices.size() / 3);
+    for (size_t i = 0; i < indices.size(); i += 3)
+      tris.push_back(TriangleT(VertexTriple(indices[i], indices[i + 1], indices[i + 2], &mesh, (intx)i / 3)));
+
+    return;
+  }
+
+  intx num_faces = mesh.numFaces();
+  for (intx f = 0; f < num_faces; ++f)
+  {
+    typename MeshT::Face face = mesh.getFace(f);
+    addFace<MeshT>(mesh, face, tris);
+  }
+}
+
 } // namespace MeshTrianglesInternal
 
 /**
- * A set of triangles obtained by triangulating mesh faces. Implemented for general, DCEL and display meshes.
+ * A set of triangles obtained by triangulating mesh faces. Implemented for general, DCEL, display and compact meshes.
  *
- * @see GeneralMesh, DCELMesh, DisplayMesh
+ * @see GeneralMesh, DCELMesh, DisplayMesh, CompactMesh
  */
 template <typename MeshT>
 class MeshTriangles
@@ -0,0 +1,1627 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_Algorithms_OutOfCoreKDTreeN_hpp__
+#define __Thea_Algorithms_OutOfCoreKDTreeN_hpp__
+
+#include "../Common.hpp"
+#include "../Array.hpp"
+#include "../FileSystem.hpp"
+#include "../Math.hpp"
+#include "../MemoryMappedFile.hpp"
+#include "../Noncopyable.hpp"
+#include "../ScopedLock.hpp"
+#include "BoundedTraitsN.hpp"
+#include "Filter.hpp"
+#include "FlatKDTreeN.hpp"
+#include "ProximityQueryStructureN.hpp"
+#include "RangeQueryStructure.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <type_traits>
+
+namespace Thea {
+namespace Algorithms {
+
+/**
+ * A read-only kd-tree on a set of elements that may be too large to fit in memory, such as a massive point cloud, stored in a
+ * file. The elements of each leaf are stored contiguously in a bucket that starts on a page boundary of the file. The nodes of
+ * the tree are small and are held in memory, while the file is memory-mapped and the buckets are paged in on demand as queries
+ * visit them. The number of bytes of buckets kept resident is limited by a budget: when it is exceeded, the least recently used
+ * buckets are released back to the operating system.
+ *
+ * The tree is built by build(), which streams the elements from an input iterator in a single pass and never holds more than a
+ * configurable budget of them in memory. The split planes are chosen from a uniform random sample of the elements. The elements
+ * are then distributed to the leaves in streaming passes over temporary files, each pass splitting the data among a bounded
+ * number of subtrees, until every block of elements fits within the memory budget.
+ *
+ * The tree supports the same proximity and range queries as FlatKDTreeN, with optional per-query filters, and can be queried
+ * from multiple threads at once. Element indices passed to and returned from queries refer to the order in which the elements
+ * are stored in the file (the elements of every subtree occupy a contiguous range of indices), and the position of the same
+ * element in the input sequence can be obtained with getSourceIndex().
+ *
+ * The element type must be bitwise serializable (see IsBitwiseSerializable), and BoundedTraitsN<T, N, ScalarT> must be defined
+ * for it. The file uses the native byte order and type sizes, and is not portable across platforms that differ in these.
+ */
+template <typename T, int N, typename ScalarT = Real>
+class /* THEA_API */ OutOfCoreKDTreeN
+: public RangeQueryStructure<T>,
+  public ProximityQueryStructureN<N, ScalarT>,
+  private Noncopyable
+{
+  private:
+    typedef ProximityQueryStructureN<N, ScalarT>  ProximityQueryBaseT;
+    typedef BoundedTraitsN<T, N, ScalarT>         BoundedTraitsT;
+
+    static_assert(IsBitwiseSerializable<T>::value, "OutOfCoreKDTreeN: Elements must be bitwise serializable");
+
+  public:
+    THEA_DECL_SMART_POINTERS(OutOfCoreKDTreeN)
+
+    typedef T  Element;     ///< Type of elements in the kd-tree.
+    typedef T  value_type;  ///< Type of elements in the kd-tree (STL convention).
+
+    typedef typename ProximityQueryBaseT::VectorT       VectorT;          ///< Vector in N-space.
+    typedef typename ProximityQueryBaseT::NeighborPair  NeighborPair;     ///< Pair of neighboring elements.
+    typedef AxisAlignedBoxN<N, ScalarT>                 AxisAlignedBoxT;  ///< Axis-aligned box in N-space.
+
+    /** A node of the tree. The nodes are stored in depth-first order, so the low child of a node immediately follows it. */
+    struct Node
+    {
+      uint64 first_elem;      ///< Index of the first element of the subtree rooted at the node.
+      uint64 num_elems;       ///< Number of elements in the subtree rooted at the node.
+      uint32 hi;              ///< Position of the high child in the node array, or 0 if the node is a leaf.
+      uint32 bucket;          ///< Index of the bucket holding the elements of a leaf (unused for internal nodes).
+      ScalarT lo_corner[N];   ///< Lower corner of the bounding box of the subtree (unused if the subtree is empty).
+      ScalarT hi_corner[N];   ///< Upper corner of the bounding box of the subtree (unused if the subtree is empty).
+
+      /** Check if the node is a leaf. */
+      bool isLeaf() const { return hi == 0; }
+
+      /** Get the bounding box of the subtree. */
+      AxisAlignedBoxT getBounds() const
+      {
+        VectorT lo, hi_;
+        for (intx i = 0; i < N; ++i) { lo[i] = lo_corner[i]; hi_[i] = hi_corner[i]; }
+        return AxisAlignedBoxT(lo, hi_);
+      }
+
+    }; // struct Node
+
+    /** A block of the file holding the elements of a leaf, followed by the source index of each element. */
+    struct Bucket
+    {
+      uint64 offset;      ///< Position of the block in the file in bytes, which is a multiple of the page size.
+      uint64 first_elem;  ///< Index of the first element in the bucket.
+      uint64 num_elems;   ///< Number of elements in the bucket.
+
+    }; // struct Bucket
+
+    /** Options for building the tree. */
+    class BuildOptions
+    {
+      public:
+        /**
+         * Set the target size of a bucket in bytes, including the source indices of its elements (default 64KB). Larger buckets
+         * mean fewer, larger reads from disk, but more elements to test at each leaf. Buckets can exceed this size, since the
+         * splits are chosen from a sample of the elements.
+         */
+        BuildOptions & setBucketBytes(int64 bucket_bytes_) { bucket_bytes = bucket_bytes_; return *this; }
+
+        /** Get the target size of a bucket in bytes. */
+        int64 getBucketBytes() const { return bucket_bytes; }
+
+        /**
+         * Set the approximate number of bytes of element data held in memory at any time during the build (default 256MB).
+         * Elements in excess of this are spilled to temporary files next to the output file.
+         */
+        BuildOptions & setMemoryBudget(int64 memory_budget_) { memory_budget = memory_budget_; return *this; }
+
+        /** Get the approximate number of bytes of element data held in memory at any time during the build. */
+        int64 getMemoryBudget() const { return memory_budget; }
+
+        /**
+         * Set the maximum number of temporary files that a block of elements too large for the memory budget is split into, in a
+         * single streaming pass (default 64). Must be at least 2.
+         */
+        BuildOptions & setMaxPartitions(intx max_partitions_) { max_partitions = max_partitions_; return *this; }
+
+        /** Get the maximum number of temporary files that a block of elements is split into in a single pass. */
+        intx getMaxPartitions() const { return max_partitions; }
+
+        /**
+         * Set the maximum number of elements sampled to choose the splits of the tree (default 2^20). The sample is also limited
+         * by the memory budget.
+         */
+        BuildOptions & setMaxSamples(intx max_samples_) { max_samples = max_samples_; return *this; }
+
+        /** Get the maximum number of elements sampled to choose the splits of the tree. */
+        intx getMaxSamples() const { return max_samples; }
+
+        /** Construct with default values. */
+        BuildOptions() : bucket_bytes(64 * 1024), memory_budget(256 * 1024 * 1024), max_partitions(64), max_samples(1 << 20) {}
+
+        /** Get a set of options with default values. */
+        static BuildOptions const & defaults() { static BuildOptions const def; return def; }
+
+      private:
+        int64 bucket_bytes;   ///< Target size of a bucket in bytes.
+        int64 memory_budget;  ///< Approximate number of bytes of element data held in memory during the build.
+        intx max_partitions;  ///< Maximum number of temporary files a block of elements is split into in a single pass.
+        intx max_samples;     ///< Maximum number of elements sampled to choose the splits.
+
+    }; // class BuildOptions
+
+    /** The default value of the budget for resident buckets, in bytes. */
+    static int64 const DEFAULT_CACHE_BUDGET = 256 * 1024 * 1024;
+
+    /** Default constructor, creates an empty tree. */
+    OutOfCoreKDTreeN() : num_elems(0), cache_budget(DEFAULT_CACHE_BUDGET), resident_bytes(0), num_bucket_loads(0) {}
+
+    /**
+     * Build a tree from a sequence of elements and save it to a file, which can then be opened with open(). InputIterator must
+     * dereference to type T, and the sequence is traversed exactly once.
+     *
+     * @param begin Points to the first element to be added.
+     * @param end Points to one position beyond the last element to be added.
+     * @param path The path of the file to write. Temporary files are created, and deleted, next to it.
+     * @param options Options for building the tree.
+     *
+     * @return True on success, false on error.
+     */
+    template <typename InputIterator>
+    static bool build(InputIterator begin, InputIterator end, std::string const & path,
+                      BuildOptions const & options = BuildOptions::defaults())
+    {
+      Builder builder(path, options);
+      return builder.build(begin, end);
+    }
+
+    /**
+     * Open a tree saved by build(), discarding any prior data. The nodes of the tree are loaded into memory, and the file is
+     * memory-mapped so that buckets are paged in only when queries visit them. The file must not be modified while the tree is
+     * in use.
+     *
+     * @param path The path of the file to open.
+     * @param cache_budget_ The maximum number of bytes of buckets to keep resident (see setCacheBudget()).
+     *
+     * @return True if the tree was successfully opened, false if the file was missing or invalid, in which case the tree is left
+     *   empty.
+     */
+    bool open(std::string const & path, int64 cache_budget_ = DEFAULT_CACHE_BUDGET)
+    {
+      close();
+
+      MemoryMappedFile::Ptr file(new MemoryMappedFile);
+      if (!file->open(path))
+        return false;
+
+      if (file->size() < (int64)sizeof(FileHeader))
+      {
+        THEA_WARNING << "OutOfCoreKDTreeN: File '" << path << "' is too small to be a saved kd-tree";
+        return false;
+      }
+
+      FileHeader header;
+      std::memcpy(&header, file->data(), sizeof(header));
+
+      if (std::memcmp(header.magic, FILE_MAGIC, sizeof(header.magic)) != 0
+       || header.endian_check != ENDIAN_CHECK
+       || header.version != FILE_VERSION
+       || header.dim != (uint32)N
+       || header.scalar_size != (uint32)sizeof(ScalarT)
+       || header.elem_size != (uint32)sizeof(T)
+       || header.node_size != (uint32)sizeof(Node)
+       || header.num_nodes < 1
+       || header.file_size != (uint64)file->size()
+       || !isValidFileArray(header.nodes_offset, header.num_nodes, sizeof(Node), alignof(Node), header.file_size)
+       || !isValidFileArray(header.buckets_offset, header.num_buckets, sizeof(Bucket), alignof(Bucket), header.file_size)
+       || header.data_offset > header.file_size)
+      {
+        THEA_WARNING << "OutOfCoreKDTreeN: File '" << path << "' is not a compatible saved kd-tree";
+        return false;
+      }
+
+      Node const * file_nodes = reinterpret_cast<Node const *>(file->data() + header.nodes_offset);
+      Bucket const * file_buckets = reinterpret_cast<Bucket const *>(file->data() + header.buckets_offset);
+      for (uint64 i = 0; i < header.num_buckets; ++i)
+      {
+        // The elements and their source indices must fit in the file, and the source indices are 8-byte aligned relative to
+        // the start of the bucket
+        Bucket const & bucket = file_buckets[i];
+        if (!isValidFileArray(bucket.offset, bucket.num_elems, sizeof(T) + sizeof(uint64),
+                              std::max(alignof(T), alignof(uint64)), header.file_size)
+         || bucketBytes(bucket.num_elems) > header.file_size - bucket.offset
+         || !isValidElementRange(bucket.first_elem, bucket.num_elems, header.num_elems))
+        {
+          THEA_WARNING << "OutOfCoreKDTreeN: File '" << path << "' is truncated or corrupt";
+          return false;
+        }
+      }
+
+      // Queries trust the nodes, so check that they reference valid nodes, buckets and elements. Children must follow their
+      // parents, so traversals always terminate, and a leaf must hold exactly the elements of its bucket, since queries scan
+      // the bucket for the elements of the leaf.
+      for (uint64 i = 0; i < header.num_nodes; ++i)
+      {
+        Node const & node = file_nodes[i];
+        bool valid_children = (node.isLeaf() ? (node.bucket < header.num_buckets
+                                                && node.first_elem == file_buckets[node.bucket].first_elem
+                                                && node.num_elems == file_buckets[node.bucket].num_elems)
+                                             : (node.hi > i + 1 && node.hi < header.num_nodes));
+        if (!valid_children || !isValidElementRange(node.first_elem, node.num_elems, header.num_elems))
+        {
+          THEA_WARNING << "OutOfCoreKDTreeN: File '" << path << "' has an invalid node " << i;
+          return false;
+        }
+      }
+
+      nodes.assign(file_nodes, file_nodes + header.num_nodes);
+      buckets.assign(file_buckets, file_buckets + header.num_buckets);
+      num_elems = (intx)header.num_elems;
+      if (nodes[0].num_elems > 0)
+        root_bounds = nodes[0].getBounds();
+
+      // The nodes have been copied into memory, so their pages in the file are no longer needed
+      file->release(0, (int64)header.data_offset);
+
+      // Set up an empty list of resident buckets. The extra entry is the head of the circular list.
+      lru_prev.assign(buckets.size() + 1, (uint32)buckets.size());
+      lru_next.assign(buckets.size() + 1, (uint32)buckets.size());
+      resident.assign(buckets.size(), 0);
+      cache_budget = cache_budget_;
+
+      mapped_file = file;
+      return true;
+    }
+
+    /** Close the tree, releasing all memory and unmapping the file. */
+    void close()
+    {
+      mapped_file.reset();
+      Array<Node>().swap(nodes);
+      Array<Bucket>().swap(buckets);
+      Array<uint32>().swap(lru_prev);
+      Array<uint32>().swap(lru_next);
+      Array<uint8>().swap(resident);
+      num_elems = 0;
+      root_bounds.setNull();
+      resident_bytes = 0;
+      num_bucket_loads = 0;
+    }
+
+    /** Check if a tree file is currently open. */
+    bool isOpen() const { return (bool)mapped_file; }
+
+    /** Check if the tree is empty. */
+    bool isEmpty() const { return num_elems <= 0; }
+
+    /** Get the number of elements in the tree. */
+    intx numElements() const { return num_elems; }
+
+    /** Get the number of nodes in the tree. */
+    intx numNodes() const { return (intx)nodes.size(); }
+
+    /** Get the array of nodes in depth-first order. The root, if the tree is open, is the first node. */
+    Node const * getNodes() const { return nodes.empty() ? nullptr : &nodes[0]; }
+
+    /** Get the number of buckets, i.e. leaves, in the tree. */
+    intx numBuckets() const { return (intx)buckets.size(); }
+
+    /** Get the array of buckets, in depth-first order of the corresponding leaves. */
+    Bucket const * getBuckets() const { return buckets.empty() ? nullptr : &buckets[0]; }
+
+    /** Get a bounding box for all the objects in the tree. */
+    AxisAlignedBoxT const & getBounds() const { return root_bounds; }
+
+    /** Get the element with a given index, paging in its bucket if necessary. */
+    T const & getElement(intx index) const
+    {
+      Bucket const & bucket = findBucket(index);
+      return bucketElements(bucket)[(uint64)index - bucket.first_elem];
+    }
+
+    /** Get the position, in the sequence of elements passed to build(), of the element with a given index. */
+    intx getSourceIndex(intx index) const
+    {
+      Bucket const & bucket = findBucket(index);
+      return (intx)bucketSourceIndices(bucket)[(uint64)index - bucket.first_elem];
+    }
+
+    /**
+     * Set the maximum number of bytes of buckets to keep resident. When a query visits a bucket that is not resident and the
+     * budget is exceeded, the least recently used buckets are released until it is met again. The bucket currently being visited
+     * is never released, so the budget may be exceeded if it is smaller than a single bucket. A negative value places no limit
+     * on the resident buckets, leaving it to the operating system to page them out.
+     */
+    void setCacheBudget(int64 cache_budget_)
+    {
+      Array<uint32> evicted;
+      {
+        ScopedLock<std::mutex> guard(&cache_mutex);
+        cache_budget = cache_budget_;
+        enforceCacheBudget((uint32)buckets.size(), evicted);
+      }
+
+      releaseBuckets(evicted);
+    }
+
+    /** Get the maximum number of bytes of buckets to keep resident, or a negative value if there is no limit. */
+    int64 getCacheBudget() const { return cache_budget; }
+
+    /** Release all resident buckets. */
+    void clearCache()
+    {
+      Array<uint32> evicted;
+      {
+        ScopedLock<std::mutex> guard(&cache_mutex);
+        uint32 head = (uint32)buckets.size();
+        while (lru_next[head] != head)
+          evict(lru_next[head], evicted);
+      }
+
+      releaseBuckets(evicted);
+    }
+
+    /** Get the number of bytes of buckets that are currently resident. */
+    int64 getResidentBytes() const
+    {
+      ScopedLock<std::mutex> guard(&cache_mutex);
+      return resident_bytes;
+    }
+
+    /** Get the number of times a bucket that was not resident has been paged in since the tree was opened. */
+    int64 numBucketLoads() const
+    {
+      ScopedLock<std::mutex> guard(&cache_mutex);
+      return num_bucket_loads;
+    }
+
+    /**
+     * Get the minimum distance between this structure and a query object. If \a filter is not null, elements that it does not
+     * allow are ignored.
+     */
+    template <typename MetricT, typename QueryT>
+    double distance(QueryT const & query, double dist_bound = -1, Filter<T> const * filter = nullptr) const
+    {
+      double result = -1;
+      if (closestElement<MetricT>(query, dist_bound, &result, nullptr, filter) >= 0)
+        return result;
+      else
+        return -1;
+    }
+
+    /**
+     * Get the closest element in this structure to a query object, within a specified distance bound.
+     *
+     * @param query Query object.
+     * @param dist_bound Upper bound on the distance between any pair of points considered. Ignored if negative.
+     * @param dist The distance to the query object is placed here. Ignored if null.
+     * @param closest_point The coordinates of the closest point are placed here. Ignored if null.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     *
+     * @return A non-negative handle to the closest element, if one was found, else a negative number.
+     */
+    template <typename MetricT, typename QueryT>
+    intx closestElement(QueryT const & query, double dist_bound = -1, double * dist = nullptr,
+                        VectorT * closest_point = nullptr, Filter<T> const * filter = nullptr) const
+    {
+      NeighborPair pair = closestPair<MetricT>(query, dist_bound, closest_point != nullptr, filter);
+
+      if (pair.isValid())
+      {
+        if (dist) *dist = MetricT::invertMonotoneApprox(pair.getMonotoneApproxDistance());
+        if (closest_point) *closest_point = pair.getTargetPoint();
+      }
+
+      return pair.getTargetIndex();
+    }
+
+    /**
+     * Get the closest pair of elements between this structure and another structure, whose separation is less than a specified
+     * upper bound. The parameters have the same meaning as in FlatKDTreeN::closestPair().
+     */
+    template <typename MetricT, typename QueryT>
+    NeighborPair closestPair(QueryT const & query, double dist_bound = -1, bool get_closest_points = false,
+                             Filter<T> const * filter = nullptr) const
+    {
+      if (isEmpty()) return NeighborPair(-1);
+
+      AxisAlignedBoxT query_bounds;
+      getObjectBounds(query, query_bounds);
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+      if (mon_approx_dist_bound >= 0)
+      {
+        double lower_bound = monotonePruningDistance<MetricT>(root_bounds, query, query_bounds);
+        if (lower_bound >= 0 && lower_bound > mon_approx_dist_bound)
+          return NeighborPair(-1);
+      }
+
+      NeighborPair pair(-1, -1, mon_approx_dist_bound);
+      closestPair<MetricT>(0, query, query_bounds, pair, get_closest_points, filter);
+
+      return pair;
+    }
+
+    /**
+     * Get the k elements closest to a query object. The returned elements are placed in a set of bounded size (k). The
+     * parameters have the same meaning as in KDTreeN::kClosestPairs().
+     *
+     * @return The number of neighbors found (i.e. the size of \a k_closest_pairs).
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound = -1,
+                       bool get_closest_points = false, bool clear_set = true, intx use_as_query_index_and_swap = -1,
+                       Filter<T> const * filter = nullptr) const
+    {
+      if (clear_set) k_closest_pairs.clear();
+
+      if (isEmpty()) return 0;
+
+      AxisAlignedBoxT query_bounds;
+      getObjectBounds(query, query_bounds);
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+      if (mon_approx_dist_bound >= 0)
+      {
+        double lower_bound = monotonePruningDistance<MetricT>(root_bounds, query, query_bounds);
+        if (lower_bound >= 0)
+        {
+          if (lower_bound > mon_approx_dist_bound)
+            return 0;
+
+          if (!k_closest_pairs.isInsertable(NeighborPair(0, 0, lower_bound)))
+            return 0;
+        }
+      }
+
+      kClosestPairs<MetricT>(0, query, query_bounds, k_closest_pairs, dist_bound, get_closest_points,
+                             use_as_query_index_and_swap, filter);
+
+      return k_closest_pairs.size();
+    }
+
+    /**
+     * Get the k elements closest to a query object, ignoring elements not allowed by a filter. Equivalent to the other version
+     * of kClosestPairs() with default values for the internal parameters.
+     */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    intx kClosestPairs(QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs, double dist_bound,
+                       bool get_closest_points, Filter<T> const * filter) const
+    {
+      return kClosestPairs<MetricT>(query, k_closest_pairs, dist_bound, get_closest_points, true, -1, filter);
+    }
+
+    /**
+     * Get all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and new objects are appended to the array.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQuery(RangeT const & range, Array<T> & result, bool discard_prior_results = true,
+                    Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      processRangeUntil<IntersectionTesterT>(range, RangeQueryFunctor(result), filter);
+    }
+
+    /**
+     * Get the indices of all objects intersecting a range.
+     *
+     * @param range The range to search in.
+     * @param result The indices of objects intersecting the range are stored here.
+     * @param discard_prior_results If true, the contents of \a results are cleared before the range query proceeds. If false,
+     *   the previous results are retained and indices of new objects are appended to the array.
+     * @param filter If not null, elements not allowed by this filter are ignored.
+     */
+    template <typename IntersectionTesterT, typename RangeT>
+    void rangeQueryIndices(RangeT const & range, Array<intx> & result, bool discard_prior_results = true,
+                           Filter<T> const * filter = nullptr) const
+    {
+      if (discard_prior_results) result.clear();
+      processRangeUntil<IntersectionTesterT>(range, RangeQueryIndicesFunctor(result), filter);
+    }
+
+    /**
+     * Apply a functor to all objects in a range, until the functor returns true. The functor should provide the member function
+     * (or be a function pointer with the equivalent signature)
+     * \code
+     * bool operator()(intx index, T const & t)
+     * \endcode
+     * and will be passed the index of each object contained in the range as well as a handle to the object itself. If the
+     * functor returns true on any object, the search will terminate immediately. To pass a functor by reference, wrap it in
+     * <tt>std::ref</tt>. If \a filter is not null, elements not allowed by it are ignored.
+     *
+     * @return The index of the first object in the range for which the functor evaluated to true (the search stopped
+     *   immediately after processing this object), else a negative value.
+     */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(RangeT const & range, FunctorT functor, Filter<T> const * filter = nullptr) const
+    {
+      return isEmpty() ? -1 : processRangeUntil<IntersectionTesterT>(0, false, range, functor, filter);
+    }
+
+  private:
+    /** A functor to add results of a range query to an array. */
+    class RangeQueryFunctor
+    {
+      public:
+        RangeQueryFunctor(Array<T> & result_) : result(result_) {}
+        bool operator()(intx index, T const & t) { result.push_back(t); return false; }
+
+      private:
+        Array<T> & result;
+    };
+
+    /** A functor to add the indices of results of a range query to an array. */
+    class RangeQueryIndicesFunctor
+    {
+      public:
+        RangeQueryIndicesFunctor(Array<intx> & result_) : result(result_) {}
+        bool operator()(intx index, T const & t) { result.push_back(index); return false; }
+
+      private:
+        Array<intx> & result;
+    };
+
+    /** Header of a saved tree. All offsets are in bytes from the start of the file. */
+    struct FileHeader
+    {
+      char magic[8];           ///< Identifies the file format.
+      uint32 endian_check;     ///< Detects files saved with a different byte order.
+      uint32 version;          ///< Version of the file format.
+      uint32 dim;              ///< Number of dimensions N.
+      uint32 scalar_size;      ///< Size of the scalar type, in bytes.
+      uint32 elem_size;        ///< Size of an element, in bytes.
+      uint32 node_size;        ///< Size of a node, in bytes.
+      uint64 page_size;        ///< Alignment of the buckets in the file.
+      uint64 num_elems;        ///< Number of elements.
+      uint64 num_nodes;        ///< Number of nodes.
+      uint64 num_buckets;      ///< Number of buckets.
+      uint64 nodes_offset;     ///< Start of the node array.
+      uint64 buckets_offset;   ///< Start of the bucket array.
+      uint64 data_offset;      ///< Start of the first bucket.
+      uint64 file_size;        ///< Total size of the file.
+    };
+
+    static char const * const FILE_MAGIC;          ///< Identifies the file format.
+    static uint32 const ENDIAN_CHECK = 0x01020304;  ///< Value that reads differently with the wrong byte order.
+    static uint32 const FILE_VERSION = 1;           ///< Version of the file format.
+
+    /** An element, with its position in the input sequence, as stored in temporary files during the build. */
+    struct Record
+    {
+      T elem;               ///< The element.
+      uint64 source_index;  ///< Position of the element in the input sequence.
+    };
+
+    /** A block of records to be distributed among the leaves of a subtree, held either in memory or in a temporary file. */
+    struct Partition
+    {
+      Array<Record> records;  ///< The records, if held in memory.
+      std::string path;       ///< The temporary file holding the records, or empty if they are held in memory.
+      uint64 num_records;     ///< The number of records.
+
+      /** Constructor. */
+      Partition() : num_records(0) {}
+    };
+
+    /** Compares elements by a coordinate of their centers. */
+    struct CenterLess
+    {
+      intx coord;
+
+      CenterLess(intx coord_) : coord(coord_) {}
+
+      bool operator()(T const & a, T const & b) const
+      {
+        return BoundedTraitsT::getCenter(a)[coord] < BoundedTraitsT::getCenter(b)[coord];
+      }
+    };
+
+    /** Compares an element index to the index of the first element of a bucket. */
+    struct BucketFirstElemLess
+    {
+      bool operator()(uint64 index, Bucket const & bucket) const { return index < bucket.first_elem; }
+    };
+
+    /** Get the offset of the source indices of a bucket from the start of the bucket. */
+    static uint64 sourceIndicesOffset(uint64 num_bucket_elems)
+    {
+      return (num_bucket_elems * sizeof(T) + 7) & ~(uint64)7;
+    }
+
+    /** Get the number of bytes occupied by a bucket, excluding padding. */
+    static uint64 bucketBytes(uint64 num_bucket_elems)
+    {
+      return sourceIndicesOffset(num_bucket_elems) + num_bucket_elems * sizeof(uint64);
+    }
+
+    /** Check if a range of elements lies within the first \a total elements, without overflowing. */
+    static bool isValidElementRange(uint64 first, uint64 count, uint64 total)
+    {
+      return count <= total && first <= total - count;
+    }
+
+    /**
+     * Check if an array of \a count items of \a item_size bytes each, starting at a given offset, lies within a file of the
+     * given size, without overflowing, and starts at a multiple of \a alignment (the file is mapped at a page boundary).
+     */
+    static bool isValidFileArray(uint64 offset, uint64 count, uint64 item_size, uint64 alignment, uint64 file_size)
+    {
+      return offset <= file_size && offset % alignment == 0 && count <= (file_size - offset) / item_size;
+    }
+
+    /** Round a file offset up to a multiple of an alignment, which must be a power of two. */
+    static uint64 alignFileOffset(uint64 offset, uint64 alignment) { return (offset + alignment - 1) & ~(alignment - 1); }
+
+    /** Builds a tree file from a sequence of elements, streaming them through temporary files as needed. */
+    class Builder
+    {
+      public:
+        /** Constructor. */
+        Builder(std::string const & path_, BuildOptions const & options_)
+        : path(path_), options(options_), page_size((uint64)std::max((int64)4096, MemoryMappedFile::pageSize())),
+          data_end(0), num_written(0), num_temp_files(0)
+        {}
+
+        /** Destructor. Deletes any temporary files left behind by an error. */
+        ~Builder()
+        {
+          for (size_t i = 0; i < temp_paths.size(); ++i)
+            FileSystem::remove(temp_paths[i]);
+        }
+
+        /** Build the tree from a sequence of elements. */
+        template <typename InputIterator>
+        bool build(InputIterator begin, InputIterator end)
+        {
+          // Stream the input, keeping a uniform random sample of the elements, and spilling them to a temporary file if there
+          // are too many to hold in memory
+          size_t max_samples = (size_t)std::max((int64)1, std::min((int64)options.getMaxSamples(),
+                                                                   options.getMemoryBudget() / (int64)(4 * sizeof(T))));
+          size_t max_records = (size_t)std::max((int64)1, options.getMemoryBudget() / (int64)(2 * sizeof(Record)));
+
+          Partition all;
+          Array<T> sample;
+          std::mt19937_64 rng(0);
+          std::ofstream spill;
+          Record r;
+          for (uint64 n = 0; begin != end; ++begin, ++n)
+          {
+            r.elem = *begin;
+            r.source_index = n;
+            all.records.push_back(r);
+
+            // Reservoir sampling
+            if (sample.size() < max_samples)
+              sample.push_back(r.elem);
+            else
+            {
+              uint64 j = rng() % (n + 1);
+              if (j < max_samples)
+                sample[(size_t)j] = r.elem;
+            }
+
+            if (all.records.size() >= max_records)
+            {
+              if (!spill.is_open() && !openTempFile(all.path, spill))
+                return false;
+
+              writeRecords(spill, all.records);
+              all.num_records += all.records.size();
+              all.records.clear();
+            }
+          }
+
+          all.num_records += all.records.size();
+          if (spill.is_open())
+          {
+            writeRecords(spill, all.records);
+            Array<Record>().swap(all.records);
+
+            spill.close();
+            if (!spill)
+            {
+              THEA_ERROR << "OutOfCoreKDTreeN: Error writing temporary file '" << all.path << '\'';
+              return false;
+            }
+          }
+
+          // Choose the splits from the sample
+          uint64 bucket_elems = (uint64)std::max((int64)1, options.getBucketBytes() / (int64)(sizeof(T) + sizeof(uint64)));
+          double sample_weight = (sample.empty() ? 0 : all.num_records / (double)sample.size());
+          splitSample(sample.empty() ? nullptr : &sample[0], sample.size(), sample_weight, bucket_elems);
+          Array<T>().swap(sample);
+
+          alwaysAssertM((uint64)nodes.size() < (uint64)std::numeric_limits<uint32>::max(),
+                        "OutOfCoreKDTreeN: Too many nodes");
+
+          FileHeader header;
+          std::memset(&header, 0, sizeof(header));
+          std::memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+          header.endian_check = ENDIAN_CHECK;
+          header.version = FILE_VERSION;
+          header.dim = (uint32)N;
+          header.scalar_size = (uint32)sizeof(ScalarT);
+          header.elem_size = (uint32)sizeof(T);
+          header.node_size = (uint32)sizeof(Node);
+          header.page_size = page_size;
+          header.num_elems = all.num_records;
+          header.num_nodes = (uint64)nodes.size();
+          header.num_buckets = (uint64)buckets.size();
+          header.nodes_offset = alignFileOffset(sizeof(FileHeader), 64);
+          header.buckets_offset = alignFileOffset(header.nodes_offset + header.num_nodes * sizeof(Node), 64);
+          header.data_offset = alignFileOffset(header.buckets_offset + header.num_buckets * sizeof(Bucket), page_size);
+
+          out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+          if (!out)
+          {
+            THEA_ERROR << "OutOfCoreKDTreeN: Could not open file '" << path << "' for writing";
+            return false;
+          }
+
+          // Write the buckets, then the nodes and header before them now that the bounds of the nodes are known
+          data_end = header.data_offset;
+          frontier_slots.assign(nodes.size(), -1);
+          if (!distribute(all, 0))
+            return false;
+
+          finalizeNode(0);
+          header.file_size = std::max(data_end, header.data_offset);
+
+          out.seekp(0);
+          out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+          out.seekp((std::streamoff)header.nodes_offset);
+          out.write(reinterpret_cast<char const *>(&nodes[0]), (std::streamsize)(nodes.size() * sizeof(Node)));
+          out.seekp((std::streamoff)header.buckets_offset);
+          out.write(reinterpret_cast<char const *>(&buckets[0]), (std::streamsize)(buckets.size() * sizeof(Bucket)));
+
+          // Make sure the file extends to the end of the last bucket, which may be partly padding. If the data already reaches
+          // the end, the last byte written is data and must not be overwritten.
+          out.seekp(0, std::ios::end);
+          if ((uint64)out.tellp() < header.file_size)
+          {
+            static char const ZERO = 0;
+            out.seekp((std::streamoff)(header.file_size - 1));
+            out.write(&ZERO, 1);
+          }
+
+          out.close();
+          if (!out)
+          {
+            THEA_ERROR << "OutOfCoreKDTreeN: Error writing file '" << path << '\'';
+            return false;
+          }
+
+          return true;
+        }
+
+      private:
+        /** The split plane of an internal node, used to route elements to leaves during the build. */
+        struct Split
+        {
+          intx coord;     ///< The coordinate axis normal to the plane.
+          ScalarT value;  ///< Elements whose centers have a smaller coordinate than this go to the low child.
+        };
+
+        /**
+         * Recursively create the nodes of a subtree from a sample of its elements, each of which represents \a sample_weight
+         * elements of the input. Returns the index of the root of the subtree.
+         */
+        uint32 splitSample(T * sample, size_t num_samples, double sample_weight, uint64 bucket_elems)
+        {
+          uint32 index = (uint32)nodes.size();
+
+          Node node;
+          std::memset(&node, 0, sizeof(node));
+          nodes.push_back(node);
+          splits.push_back(Split());
+
+          if (num_samples < 2 || num_samples * sample_weight <= (double)bucket_elems)
+          {
+            nodes[index].bucket = (uint32)buckets.size();
+            buckets.push_back(Bucket());
+            bucket_nodes.push_back(index);
+            return index;
+          }
+
+          AxisAlignedBoxT center_bounds;
+          for (size_t i = 0; i < num_samples; ++i)
+            center_bounds.merge(BoundedTraitsT::getCenter(sample[i]));
+
+          intx coord = Math::maxAxis(center_bounds.getExtent());
+          size_t mid = num_samples / 2;
+          std::nth_element(sample, sample + mid, sample + num_samples, CenterLess(coord));
+
+          splits[index].coord = coord;
+          splits[index].value = BoundedTraitsT::getCenter(sample[mid])[coord];
+
+          splitSample(sample, mid, sample_weight, bucket_elems);
+          uint32 hi = splitSample(sample + mid, num_samples - mid, sample_weight, bucket_elems);
+          nodes[index].hi = hi;
+
+          return index;
+        }
+
+        /**
+         * Route an element down the tree from a node, until it reaches a leaf or a node with a non-negative slot in
+         * frontier_slots. Returns the index of the node where it stops.
+         */
+        uint32 route(T const & elem, uint32 index) const
+        {
+          VectorT c = BoundedTraitsT::getCenter(elem);
+          while (!nodes[index].isLeaf() && frontier_slots[index] < 0)
+          {
+            Split const & split = splits[index];
+            index = (c[split.coord] < split.value ? index + 1 : nodes[index].hi);
+          }
+
+          return index;
+        }
+
+        /** Write the records of a partition to the buckets of the leaves of the subtree rooted at a node, in depth-first order. */
+        bool distribute(Partition & part, uint32 index)
+        {
+          // Partitions are loaded when they fit in memory, allowing for a second copy to sort the records by leaf
+          bool fits = (part.num_records * sizeof(Record) <= (uint64)options.getMemoryBudget() / 2);
+
+          if (nodes[index].isLeaf())
+          {
+            if (!part.path.empty() && !fits)
+              return writeBucketFromFile(part, index);
+
+            if (!loadPartition(part)) return false;
+            beginBucket(index, part.num_records);
+            writeBucketBlock(index, part.records.empty() ? nullptr : &part.records[0], part.records.size(), 0);
+            Array<Record>().swap(part.records);
+            return true;
+          }
+
+          if (part.path.empty() || fits)
+          {
+            if (!loadPartition(part)) return false;
+            writeLeaves(part.records, index);
+            Array<Record>().swap(part.records);
+            return true;
+          }
+
+          return splitPartition(part, index);
+        }
+
+        /** Sort the records of a subtree by leaf, and write the bucket of each leaf. */
+        void writeLeaves(Array<Record> const & records, uint32 index)
+        {
+          // The buckets of a subtree are consecutive
+          uint32 first = index, last = index;
+          while (!nodes[first].isLeaf()) first = first + 1;
+          while (!nodes[last].isLeaf()) last = nodes[last].hi;
+
+          uint32 first_bucket = nodes[first].bucket;
+          size_t num_subtree_buckets = (size_t)(nodes[last].bucket - first_bucket + 1);
+
+          Array<uint32> record_buckets(records.size());
+          Array<uint64> offsets(num_subtree_buckets + 1, 0);
+          for (size_t i = 0; i < records.size(); ++i)
+          {
+            record_buckets[i] = nodes[route(records[i].elem, index)].bucket - first_bucket;
+            offsets[record_buckets[i] + 1]++;
+          }
+
+          for (size_t b = 0; b < num_subtree_buckets; ++b)
+            offsets[b + 1] += offsets[b];
+
+          Array<Record> sorted(records.size());
+          Array<uint64> next(offsets.begin(), offsets.end() - 1);
+          for (size_t i = 0; i < records.size(); ++i)
+            sorted[(size_t)next[record_buckets[i]]++] = records[i];
+
+          for (size_t b = 0; b < num_subtree_buckets; ++b)
+          {
+            uint32 leaf = bucket_nodes[first_bucket + b];
+            uint64 count = offsets[b + 1] - offsets[b];
+            beginBucket(leaf, count);
+            writeBucketBlock(leaf, count > 0 ? &sorted[(size_t)offsets[b]] : nullptr, (size_t)count, 0);
+          }
+        }
+
+        /**
+         * Split a partition that is too large to fit in memory among the subtrees rooted at a frontier below a node, in a single
+         * streaming pass, and recursively distribute the resulting partitions.
+         */
+        bool splitPartition(Partition & part, uint32 index)
+        {
+          // Expand the frontier level by level, keeping it in depth-first order, as long as the number of partitions allows
+          size_t max_parts = (size_t)std::max(options.getMaxPartitions(), (intx)2);
+          Array<uint32> frontier(1, index);
+          while (true)
+          {
+            size_t num_internal = 0;
+            for (size_t i = 0; i < frontier.size(); ++i)
+              if (!nodes[frontier[i]].isLeaf()) num_internal++;
+
+            if (num_internal == 0 || frontier.size() + num_internal > max_parts)
+              break;
+
+            Array<uint32> expanded;
+            for (size_t i = 0; i < frontier.size(); ++i)
+            {
+              if (nodes[frontier[i]].isLeaf())
+                expanded.push_back(frontier[i]);
+              else
+              {
+                expanded.push_back(frontier[i] + 1);
+                expanded.push_back(nodes[frontier[i]].hi);
+              }
+            }
+
+            frontier.swap(expanded);
+          }
+
+          size_t num_parts = frontier.size();
+          Array<Partition> parts(num_parts);
+          Array<std::ofstream> part_files(num_parts);
+          Array< Array<Record> > part_buffers(num_parts);
+          size_t buffer_records = (size_t)std::max((int64)1,
+                                                   options.getMemoryBudget() / (int64)(2 * num_parts * sizeof(Record)));
+          for (size_t i = 0; i < num_parts; ++i)
+          {
+            frontier_slots[frontier[i]] = (int32)i;
+            if (!openTempFile(parts[i].path, part_files[i]))
+              return false;
+
+            part_buffers[i].reserve(buffer_records);
+          }
+
+          std::ifstream in(part.path.c_str(), std::ios::binary);
+          Array<Record> chunk;
+          for (uint64 num_read = 0; num_read < part.num_records; )
+          {
+            if (!readRecords(in, part, num_read, buffer_records, chunk))
+              return false;
+
+            for (size_t i = 0; i < chunk.size(); ++i)
+            {
+              int32 slot = frontier_slots[route(chunk[i].elem, index)];
+              part_buffers[(size_t)slot].push_back(chunk[i]);
+              parts[(size_t)slot].num_records++;
+
+              if (part_buffers[(size_t)slot].size() >= buffer_records)
+              {
+                writeRecords(part_files[(size_t)slot], part_buffers[(size_t)slot]);
+                part_buffers[(size_t)slot].clear();
+              }
+            }
+
+            num_read += chunk.size();
+          }
+
+          in.close();
+          removeTempFile(part.path);
+
+          for (size_t i = 0; i < num_parts; ++i)
+          {
+            frontier_slots[frontier[i]] = -1;
+
+            writeRecords(part_files[i], part_buffers[i]);
+            Array<Record>().swap(part_buffers[i]);
+
+            part_files[i].close();
+            if (!part_files[i])
+            {
+              THEA_ERROR << "OutOfCoreKDTreeN: Error writing temporary file '" << parts[i].path << '\'';
+              return false;
+            }
+          }
+
+          for (size_t i = 0; i < num_parts; ++i)
+            if (!distribute(parts[i], frontier[i]))
+              return false;
+
+          return true;
+        }
+
+        /** Write the bucket of a leaf from a partition that is too large to load into memory, in a single streaming pass. */
+        bool writeBucketFromFile(Partition & part, uint32 leaf)
+        {
+          size_t chunk_records = (size_t)std::max((int64)1, options.getMemoryBudget() / (int64)(2 * sizeof(Record)));
+          beginBucket(leaf, part.num_records);
+
+          std::ifstream in(part.path.c_str(), std::ios::binary);
+          Array<Record> chunk;
+          for (uint64 num_read = 0; num_read < part.num_records; )
+          {
+            if (!readRecords(in, part, num_read, chunk_records, chunk))
+              return false;
+
+            writeBucketBlock(leaf, &chunk[0], chunk.size(), num_read);
+            num_read += chunk.size();
+          }
+
+          in.close();
+          removeTempFile(part.path);
+          return true;
+        }
+
+        /** Start writing the bucket of a leaf with a given number of elements, at the end of the data written so far. */
+        void beginBucket(uint32 leaf, uint64 count)
+        {
+          Bucket & bucket = buckets[nodes[leaf].bucket];
+          bucket.offset = data_end;
+          bucket.first_elem = num_written;
+          bucket.num_elems = count;
+
+          nodes[leaf].first_elem = num_written;
+          nodes[leaf].num_elems = count;
+          leaf_bounds = AxisAlignedBoxT();
+
+          num_written += count;
+          data_end = alignFileOffset(data_end + bucketBytes(count), page_size);
+        }
+
+        /**
+         * Write a block of records to the bucket of a leaf, starting at position \a first in the bucket, and update the bounds of
+         * the leaf.
+         */
+        void writeBucketBlock(uint32 leaf, Record const * records, size_t count, uint64 first)
+        {
+          if (count > 0)
+          {
+            Bucket const & bucket = buckets[nodes[leaf].bucket];
+
+            block_elems.resize(count);
+            block_indices.resize(count);
+            AxisAlignedBoxT elem_bounds;
+            for (size_t i = 0; i < count; ++i)
+            {
+              block_elems[i] = records[i].elem;
+              block_indices[i] = records[i].source_index;
+
+              BoundedTraitsT::getBounds(records[i].elem, elem_bounds);
+              leaf_bounds.merge(elem_bounds);
+            }
+
+            out.seekp((std::streamoff)(bucket.offset + first * sizeof(T)));
+            out.write(reinterpret_cast<char const *>(&block_elems[0]), (std::streamsize)(count * sizeof(T)));
+            out.seekp((std::streamoff)(bucket.offset + sourceIndicesOffset(bucket.num_elems) + first * sizeof(uint64)));
+            out.write(reinterpret_cast<char const *>(&block_indices[0]), (std::streamsize)(count * sizeof(uint64)));
+          }
+
+          if (!leaf_bounds.isNull())
+            setNodeBounds(nodes[leaf], leaf_bounds);
+        }
+
+        /** Compute the element ranges and bounds of the internal nodes of a subtree, from those of the leaves. */
+        void finalizeNode(uint32 index)
+        {
+          Node & node = nodes[index];
+          if (node.isLeaf())
+            return;
+
+          finalizeNode(index + 1);
+          finalizeNode(node.hi);
+
+          Node const * children[2] = { &nodes[index + 1], &nodes[node.hi] };
+          node.first_elem = children[0]->first_elem;
+          node.num_elems = children[0]->num_elems + children[1]->num_elems;
+
+          AxisAlignedBoxT node_bounds;
+          for (int i = 0; i < 2; ++i)
+            if (children[i]->num_elems > 0)
+              node_bounds.merge(children[i]->getBounds());
+
+          if (!node_bounds.isNull())
+            setNodeBounds(node, node_bounds);
+        }
+
+        /** Set the stored bounding box of a node. */
+        static void setNodeBounds(Node & node, AxisAlignedBoxT const & box)
+        {
+          for (intx i = 0; i < N; ++i)
+          {
+            node.lo_corner[i] = box.getLow()[i];
+            node.hi_corner[i] = box.getHigh()[i];
+          }
+        }
+
+        /** Load the records of a partition into memory, if they are in a temporary file, and delete the file. */
+        bool loadPartition(Partition & part)
+        {
+          if (part.path.empty())
+            return true;
+
+          std::ifstream in(part.path.c_str(), std::ios::binary);
+          if (!readRecords(in, part, 0, (size_t)part.num_records, part.records))
+            return false;
+
+          in.close();
+          removeTempFile(part.path);
+          return true;
+        }
+
+        /** Read the next block of at most \a max_records records from the file of a partition. */
+        bool readRecords(std::ifstream & in, Partition const & part, uint64 num_read, size_t max_records, Array<Record> & records)
+        {
+          records.resize((size_t)std::min((uint64)max_records, part.num_records - num_read));
+          if (!records.empty())
+            in.read(reinterpret_cast<char *>(&records[0]), (std::streamsize)(records.size() * sizeof(Record)));
+
+          if (!in)
+          {
+            THEA_ERROR << "OutOfCoreKDTreeN: Error reading temporary file '" << part.path << '\'';
+            return false;
+          }
+
+          return true;
+        }
+
+        /** Append records to a temporary file. */
+        static void writeRecords(std::ofstream & file, Array<Record> const & records)
+        {
+          if (!records.empty())
+            file.write(reinterpret_cast<char const *>(&records[0]), (std::streamsize)(records.size() * sizeof(Record)));
+        }
+
+        /** Create a new temporary file next to the output file. */
+        bool openTempFile(std::string & temp_path, std::ofstream & file)
+        {
+          temp_path = path + format(".%ld.tmp", (long)num_temp_files++);
+          temp_paths.push_back(temp_path);
+
+          file.open(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+          if (!file)
+          {
+            THEA_ERROR << "OutOfCoreKDTreeN: Could not create temporary file '" << temp_path << '\'';
+            return false;
+          }
+
+          return true;
+        }
+
+        /** Delete a temporary file that is no longer needed. */
+        static void removeTempFile(std::string & temp_path)
+        {
+          FileSystem::remove(temp_path);
+          temp_path.clear();
+        }
+
+        std::string path;              ///< The path of the output file.
+        BuildOptions options;          ///< Build options.
+        uint64 page_size;              ///< Alignment of buckets in the output file.
+        std::ofstream out;             ///< The output file.
+        Array<Node> nodes;             ///< The nodes of the tree, in depth-first order.
+        Array<Split> splits;           ///< The split plane of each internal node.
+        Array<Bucket> buckets;         ///< The buckets of the leaves, in depth-first order.
+        Array<uint32> bucket_nodes;    ///< The leaf corresponding to each bucket.
+        Array<int32> frontier_slots;   ///< For each node, its partition in the current split pass, or -1.
+        AxisAlignedBoxT leaf_bounds;   ///< Bounds of the elements written so far to the current bucket.
+        Array<T> block_elems;          ///< Scratch space for writing elements.
+        Array<uint64> block_indices;   ///< Scratch space for writing source indices.
+        uint64 data_end;               ///< The end of the data written so far, rounded up to a page boundary.
+        uint64 num_written;            ///< The number of elements written so far.
+        intx num_temp_files;           ///< The number of temporary files created so far.
+        Array<std::string> temp_paths; ///< The paths of all temporary files created.
+
+    }; // class Builder
+
+    /** Find the bucket containing the element with a given index. */
+    Bucket const & findBucket(intx index) const
+    {
+      debugAssertM(index >= 0 && index < num_elems, "OutOfCoreKDTreeN: Element index out of bounds");
+
+      // The last bucket starting at or before the index is the one containing it, since empty buckets share their first index
+      // with the next bucket
+      return *(std::upper_bound(buckets.begin(), buckets.end(), (uint64)index, BucketFirstElemLess()) - 1);
+    }
+
+    /** Get the elements of a bucket, marking it as recently used. */
+    T const * bucketElements(Bucket const & bucket) const
+    {
+      touchBucket((uint32)(&bucket - &buckets[0]));
+      return reinterpret_cast<T const *>(mapped_file->data() + bucket.offset);
+    }
+
+    /** Get the source indices of the elements of a bucket, marking it as recently used. */
+    uint64 const * bucketSourceIndices(Bucket const & bucket) const
+    {
+      touchBucket((uint32)(&bucket - &buckets[0]));
+      return reinterpret_cast<uint64 const *>(mapped_file->data() + bucket.offset + sourceIndicesOffset(bucket.num_elems));
+    }
+
+    /** Move a bucket to the front of the list of resident buckets, paging it in and evicting other buckets as necessary. */
+    void touchBucket(uint32 b) const
+    {
+      bool loaded = false;
+      Array<uint32> evicted;  // does not allocate unless a bucket is evicted
+      {
+        ScopedLock<std::mutex> guard(&cache_mutex);
+
+        uint32 head = (uint32)buckets.size();
+        if (resident[b])
+        {
+          // Unlink from the current position
+          lru_next[lru_prev[b]] = lru_next[b];
+          lru_prev[lru_next[b]] = lru_prev[b];
+        }
+        else
+        {
+          resident[b] = 1;
+          resident_bytes += (int64)bucketBytes(buckets[b].num_elems);
+          num_bucket_loads++;
+          loaded = true;
+        }
+
+        // Link at the front
+        lru_prev[b] = head;
+        lru_next[b] = lru_next[head];
+        lru_prev[lru_next[head]] = b;
+        lru_next[head] = b;
+
+        enforceCacheBudget(b, evicted);
+      }
+
+      // The system calls to page buckets in and out are made outside the lock, so that other threads are not held up. They are
+      // only hints: if another thread touches an evicted bucket meanwhile, its pages are simply read back from the file.
+      releaseBuckets(evicted);
+      if (loaded)
+        mapped_file->prefetch((int64)buckets[b].offset, (int64)bucketBytes(buckets[b].num_elems));
+    }
+
+    /**
+     * Evict the least recently used buckets, except \a keep, until the resident buckets fit in the budget. The evicted buckets
+     * are appended to \a evicted, to be released by the caller.
+     */
+    void enforceCacheBudget(uint32 keep, Array<uint32> & evicted) const
+    {
+      if (cache_budget < 0)
+        return;
+
+      uint32 head = (uint32)buckets.size();
+      while (resident_bytes > cache_budget && lru_prev[head] != head && lru_prev[head] != keep)
+        evict(lru_prev[head], evicted);
+    }
+
+    /** Remove a bucket from the list of resident buckets, and append it to \a evicted to be released by the caller. */
+    void evict(uint32 b, Array<uint32> & evicted) const
+    {
+      lru_next[lru_prev[b]] = lru_next[b];
+      lru_prev[lru_next[b]] = lru_prev[b];
+
+      resident[b] = 0;
+      resident_bytes -= (int64)bucketBytes(buckets[b].num_elems);
+
+      evicted.push_back(b);
+    }
+
+    /** Release evicted buckets back to the operating system. Should be called without holding the lock on the cache. */
+    void releaseBuckets(Array<uint32> const & evicted) const
+    {
+      for (size_t i = 0; i < evicted.size(); ++i)
+        mapped_file->release((int64)buckets[evicted[i]].offset, (int64)bucketBytes(buckets[evicted[i]].num_elems));
+    }
+
+    /** Get the bounding box for an object, if it is bounded. */
+    template < typename U, typename std::enable_if< IsBoundedN<U, N>::value, int >::type = 0 >
+    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    {
+      BoundedTraitsN<U, N, ScalarT>::getBounds(u, bounds);
+    }
+
+    /** Returns a null bounding box for unbounded objects. */
+    template < typename U, typename std::enable_if< !IsBoundedN<U, N>::value, int >::type = 0 >
+    static void getObjectBounds(U const & u, AxisAlignedBoxT & bounds)
+    {
+      bounds.setNull();
+    }
+
+    /**
+     * Get a lower bound on (the monotone approximation to) the distance between a node's bounding box and a bounded query
+     * object, or a negative value if no such lower bound can be calculated.
+     */
+    template < typename MetricT, typename QueryT, typename std::enable_if< IsBoundedN<QueryT, N>::value, int >::type = 0 >
+    static double monotonePruningDistance(AxisAlignedBoxT const & node_bounds, QueryT const & query,
+                                          AxisAlignedBoxT const & query_bounds)
+    {
+      if (!query_bounds.isNull())
+        return MetricT::template monotoneApproxDistance<N, ScalarT>(query_bounds, node_bounds);
+      else
+        return -1;
+    }
+
+    /**
+     * Get a lower bound on (the monotone approximation to) the distance between a node's bounding box and an unbounded query
+     * object. \a query_bounds is ignored.
+     */
+    template < typename MetricT, typename QueryT, typename std::enable_if< !IsBoundedN<QueryT, N>::value, int >::type = 0 >
+    static double monotonePruningDistance(AxisAlignedBoxT const & node_bounds, QueryT const & query,
+                                          AxisAlignedBoxT const & query_bounds)
+    {
+      return MetricT::template monotoneApproxDistance<N, ScalarT>(query, node_bounds);
+    }
+
+    /** Check if an element passes the per-query filter (if not null). */
+    static bool elementPassesFilter(T const & elem, Filter<T> const * filter)
+    {
+      return !filter || filter->allows(elem);
+    }
+
+    /**
+     * Get the children of an internal node, nearest first, with lower bounds on their distances from a query object. Returns
+     * the number of non-empty children.
+     */
+    template <typename MetricT, typename QueryT>
+    int orderedChildren(uint32 index, QueryT const & query, AxisAlignedBoxT const & query_bounds, uint32 * n,
+                        double * mad) const
+    {
+      int num_children = 0;
+      uint32 children[2] = { index + 1, nodes[index].hi };
+      for (int i = 0; i < 2; ++i)
+        if (nodes[children[i]].num_elems > 0)
+        {
+          n[num_children] = children[i];
+          mad[num_children] = monotonePruningDistance<MetricT>(nodes[children[i]].getBounds(), query, query_bounds);
+          num_children++;
+        }
+
+      // The smaller non-negative value should be first
+      if (num_children == 2 && mad[1] >= 0 && (mad[0] < 0 || mad[0] > mad[1]))
+      {
+        std::swap(n[0], n[1]);
+        std::swap(mad[0], mad[1]);
+      }
+
+      return num_children;
+    }
+
+    /** Recursively look for the closest element to a query object. */
+    template <typename MetricT, typename QueryT>
+    void closestPair(uint32 index, QueryT const & query, AxisAlignedBoxT const & query_bounds, NeighborPair & pair,
+                     bool get_closest_points, Filter<T> const * filter) const
+    {
+      Node const & node = nodes[index];
+      if (node.isLeaf())
+        closestPairLeaf<MetricT>(node, query, pair, get_closest_points, filter);
+      else
+      {
+        uint32 n[2];
+        double mad[2];
+        int num_children = orderedChildren<MetricT>(index, query, query_bounds, n, mad);
+
+        for (int i = 0; i < num_children; ++i)
+          if (pair.getMonotoneApproxDistance() < 0 || mad[i] <= pair.getMonotoneApproxDistance())
+            closestPair<MetricT>(n[i], query, query_bounds, pair, get_closest_points, filter);
+      }
+    }
+
+    /** Search the elements of a leaf for the one closest to a query object that is a proximity query structure. */
+    template < typename MetricT, typename QueryT,
+               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void closestPairLeaf(Node const & leaf, QueryT const & query, NeighborPair & pair, bool get_closest_points,
+                         Filter<T> const * filter) const
+    {
+      T const * elems = bucketElements(buckets[leaf.bucket]);
+      for (uint64 i = 0; i < leaf.num_elems; ++i)
+      {
+        T const & elem = elems[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        double dist_bound = (pair.getMonotoneApproxDistance() >= 0
+                           ? MetricT::invertMonotoneApprox(pair.getMonotoneApproxDistance()) : -1);
+        NeighborPair swapped = query.template closestPair<MetricT>(elem, dist_bound, get_closest_points);
+        if (swapped.isValid()
+         && (pair.getMonotoneApproxDistance() < 0 || swapped.getMonotoneApproxDistance() <= pair.getMonotoneApproxDistance()))
+        {
+          pair = swapped.swapped();
+          pair.setTargetIndex((intx)(leaf.first_elem + i));
+        }
+      }
+    }
+
+    /** Search the elements of a leaf for the one closest to a query object that is not a proximity query structure. */
+    template < typename MetricT, typename QueryT,
+               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void closestPairLeaf(Node const & leaf, QueryT const & query, NeighborPair & pair, bool get_closest_points,
+                         Filter<T> const * filter) const
+    {
+      VectorT qp = VectorT::Zero(), tp = VectorT::Zero();  // initialize to squash uninitialized variable warning
+
+      T const * elems = bucketElements(buckets[leaf.bucket]);
+      for (uint64 i = 0; i < leaf.num_elems; ++i)
+      {
+        T const & elem = elems[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        double mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+        if (pair.getMonotoneApproxDistance() < 0 || mad <= pair.getMonotoneApproxDistance())
+          pair = NeighborPair(0, (intx)(leaf.first_elem + i), mad, qp, tp);
+      }
+    }
+
+    /** Recursively look for the k closest elements to a query object. */
+    template <typename MetricT, typename QueryT, typename BoundedNeighborPairSetT>
+    void kClosestPairs(uint32 index, QueryT const & query, AxisAlignedBoxT const & query_bounds,
+                       BoundedNeighborPairSetT & k_closest_pairs, double dist_bound, bool get_closest_points,
+                       intx use_as_query_index_and_swap, Filter<T> const * filter) const
+    {
+      Node const & node = nodes[index];
+      if (node.isLeaf())
+        kClosestPairsLeaf<MetricT>(node, query, k_closest_pairs, dist_bound, get_closest_points, use_as_query_index_and_swap,
+                                   filter);
+      else
+      {
+        uint32 n[2];
+        double mad[2];
+        int num_children = orderedChildren<MetricT>(index, query, query_bounds, n, mad);
+
+        double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+        for (int i = 0; i < num_children; ++i)
+        {
+          if ((mon_approx_dist_bound < 0 || mad[i] <= mon_approx_dist_bound)
+            && k_closest_pairs.isInsertable(NeighborPair(0, 0, mad[i])))
+          {
+            kClosestPairs<MetricT>(n[i], query, query_bounds, k_closest_pairs, dist_bound, get_closest_points,
+                                   use_as_query_index_and_swap, filter);
+          }
+        }
+      }
+    }
+
+    /** Search the elements of a leaf for the k nearest neighbors of a query object that is a proximity query structure. */
+    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSetT,
+               typename std::enable_if< std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void kClosestPairsLeaf(Node const & leaf, QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs,
+                           double dist_bound, bool get_closest_points, intx use_as_query_index_and_swap,
+                           Filter<T> const * filter) const
+    {
+      T const * elems = bucketElements(buckets[leaf.bucket]);
+      for (uint64 i = 0; i < leaf.num_elems; ++i)
+      {
+        T const & elem = elems[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        query.template kClosestPairs<MetricT>(elem, k_closest_pairs, dist_bound, get_closest_points, false,
+                                              (intx)(leaf.first_elem + i));
+      }
+    }
+
+    /** Search the elements of a leaf for the k nearest neighbors of a query object that is not a proximity query structure. */
+    template < typename MetricT, typename QueryT, typename BoundedNeighborPairSetT,
+               typename std::enable_if< !std::is_base_of<ProximityQueryBaseT, QueryT>::value, int >::type = 0 >
+    void kClosestPairsLeaf(Node const & leaf, QueryT const & query, BoundedNeighborPairSetT & k_closest_pairs,
+                           double dist_bound, bool get_closest_points, intx use_as_query_index_and_swap,
+                           Filter<T> const * filter) const
+    {
+      double mon_approx_dist_bound = (dist_bound >= 0 ? MetricT::computeMonotoneApprox(dist_bound) : -1);
+
+      std::equal_to<NeighborPair> eq_comp;
+      VectorT qp, tp;
+
+      T const * elems = bucketElements(buckets[leaf.bucket]);
+      for (uint64 i = 0; i < leaf.num_elems; ++i)
+      {
+        T const & elem = elems[i];
+        if (!elementPassesFilter(elem, filter))
+          continue;
+
+        // Check if the element is already in the set of neighbors or not
+        intx index = (intx)(leaf.first_elem + i);
+        NeighborPair pair = (use_as_query_index_and_swap >= 0 ? NeighborPair(index, use_as_query_index_and_swap)
+                                                              : NeighborPair(0, index));
+        if (k_closest_pairs.contains(pair, eq_comp))  // already found
+          continue;
+
+        double mad = MetricT::template closestPoints<N, ScalarT>(elem, query, tp, qp);
+        if (mon_approx_dist_bound < 0 || mad <= mon_approx_dist_bound)
+        {
+          pair.setMonotoneApproxDistance(mad);
+
+          if (get_closest_points)
+          {
+            if (use_as_query_index_and_swap >= 0)
+            {
+              pair.setQueryPoint(tp);
+              pair.setTargetPoint(qp);
+            }
+            else
+            {
+              pair.setQueryPoint(qp);
+              pair.setTargetPoint(tp);
+            }
+          }
+
+          k_closest_pairs.insert(pair);
+        }
+      }
+    }
+
+    /**
+     * Apply a functor to all elements of a subtree within a range, until the functor returns true. If \a contained is true,
+     * the subtree is known to lie entirely within the range.
+     */
+    template <typename IntersectionTesterT, typename RangeT, typename FunctorT>
+    intx processRangeUntil(uint32 index, bool contained, RangeT const & range, FunctorT & functor,
+                           Filter<T> const * filter) const
+    {
+      Node const & node = nodes[index];
+      if (node.num_elems <= 0)
+        return -1;
+
+      if (!contained)
+      {
+        // Early exit if the range and node are disjoint
+        AxisAlignedBoxT node_bounds = node.getBounds();
+        if (!IntersectionTesterT::template intersects<N, ScalarT>(range, node_bounds))
+          return -1;
+
+        contained = range.contains(node_bounds);
+      }
+
+      if (node.isLeaf())
+      {
+        T const * elems = bucketElements(buckets[node.bucket]);
+        for (uint64 i = 0; i < node.num_elems; ++i)
+        {
+          T const & elem = elems[i];
+          if (!elementPassesFilter(elem, filter))
+            continue;
+
+          if (contained || IntersectionTesterT::template intersects<N, ScalarT>(elem, range))
+            if (functor((intx)(node.first_elem + i), elem))
+              return (intx)(node.first_elem + i);
+        }
+      }
+      else
+      {
+        intx result = processRangeUntil<IntersectionTesterT>(index + 1, contained, range, functor, filter);
+        if (result >= 0) return result;
+        return processRangeUntil<IntersectionTesterT>(node.hi, contained, range, functor, filter);
+      }
+
+      return -1;
+    }
+
+    MemoryMappedFile::Ptr mapped_file;  ///< The mapped tree file.
+    Array<Node> nodes;                  ///< The nodes of the tree, held in memory.
+    Array<Bucket> buckets;              ///< The buckets of the leaves, held in memory.
+    intx num_elems;                     ///< Number of elements.
+    AxisAlignedBoxT root_bounds;        ///< Bounding box of all elements.
+
+    int64 cache_budget;                 ///< Maximum number of bytes of buckets to keep resident.
+    mutable std::mutex cache_mutex;     ///< Guards the list of resident buckets.
+    mutable Array<uint32> lru_prev;     ///< Previous bucket in the circular list of resident buckets, most recently used first.
+    mutable Array<uint32> lru_next;     ///< Next bucket in the circular list of resident buckets, most recently used first.
+    mutable Array<uint8> resident;      ///< Flags resident buckets.
+    mutable int64 resident_bytes;       ///< Number of bytes of resident buckets.
+    mutable int64 num_bucket_loads;     ///< Number of times a bucket has been paged in.
+
+}; // class OutOfCoreKDTreeN
+
+template <typename T, int N, typename ScalarT>
+char const * const OutOfCoreKDTreeN<T, N, ScalarT>::FILE_MAGIC = "THEAOKDT";
+
+} // namespace Algorithms
+} // namespace Thea
+
+#endif
@@ -0,0 +1,324 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_ArenaAllocator_hpp__
+#define __Thea_ArenaAllocator_hpp__
+
+#include "Common.hpp"
+#include "Array.hpp"
+#include "Noncopyable.hpp"
+#include "Spinlock.hpp"
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Thea {
+
+/**
+ * A pool of small memory blocks, grouped into size classes and carved out of large chunks. A freed block is pushed onto the
+ * free list of its size class and recycled by the next allocation from that class, so allocating and freeing never touch the
+ * system allocator except to obtain a new chunk. All chunks are returned to the system together when the arena is destroyed
+ * or release() is called. A structure whose nodes own nothing but memory from the arena can hence be torn down without
+ * visiting its nodes at all, by abandoning them and releasing the arena (see GeneralMesh).
+ *
+ * Blocks larger than MAX_BLOCK_SIZE bytes bypass the arena and are obtained directly from <tt>operator new</tt>. All blocks are
+ * aligned to GRANULARITY bytes.
+ *
+ * Every operation is serialized by a spinlock, so an arena may be safely shared by allocators in different threads. In the
+ * common case where each data structure has its own arena (as with GeneralMesh), the lock is never contended.
+ *
+ * @see ArenaAllocator
+ */
+class MemoryArena : private Noncopyable
+{
+  public:
+    THEA_DECL_SMART_POINTERS(MemoryArena)
+
+    /** Size classes are multiples of this number of bytes, which is also the alignment of each block. */
+    static size_t const GRANULARITY = 8;
+
+    /** Size of the largest block managed by the arena. */
+    static size_t const MAX_BLOCK_SIZE = 512;
+
+    /** Default size of each chunk obtained from the system. */
+    static size_t const DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    /** Constructor. Memory is obtained from the system in chunks of (at least) \a chunk_size_ bytes. */
+    explicit MemoryArena(size_t chunk_size_ = DEFAULT_CHUNK_SIZE)
+    : chunk_size(std::max(roundUp(chunk_size_), MAX_BLOCK_SIZE)), cursor(nullptr), chunk_end(nullptr), num_live_blocks(0)
+    {
+      std::fill(free_lists, free_lists + NUM_SIZE_CLASSES, (FreeBlock *)nullptr);
+    }
+
+    /** Destructor. Releases all memory held by the arena. */
+    ~MemoryArena() { release(); }
+
+    /** Allocate a block of \a num_bytes bytes. */
+    void * allocate(size_t num_bytes)
+    {
+      if (num_bytes > MAX_BLOCK_SIZE)
+        return ::operator new(num_bytes);
+
+      size_t size_class = sizeClass(num_bytes);
+
+      lock.lock();
+        void * block;
+        if (free_lists[size_class])
+        {
+          block = free_lists[size_class];
+          free_lists[size_class] = free_lists[size_class]->next;
+        }
+        else
+        {
+          size_t block_size = (size_class + 1) * GRANULARITY;
+          if ((size_t)(chunk_end - cursor) < block_size)
+            newChunk();
+
+          block = cursor;
+          cursor += block_size;
+        }
+
+        num_live_blocks++;
+      lock.unlock();
+
+      return block;
+    }
+
+    /** Return a block of \a num_bytes bytes, previously obtained by calling allocate() on this arena, to the arena. */
+    void deallocate(void * p, size_t num_bytes)
+    {
+      if (!p)
+        return;
+
+      if (num_bytes > MAX_BLOCK_SIZE)
+      {
+        ::operator delete(p);
+        return;
+      }
+
+      size_t size_class = sizeClass(num_bytes);
+
+      lock.lock();
+        FreeBlock * block = static_cast<FreeBlock *>(p);
+        block->next = free_lists[size_class];
+        free_lists[size_class] = block;
+
+        num_live_blocks--;
+      lock.unlock();
+    }
+
+    /**
+     * Return all chunks to the system in one go. Every block allocated from the arena (except those larger than
+     * MAX_BLOCK_SIZE) becomes invalid, whether or not it was deallocated.
+     */
+    void release()
+    {
+      lock.lock();
+        for (size_t i = 0; i < chunks.size(); ++i)
+          ::operator delete(chunks[i]);
+
+        chunks.clear();
+        std::fill(free_lists, free_lists + NUM_SIZE_CLASSES, (FreeBlock *)nullptr);
+        cursor = chunk_end = nullptr;
+        num_live_blocks = 0;
+      lock.unlock();
+    }
+
+    /** Get the number of chunks currently held by the arena. */
+    size_t numChunks() const { return chunks.size(); }
+
+    /** Get the total number of bytes currently held by the arena in chunks. */
+    size_t numReservedBytes() const { return chunks.size() * chunk_size; }
+
+    /** Get the number of blocks allocated from the chunks of the arena and not yet deallocated. */
+    intx numLiveBlocks() const { return num_live_blocks; }
+
+  private:
+    /** Number of size classes. */
+    static size_t const NUM_SIZE_CLASSES = MAX_BLOCK_SIZE / GRANULARITY;
+
+    /** An unused block, linked into the free list of its size class. */
+    struct FreeBlock { FreeBlock * next; };
+
+    /** Round a size up to the next multiple of GRANULARITY. */
+    static size_t roundUp(size_t num_bytes) { return (num_bytes + GRANULARITY - 1) / GRANULARITY * GRANULARITY; }
+
+    /** Get the size class of a block of \a num_bytes bytes, where 0 < num_bytes <= MAX_BLOCK_SIZE. */
+    static size_t sizeClass(size_t num_bytes) { return num_bytes == 0 ? 0 : (num_bytes - 1) / GRANULARITY; }
+
+    /** Start allocating from a new chunk, abandoning the unused tail of the current one. Must be called with the lock held. */
+    void newChunk()
+    {
+      cursor = static_cast<unsigned char *>(::operator new(chunk_size));
+      chunk_end = cursor + chunk_size;
+      chunks.push_back(cursor);
+    }
+
+    size_t chunk_size;                         ///< Size of each chunk, in bytes.
+    Array<void *> chunks;                      ///< Chunks obtained from the system.
+    FreeBlock * free_lists[NUM_SIZE_CLASSES];  ///< Recycled blocks, one list per size class.
+    unsigned char * cursor;                    ///< Start of the unused region of the current chunk.
+    unsigned char * chunk_end;                 ///< End of the current chunk.
+    intx num_live_blocks;                      ///< Number of blocks allocated from chunks and not deallocated.
+    Spinlock lock;                             ///< Serializes access to the arena.
+
+}; // class MemoryArena
+
+/**
+ * A standard-compliant allocator that draws memory from a MemoryArena. The allocator holds a plain pointer to the arena and
+ * does not own it, so it is as cheap to copy as a pointer: the arena must outlive every allocator (and every container) that
+ * uses it. Copies of an allocator, including copies rebound to other value types, share the same arena. A default-constructed
+ * allocator is not bound to any arena and simply forwards to <tt>operator new</tt> and <tt>operator delete</tt>.
+ *
+ * To give a data structure that is parametrized by the allocator (such as GeneralMesh) its own arena, have it hold an
+ * AllocatorInstance, which owns the arena and can release all its memory in one go.
+ *
+ * @see MemoryArena, AllocatorInstance
+ */
+template <typename T>
+class ArenaAllocator
+{
+  public:
+    typedef T value_type;                    ///< Type of allocated objects.
+    typedef std::size_t size_type;           ///< Type of block sizes.
+    typedef std::ptrdiff_t difference_type;  ///< Type of difference of two pointers.
+
+    typedef T * pointer;                     ///< Pointer to an allocated object/block.
+    typedef T const * const_pointer;         ///< Const pointer to an allocated object/block.
+
+    typedef T & reference;                   ///< Reference to an allocated object.
+    typedef T const & const_reference;       ///< Const reference to an allocated object.
+
+    // Containers that exchange contents must also exchange arenas, else blocks would be returned to the wrong arena
+    typedef std::true_type propagate_on_container_move_assignment;  ///< Move-assignment transfers the arena.
+    typedef std::true_type propagate_on_container_swap;             ///< Swapping containers swaps their arenas.
+
+  public:
+    /** Default constructor. The allocator is not bound to any arena. */
+    ArenaAllocator() throw () : arena(nullptr) {}
+
+    /** Construct an allocator that draws memory from an arena, which must outlive the allocator and all its copies. */
+    explicit ArenaAllocator(MemoryArena * arena_) throw () : arena(arena_) {}
+
+    /** Copy constructor. The new allocator shares the arena of \a src. */
+    template <typename T2> ArenaAllocator(ArenaAllocator<T2> const & src) throw () : arena(src.getArena()) {}
+
+    /** Get the arena used by the allocator, if any. */
+    MemoryArena * getArena() const { return arena; }
+
+    /** Get the address of a referenced object. */
+    pointer address(reference r) { return &r; }
+
+    /** Get the address of a referenced object. */
+    const_pointer address(const_reference r) const { return &r; }
+
+    /** Allocate a block for \a n objects. */
+    pointer allocate(size_type n)
+    {
+      static_assert(alignof(T) <= MemoryArena::GRANULARITY, "ArenaAllocator: Type is over-aligned");
+
+      return static_cast<pointer>(arena ? arena->allocate(n * sizeof(value_type)) : ::operator new(n * sizeof(value_type)));
+    }
+
+    /** Deallocate a block for \a n objects, previously obtained from this allocator or one that compares equal to it. */
+    void deallocate(pointer p, size_type n)
+    {
+      if (arena)
+        arena->deallocate(p, n * sizeof(value_type));
+      else
+        ::operator delete(p);
+    }
+
+    /** Construct an object at a memory location. */
+    template <typename U, typename... Args> void construct(U * p, Args &&... args)
+    { new ((void *)p) U(std::forward<Args>(args)...); }
+
+    /** Destroy an object at a memory location. */
+    template <typename U> void destroy(U * p) { p->~U(); }
+
+    /** Get the maximum number of elements that can theoretically be allocated. */
+    size_type max_size() const throw () { return size_type(-1) / sizeof(value_type); }
+
+    /** A structure that enables this allocator to allocate storage for objects of another type. */
+    template <typename T2>
+    struct rebind
+    {
+      typedef ArenaAllocator<T2> other;
+    };
+
+    /** Check if two allocators are different. */
+    template <typename T2> bool operator!=(ArenaAllocator<T2> const & other) const { return !(*this == other); }
+
+    /**
+     * Check if two allocators are the same. Returns true if and only if storage allocated from *this can be deallocated from
+     * \a other, and vice versa, i.e. if both use the same arena or neither uses one.
+     */
+    template <typename T2> bool operator==(ArenaAllocator<T2> const & other) const { return arena == other.getArena(); }
+
+  private:
+    MemoryArena * arena;  ///< The arena (not owned) from which memory is drawn, or null to use the global heap.
+
+}; // class ArenaAllocator
+
+/**
+ * Holds the allocator, and any state it needs, for a single instance of a class parametrized by an allocator type, such as
+ * GeneralMesh. The default implementation simply holds a default-constructed allocator, so stateless allocators like
+ * <tt>std::allocator</tt> are unaffected. Specialized for ArenaAllocator to give each instance its own arena, which is owned
+ * by the AllocatorInstance.
+ *
+ * If CAN_RELEASE_ALL is true, releaseAll() frees all memory ever obtained from the allocator (and its copies) at once. Objects
+ * in that memory are not destroyed, so the owner must ensure they need no destruction beyond freeing the memory, and must
+ * never access them again. Else, releaseAll() does nothing.
+ */
+template <typename AllocatorT>
+class AllocatorInstance : private Noncopyable
+{
+  public:
+    /** Whether releaseAll() frees all memory obtained from the allocator. */
+    static bool const CAN_RELEASE_ALL = false;
+
+    /** Get the allocator. */
+    AllocatorT const & get() const { return alloc; }
+
+    /** Does nothing, since the allocator cannot free all its memory at once. */
+    void releaseAll() {}
+
+  private:
+    AllocatorT alloc;  ///< The allocator.
+
+}; // class AllocatorInstance
+
+// Each instance owns a private arena, released in bulk by releaseAll() or when the instance is destroyed.
+template <typename T>
+class AllocatorInstance< ArenaAllocator<T> > : private Noncopyable
+{
+  public:
+    static bool const CAN_RELEASE_ALL = true;
+
+    AllocatorInstance() : alloc(&arena) {}
+
+    ArenaAllocator<T> const & get() const { return alloc; }
+
+    void releaseAll() { arena.release(); }
+
+  private:
+    MemoryArena arena;         ///< The arena owned by the instance (must be initialized before the allocator).
+    ArenaAllocator<T> alloc;   ///< Allocator drawing from the arena.
+
+}; // class AllocatorInstance< ArenaAllocator<T> >
+
+} // namespace Thea
+
+#endif
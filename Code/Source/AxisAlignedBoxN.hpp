@@ -424,7 +424,7 @@ class /* THEA_DLL_LOCAL */ AxisAlignedBoxNBase : public RayIntersectableN<N, T>
           return RayIntersectionN<N, T>(-1);
       }
 
-      VectorT max_t(-1), location;
+      VectorT max_t = VectorT::Constant(-1), location;
       VectorT const & origin = ray.getOrigin();
       VectorT const & dir = ray.getDirection();
       bool inside = true;
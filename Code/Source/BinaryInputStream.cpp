@@ -65,6 +65,9 @@ bool const BinaryInputStream::NO_COPY = false;
 // The initial buffer will be no larger than this (50 MB), but may grow if a large memory read occurs.
 #define THEA_INITIAL_READ_BUFFER_LENGTH 50000000
 
+// In-place reads of mapped files of at least this many pages are prefetched. Smaller reads are not worth a system call.
+#define THEA_MIN_PREFETCH_PAGES 16
+
 void
 BinaryInputStream::readBool8(int64 n, Array<bool> & out)
 {
@@ -283,7 +286,7 @@ BinaryInputStream::BinaryInputStream(uint8 const * data, int64 data_len, Endiann
   }
 }
 
-BinaryInputStream::BinaryInputStream(std::string const & path, Endianness file_endian)
+BinaryInputStream::BinaryInputStream(std::string const & path, Endianness file_endian, bool memory_map)
 : NamedObject(FilePath::objectName(path)),
   m_path(FileSystem::resolve(path)),
   m_bitPos(0),
@@ -301,6 +304,28 @@ BinaryInputStream::BinaryInputStream(std::string const & path, Endianness file_e
   // Figure out how big the file is and verify that it exists.
   m_length = FileSystem::fileSize(m_path);
 
+#ifndef THEA_WINDOWS
+  if (memory_map && m_length > 0)
+  {
+    // Mapping fails if the path is not a regular file, in which case the file is read into a buffer as usual
+    MemoryMappedFile::Ptr mapped_file(new MemoryMappedFile);
+    if (mapped_file->open(m_path) && mapped_file->data() && mapped_file->size() == m_length)
+    {
+      // Files are usually read from beginning to end, so the OS can read ahead. Start paging in as much as would have been
+      // read into a buffer.
+      mapped_file->adviseSequential();
+      mapped_file->prefetch(0, THEA_INITIAL_READ_BUFFER_LENGTH);
+
+      m_mappedFile = mapped_file;
+      m_buffer = const_cast<uint8 *>(mapped_file->data());  // never written to
+      m_bufferLength = m_length;
+      m_freeBuffer = false;
+
+      return;
+    }
+  }
+#endif
+
   // Open the file
   FILE * file = fopen(m_path.c_str(), "rb");
 
@@ -366,14 +391,26 @@ BinaryInputStream::BinaryInputStream(BinaryInputStream & src, int64 block_len)
   if (m_length <= 0)
     return;
 
-  // FIXME: Replace the copy with an (offset, length) pair that directly references the source file or memory buffer? But
-  // because of the way BinaryInputStream caches data from a file (reopening it when buffering), this might not actually save
-  // memory for files at least.
+  // If the source buffer holds all its data (a mapped file, a block of memory, or a small file read in full), it will never
+  // be reloaded and the block can simply reference it
+  if (src.m_alreadyRead == 0 && src.m_bufferLength >= src.m_length)
+  {
+    src.prepareToRead(m_length);
+
+    m_buffer = src.m_buffer + src.m_pos;
+    m_bufferLength = m_length;
+    m_freeBuffer = false;
+    m_mappedFile = src.m_mappedFile;  // keep the mapping alive
+
+    src.m_pos += m_length;
+    return;
+  }
 
   m_buffer = (uint8 *)std::malloc((size_t)m_length);
   if (!m_buffer)
     throw Error(getNameStr() + ": Could not allocate buffer");
 
+  m_bufferLength = m_length;  // else the first read would try to reload the block from the start of the source file
   src.readBytes(m_length, m_buffer);
 }
 
@@ -396,6 +433,24 @@ BinaryInputStream::readBytes(int64 n, void * bytes)
   }
 }
 
+uint8 const *
+BinaryInputStream::readBytesInPlace(int64 n)
+{
+  alwaysAssertM(n >= 0, format("BinaryInputStream: Cannot read a negative number of bytes (%ld)", (intx)n));
+
+  prepareToRead(n);
+
+  // A large block of a mapped file is probably about to be scanned, so start paging it in (this may be a view of a block of
+  // the file, so compute the offset from the start of the mapping)
+  if (m_mappedFile && n >= THEA_MIN_PREFETCH_PAGES * MemoryMappedFile::pageSize())
+    m_mappedFile->prefetch((int64)(m_buffer + m_pos - m_mappedFile->data()), n);
+
+  uint8 const * bytes = m_buffer + m_pos;
+  m_pos += n;
+
+  return bytes;
+}
+
 uint64
 BinaryInputStream::readUInt64()
 {
@@ -484,35 +539,71 @@ BinaryInputStream::readNullTerminatedString()
 std::string
 BinaryInputStream::readLine()
 {
+  int64 length = 0;
+  char const * line = readLineInPlace(length);
+  return std::string(line, (size_t)length);
+}
+
+namespace BinaryInputStreamInternal {
+
+// Find the first newline character (\n or \r) in a range of bytes, or return null if there is none.
+uint8 const *
+findNewline(uint8 const * begin, uint8 const * end)
+{
+  uint8 const * nl = static_cast<uint8 const *>(std::memchr(begin, '\n', (size_t)(end - begin)));
+  uint8 const * cr = static_cast<uint8 const *>(std::memchr(begin, '\r', (size_t)((nl ? nl : end) - begin)));
+  return cr ? cr : nl;
+}
+
+} // namespace BinaryInputStreamInternal
+
+char const *
+BinaryInputStream::readLineInPlace(int64 & length)
+{
+  // Scan the buffered part of the stream for a newline, loading more of the file until one is found or the file ends
   int64 n = 0;
-  while ((m_pos + m_alreadyRead + n) < m_length)  // check if we we can read byte n
+  uint8 const * nl = nullptr;
+  while (true)
   {
-    prepareToRead(n + 1);
-    if (isNewline(m_buffer[m_pos + n]))
+    int64 num_buffered = std::min(m_bufferLength, m_length - m_alreadyRead) - m_pos;
+    if (num_buffered > n)
+    {
+      nl = BinaryInputStreamInternal::findNewline(m_buffer + m_pos + n, m_buffer + m_pos + num_buffered);
+      if (nl)
+      {
+        n = (int64)(nl - (m_buffer + m_pos));
+        break;
+      }
+
+      n = num_buffered;
+    }
+
+    if (m_pos + m_alreadyRead + n >= m_length)  // end of file
       break;
 
-    ++n;
+    prepareToRead(n + 1);
   }
 
-  // Read everything upto but not including the newline character. n is the correct length regardless of whether we reached a
-  // newline or EOF.
-  std::string const s = readString(n);
+  // Make sure the newline and the character following it (which may complete a two-character newline) are in the buffer, so
+  // that consuming them below does not reload the buffer and invalidate the line
+  int64 remaining = m_length - (m_pos + m_alreadyRead);
+  prepareToRead(std::min(n + 2, remaining));
+
+  char const * line = (char const *)(m_buffer + m_pos);
+  length = n;
+  m_pos += n;
 
   // Consume the newline
   if (hasMore())  // if we haven't reached the end of the file, then we've encountered a newline
   {
-    char firstNLChar = readInt8();
+    uint8 first_nl_char = m_buffer[m_pos++];
 
     // Consume the 2nd newline character (must be different from the first), if it exists
-    if (hasMore())
-    {
-      prepareToRead(1);
-      if (isNewline(m_buffer[m_pos]) && (m_buffer[m_pos] != firstNLChar))
-        skip(1);
-    }
+    if (hasMore() && isNewline((char)m_buffer[m_pos]) && m_buffer[m_pos] != first_nl_char)
+      m_pos++;
   }
 
-  return s;
+  return line;
 }
 
 std::string
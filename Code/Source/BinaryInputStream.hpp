@@ -41,6 +41,7 @@
 #include "Colors.hpp"
 #include "CoordinateFrame3.hpp"
 #include "MatVec.hpp"
+#include "MemoryMappedFile.hpp"
 #include "NamedObject.hpp"
 #include "Noncopyable.hpp"
 #include "Plane3.hpp"
@@ -100,6 +101,9 @@ class THEA_API BinaryInputStream : public virtual NamedObject, private Noncopyab
     /** When true, the buffer is freed in the destructor. */
     bool               m_freeBuffer;
 
+    /** The file mapped into memory, if the buffer points into a mapping of the file instead of holding a copy of it. */
+    MemoryMappedFile::Ptr m_mappedFile;
+
     /** Ensures that we are able to read at least min_length from start_position (relative to start of file). */
     void loadIntoMemory(int64 start_position, int64 min_length = 0);
 
@@ -150,8 +154,19 @@ class THEA_API BinaryInputStream : public virtual NamedObject, private Noncopyab
 
     }; // class EndiannessScope
 
-    /** Open a file as a binary input stream. If the file cannot be opened, an error is thrown. */
-    BinaryInputStream(std::string const & path, Endianness file_endian);
+    /**
+     * Open a file as a binary input stream. If the file cannot be opened, an error is thrown.
+     *
+     * If \a memory_map is true (the default), the platform is POSIX-compliant and the path refers to a regular, non-empty file,
+     * the file is mapped into memory and read in place: the operating system pages in its contents as they are accessed, and
+     * no part of the file is ever copied into a separate buffer. Else, the file is read into a buffer in large chunks as
+     * necessary.
+     *
+     * A mapped file must not be truncated by another process while the stream (or any sub-stream of it) exists: accessing
+     * the missing part of the mapping raises SIGBUS and terminates the program, instead of throwing a read error. Pass
+     * \a memory_map = false if the file may change while it is being read.
+     */
+    BinaryInputStream(std::string const & path, Endianness file_endian, bool memory_map = true);
 
     /**
      * Wrap a block of in-memory data as an input stream. Unless you specify \a copy_memory = false, the data is copied from the
@@ -164,6 +179,9 @@ class THEA_API BinaryInputStream : public virtual NamedObject, private Noncopyab
      * source stream must exist as long as this object does, since the implementation does not guarantee that the block will be
      * fully copied to a new buffer. The block is marked as read in the source stream, and the next read position in that stream
      * is set to just after the block.
+     *
+     * If all the data of the source stream is in memory (e.g. if it is a memory-mapped file or a block of memory), the new
+     * stream is simply a view of the block and no data is copied.
      */
     BinaryInputStream(BinaryInputStream & src, int64 block_len);
 
@@ -189,6 +207,12 @@ class THEA_API BinaryInputStream : public virtual NamedObject, private Noncopyab
       return m_path;
     }
 
+    /** Check if the stream reads directly from a file mapped into memory. */
+    bool isMemoryMapped() const
+    {
+      return (bool)m_mappedFile;
+    }
+
     /** Get the number of bytes in the stream. */
     int64 size() const
     {
@@ -363,11 +387,27 @@ class THEA_API BinaryInputStream : public virtual NamedObject, private Noncopyab
     /** Read a sequence of \a n bytes. */
     void readBytes(int64 n, void * bytes);
 
+    /**
+     * Read a sequence of \a n bytes without copying them, and return a pointer to the first one in the internal buffer of the
+     * stream. If the bytes are not all in the buffer, it is enlarged as necessary and they are read into it from the file. The
+     * pointer is invalidated by the next operation on the stream.
+     */
+    uint8 const * readBytesInPlace(int64 n);
+
     /**
      * Reads until any newline character (\\r, \\r\\n, \\n\\r, \\n) or the end of the file is encountered. Consumes the newline.
      */
     std::string readLine();
 
+    /**
+     * Reads a line like readLine(), but without copying it. Returns a pointer to the first character of the line in the
+     * internal buffer of the stream, and sets \a length to the number of characters in the line, excluding the newline. The
+     * line is <b>not</b> null-terminated, and the pointer is invalidated by the next operation on the stream. Newlines are
+     * located with <tt>std::memchr</tt>, which is vectorized on most platforms, so this is much faster than readLine() for
+     * parsing large text files.
+     */
+    char const * readLineInPlace(int64 & length);
+
     /**
      * Read a string. The format is:
      * - Length of string (32-bit integer)
@@ -76,10 +76,50 @@ class /* THEA_API */ BoxN : public RayIntersectableN<N, T>
     /** Check if the box intersects (i.e. contains) a point. */
     bool intersects(VectorT const & p) const { return contains(p); }
 
-    /** Check if the box intersects an axis-aligned box. */
-    bool intersects(AxisAlignedBoxT const & aab) const
+    /**
+     * Check if the box intersects an axis-aligned box, with the separating axis test. The test is exact for N <= 3. For higher
+     * dimensions only the face normals of the two boxes are tested, so the function may report intersections between disjoint
+     * boxes (but never the reverse).
+     */
+    bool intersects(AxisAlignedBoxT const & aab_) const
     {
-      throw Error("BoxN: Intersection with axis-aligned box not implemented");
+      if (aab.isNull() || aab_.isNull())
+        return false;
+
+      auto const & rot = frame.getRotation();
+      VectorT h_this = 0.5f * aab.getExtent();
+      VectorT h_other = 0.5f * aab_.getExtent();
+      VectorT diff = frame.pointToWorldSpace(aab.getCenter()) - aab_.getCenter();
+
+      // Check if the projections of the boxes onto an axis are disjoint
+      auto separates = [&](VectorT const & axis)
+      {
+        T r_other = axis.cwiseAbs().dot(h_other);
+        T r_this = (rot.transpose() * axis).cwiseAbs().dot(h_this);
+        return std::abs(axis.dot(diff)) > r_this + r_other;
+      };
+
+      for (intx i = 0; i < N; ++i)
+      {
+        if (separates(VectorT::Unit(i)) || separates(VectorT(rot.col(i))))
+          return false;
+      }
+
+      // In 3D, also test the cross products of pairs of edge directions
+      if (N == 3)
+      {
+        for (intx i = 0; i < N; ++i)
+          for (intx j = 0; j < N; ++j)
+          {
+            VectorT axis = VectorT::Zero();  // unit_i x rot.col(j)
+            axis[(i + 1) % N] = -rot((i + 2) % N, j);
+            axis[(i + 2) % N] = rot((i + 1) % N, j);
+            if (separates(axis))
+              return false;
+          }
+      }
+
+      return true;
     }
 
     /** Check if the box intersects another. */
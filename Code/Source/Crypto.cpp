@@ -83,4 +83,18 @@ Crypto::crc32(void const * byte, size_t num_bytes)
   return base_crc32(base_crc32(0, nullptr, 0), byte, num_bytes);
 }
 
+uint64
+Crypto::fnv1a64(void const * byte, size_t num_bytes, uint64 seed)
+{
+  uint8 const * p = (uint8 const *)byte;
+  uint64 h = seed;
+  for (size_t i = 0; i < num_bytes; ++i)
+  {
+    h ^= (uint64)p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
 } // namespace Thea
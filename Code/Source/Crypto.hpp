@@ -26,6 +26,12 @@ class THEA_API Crypto
     /** Get the CRC32 hash of a sequence of bytes. */
     static uint32 crc32(void const * byte, size_t num_bytes);
 
+    /**
+     * Get the 64-bit FNV-1a hash of a sequence of bytes. Long sequences can be hashed incrementally by passing the hash of the
+     * preceding bytes as \a seed. Not suitable for cryptographic purposes, but a good fast checksum.
+     */
+    static uint64 fnv1a64(void const * byte, size_t num_bytes, uint64 seed = 0xcbf29ce484222325ULL);
+
 }; // class Crypto
 
 } // namespace Thea
@@ -0,0 +1,502 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#include "CompactMesh.hpp"
+#include "../Polygon3.hpp"
+
+namespace Thea {
+namespace Graphics {
+
+CompactMesh::CompactMesh(std::string const & name)
+: NamedObject(name),
+  num_tri_faces(0),
+  num_quad_faces(0),
+  valid_bounds(true),
+  valid_adjacency(false),
+  valid_packed_topology(false),
+  vertex_matrix(nullptr, 3, 0),
+  tri_matrix(nullptr, 3, 0),
+  quad_matrix(nullptr, 4, 0),
+  vertex_wrapper(&vertex_matrix),
+  tri_wrapper(&tri_matrix),
+  quad_wrapper(&quad_matrix)
+{}
+
+CompactMesh::CompactMesh(CompactMesh const & src)
+: NamedObject(src),
+  positions(src.positions),
+  normals(src.normals),
+  face_offsets(src.face_offsets),
+  face_vertices(src.face_vertices),
+  num_tri_faces(src.num_tri_faces),
+  num_quad_faces(src.num_quad_faces),
+  vertex_source_indices(src.vertex_source_indices),
+  face_source_indices(src.face_source_indices),
+  valid_bounds(src.valid_bounds),
+  bounds(src.bounds),
+  valid_adjacency(false),
+  valid_packed_topology(false),
+  vertex_matrix(nullptr, 3, 0),
+  tri_matrix(nullptr, 3, 0),
+  quad_matrix(nullptr, 4, 0),
+  vertex_wrapper(&vertex_matrix),
+  tri_wrapper(&tri_matrix),
+  quad_wrapper(&quad_matrix)
+{}
+
+void
+CompactMesh::clear()
+{
+  positions.clear();
+  normals.clear();
+  face_offsets.clear();
+  face_vertices.clear();
+  num_tri_faces = num_quad_faces = 0;
+
+  vertex_source_indices.clear();
+  face_source_indices.clear();
+
+  vertex_face_offsets.clear();
+  vertex_faces.clear();
+  halfedge_faces.clear();
+  opposite_halfedges.clear();
+  packed_tris.clear();
+  packed_quads.clear();
+
+  valid_bounds = true;
+  bounds = AxisAlignedBox3();
+
+  invalidateTopology();
+}
+
+void
+CompactMesh::reserve(intx num_vertices, intx num_faces, intx num_face_vertex_indices)
+{
+  if (num_vertices >= 0)
+  {
+    positions.reserve((size_t)num_vertices);
+    if (!normals.empty()) normals.reserve((size_t)num_vertices);
+  }
+
+  if (num_faces >= 0)
+    face_offsets.reserve((size_t)num_faces + 1);
+
+  if (num_face_vertex_indices >= 0)
+    face_vertices.reserve((size_t)num_face_vertex_indices);
+}
+
+AbstractDenseMatrix<Real> const *
+CompactMesh::getVertexMatrix() const
+{
+  // Assume Vector3 is tightly packed and has no padding
+  Vector3 const * buf = (positions.empty() ? nullptr : positions.data());
+  new (&vertex_matrix) VertexMatrix(reinterpret_cast<Real *>(const_cast<Vector3 *>(buf)), 3, numVertices());
+  return &vertex_wrapper;
+}
+
+AbstractDenseMatrix<uint32> const *
+CompactMesh::getTriangleMatrix() const
+{
+  // Only a mesh with faces of different degrees needs a packed copy
+  static IndexArray const EMPTY;
+  IndexArray const * src = &face_vertices;
+  if (num_quad_faces == numFaces())
+    src = &EMPTY;
+  else if (num_tri_faces != numFaces())
+  {
+    packTopology();
+    src = &packed_tris;
+  }
+
+  uint32 const * buf = (src->empty() ? nullptr : src->data());
+  new (&tri_matrix) TriangleMatrix(const_cast<uint32 *>(buf), 3, (intx)src->size() / 3);
+  return &tri_wrapper;
+}
+
+AbstractDenseMatrix<uint32> const *
+CompactMesh::getQuadMatrix() const
+{
+  // Only a mesh with faces of different degrees needs a packed copy. Larger polygons are triangulated, so a mesh with no quads
+  // has an empty quad matrix.
+  static IndexArray const EMPTY;
+  IndexArray const * src = &face_vertices;
+  if (num_quad_faces == 0)
+    src = &EMPTY;
+  else if (num_quad_faces != numFaces())
+  {
+    packTopology();
+    src = &packed_quads;
+  }
+
+  uint32 const * buf = (src->empty() ? nullptr : src->data());
+  new (&quad_matrix) QuadMatrix(const_cast<uint32 *>(buf), 4, (intx)src->size() / 4);
+  return &quad_wrapper;
+}
+
+intx
+CompactMesh::addVertex(Vector3 const & point, intx source_index, Vector3 const * normal, ColorRGBA const * color,
+                       Vector2 const * texcoord)
+{
+  alwaysAssertM((source_index >= 0 && vertex_source_indices.size() == positions.size())
+             || (source_index < 0 && vertex_source_indices.empty()),
+                getNameStr() + ": Mesh must have all or no vertex source indices");
+  alwaysAssertM((normal && normals.size() == positions.size()) || (!normal && normals.empty()),
+                getNameStr() + ": Mesh must have all or no normals");
+
+  intx index = (intx)positions.size();
+  alwaysAssertM(index < (intx)std::numeric_limits<uint32>::max(), getNameStr() + ": Too many vertices for 32-bit indices");
+
+  if (valid_bounds)
+    bounds.merge(point);
+
+  positions.push_back(point);
+  if (source_index >= 0)  vertex_source_indices.push_back(source_index);
+  if (normal)             normals.push_back(*normal);
+
+  invalidateTopology();  // the adjacency arrays are indexed by vertex
+
+  return index;
+}
+
+intx
+CompactMesh::addVertices(intx num_vertices, Vector3 const * points, intx first_source_index)
+{
+  alwaysAssertM(num_vertices >= 0, getNameStr() + ": Number of vertices cannot be negative");
+  alwaysAssertM((first_source_index >= 0 && vertex_source_indices.size() == positions.size())
+             || (first_source_index < 0 && vertex_source_indices.empty()),
+                getNameStr() + ": Mesh must have all or no vertex source indices");
+  alwaysAssertM(normals.empty(), getNameStr() + ": Mesh must have all or no normals");
+
+  intx index = (intx)positions.size();
+  alwaysAssertM(index + num_vertices <= (intx)std::numeric_limits<uint32>::max(),
+                getNameStr() + ": Too many vertices for 32-bit indices");
+
+  if (valid_bounds)
+    for (intx i = 0; i < num_vertices; ++i)
+      bounds.merge(points[i]);
+
+  positions.insert(positions.end(), points, points + num_vertices);
+
+  if (first_source_index >= 0)
+    for (intx i = 0; i < num_vertices; ++i)
+      vertex_source_indices.push_back(first_source_index + i);
+
+  invalidateTopology();
+
+  return index;
+}
+
+intx
+CompactMesh::addTriangles(intx num_triangles, uint32 const * tri_vertex_indices, intx first_source_face_index)
+{
+  alwaysAssertM(num_triangles >= 0, getNameStr() + ": Number of triangles cannot be negative");
+  alwaysAssertM((first_source_face_index >= 0 && face_source_indices.size() == (size_t)numFaces())
+             || (first_source_face_index < 0 && face_source_indices.empty()),
+                getNameStr() + ": Mesh must have all or no face source indices");
+
+  size_t num_indices = (size_t)(3 * num_triangles);
+  alwaysAssertM(face_vertices.size() + num_indices < (size_t)std::numeric_limits<uint32>::max(),
+                getNameStr() + ": Too many face vertex indices for 32-bit offsets");
+
+#ifdef THEA_DEBUG_BUILD
+  for (size_t i = 0; i < num_indices; ++i)
+    debugAssertM((intx)tri_vertex_indices[i] < numVertices(), getNameStr() + ": Vertex index out of bounds");
+#endif
+
+  if (face_offsets.empty())
+    face_offsets.push_back(0);
+
+  intx index = numFaces();
+  uint32 offset = (uint32)face_vertices.size();
+  face_vertices.insert(face_vertices.end(), tri_vertex_indices, tri_vertex_indices + num_indices);
+
+  face_offsets.reserve(face_offsets.size() + (size_t)num_triangles);
+  for (intx i = 0; i < num_triangles; ++i)
+  {
+    offset += 3;
+    face_offsets.push_back(offset);
+  }
+
+  if (first_source_face_index >= 0)
+    for (intx i = 0; i < num_triangles; ++i)
+      face_source_indices.push_back(first_source_face_index + i);
+
+  num_tri_faces += num_triangles;
+
+  invalidateTopology();
+
+  return index;
+}
+
+intx
+CompactMesh::addFace(intx num_vertices, intx const * face_vertex_indices_, intx source_face_index)
+{
+  return addFace(face_vertex_indices_, face_vertex_indices_ + num_vertices, source_face_index);
+}
+
+intx
+CompactMesh::finishFace(intx num_vertices, intx source_face_index)
+{
+  alwaysAssertM((source_face_index >= 0 && face_source_indices.size() == (size_t)numFaces())
+             || (source_face_index < 0 && face_source_indices.empty()),
+                getNameStr() + ": Mesh must have all or no face source indices");
+  alwaysAssertM(face_vertices.size() < (size_t)std::numeric_limits<uint32>::max(),
+                getNameStr() + ": Too many face vertex indices for 32-bit offsets");
+
+  if (face_offsets.empty())
+    face_offsets.push_back(0);
+
+  intx index = numFaces();
+  face_offsets.push_back((uint32)face_vertices.size());
+  debugAssertM((intx)(face_offsets[(size_t)index + 1] - face_offsets[(size_t)index]) == num_vertices,
+               getNameStr() + ": Face vertex count mismatch");
+
+  if (source_face_index >= 0) face_source_indices.push_back(source_face_index);
+
+  if (num_vertices == 3)
+    num_tri_faces++;
+  else if (num_vertices == 4)
+    num_quad_faces++;
+
+  invalidateTopology();
+
+  return index;
+}
+
+Vector3
+CompactMesh::getFaceNormal(intx face_index) const
+{
+  return getFaceAreaNormal(face_index).normalized();
+}
+
+Vector3
+CompactMesh::getFaceAreaNormal(intx face_index) const
+{
+  uint32 const * fv = getFaceVertices(face_index);
+  intx n = numFaceVertices(face_index);
+
+  // Newell's method, relative to the first vertex for better precision
+  Vector3 const & p0 = positions[fv[0]];
+  Vector3 sum = Vector3::Zero();
+  for (intx i = 1; i + 1 < n; ++i)
+    sum += (positions[fv[i]] - p0).cross(positions[fv[i + 1]] - p0);
+
+  return sum;
+}
+
+void
+CompactMesh::computeAveragedVertexNormals()
+{
+  normals.resize(positions.size());
+  for (size_t i = 0; i < normals.size(); ++i)
+    normals[i] = Vector3::Zero();
+
+  // Summing the unnormalized face normals weights each face by its area
+  intx nf = numFaces();
+  for (intx f = 0; f < nf; ++f)
+  {
+    Vector3 n = getFaceAreaNormal(f);
+    for (uint32 j = face_offsets[(size_t)f]; j < face_offsets[(size_t)f + 1]; ++j)
+      normals[face_vertices[j]] += n;
+  }
+
+  for (size_t i = 0; i < normals.size(); ++i)
+    normals[i] = normals[i].normalized();
+}
+
+void
+CompactMesh::updateBounds()
+{
+  if (valid_bounds) return;
+
+  bounds = AxisAlignedBox3();
+  for (size_t i = 0; i < positions.size(); ++i)
+    bounds.merge(positions[i]);
+
+  valid_bounds = true;
+}
+
+void
+CompactMesh::updateAdjacency() const
+{
+  if (valid_adjacency) return;
+
+  size_t nv = positions.size();
+  size_t nf = (size_t)numFaces();
+  size_t nh = face_vertices.size();
+
+  // Face containing each halfedge
+  halfedge_faces.resize(nh);
+  for (size_t f = 0; f < nf; ++f)
+    for (uint32 h = face_offsets[f]; h < face_offsets[f + 1]; ++h)
+      halfedge_faces[h] = (uint32)f;
+
+  // Vertex-to-face incidences, by counting sort on the halfedge origins
+  vertex_face_offsets.assign(nv + 1, 0);
+  for (size_t h = 0; h < nh; ++h)
+    vertex_face_offsets[(size_t)face_vertices[h] + 1]++;
+
+  for (size_t v = 0; v < nv; ++v)
+    vertex_face_offsets[v + 1] += vertex_face_offsets[v];
+
+  IndexArray next_slot(vertex_face_offsets.begin(), vertex_face_offsets.end() - 1);
+  vertex_faces.resize(nh);
+  for (size_t h = 0; h < nh; ++h)
+    vertex_faces[next_slot[face_vertices[h]]++] = halfedge_faces[h];
+
+  // The opposite of a halfedge a --> b is the unique halfedge b --> a in a face incident on b, if there is one
+  opposite_halfedges.resize(nh);
+  for (size_t f = 0; f < nf; ++f)
+  {
+    uint32 fbeg = face_offsets[f], fend = face_offsets[f + 1];
+    for (uint32 h = fbeg; h < fend; ++h)
+    {
+      uint32 a = face_vertices[h];
+      uint32 b = face_vertices[h + 1 < fend ? h + 1 : fbeg];
+
+      intx opposite = -1;
+      int num_candidates = 0;
+      for (uint32 i = vertex_face_offsets[b]; i < vertex_face_offsets[(size_t)b + 1]; ++i)
+      {
+        uint32 g = vertex_faces[i];
+        if (g == f || (i > vertex_face_offsets[b] && vertex_faces[i - 1] == g))  // skip self and repeated incidences
+          continue;
+
+        uint32 gbeg = face_offsets[g], gend = face_offsets[(size_t)g + 1];
+        for (uint32 k = gbeg; k < gend; ++k)
+          if (face_vertices[k] == b && face_vertices[k + 1 < gend ? k + 1 : gbeg] == a)
+          {
+            opposite = (intx)k;
+            num_candidates++;
+          }
+      }
+
+      opposite_halfedges[h] = (num_candidates == 1 ? opposite : -1);
+    }
+  }
+
+  valid_adjacency = true;
+}
+
+void
+CompactMesh::packTopology() const
+{
+  if (valid_packed_topology) return;
+
+  packed_tris.clear();
+  packed_quads.clear();
+
+  Polygon3 poly;
+  Array<intx> tri_indices;
+  intx nf = numFaces();
+  for (intx f = 0; f < nf; ++f)
+  {
+    uint32 const * fv = getFaceVertices(f);
+    intx n = numFaceVertices(f);
+    if (n == 3)
+      packed_tris.insert(packed_tris.end(), fv, fv + 3);
+    else if (n == 4)
+      packed_quads.insert(packed_quads.end(), fv, fv + 4);
+    else
+    {
+      poly.clear();
+      for (intx i = 0; i < n; ++i)
+        poly.addVertex(positions[fv[i]], (intx)fv[i]);
+
+      intx num_tris = poly.triangulate(tri_indices);
+      for (intx i = 0; i < 3 * num_tris; ++i)
+        packed_tris.push_back((uint32)tri_indices[(size_t)i]);
+    }
+  }
+
+  valid_packed_topology = true;
+}
+
+void
+CompactMesh::draw(RenderSystem & render_system, AbstractRenderOptions const & options) const
+{
+  bool vertex_normals = (options.sendNormals() && options.useVertexNormals() && hasNormals());
+  bool face_normals = (options.sendNormals() && !vertex_normals);
+  intx nf = numFaces();
+
+  if (options.drawFaces())
+  {
+    if (options.drawEdges())
+    {
+      render_system.pushShapeFlags();
+      render_system.setPolygonOffset(true, 1);
+    }
+
+    // Send each face as a separate polygon unless it can be batched with others as a triangle or quad
+    for (int pass = 0; pass < 3; ++pass)
+    {
+      if (pass == 0) render_system.beginPrimitive(RenderSystem::Primitive::TRIANGLES);
+      else if (pass == 1) render_system.beginPrimitive(RenderSystem::Primitive::QUADS);
+
+      for (intx f = 0; f < nf; ++f)
+      {
+        intx n = numFaceVertices(f);
+        if ((pass == 0 && n != 3) || (pass == 1 && n != 4) || (pass == 2 && n <= 4))
+          continue;
+
+        if (pass == 2) render_system.beginPrimitive(RenderSystem::Primitive::POLYGON);
+
+        if (face_normals)
+          render_system.sendNormal(getFaceNormal(f));
+
+        uint32 const * fv = getFaceVertices(f);
+        for (intx j = 0; j < n; ++j)
+        {
+          if (vertex_normals) render_system.sendNormal(normals[fv[j]]);
+          render_system.sendVertex(positions[fv[j]]);
+        }
+
+        if (pass == 2) render_system.endPrimitive();
+      }
+
+      if (pass < 2) render_system.endPrimitive();
+    }
+
+    if (options.drawEdges())
+      render_system.popShapeFlags();
+  }
+
+  if (options.drawEdges())
+  {
+    render_system.pushShader();
+    render_system.pushColorFlags();
+
+      render_system.setShader(nullptr);
+      render_system.setColor(ColorRGBA(options.edgeColor()));  // set default edge color
+
+      // Draw each edge once, from the halfedge with the smaller index in each pair
+      render_system.beginPrimitive(RenderSystem::Primitive::LINES);
+        intx nh = numHalfedges();
+        for (intx h = 0; h < nh; ++h)
+        {
+          intx opp = getOppositeHalfedge(h);
+          if (opp >= 0 && opp < h) continue;
+
+          render_system.sendVertex(positions[(size_t)getHalfedgeOrigin(h)]);
+          render_system.sendVertex(positions[(size_t)getHalfedgeEnd(h)]);
+        }
+      render_system.endPrimitive();
+
+    render_system.popColorFlags();
+    render_system.popShader();
+  }
+}
+
+} // namespace Graphics
+} // namespace Thea
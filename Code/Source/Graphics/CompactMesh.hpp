@@ -0,0 +1,547 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_Graphics_CompactMesh_hpp__
+#define __Thea_Graphics_CompactMesh_hpp__
+
+#include "../Common.hpp"
+#include "../Array.hpp"
+#include "../AxisAlignedBox3.hpp"
+#include "../MatrixWrapper.hpp"
+#include "../UnorderedMap.hpp"
+#include "AbstractMesh.hpp"
+#include "DefaultMeshCodecs.hpp"
+#include "IncrementalCompactMeshBuilder.hpp"
+#include "MeshType.hpp"
+#include <iterator>
+#include <type_traits>
+
+namespace Thea {
+namespace Graphics {
+
+// Forward declaration
+class CompactMesh;
+
+/**
+ * A face of a CompactMesh. This is a lightweight handle created on the fly when a face is accessed, face data is not actually
+ * stored in this format. It can be freely copied and used as a reference to a face.
+ */
+class THEA_API CompactMeshFace
+{
+  public:
+    typedef CompactMesh Mesh;  ///< Parent mesh class.
+
+    /** Constructor. */
+    CompactMeshFace(CompactMesh const * mesh_ = nullptr, intx index_ = -1) : mesh(mesh_), index(index_) {}
+
+    /** Check if the face reference is valid. */
+    operator bool() const { return mesh && index >= 0; }
+
+    /** Get the parent mesh. */
+    CompactMesh const * getMesh() const { return mesh; }
+
+    /** Get the index of the face in the parent mesh. */
+    intx getIndex() const { return index; }
+
+    /** Get the number of vertices of the face. */
+    intx numVertices() const;
+
+    /** Check if the face is a triangle. */
+    bool isTriangle() const { return numVertices() == 3; }
+
+    /** Check if the face is a quad. */
+    bool isQuad() const { return numVertices() == 4; }
+
+    /** Get the index of the \a i'th vertex of the face, in counter-clockwise order. */
+    intx getVertexIndex(intx i) const;
+
+    /** Get the position of the \a i'th vertex of the face, in counter-clockwise order. */
+    Vector3 const & getVertexPosition(intx i) const;
+
+    /** Get the unit normal of the face, computed from its vertices. */
+    Vector3 getNormal() const;
+
+  private:
+    CompactMesh const * mesh;
+    intx index;
+
+}; // class CompactMeshFace
+
+/**
+ * A polygon mesh stored in a handful of contiguous arrays, with no per-element heap allocations. Vertex positions and normals
+ * are held in separate flat arrays, and faces are stored in compressed sparse row (CSR) form: the vertex indices of face
+ * <tt>f</tt> occupy the range <tt>[getFaceOffsets()[f], getFaceOffsets()[f + 1])</tt> of getFaceVertexIndices(). All indices
+ * are 32-bit.
+ *
+ * Each entry of the face vertex index array doubles as a halfedge, directed from the vertex at that entry to the next vertex
+ * of the same face. Vertex-to-face incidences and opposite halfedges are computed lazily on first request, and cached till the
+ * topology changes.
+ *
+ * The mesh is designed for read-mostly pipelines: vertices and faces can be appended and vertex attributes modified, but
+ * elements cannot be removed. Use GeneralMesh or DCELMesh for local topological edits, and fromGeneralMesh() /
+ * toGeneralMesh() to move between representations.
+ *
+ * @see GeneralMesh, DisplayMesh
+ */
+class THEA_API CompactMesh : public virtual NamedObject, public AbstractMesh
+{
+  public:
+    THEA_DECL_SMART_POINTERS(CompactMesh)
+
+    /** Mesh type tag. */
+    struct COMPACT_MESH_TAG {};
+
+    typedef Array<Vector3>  PositionArray;  ///< Array of vertex positions.
+    typedef Array<Vector3>  NormalArray;    ///< Array of normals.
+    typedef Array<uint32>   IndexArray;     ///< Array of indices.
+
+    typedef CompactMeshFace Face;  ///< A convenience wrapper for accessing a face's properties.
+
+    // Generic typedefs, each mesh class must define these for builder and codec compatibility
+    typedef intx  VertexHandle;       ///< Handle to a mesh vertex.
+    typedef intx  VertexConstHandle;  ///< Handle to an immutable mesh vertex.
+    typedef intx  FaceHandle;         ///< Handle to a mesh face.
+    typedef intx  FaceConstHandle;    ///< Handle to an immutable mesh face.
+
+  private:
+    // Vertex data
+    PositionArray  positions;  ///< Vertex positions.
+    NormalArray    normals;    ///< Vertex normals.
+
+    // Face data, in CSR format
+    IndexArray face_offsets;   ///< Face i spans face_vertices[face_offsets[i] : face_offsets[i + 1]].
+    IndexArray face_vertices;  ///< Concatenated vertex indices of all faces.
+    intx num_tri_faces;        ///< Number of faces with exactly 3 vertices.
+    intx num_quad_faces;       ///< Number of faces with exactly 4 vertices.
+
+    // Element source indices (typically from source files)
+    Array<intx> vertex_source_indices;
+    Array<intx> face_source_indices;
+
+    bool valid_bounds;  ///< Is the bounding box valid?
+    AxisAlignedBox3 bounds;  ///< Bounding box.
+
+    // Lazily computed adjacency
+    mutable bool valid_adjacency;            ///< Are the adjacency arrays synchronized with the faces?
+    mutable IndexArray vertex_face_offsets;  ///< CSR offsets of the faces incident on each vertex.
+    mutable IndexArray vertex_faces;         ///< Concatenated indices of the faces incident on each vertex.
+    mutable IndexArray halfedge_faces;       ///< Face containing each halfedge.
+    mutable Array<intx> opposite_halfedges;  ///< Opposite of each halfedge, or -1 for boundary/non-manifold halfedges.
+
+    // Lazily computed triangle and quad lists for the AbstractMesh API, used only if the mesh has mixed face degrees
+    mutable bool valid_packed_topology;  ///< Are the packed triangle and quad lists synchronized with the faces?
+    mutable IndexArray packed_tris;      ///< Triangle indices (in triplets), with larger polygons triangulated.
+    mutable IndexArray packed_quads;     ///< Quad indices (in quartets).
+
+    // Map the vertex and index buffers as matrices for the AbstractMesh API
+    typedef MatrixMap<3, Eigen::Dynamic, Real,   MatrixLayout::COLUMN_MAJOR>  VertexMatrix;    ///< Wraps vertices as a matrix.
+    typedef MatrixMap<3, Eigen::Dynamic, uint32, MatrixLayout::COLUMN_MAJOR>  TriangleMatrix;  ///< Wraps triangles as a matrix.
+    typedef MatrixMap<4, Eigen::Dynamic, uint32, MatrixLayout::COLUMN_MAJOR>  QuadMatrix;      ///< Wraps quads as a matrix.
+
+    mutable VertexMatrix    vertex_matrix;  ///< Vertex data as a dense 3xN column-major matrix.
+    mutable TriangleMatrix  tri_matrix;     ///< Triangle indices as a dense 3xN column-major matrix.
+    mutable QuadMatrix      quad_matrix;    ///< Quad indices as a dense 4xN column-major matrix.
+
+    mutable MatrixWrapper<VertexMatrix>    vertex_wrapper;
+    mutable MatrixWrapper<TriangleMatrix>  tri_wrapper;
+    mutable MatrixWrapper<QuadMatrix>      quad_wrapper;
+
+  public:
+    /** Constructor. */
+    CompactMesh(std::string const & name = "AnonymousMesh");
+
+    /** Copy constructor. */
+    CompactMesh(CompactMesh const & src);
+
+    /** Destructor. */
+    virtual ~CompactMesh() {}
+
+    // Abstract mesh interface. The vertex matrix always wraps the position array directly. The triangle (resp. quad) matrix
+    // wraps the face index array directly if all faces are triangles (resp. quads), and is empty if there are no faces of that
+    // kind. A packed copy is built on demand only if faces of different degrees are mixed.
+    AbstractDenseMatrix<Real> const * getVertexMatrix() const;
+    AbstractDenseMatrix<uint32> const * getTriangleMatrix() const;
+    AbstractDenseMatrix<uint32> const * getQuadMatrix() const;
+
+    /** Deletes all data in the mesh. */
+    virtual void clear();
+
+    /**
+     * Preallocate storage for a given number of vertices, faces, and face vertex indices (summed over all faces). Any of the
+     * arguments may be negative to skip reserving space for that type of element.
+     */
+    void reserve(intx num_vertices, intx num_faces, intx num_face_vertex_indices = -1);
+
+    /** True if and only if the mesh contains no objects. */
+    bool isEmpty() const { return positions.empty() && numFaces() <= 0; }
+
+    /** Get the number of vertices. */
+    intx numVertices() const { return (intx)positions.size(); }
+
+    /** Get the number of faces. */
+    intx numFaces() const { return face_offsets.empty() ? 0 : (intx)face_offsets.size() - 1; }
+
+    /** Get the number of faces with exactly three vertices. */
+    intx numTriangles() const { return num_tri_faces; }
+
+    /** Get the number of faces with exactly four vertices. */
+    intx numQuads() const { return num_quad_faces; }
+
+    /** Get the number of halfedges, which is the same as the total number of vertex indices summed over all faces. */
+    intx numHalfedges() const { return (intx)face_vertices.size(); }
+
+    /** Get the set of vertex positions. */
+    PositionArray const & getPositions() const { return positions; }
+
+    /** Get the set of vertex normals. */
+    NormalArray const & getNormals() const { return normals; }
+
+    /** Check if the vertices have attached normal information. */
+    bool hasNormals() const { return !normals.empty(); }
+
+    /** Get the position of a vertex. */
+    Vector3 const & getPosition(intx vertex_index) const
+    {
+      debugAssertM(vertex_index >= 0 && vertex_index < numVertices(), getNameStr() + ": Vertex index out of bounds");
+      return positions[(size_t)vertex_index];
+    }
+
+    /** Get the normal of a vertex. Call only if hasNormals() returns true. */
+    Vector3 const & getNormal(intx vertex_index) const
+    {
+      debugAssertM(vertex_index >= 0 && vertex_index < (intx)normals.size(),
+                   getNameStr() + ": Vertex index out of bounds, or vertex does not have associated normal field");
+      return normals[(size_t)vertex_index];
+    }
+
+    /** Get the CSR offsets of the faces into the face vertex index array. This array has numFaces() + 1 entries. */
+    IndexArray const & getFaceOffsets() const { return face_offsets; }
+
+    /** Get the concatenated vertex indices of all faces. */
+    IndexArray const & getFaceVertexIndices() const { return face_vertices; }
+
+    /** Get a lightweight handle to a face. */
+    Face getFace(intx face_index) const
+    {
+      debugAssertM(face_index >= 0 && face_index < numFaces(), getNameStr() + ": Face index out of bounds");
+      return Face(this, face_index);
+    }
+
+    /** Get the number of vertices of a face. */
+    intx numFaceVertices(intx face_index) const
+    {
+      debugAssertM(face_index >= 0 && face_index < numFaces(), getNameStr() + ": Face index out of bounds");
+      return (intx)(face_offsets[(size_t)face_index + 1] - face_offsets[(size_t)face_index]);
+    }
+
+    /** Get a pointer to the first of the numFaceVertices() vertex indices of a face. */
+    uint32 const * getFaceVertices(intx face_index) const
+    {
+      debugAssertM(face_index >= 0 && face_index < numFaces(), getNameStr() + ": Face index out of bounds");
+      return face_vertices.data() + face_offsets[(size_t)face_index];
+    }
+
+    /** Get the unit normal of a face, computed from its vertices by Newell's method. */
+    Vector3 getFaceNormal(intx face_index) const;
+
+    /** Get the source index of a given vertex. This is typically the index of the vertex in the source mesh file. */
+    intx getVertexSourceIndex(intx i) const
+    {
+      return i >= 0 && i < (intx)vertex_source_indices.size() ? vertex_source_indices[(size_t)i] : -1;
+    }
+
+    /** Get the source index of a given face. This is typically the index of the face in the source mesh file. */
+    intx getFaceSourceIndex(intx i) const
+    {
+      return i >= 0 && i < (intx)face_source_indices.size() ? face_source_indices[(size_t)i] : -1;
+    }
+
+    /**
+     * Add a vertex to the mesh, with an optional normal, as well as an optional source index (typically the index of the
+     * vertex in the mesh source file). Colors and texture coordinates are accepted for builder compatibility but are not
+     * stored.
+     *
+     * The normal is an all or nothing choice for the mesh: it must be specified for all vertices, or no vertices. Similarly,
+     * if the source index is non-negative, it must be so for all vertices.
+     *
+     * @return The index of the new vertex in the mesh (distinct from the source index input to this function). Indices are
+     *   guaranteed to be sequentially generated, starting from 0.
+     */
+    intx addVertex(Vector3 const & point, intx source_index = -1, Vector3 const * normal = nullptr,
+                   ColorRGBA const * color = nullptr, Vector2 const * texcoord = nullptr);
+
+    /**
+     * Add a polygonal face to the mesh, specified as a sequence of vertex indices and an optional source face index
+     * (typically the index of the face in the mesh source file). Polygons with less than 3 vertices are ignored.
+     *
+     * @return The index of the new face, or -1 on failure. Indices are guaranteed to be sequentially generated, starting from
+     *   0.
+     */
+    intx addFace(intx num_vertices, intx const * face_vertex_indices_, intx source_face_index = -1);
+
+    /**
+     * Add a polygonal face to the mesh, specified as a sequence of vertex indices obtained by dereferencing [vbegin, vend), and
+     * an optional source face index (typically the index of the face in the mesh source file). Polygons with less than 3
+     * vertices are ignored.
+     *
+     * @return The index of the new face, or -1 on failure.
+     */
+    template <typename IndexIterator> intx addFace(IndexIterator vi_begin, IndexIterator vi_end, intx source_face_index = -1)
+    {
+      intx num_vertices = (intx)std::distance(vi_begin, vi_end);
+      if (num_vertices < 3)
+      {
+        THEA_DEBUG << getName() << ": Skipping face -- too few vertices (" << num_vertices << ')';
+        return -1;
+      }
+
+      for (IndexIterator vi = vi_begin; vi != vi_end; ++vi)
+      {
+        debugAssertM((intx)*vi >= 0 && (intx)*vi < numVertices(), getNameStr() + ": Vertex index out of bounds");
+        face_vertices.push_back((uint32)*vi);
+      }
+
+      return finishFace(num_vertices, source_face_index);
+    }
+
+    /**
+     * Add a block of vertices to the mesh, given their positions. This is much faster than adding them one at a time, and is
+     * used by codecs to load large meshes. The vertices have no normals. If \a first_source_index is non-negative, the
+     * vertices get consecutive source indices starting from it, else they have no source indices. The all or nothing rules
+     * of addVertex() apply.
+     *
+     * @return The index of the first new vertex. The remaining ones have consecutive indices.
+     */
+    intx addVertices(intx num_vertices, Vector3 const * points, intx first_source_index = -1);
+
+    /**
+     * Add a block of triangles to the mesh, specified as \a num_triangles consecutive triplets of vertex indices. If
+     * \a first_source_face_index is non-negative, the triangles get consecutive source indices starting from it. Unlike
+     * addFace(), the vertex indices are only checked in debug mode.
+     *
+     * @return The index of the first new face. The remaining ones have consecutive indices.
+     */
+    intx addTriangles(intx num_triangles, uint32 const * tri_vertex_indices, intx first_source_face_index = -1);
+
+    /** Set the position of a mesh vertex. */
+    void setPosition(intx vertex_index, Vector3 const & position)
+    {
+      alwaysAssertM(vertex_index >= 0 && vertex_index < numVertices(), getNameStr() + ": Vertex index out of bounds");
+
+      positions[(size_t)vertex_index] = position;
+      invalidateBounds();
+    }
+
+    /** Set the normal of a mesh vertex. */
+    void setNormal(intx vertex_index, Vector3 const & normal)
+    {
+      alwaysAssertM(vertex_index >= 0 && vertex_index < (intx)normals.size(),
+                    getNameStr() + ": Vertex index out of bounds, or vertex does not have associated normal field");
+
+      normals[(size_t)vertex_index] = normal;
+    }
+
+    /**
+     * Set the normal at each vertex as the average of the normals of all faces incident at the vertex, weighted by face area.
+     */
+    void computeAveragedVertexNormals();
+
+    /** Recompute and cache the bounding box for the mesh. Make sure this has been called before calling getBounds(). */
+    void updateBounds();
+
+    /**
+     * Get the cached bounding box of the mesh. Will be out-of-date unless updateBounds() has been called after all
+     * modifications.
+     */
+    AxisAlignedBox3 const & getBounds() const
+    {
+      const_cast<CompactMesh *>(this)->updateBounds();
+      return bounds;
+    }
+
+    /**
+     * Build the vertex-to-face incidences and halfedge pairings, if they are not already up to date. This is called
+     * automatically by the accessors below, and need only be called explicitly (e.g. before sharing the mesh across threads)
+     * to avoid the lazy computation.
+     */
+    void updateAdjacency() const;
+
+    /** Get the number of faces incident on a vertex. */
+    intx numVertexFaces(intx vertex_index) const
+    {
+      updateAdjacency();
+      return (intx)(vertex_face_offsets[(size_t)vertex_index + 1] - vertex_face_offsets[(size_t)vertex_index]);
+    }
+
+    /** Get a pointer to the first of the numVertexFaces() indices of the faces incident on a vertex. */
+    uint32 const * getVertexFaces(intx vertex_index) const
+    {
+      updateAdjacency();
+      return vertex_faces.data() + vertex_face_offsets[(size_t)vertex_index];
+    }
+
+    /** Get the vertex from which a halfedge starts. */
+    intx getHalfedgeOrigin(intx halfedge) const { return (intx)face_vertices[(size_t)halfedge]; }
+
+    /** Get the vertex at which a halfedge ends. */
+    intx getHalfedgeEnd(intx halfedge) const { return (intx)face_vertices[(size_t)nextHalfedge(halfedge)]; }
+
+    /** Get the face containing a halfedge. */
+    intx getHalfedgeFace(intx halfedge) const
+    {
+      updateAdjacency();
+      return (intx)halfedge_faces[(size_t)halfedge];
+    }
+
+    /** Get the next halfedge in counter-clockwise order around the same face. */
+    intx nextHalfedge(intx halfedge) const
+    {
+      size_t face = (size_t)getHalfedgeFace(halfedge);
+      return halfedge + 1 < (intx)face_offsets[face + 1] ? halfedge + 1 : (intx)face_offsets[face];
+    }
+
+    /** Get the oppositely directed halfedge of the adjacent face, or -1 if the edge is on the boundary or non-manifold. */
+    intx getOppositeHalfedge(intx halfedge) const
+    {
+      updateAdjacency();
+      return opposite_halfedges[(size_t)halfedge];
+    }
+
+    /**
+     * Replace the contents of this mesh with those of a GeneralMesh. Vertices and faces are numbered in the iteration order of
+     * the source mesh, and their indices in the source mesh are stored as source indices. Vertex normals are copied.
+     */
+    template < typename GeneralMeshT, typename std::enable_if< IsGeneralMesh<GeneralMeshT>::value, int >::type = 0 >
+    void fromGeneralMesh(GeneralMeshT const & src)
+    {
+      clear();
+
+      intx num_indices = 0;
+      for (auto fi = src.facesBegin(); fi != src.facesEnd(); ++fi)
+        num_indices += fi->numVertices();
+
+      reserve(src.numVertices(), src.numFaces(), num_indices);
+      vertex_source_indices.reserve((size_t)src.numVertices());
+      face_source_indices.reserve((size_t)src.numFaces());
+
+      // Number the vertices in iteration order. The source mesh is not modified, so it may be converted by several threads at
+      // once.
+      UnorderedMap<typename GeneralMeshT::Vertex const *, uint32> vertex_indices;
+      vertex_indices.reserve((size_t)src.numVertices());
+
+      uint32 index = 0;
+      for (auto vi = src.verticesBegin(); vi != src.verticesEnd(); ++vi, ++index)
+      {
+        Vector3 n = vi->getNormal();
+        addVertex(vi->getPosition(), vi->getIndex(), &n);
+        vertex_indices[&(*vi)] = index;
+      }
+
+      for (auto fi = src.facesBegin(); fi != src.facesEnd(); ++fi)
+      {
+        for (auto fvi = fi->verticesBegin(); fvi != fi->verticesEnd(); ++fvi)
+          face_vertices.push_back(vertex_indices[*fvi]);
+
+        finishFace(fi->numVertices(), fi->getIndex());
+      }
+    }
+
+    /**
+     * Append the contents of this mesh to a GeneralMesh. Source indices, if present, are passed on as the indices of the new
+     * vertices and faces. Vertex normals, if present, are copied as precomputed normals.
+     */
+    template < typename GeneralMeshT, typename std::enable_if< IsGeneralMesh<GeneralMeshT>::value, int >::type = 0 >
+    void toGeneralMesh(GeneralMeshT & dst) const
+    {
+      typedef typename GeneralMeshT::Vertex DstVertex;
+
+      Array<DstVertex *> dst_vertices((size_t)numVertices());
+      for (size_t i = 0; i < positions.size(); ++i)
+      {
+        dst_vertices[i] = dst.addVertex(positions[i], getVertexSourceIndex((intx)i),
+                                        normals.empty() ? nullptr : &normals[i]);
+        alwaysAssertM(dst_vertices[i], getNameStr() + ": Could not add vertex to general mesh");
+      }
+
+      Array<DstVertex *> face;
+      intx nf = numFaces();
+      for (intx f = 0; f < nf; ++f)
+      {
+        uint32 const * fv = getFaceVertices(f);
+        intx n = numFaceVertices(f);
+        face.resize((size_t)n);
+        for (intx j = 0; j < n; ++j)
+          face[(size_t)j] = dst_vertices[(size_t)fv[j]];
+
+        dst.addFace(face.begin(), face.end(), getFaceSourceIndex(f));
+      }
+    }
+
+    void draw(RenderSystem & render_system, AbstractRenderOptions const & options = RenderOptions::defaults()) const;
+
+  protected:
+    /** Invalidate the current bounding box of the mesh. */
+    void invalidateBounds() { valid_bounds = false; }
+
+    /** Invalidate all cached data derived from the face topology. */
+    void invalidateTopology() { valid_adjacency = false; valid_packed_topology = false; }
+
+  private:
+    /**
+     * Complete the addition of a face whose \a num_vertices vertex indices have already been appended to the face vertex
+     * index array.
+     */
+    intx finishFace(intx num_vertices, intx source_face_index);
+
+    /** Get the normal of a face scaled by twice its area, computed by Newell's method. */
+    Vector3 getFaceAreaNormal(intx face_index) const;
+
+    /** Build the packed triangle and quad lists for the AbstractMesh API. */
+    void packTopology() const;
+
+}; // class CompactMesh
+
+//============================================================================================================================
+// CompactMeshFace
+//============================================================================================================================
+
+inline intx
+CompactMeshFace::numVertices() const
+{
+  return mesh->numFaceVertices(index);
+}
+
+inline intx
+CompactMeshFace::getVertexIndex(intx i) const
+{
+  debugAssertM(i >= 0 && i < numVertices(), "CompactMeshFace: Vertex index out of bounds");
+  return (intx)mesh->getFaceVertices(index)[i];
+}
+
+inline Vector3 const &
+CompactMeshFace::getVertexPosition(intx i) const
+{
+  return mesh->getPosition(getVertexIndex(i));
+}
+
+inline Vector3
+CompactMeshFace::getNormal() const
+{
+  return mesh->getFaceNormal(index);
+}
+
+} // namespace Graphics
+} // namespace Thea
+
+#endif
@@ -216,6 +216,33 @@ DisplayMesh::addVertex(Vector3 const & point, intx source_index, Vector3 const *
   return index;
 }
 
+intx
+DisplayMesh::addVertices(intx num_vertices, Vector3 const * points, intx first_source_index)
+{
+  alwaysAssertM(num_vertices >= 0, getNameStr() + ": Number of vertices cannot be negative");
+  alwaysAssertM((first_source_index >= 0 && vertex_source_indices.size() == vertices.size())
+             || (first_source_index < 0 && vertex_source_indices.empty()),
+                getNameStr() + ": Mesh must have all or no vertex source indices");
+  alwaysAssertM(normals.empty() && colors.empty() && texcoords.empty(),
+                getNameStr() + ": Mesh must have all or no normals, vertex colors and texture coordinates");
+
+  intx index = (intx)vertices.size();
+
+  if (valid_bounds)
+    for (intx i = 0; i < num_vertices; ++i)
+      bounds.merge(points[i]);
+
+  vertices.insert(vertices.end(), points, points + num_vertices);
+
+  if (first_source_index >= 0)
+    for (intx i = 0; i < num_vertices; ++i)
+      vertex_source_indices.push_back(first_source_index + i);
+
+  invalidateGPUBuffers();
+
+  return index;
+}
+
 intx
 DisplayMesh::addTriangle(intx vi0, intx vi1, intx vi2, intx source_face_index)
 {
@@ -242,6 +269,34 @@ DisplayMesh::addTriangle(intx vi0, intx vi1, intx vi2, intx source_face_index)
   return index;
 }
 
+intx
+DisplayMesh::addTriangles(intx num_triangles, uint32 const * tri_vertex_indices, intx first_source_face_index)
+{
+  alwaysAssertM(num_triangles >= 0, getNameStr() + ": Number of triangles cannot be negative");
+  alwaysAssertM((first_source_face_index >= 0 && 3 * tri_source_face_indices.size() == tris.size())
+             || (first_source_face_index < 0 && tri_source_face_indices.empty()),
+                getNameStr() + ": Mesh must have all or no triangle face source indices");
+
+  size_t num_indices = (size_t)(3 * num_triangles);
+
+#ifdef THEA_DEBUG_BUILD
+  for (size_t i = 0; i < num_indices; ++i)
+    debugAssertM(tri_vertex_indices[i] < vertices.size(), getNameStr() + ": Vertex index out of bounds");
+#endif
+
+  intx index = (intx)(tris.size() / 3);
+
+  tris.insert(tris.end(), tri_vertex_indices, tri_vertex_indices + num_indices);
+
+  if (first_source_face_index >= 0)
+    for (intx i = 0; i < num_triangles; ++i)
+      tri_source_face_indices.push_back(first_source_face_index + i);
+
+  invalidateGPUBuffers();
+
+  return index;
+}
+
 intx
 DisplayMesh::addQuad(intx vi0, intx vi1, intx vi2, intx vi3, intx source_face_index)
 {
@@ -498,6 +498,15 @@ class THEA_API DisplayMesh : public virtual NamedObject, public AbstractMesh
     virtual intx addVertex(Vector3 const & point, intx source_index = -1, Vector3 const * normal = nullptr,
                            ColorRGBA const * color = nullptr, Vector2 const * texcoord = nullptr);
 
+    /**
+     * Add a block of vertices to the mesh, given their positions, without normals, colors or texture coordinates. This is much
+     * faster than adding them one at a time. If \a first_source_index is non-negative, the vertices get consecutive source
+     * indices starting from it. The all or nothing rules of addVertex() apply.
+     *
+     * @return The index of the first new vertex. The remaining ones have consecutive indices.
+     */
+    virtual intx addVertices(intx num_vertices, Vector3 const * points, intx first_source_index = -1);
+
     /**
      * Add a triangular face to the mesh, specified by three vertex indices and an optional source face index (typically the
      * index of the face in the mesh source file)
@@ -507,6 +516,14 @@ class THEA_API DisplayMesh : public virtual NamedObject, public AbstractMesh
      */
     virtual intx addTriangle(intx vi0, intx vi1, intx vi2, intx source_face_index = -1);
 
+    /**
+     * Add a block of triangles to the mesh, specified as \a num_triangles consecutive triplets of vertex indices. If
+     * \a first_source_face_index is non-negative, the triangles get consecutive source face indices starting from it.
+     *
+     * @return The index of the first new triangle in the triangle list. The remaining ones have consecutive indices.
+     */
+    virtual intx addTriangles(intx num_triangles, uint32 const * tri_vertex_indices, intx first_source_face_index = -1);
+
     /**
      * Add a quadrilateral face to the mesh, specified by four vertex indices and an optional source face index (typically the
      * index of the face in the mesh source file)
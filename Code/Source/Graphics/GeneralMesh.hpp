@@ -16,6 +16,7 @@
 #define __Thea_Graphics_GeneralMesh_hpp__
 
 #include "../Common.hpp"
+#include "../ArenaAllocator.hpp"
 #include "../Array.hpp"
 #include "../AxisAlignedBox3.hpp"
 #include "../Colors.hpp"
@@ -45,6 +46,12 @@ namespace Graphics {
  * GeneralMeshEdge and GeneralMeshFace classes, then the user <i>must</i> manually indicate that the mesh needs to be
  * resynchronized with the GPU. The invalidateGPUBuffers() function should be used for this.
  *
+ * The vertices, edges and faces of the mesh, and their lists of incident elements, are allocated with (rebound instances of)
+ * AllocatorT. Each mesh holds its own AllocatorInstance. Hence with ArenaAllocator, every mesh draws its elements from a
+ * private MemoryArena, which avoids a trip to the system heap for each small list node. If, in addition, the vertex, edge and
+ * face attributes are trivially destructible, destroying or clearing the mesh does not visit its elements at all: they are
+ * abandoned and the arena is released in one go.
+ *
  * @todo Add support for GPU-buffered texture coordinates with 1, 3 or 4 dimensions.
  * @todo Instantiate different types of GPU buffers for different types of colors/texture coordinates.
  */
@@ -88,6 +95,9 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
     typedef Face          *  FaceHandle;         ///< Handle to a mesh face.
     typedef Face   const  *  FaceConstHandle;    ///< Handle to an immutable mesh face.
 
+    /** Allocator shared by all elements of the mesh and their incidence lists (rebound to the appropriate types). */
+    typedef AllocatorT<char> Allocator;
+
     /** Identifiers for the various buffers (enum class). */
     struct BufferID
     {
@@ -110,6 +120,10 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
     /** Constructor. */
     GeneralMesh(std::string const & name = "AnonymousMesh")
     : NamedObject(name),
+      element_alloc(alloc_instance.get()),
+      faces(element_alloc),
+      vertices(element_alloc),
+      edges(element_alloc),
       max_vertex_index(-1),
       max_face_index(-1),
       changed_packed(BufferID::ALL),
@@ -143,6 +157,9 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
       throw Error("GeneralMesh: Copy constructor not currently implemented");
     }
 
+    /** Destructor. */
+    ~GeneralMesh() { clearElements(); }
+
     /**
      * Make an exact copy of the mesh, optionally returning mapping from source to destination vertices/edges/faces. Previous
      * data in the maps is <b>not</b> cleared.
@@ -165,9 +182,9 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
 
       dst.clear();
 
-      dst.vertices.resize(vertices.size());
-      dst.edges.resize(edges.size());
-      dst.faces.resize(faces.size());
+      dst.vertices.resize(vertices.size(), Vertex(dst.element_alloc));
+      dst.edges.resize(edges.size(), Edge(nullptr, nullptr, dst.element_alloc));
+      dst.faces.resize(faces.size(), Face(dst.element_alloc));
 
       // Initialize vertex mapping from source to destination
       {
@@ -290,9 +307,7 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
     /** Deletes all data in the mesh and resets automatic element indexing. */
     void clear()
     {
-      vertices.clear();
-      edges.clear();
-      faces.clear();
+      clearElements();
       bounds = AxisAlignedBox3();
       max_vertex_index = -1;
       max_face_index = -1;
@@ -313,6 +328,9 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
     /** True if and only if the mesh contains no objects. */
     bool isEmpty() const { return vertices.empty() && faces.empty() && edges.empty(); }
 
+    /** Get the allocator shared by all elements of the mesh. */
+    Allocator const & getAllocator() const { return element_alloc; }
+
     /** Get the number of vertices. */
     intx numVertices() const { return (intx)vertices.size(); };
 
@@ -375,9 +393,9 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
                        ColorRGBA const * color = nullptr, Vector2 const * texcoord = nullptr)
     {
       if (normal)
-        vertices.push_back(Vertex(point, *normal));
+        vertices.push_back(Vertex(point, *normal, element_alloc));
       else
-        vertices.push_back(Vertex(point));
+        vertices.push_back(Vertex(point, element_alloc));
 
       Vertex * vertex = &(*vertices.rbegin());
       if (color)     setVertexColor<Vertex>(vertex, *color);
@@ -408,7 +426,7 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
     Face * addFace(VertexInputIterator vbegin, VertexInputIterator vend, intx index = -1)
     {
       // Create the (initially empty) face
-      faces.push_back(Face());
+      faces.push_back(Face(element_alloc));
       Face * face = &(*faces.rbegin());
 
       // Initialize the face
@@ -741,7 +759,7 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
 
       Vertex * old_e1 = edge->getEndpoint(1);
       edge->setEndpoint(1, vertex);
-      edges.push_back(Edge(vertex, old_e1));
+      edges.push_back(Edge(vertex, old_e1, element_alloc));
       Edge * new_edge = &edges.back();
 
       vertex->addEdge(edge);
@@ -1158,6 +1176,34 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
     }
 
   private:
+    /**
+     * Remove all vertices, edges and faces. If the allocator can release all its memory at once, and the elements own nothing
+     * else (their attributes are trivially destructible), the element lists are abandoned without visiting their nodes, all
+     * memory is released in one go, and the lists are recreated empty. Else, the lists are cleared one node at a time.
+     */
+    void clearElements()
+    {
+      if (AllocatorInstance<Allocator>::CAN_RELEASE_ALL
+       && std::is_trivially_destructible<VertexAttributeT>::value
+       && std::is_trivially_destructible<EdgeAttributeT>::value
+       && std::is_trivially_destructible<FaceAttributeT>::value)
+      {
+        // Ending the lifetime of the lists by reusing their storage, without calling their destructors, is allowed since no
+        // side effects other than freeing memory are skipped. Some standard libraries allocate a sentinel node even for an
+        // empty list, so the memory must be released before the new lists are created.
+        alloc_instance.releaseAll();
+        new (&faces) FaceList(element_alloc);
+        new (&vertices) VertexList(element_alloc);
+        new (&edges) EdgeList(element_alloc);
+      }
+      else
+      {
+        vertices.clear();
+        edges.clear();
+        faces.clear();
+      }
+    }
+
     /**
      * Initialize a pre-constructed face, which will be assigned the sequence of vertices obtained by dereferencing
      * [vbegin, vend). VertexInputIterator must dereference to a pointer to a Vertex. Unless the mesh is already in an
@@ -1205,7 +1251,7 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
         Edge * edge = (*vi)->getEdgeTo(*next);
         if (!edge)
         {
-          edges.push_back(Edge(*vi, *next));
+          edges.push_back(Edge(*vi, *next, element_alloc));
           edge = &(*edges.rbegin());
 
           (*vi)->addEdge(edge);
@@ -1687,6 +1733,8 @@ class /* THEA_API */ GeneralMesh : public virtual NamedObject, public AbstractMe
     typedef Array<Vector2>    TexCoordArray;  ///< Array of texture coordinates.
     typedef Array<uint32>     IndexArray;     ///< Array of indices.
 
+    AllocatorInstance<Allocator> alloc_instance;  ///< Owns the allocator and its state (must precede the members below).
+    Allocator   element_alloc;  ///< Allocator shared by all mesh elements (must be initialized before the lists below).
     FaceList    faces;        ///< Set of mesh faces.
     VertexList  vertices;     ///< Set of mesh vertices.
     EdgeList    edges;        ///< Set of mesh edges.
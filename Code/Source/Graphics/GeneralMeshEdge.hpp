@@ -48,8 +48,12 @@ class /* THEA_API */ GeneralMeshEdge : public AttributedObject<EdgeAttributeT>
     typedef typename FaceList::iterator        FaceIterator;       ///< Iterator over faces.
     typedef typename FaceList::const_iterator  FaceConstIterator;  ///< Const iterator over faces.
 
-    /** Construct from two endpoints. */
-    GeneralMeshEdge(Vertex * v0 = nullptr, Vertex * v1 = nullptr) : marked(false), bits(0), internal_bits(0)
+    /** Allocator for the list of incident faces (rebound to the appropriate type). */
+    typedef AllocatorT<char> Allocator;
+
+    /** Construct from two endpoints, optionally specifying the allocator for the list of incident faces. */
+    GeneralMeshEdge(Vertex * v0 = nullptr, Vertex * v1 = nullptr, Allocator const & alloc = Allocator())
+    : faces(alloc), marked(false), bits(0), internal_bits(0)
     {
       endpoints[0] = v0;
       endpoints[1] = v1;
@@ -58,8 +58,16 @@ class /* THEA_API */ GeneralMeshFace : public NormalAttribute<Vector3>, public A
     typedef typename EdgeList::reverse_iterator          EdgeReverseIterator;         ///< Reverse iterator over edges.
     typedef typename EdgeList::const_reverse_iterator    EdgeConstReverseIterator;    ///< Const reverse iterator over edges.
 
-    /** Construct with the given normal. */
-    GeneralMeshFace(Vector3 const & normal = Vector3::Zero()) : NormalBaseType(normal), index(-1), marked(false) {}
+    /** Allocator for the lists of vertices and edges (rebound to the appropriate types). */
+    typedef AllocatorT<char> Allocator;
+
+    /** Construct with the given normal, optionally specifying the allocator for the lists of vertices and edges. */
+    GeneralMeshFace(Vector3 const & normal = Vector3::Zero(), Allocator const & alloc = Allocator())
+    : NormalBaseType(normal), vertices(alloc), edges(alloc), index(-1), marked(false) {}
+
+    /** Construct a face whose lists of vertices and edges use the given allocator. */
+    explicit GeneralMeshFace(Allocator const & alloc)
+    : NormalBaseType(Vector3::Zero()), vertices(alloc), edges(alloc), index(-1), marked(false) {}
 
     /** Check if the face has a given vertex. */
     bool hasVertex(Vertex const * vertex) const
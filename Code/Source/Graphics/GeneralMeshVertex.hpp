@@ -60,24 +60,33 @@ class /* THEA_API */ GeneralMeshVertex
     typedef typename FaceList::iterator        FaceIterator;       ///< Iterator over faces.
     typedef typename FaceList::const_iterator  FaceConstIterator;  ///< Const iterator over faces.
 
+    /** Allocator for the lists of incident edges and faces (rebound to the appropriate types). */
+    typedef AllocatorT<char> Allocator;
+
     /** Default constructor. */
     GeneralMeshVertex()
     : NormalBaseType(Vector3::Zero()), index(-1), has_precomputed_normal(false), normal_normalization_factor(0), marked(false)
     {}
 
-    /** Sets the vertex to have a location. */
-    explicit GeneralMeshVertex(Vector3 const & p)
-    : PositionBaseType(p), NormalBaseType(Vector3::Zero()), index(-1), has_precomputed_normal(false),
+    /** Construct a vertex whose lists of incident edges and faces use the given allocator. */
+    explicit GeneralMeshVertex(Allocator const & alloc)
+    : NormalBaseType(Vector3::Zero()), edges(alloc), faces(alloc), index(-1), has_precomputed_normal(false),
       normal_normalization_factor(0), marked(false)
     {}
 
+    /** Sets the vertex to have a location. */
+    explicit GeneralMeshVertex(Vector3 const & p, Allocator const & alloc = Allocator())
+    : PositionBaseType(p), NormalBaseType(Vector3::Zero()), edges(alloc), faces(alloc), index(-1),
+      has_precomputed_normal(false), normal_normalization_factor(0), marked(false)
+    {}
+
     /**
      * Sets the vertex to have a location and a precomputed normal. Adding faces will <b>not</b> change the vertex normal if
      * this constructor is used.
      */
-    GeneralMeshVertex(Vector3 const & p, Vector3 const & n)
-    : PositionBaseType(p), NormalBaseType(n), index(-1), has_precomputed_normal(true), normal_normalization_factor(0),
-      marked(false)
+    GeneralMeshVertex(Vector3 const & p, Vector3 const & n, Allocator const & alloc = Allocator())
+    : PositionBaseType(p), NormalBaseType(n), edges(alloc), faces(alloc), index(-1), has_precomputed_normal(true),
+      normal_normalization_factor(0), marked(false)
     {}
 
     /**
@@ -87,6 +87,33 @@ class IncrementalMeshBuilder<MeshT, typename std::enable_if< IsDisplayMesh<MeshT
       return ref;
     }
 
+    /**
+     * Add a block of vertices with the given positions to the mesh, and return a handle to the first one. The remaining
+     * vertices have consecutive handles. If \a first_index is non-negative, the vertices are assigned consecutive indices
+     * starting from it. Must be called within a begin() / end() block.
+     */
+    VertexHandle addVertices(intx count, Vector3 const * positions, intx first_index = -1)
+    {
+      debugAssertM(building, "IncrementalMeshBuilder: Vertices cannot be added outside a begin/end block");
+
+      VertexHandle ref = mesh->addVertices(count, positions, first_index);
+      num_vertices += count;
+      return ref;
+    }
+
+    /**
+     * Add a block of triangles to the mesh, each specified by three consecutive vertex handles in \a tri_vertices. If
+     * \a first_index is non-negative, the triangles are assigned consecutive indices starting from it. Must be called within
+     * a begin() / end() block.
+     */
+    void addTriangles(intx count, uint32 const * tri_vertices, intx first_index = -1)
+    {
+      debugAssertM(building, "IncrementalMeshBuilder: Faces cannot be added outside a begin/end block");
+
+      mesh->addTriangles(count, tri_vertices, first_index);
+      num_faces += count;
+    }
+
     /** Get the number of vertices added so far. */
     intx numVertices() const { return num_vertices; }
 
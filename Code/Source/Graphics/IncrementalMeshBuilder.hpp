@@ -51,6 +51,14 @@ class IncrementalMeshBuilder
     /** Add a face to the mesh and return a handle to it. Must be called within a begin() / end() block. */
     template <typename IndexIterator> FaceHandle addFace(IndexIterator begin, IndexIterator end, intx index = -1);
 
+    /*
+     * Builders for meshes that store their elements in arrays may additionally provide the following functions, which codecs
+     * use (if available) to add large blocks of elements at once. Vertex handles of such meshes must be integer indices.
+     *
+     *   VertexHandle addVertices(intx count, Vector3 const * positions, intx first_index = -1);
+     *   void addTriangles(intx count, uint32 const * tri_vertices, intx first_index = -1);
+     */
+
     /** Get the number of vertices added so far. */
     intx numVertices() const;
 
@@ -17,10 +17,14 @@
 
 #include "../Common.hpp"
 #include "../Array.hpp"
+#include "../LineScanner.hpp"
+#include "../System.hpp"
+#include "../ThreadGroup.hpp"
 #include "../UnorderedMap.hpp"
 #include "MeshGroup.hpp"
 #include "MeshCodec.hpp"
 #include "MeshType.hpp"
+#include <algorithm>
 #include <functional>
 #include <sstream>
 #include <type_traits>
@@ -54,11 +58,103 @@ struct VertexIndexMap
 };
 
 template <typename MeshT>
-struct VertexIndexMap<MeshT, typename std::enable_if< Graphics::IsDisplayMesh<MeshT>::value >::type>
+struct VertexIndexMap<MeshT, typename std::enable_if< Graphics::IsDisplayMesh<MeshT>::value
+                                                   || Graphics::IsCompactMesh<MeshT>::value >::type>
 {
   typedef UnorderedMap<std::pair<MeshT const *, intx>, intx> type;
 };
 
+/** A face read from an OBJ file, whose vertex references are resolved when the face is added to a mesh. */
+struct FaceRecord
+{
+  intx corners_begin;       ///< Index of the first vertex reference of the face in ParsedLines::corners.
+  intx corners_end;         ///< One past the index of the last vertex reference of the face in ParsedLines::corners.
+  bool bad_index;           ///< True if a vertex reference following the recorded ones could not be parsed.
+  intx num_vertices;        ///< Number of vertex positions preceding the face in its block of lines.
+  intx num_texcoords;       ///< Number of texture coordinates preceding the face in its block of lines.
+  intx num_normals;         ///< Number of normals preceding the face in its block of lines.
+  intx line_number;         ///< Number of the line containing the face, relative to the start of its block.
+  char const * line_begin;  ///< Beginning of the text of the line.
+  char const * line_end;    ///< End of the text of the line.
+};
+
+/** A group (or object) statement read from an OBJ file. */
+struct GroupRecord
+{
+  intx face_index;   ///< Number of faces preceding the statement in its block of lines.
+  std::string name;  ///< Name of the group, possibly empty.
+};
+
+/**
+ * The elements read from a contiguous block of lines of an OBJ file. Since faces may refer to vertices relative to the end of
+ * the list of vertices read so far, vertex references are only resolved when the blocks are assembled in order, which allows
+ * different blocks to be parsed independently.
+ */
+struct ParsedLines
+{
+  Array<Vector3> vertices;     ///< Vertex positions.
+  Array<Vector2> texcoords;    ///< Texture coordinates.
+  Array<Vector3> normals;      ///< Vertex normals.
+  Array<VTN> corners;          ///< Vertex references of faces, as (unresolved) vertex/texcoord/normal index triplets.
+  Array<FaceRecord> faces;     ///< Faces.
+  Array<GroupRecord> groups;   ///< Group statements.
+  intx num_lines;              ///< Number of lines in the block.
+  char const * error_element;  ///< If non-null, the element that could not be read, after which parsing was abandoned.
+  intx error_line;             ///< Number of the line containing the error, relative to the start of the block.
+  std::string error_text;      ///< Text of the line containing the error.
+  std::string fatal_error;     ///< Message of an unexpected exception thrown during parsing, if any.
+
+  /** Constructor. */
+  ParsedLines() : num_lines(0), error_element(nullptr), error_line(0) {}
+
+  /** Discard all parsed elements. */
+  void clear()
+  {
+    vertices.clear(); texcoords.clear(); normals.clear();
+    clearFaces();
+
+    num_lines = 0;
+    error_element = nullptr;
+    error_line = 0;
+    error_text.clear();
+    fatal_error.clear();
+  }
+
+  /** Discard faces and groups, but retain vertex data. */
+  void clearFaces() { corners.clear(); faces.clear(); groups.clear(); }
+};
+
+/** Check if a character is part of a line break. */
+inline bool
+isLineBreak(char c)
+{
+  return c == '\n' || c == '\r';
+}
+
+/**
+ * Get the beginning of the first line starting at or after a position in a text, consistent with the way the text is
+ * split into lines when it is read sequentially from its beginning (see BinaryInputStream::readLineInPlace()). Returns \a end
+ * if there is no such line.
+ */
+inline char const *
+nextLineStart(char const * pos, char const * end)
+{
+  // A run of line break characters can be split into lines in different ways depending on what precedes it, so skip any run
+  // the position lies in and look for the next one, which is unambiguously preceded by the content of a line
+  while (pos != end && isLineBreak(*pos)) ++pos;
+  while (pos != end && !isLineBreak(*pos)) ++pos;
+
+  if (pos == end)
+    return end;
+
+  // Consume the line break, which may consist of two different characters
+  char c = *pos++;
+  if (pos != end && isLineBreak(*pos) && *pos != c)
+    ++pos;
+
+  return pos;
+}
+
 } // namespace CodecOBJInternal
 
 } // namespace Thea
@@ -102,6 +198,7 @@ class CodecOBJ : public CodecOBJBase<MeshT>
         bool store_vertex_indices;
         bool store_face_indices;
         bool strict;
+        intx max_threads;
         bool verbose;
 
         friend class CodecOBJ;
@@ -110,7 +207,7 @@ class CodecOBJ : public CodecOBJBase<MeshT>
         /* Constructor. Sets default values. */
         ReadOptions()
         : ignore_texcoords(false), ignore_normals(false), skip_empty_meshes(true), flatten(false), store_vertex_indices(true),
-          store_face_indices(true), strict(false), verbose(false) {}
+          store_face_indices(true), strict(false), max_threads(1), verbose(false) {}
 
         /**
          * Ignore texture coordinates when reading from/writing to the OBJ file? If false, each unique vertex/texcoord pair
@@ -140,13 +237,23 @@ class CodecOBJ : public CodecOBJBase<MeshT>
         /** Treat warnings as errors */
         ReadOptions & setStrict(bool value) { strict = value; return *this; }
 
+        /**
+         * Set the maximum number of threads used to parse the file. If the value is 1 (the default), the file is read serially.
+         * If it is negative, the number of threads is set to the hardware concurrency. In parallel mode, the file is split into
+         * blocks of lines that are parsed concurrently, and the parsed elements are then added to meshes in their original
+         * order, so the result -- including the division into meshes, reported warnings and callbacks -- is identical to that
+         * of a serial read.
+         */
+        ReadOptions & setMaxThreads(intx value) { max_threads = value; return *this; }
+
         /** Print debugging information? */
         ReadOptions & setVerbose(bool value) { verbose = value; return *this; }
 
         /**
          * The set of default options. The default options correspond to
          * ReadOptions().setIgnoreTexCoords(false).setIgnoreNormals(false).setSkipEmptyMeshes(true).setFlatten(false)
-         *              .setStoreVertexIndices(true).setStoreFaceIndices(true).setVerbose(false).
+         *              .setStoreVertexIndices(true).setStoreFaceIndices(true).setStrict(false).setMaxThreads(1)
+         *              .setVerbose(false).
          */
         static ReadOptions const & defaults() { static ReadOptions const def; return def; }
 
@@ -217,325 +324,582 @@ class CodecOBJ : public CodecOBJBase<MeshT>
         in = tmp_in.get();
       }
 
-      using CodecOBJInternal::VTN;
-      typedef UnorderedMap<VTN, typename Builder::VertexHandle> VTNVertexMap;
-      typedef UnorderedMap<intx, typename Builder::VertexHandle> IndexVertexMap;
-      VTNVertexMap vtn_refs;
-      IndexVertexMap vrefs;
-      Array<typename Builder::VertexHandle> face;
-
       // OBJ is not neatly divided into separate meshes (e.g. *all* the vertices can be put at the beginning), so we need to
       // cache the vertices and add them to meshes on-demand.
-      Array<Vector3> vertices;
-      Array<Vector2> texcoords;
-      Array<Vector3> normals;
+      CodecOBJInternal::ParsedLines elements;
+      BuildState state(mesh_group, callback, elements,
+                       std::string(mesh_group.getName()) + (read_opts.flatten ? "/FlattenedMesh" : "/AnonymousMesh0"));
 
-      std::string line;
-      double x, y, z;
-      intx index;
+      intx num_threads = (read_opts.max_threads < 0 ? System::concurrency() : read_opts.max_threads);
+      int64 text_length = in->size() - in->getPosition();
+      if (num_threads > 1 && text_length >= 2 * MIN_PARALLEL_BLOCK_LENGTH)
+      {
+        char const * text = reinterpret_cast<char const *>(in->readBytesInPlace(text_length));
+        readParallel(text, text + text_length, num_threads, elements, state);
+      }
+      else
+      {
+        LineScanner scanner(*in);
+        while (scanner.readLine())
+        {
+          // Lines are parsed and added to the meshes one at a time
+          parseLine(scanner, elements);
+          if (!elements.faces.empty() || !elements.groups.empty() || elements.error_element)
+          {
+            buildBlock(elements, 0, state);
+            elements.clearFaces();
+          }
+        }
+      }
 
-      std::string group_name = std::string(mesh_group.getName()) + (read_opts.flatten ? "/FlattenedMesh" : "/AnonymousMesh0");
-      int anon_index = 0;
+      finish(state);
+    }
 
-      MeshPtr mesh;
-      std::shared_ptr<Builder> bp;
-      Builder * builder = nullptr;
+    void writeMeshGroup(MeshGroup const & mesh_group, BinaryOutputStream & output, bool write_block_header,
+                        WriteCallback * callback) const
+    {
+      Codec::BlockHeader bh(this->getMagic());
+      if (write_block_header)
+        bh.markAndSkip(output);
+
+      // No need to set endianness, OBJ is a purely text-based format
+
+      VertexIndexMap vertex_indices;
+      writeVertices(mesh_group, output, vertex_indices, callback);
+
+      intx next_index = 0;
+      writeFaces(mesh_group, vertex_indices, output, callback, next_index);
+
+      if (write_block_header)
+        bh.calcAndWrite(output);
+    }
+
+  private:
+    /** Minimum number of bytes in each block of lines parsed by a separate thread. */
+    static int64 const MIN_PARALLEL_BLOCK_LENGTH = 1024 * 1024;
+
+    /** Maximum number of bytes in each block of lines parsed by a separate thread. */
+    static int64 const MAX_PARALLEL_BLOCK_LENGTH = 32 * 1024 * 1024;
+
+    /** The meshes being assembled from the elements parsed from a file. */
+    struct BuildState
+    {
+      typedef UnorderedMap<CodecOBJInternal::VTN, typename Builder::VertexHandle> VTNVertexMap;
+      typedef UnorderedMap<intx, typename Builder::VertexHandle> IndexVertexMap;
 
-      intx num_faces = 0;
+      /** Constructor. */
+      BuildState(MeshGroup & mesh_group_, ReadCallback * callback_, CodecOBJInternal::ParsedLines const & elements_,
+                 std::string const & group_name_)
+      : mesh_group(mesh_group_), callback(callback_), elements(elements_), group_name(group_name_), anon_index(0),
+        builder(nullptr), num_faces(0)
+      {}
+
+      MeshGroup & mesh_group;                          ///< The mesh group being read.
+      ReadCallback * callback;                         ///< Called when an element is added to a mesh.
+      CodecOBJInternal::ParsedLines const & elements;  ///< All vertex data read so far.
+      VTNVertexMap vtn_refs;                           ///< Vertices of the current mesh, by vertex/texcoord/normal indices.
+      IndexVertexMap vrefs;                            ///< Vertices of the current mesh, by vertex index.
+      Array<typename Builder::VertexHandle> face;      ///< The vertices of the face being added.
+      std::string group_name;                          ///< Name of the current group.
+      int anon_index;                                  ///< Number of anonymous groups so far.
+      MeshPtr mesh;                                    ///< The current mesh.
+      std::shared_ptr<Builder> bp;                     ///< Builder for the current mesh.
+      Builder * builder;                               ///< Builder for the current mesh, or null if no mesh has been started.
+      intx num_faces;                                  ///< Number of faces read so far.
+
+    }; // struct BuildState
+
+    /** Parses a block of lines of a file, typically in a separate thread. */
+    struct BlockParser
+    {
+      /** Constructor. */
+      BlockParser(CodecOBJ const * codec_, char const * begin_, char const * end_, CodecOBJInternal::ParsedLines * parsed_)
+      : codec(codec_), begin(begin_), end(end_), parsed(parsed_)
+      {}
 
-      while (in->hasMore())
+      /** Parse the block. */
+      void operator()()
       {
-        std::string line = trimWhitespace(in->readLine());
-        bool done = false;
-        while (line.empty() || !(line[0] == 'v' || line[0] == 'f' || line[0] == 'p' || line[0] == 'g' || line[0] == 'o'))
+        try
         {
-          if (in->hasMore())
-            line = trimWhitespace(in->readLine());
-          else
+          BinaryInputStream in(reinterpret_cast<uint8 const *>(begin), (int64)(end - begin), Endianness::LITTLE,
+                               BinaryInputStream::NO_COPY);
+          LineScanner scanner(in);
+          while (scanner.readLine())
           {
-            done = true;
-            break;
+            if (!codec->parseLine(scanner, *parsed))
+              break;
           }
+
+          parsed->num_lines = scanner.getLineNumber();
+        }
+        catch (std::exception & e)
+        {
+          parsed->fatal_error = e.what();
         }
+        catch (...)
+        {
+          parsed->fatal_error = "An unknown error occurred";
+        }
+      }
 
-        if (done) break;
+      CodecOBJ const * codec;                   ///< The codec.
+      char const * begin;                       ///< Beginning of the block.
+      char const * end;                         ///< End of the block.
+      CodecOBJInternal::ParsedLines * parsed;   ///< The parsed elements of the block.
 
-        if (line[0] == 'v' && line.length() >= 2)
-        {
-          std::istringstream vstr(line); vstr.get();
+    }; // struct BlockParser
 
-          if (line[1] == 't')
-          {
-            if (!read_opts.ignore_texcoords)  // texcoord
-            {
-              vstr.get();
-              if (!(vstr >> x >> y))
-                throw Error(std::string(getName()) + ": Could not read texture coordinate on line '" + line + '\'');
+    /**
+     * Parse the current line of a scanner, appending its elements (if any) to a block of parsed lines. If the line could not be
+     * parsed, the error is recorded in the block and the function returns false.
+     */
+    bool parseLine(LineScanner & scanner, CodecOBJInternal::ParsedLines & parsed) const
+    {
+      intx line_length = scanner.lineLength();
+      if (line_length <= 0)
+        return true;
 
-              texcoords.push_back(Vector2((Real)x, (Real)y));
-            }
-          }
-          else if (line[1] == 'n')
+      double x, y, z;
+      char const * line = scanner.lineBegin();
+      if (line[0] == 'v' && line_length >= 2)
+      {
+        if (line[1] == 't')
+        {
+          if (!read_opts.ignore_texcoords)  // texcoord
           {
-            if (!read_opts.ignore_normals)  // normal
-            {
-              vstr.get();
-              if (!(vstr >> x >> y >> z))
-                throw Error(std::string(getName()) + ": Could not read normal on line '" + line + '\'');
+            scanner.setCursor(line + 2);
+            if (!scanner.readReal(x) || !scanner.readReal(y))
+              return setParseError(scanner, "texture coordinate", parsed);
 
-              normals.push_back(Vector3((Real)x, (Real)y, (Real)z));
-            }
+            parsed.texcoords.push_back(Vector2((Real)x, (Real)y));
           }
-          else if (line[1] == ' ' || line[1] == '\t')  // vertex
+        }
+        else if (line[1] == 'n')
+        {
+          if (!read_opts.ignore_normals)  // normal
           {
-            if (!(vstr >> x >> y >> z))
-              throw Error(std::string(getName()) + ": Could not read vertex position on line '" + line + '\'');
+            scanner.setCursor(line + 2);
+            if (!scanner.readReal(x) || !scanner.readReal(y) || !scanner.readReal(z))
+              return setParseError(scanner, "normal", parsed);
 
-            vertices.push_back(Vector3((Real)x, (Real)y, (Real)z));
+            parsed.normals.push_back(Vector3((Real)x, (Real)y, (Real)z));
           }
         }
-        else if ((line[0] == 'f' || line[0] == 'p') && line.length() >= 2 && (line[1] == ' ' || line[1] == '\t'))  // face
+        else if (line[1] == ' ' || line[1] == '\t')  // vertex
         {
-          // If no mesh+builder have been created yet, create them
-          if (!builder)
+          scanner.setCursor(line + 1);
+          if (!scanner.readReal(x) || !scanner.readReal(y) || !scanner.readReal(z))
+            return setParseError(scanner, "vertex position", parsed);
+
+          parsed.vertices.push_back(Vector3((Real)x, (Real)y, (Real)z));
+        }
+      }
+      else if ((line[0] == 'f' || line[0] == 'p') && line_length >= 2 && (line[1] == ' ' || line[1] == '\t'))  // face
+      {
+        CodecOBJInternal::FaceRecord face;
+        face.corners_begin = (intx)parsed.corners.size();
+        face.bad_index = false;
+        face.num_vertices = (intx)parsed.vertices.size();
+        face.num_texcoords = (intx)parsed.texcoords.size();
+        face.num_normals = (intx)parsed.normals.size();
+        face.line_number = scanner.getLineNumber();
+        face.line_begin = scanner.lineBegin();
+        face.line_end = scanner.lineEnd();
+
+        // The rest of the face is not needed once a vertex reference is found to be bad
+        scanner.setCursor(line + 1);
+        char const * field_begin = nullptr, * field_end = nullptr;
+        CodecOBJInternal::VTN vtn;
+        while (scanner.readField(field_begin, field_end))
+        {
+          if (!parseVertexRef(field_begin, field_end, vtn))
           {
-            mesh = MeshPtr(new Mesh(group_name));
-            bp = std::shared_ptr<Builder>(new Builder(mesh));
-            builder = bp.get();
-            builder->begin();
+            face.bad_index = true;
+            break;
           }
 
-          face.clear();
-          size_t field_begin = line.find_first_not_of("fp \t"), field_end = 0;
-          bool bad_face = false;
-          while (field_end != std::string::npos)
-          {
-            field_end = line.find_first_of(" \t", field_begin);
+          parsed.corners.push_back(vtn);
+        }
 
-            std::istringstream fstr(line.substr(field_begin, (field_end == std::string::npos ? std::string::npos
-                                                                                             : field_end - field_begin)));
-            fstr.setf(std::ios::skipws);
+        face.corners_end = (intx)parsed.corners.size();
+        parsed.faces.push_back(face);
+      }
+      else if (!read_opts.flatten
+            && ((line[0] == 'g' || line[0] == 'o') && (line_length < 2 || line[1] == ' ' || line[1] == '\t')))  // group
+      {
+        CodecOBJInternal::GroupRecord group;
+        group.face_index = (intx)parsed.faces.size();
+        scanner.setCursor(line + 1);
+        group.name = scanner.readRest();
 
-            if (!read_opts.ignore_texcoords || !read_opts.ignore_normals)  // use the VTN map
-            {
-              // OBJ stores a vertex reference as VertexIndex[/[TexCoordIndex][/NormalIndex]]
-              VTN vtn; vtn[0] = 0, vtn[1] = 0; vtn[2] = 0;
-
-              bool bad_index = false;
-              if (!(fstr >> vtn[0]))
-                bad_index = true;
-
-              if (!bad_index && fstr.get() == '/')
-              {
-                if (fstr.peek() == '/')
-                {
-                  if (!read_opts.ignore_normals)
-                  {
-                    fstr.get();
-                    if (!(fstr >> vtn[2]))
-                      bad_index = true;
-                  }
-                }
-                else
-                {
-                  if (!(fstr >> vtn[1]))
-                    bad_index = true;
-
-                  if (!bad_index)
-                  {
-                    if (read_opts.ignore_texcoords)  // reset field
-                      vtn[1] = 0;
-
-                    if (!read_opts.ignore_normals && fstr.get() == '/')
-                    {
-                      if (!(fstr >> vtn[2]))
-                        bad_index = true;
-                    }
-                  }
-                }
-              }
-
-              if (bad_index)
-              {
-                THEA_WARNING << getName() << ": Could not read index";
-                bad_face = true; break;
-              }
-
-              if (std::abs(vtn[0]) < 1 || std::abs(vtn[0]) > (intx)vertices.size())
-              {
-                THEA_WARNING << getName() << ": Vertex index " << vtn[0] << " out of bounds (#vertices = "
-                             << vertices.size() << ')';
-                bad_face = true; break;
-              }
-
-              if (!read_opts.ignore_texcoords && std::abs(vtn[1]) > (intx)texcoords.size())
-              {
-                THEA_WARNING << getName() << ": Texture coordinate index " << vtn[1] << " out of bounds (#texcoords = "
-                             << texcoords.size() << ')';
-                vtn[1] = 0;
-              }
-
-              if (!read_opts.ignore_normals && std::abs(vtn[2]) > (intx)normals.size())
-              {
-                THEA_WARNING << getName() << ": Normal index " << vtn[2] << " out of bounds (#normals = "
-                             << normals.size() << ')';
-                vtn[2] = 0;
-              }
-
-              // Negative indices indicate counting from the last element. We'll subtract one eventually, so -1 should currently
-              // map to vertices.size().
-              if (vtn[0] < 0) vtn[0] = (intx)vertices.size()  + 1 + vtn[0];
-              if (vtn[1] < 0) vtn[1] = (intx)texcoords.size() + 1 + vtn[1];
-              if (vtn[2] < 0) vtn[2] = (intx)normals.size()   + 1 + vtn[2];
-
-              // Add the vertex referenced by the triple to the mesh builder if it has not already been added
-              typename VTNVertexMap::const_iterator existing = vtn_refs.find(vtn);
-              if (existing == vtn_refs.end())
-              {
-                typename Builder::VertexHandle vref = builder->addVertex(vertices[(size_t)vtn[0] - 1],
-                                                                         read_opts.store_vertex_indices ? vtn[0] - 1 : -1,
-                                                                         vtn[2] > 0 ? &normals[(size_t)vtn[2] - 1] : nullptr,
-                                                                         nullptr,  // color
-                                                                         vtn[1] > 0 ? &texcoords[(size_t)vtn[1] - 1] : nullptr);
-                if (callback)
-                  callback->vertexRead(mesh.get(), vtn[0] - 1, vref);
+        parsed.groups.push_back(group);
+      }
+      // Else ignore the line
 
-                vtn_refs[vtn] = vref;
-                face.push_back(vref);
-              }
-              else
-                face.push_back(existing->second);
-            }
-            else
-            {
-              if (!(fstr >> index))
-              {
-                THEA_WARNING << getName() << ": Could not read index";
-                bad_face = true; break;
-              }
-
-              if (std::abs(index) < 1 || std::abs(index) > (intx)vertices.size())
-              {
-                THEA_WARNING << getName() << ": Vertex index " << index << " out of bounds (#vertices = "
-                             << vertices.size() << ')';
-                bad_face = true; break;
-              }
-
-              // OBJ indices start from 1. Negative indices indicate counting from the last element.
-              index = (index < 0 ? (intx)vertices.size() + index : index - 1);
-
-              // Add the referenced vertex to the mesh builder if it has not already been added
-              typename IndexVertexMap::const_iterator existing = vrefs.find(index);
-              if (existing == vrefs.end())
-              {
-                typename Builder::VertexHandle vref = builder->addVertex(vertices[(size_t)index],
-                                                                         (read_opts.store_vertex_indices ? index : -1));
-                if (callback)
-                  callback->vertexRead(mesh.get(), index, vref);
+      return true;
+    }
 
-                vrefs[index] = vref;
-                face.push_back(vref);
-              }
-              else
-                face.push_back(existing->second);
-            }
+    /** Record that an element could not be read from the current line of a scanner. Always returns false. */
+    static bool setParseError(LineScanner const & scanner, char const * element, CodecOBJInternal::ParsedLines & parsed)
+    {
+      parsed.error_element = element;
+      parsed.error_line = scanner.getLineNumber();
+      parsed.error_text = scanner.getLine();
+      return false;
+    }
 
-            if (field_end != std::string::npos)
-              field_begin = line.find_first_not_of(" \t", field_end);
-          }
+    /**
+     * Parse a vertex reference of a face. If texture coordinates and normals are both ignored, only the vertex index is read
+     * and the other two entries of \a vtn are set to zero. Returns false if the reference is malformed.
+     */
+    bool parseVertexRef(char const * f, char const * field_end, CodecOBJInternal::VTN & vtn) const
+    {
+      vtn[0] = 0; vtn[1] = 0; vtn[2] = 0;
 
-          if (!bad_face)
-          {
-            typename Builder::FaceHandle fref = builder->addFace(face.begin(), face.end(),
-                                                                 (read_opts.store_face_indices ? num_faces : -1));
-            if (callback)
-              callback->faceRead(mesh.get(), num_faces, fref);
+      if (!LineScanner::parseInteger(f, field_end, vtn[0]))
+        return false;
 
-            num_faces++;
-          }
-          else
+      if (read_opts.ignore_texcoords && read_opts.ignore_normals)
+        return true;
+
+      // OBJ stores a vertex reference as VertexIndex[/[TexCoordIndex][/NormalIndex]]
+      if (f != field_end && *f == '/')
+      {
+        ++f;
+        if (f != field_end && *f == '/')
+        {
+          if (!read_opts.ignore_normals)
           {
-            if (read_opts.strict)
-              throw Error(std::string(getName()) + ": Malformed face: '" + line + '\'');
-            else
-              THEA_WARNING << getName() << ": Skipping malformed face: '" << line << '\'';
+            ++f;
+            if (!LineScanner::parseInteger(f, field_end, vtn[2]))
+              return false;
           }
         }
-        else if (!read_opts.flatten
-              && ((line[0] == 'g' || line[0] == 'o') && (line.length() < 2 || line[1] == ' ' || line[1] == '\t')))  // group
+        else
         {
-          // Add the previous mesh to the mesh group
-          if (builder)
+          if (!LineScanner::parseInteger(f, field_end, vtn[1]))
+            return false;
+
+          if (read_opts.ignore_texcoords)  // reset field
+            vtn[1] = 0;
+
+          if (!read_opts.ignore_normals && f != field_end && *f == '/')
           {
-            builder->end();
-            if (builder->numFaces() > 0 || !read_opts.skip_empty_meshes)
-            {
-              if (read_opts.verbose)
-              {
-                THEA_CONSOLE << getName() << ": Mesh " << mesh->getName() << " has " << builder->numVertices()
-                             << " vertices and " << builder->numFaces() << " faces";
-              }
+            ++f;
+            if (!LineScanner::parseInteger(f, field_end, vtn[2]))
+              return false;
+          }
+        }
+      }
 
-              mesh_group.addMesh(mesh);
-            }
+      return true;
+    }
+
+    /**
+     * Parse a text in parallel, in successive rounds of blocks of lines. While the blocks of one round are added to the meshes
+     * by the calling thread, the blocks of the next round are parsed by a group of threads. The vertex data of all blocks is
+     * collected in \a elements.
+     */
+    void readParallel(char const * text, char const * text_end, intx num_threads, CodecOBJInternal::ParsedLines & elements,
+                      BuildState & state) const
+    {
+      int64 block_length = std::max(MIN_PARALLEL_BLOCK_LENGTH,
+                                    std::min(MAX_PARALLEL_BLOCK_LENGTH, (int64)(text_end - text) / (4 * num_threads)));
+
+      Array<CodecOBJInternal::ParsedLines> blocks((size_t)num_threads), next_blocks((size_t)num_threads);
+      size_t num_blocks = 0;
+      {
+        ThreadGroup pool;
+        num_blocks = startParsingBlocks(text, text_end, block_length, blocks, pool);
+        pool.joinAll();
+      }
+
+      intx line_offset = 0;
+      while (num_blocks > 0)
+      {
+        ThreadGroup pool;
+        size_t num_next_blocks = startParsingBlocks(text, text_end, block_length, next_blocks, pool);
+
+        try
+        {
+          for (size_t i = 0; i < num_blocks; ++i)
+          {
+            CodecOBJInternal::ParsedLines & block = blocks[i];
+            // The vertex data of each block is appended to the complete set just before the block is processed
+            elements.vertices.insert(elements.vertices.end(), block.vertices.begin(), block.vertices.end());
+            elements.texcoords.insert(elements.texcoords.end(), block.texcoords.begin(), block.texcoords.end());
+            elements.normals.insert(elements.normals.end(), block.normals.begin(), block.normals.end());
+
+            buildBlock(block, line_offset, state);
+            line_offset += block.num_lines;
           }
+        }
+        catch (...)
+        {
+          pool.joinAll();  // the threads must finish before the blocks they write to are destroyed
+          throw;
+        }
+
+        pool.joinAll();
+
+        blocks.swap(next_blocks);
+        num_blocks = num_next_blocks;
+      }
+    }
 
-          // Read the new group name
-          group_name = trimWhitespace(line.substr(1));
-          if (group_name.empty())
-            group_name = format("%s/AnonymousMesh%d", mesh_group.getName(), ++anon_index);
-
-          // Create a new mesh and a builder for it
-          mesh = MeshPtr(new Mesh(group_name));
-          vrefs.clear();  // start a new set of vertex handles for the new mesh
-          vtn_refs.clear();
-          bp = std::shared_ptr<Builder>(new Builder(mesh));  // old builder gets destroyed here
-          builder = bp.get();
-          builder->begin();
+    /**
+     * Start parsing up to <tt>blocks.size()</tt> consecutive blocks of lines of a text, beginning at \a pos, in separate
+     * threads. Advances \a pos past the blocks, and returns the number of blocks.
+     */
+    size_t startParsingBlocks(char const *& pos, char const * text_end, int64 block_length,
+                              Array<CodecOBJInternal::ParsedLines> & blocks, ThreadGroup & pool) const
+    {
+      size_t num_blocks = 0;
+      for ( ; num_blocks < blocks.size() && pos != text_end; ++num_blocks)
+      {
+        char const * block_end = (text_end - pos <= block_length
+                                ? text_end : CodecOBJInternal::nextLineStart(pos + block_length, text_end));
+
+        blocks[num_blocks].clear();
+        pool.addThread(new std::thread(BlockParser(this, pos, block_end, &blocks[num_blocks])));
+        pos = block_end;
+      }
+
+      return num_blocks;
+    }
+
+    /**
+     * Add the faces and groups of a block of parsed lines to the meshes, in the order in which they appear in the file, and
+     * then throw any error encountered while parsing the block. The vertex data of the block must be at the end of the
+     * complete set of vertex data referenced by \a state. Line numbers in the block are offset by \a line_offset.
+     */
+    void buildBlock(CodecOBJInternal::ParsedLines const & block, intx line_offset, BuildState & state) const
+    {
+      if (!block.fatal_error.empty())
+        throw Error(std::string(getName()) + ": " + block.fatal_error);
+
+      // Number of elements preceding the block
+      intx vertex_base    =  (intx)state.elements.vertices.size()  - (intx)block.vertices.size();
+      intx texcoord_base  =  (intx)state.elements.texcoords.size() - (intx)block.texcoords.size();
+      intx normal_base    =  (intx)state.elements.normals.size()   - (intx)block.normals.size();
+
+      size_t next_group = 0;
+      for (size_t i = 0; i < block.faces.size(); ++i)
+      {
+        for ( ; next_group < block.groups.size() && block.groups[next_group].face_index <= (intx)i; ++next_group)
+          beginGroup(block.groups[next_group].name, state);
+
+        CodecOBJInternal::FaceRecord const & face = block.faces[i];
+        addFace(block, face, vertex_base + face.num_vertices, texcoord_base + face.num_texcoords,
+                normal_base + face.num_normals, line_offset + face.line_number, state);
+      }
+
+      for ( ; next_group < block.groups.size(); ++next_group)
+        beginGroup(block.groups[next_group].name, state);
+
+      if (block.error_element)
+        throw Error(getName() + format(": Could not read %s on line %ld: '%s'", block.error_element,
+                                       line_offset + block.error_line, block.error_text.c_str()));
+    }
+
+    /**
+     * Add a parsed face to the current mesh. \a num_vertices, \a num_texcoords and \a num_normals are the numbers of elements
+     * of each type preceding the face in the file.
+     */
+    void addFace(CodecOBJInternal::ParsedLines const & block, CodecOBJInternal::FaceRecord const & face, intx num_vertices,
+                 intx num_texcoords, intx num_normals, intx line_number, BuildState & state) const
+    {
+      // If no mesh+builder have been created yet, create them
+      if (!state.builder)
+      {
+        state.mesh = MeshPtr(new Mesh(state.group_name));
+        state.bp = std::shared_ptr<Builder>(new Builder(state.mesh));
+        state.builder = state.bp.get();
+        state.builder->begin();
+      }
+
+      state.face.clear();
+      bool bad_face = false;
+      for (intx i = face.corners_begin; i < face.corners_end; ++i)
+      {
+        if (!addVertexRef(block.corners[(size_t)i], num_vertices, num_texcoords, num_normals, state))
+        {
+          bad_face = true;
+          break;
+        }
+      }
+
+      if (!bad_face && face.bad_index)
+      {
+        THEA_WARNING << getName() << ": Could not read index on line " << line_number;
+        bad_face = true;
+      }
+
+      if (!bad_face)
+      {
+        typename Builder::FaceHandle fref = state.builder->addFace(state.face.begin(), state.face.end(),
+                                                                   (read_opts.store_face_indices ? state.num_faces : -1));
+        if (state.callback)
+          state.callback->faceRead(state.mesh.get(), state.num_faces, fref);
+
+        state.num_faces++;
+      }
+      else
+      {
+        if (read_opts.strict)
+          throw Error(getName() + format(": Malformed face on line %ld: '%s'", line_number,
+                                         std::string(face.line_begin, face.line_end).c_str()));
+        else
+          THEA_WARNING << getName() << ": Skipping malformed face on line " << line_number << ": '"
+                       << std::string(face.line_begin, face.line_end) << '\'';
+      }
+    }
+
+    /**
+     * Add the vertex referenced by a face to the current mesh if it has not already been added, and append it to the face
+     * being built. \a num_vertices, \a num_texcoords and \a num_normals are the numbers of elements of each type preceding the
+     * face in the file. Returns false if the reference is invalid.
+     */
+    bool addVertexRef(CodecOBJInternal::VTN vtn, intx num_vertices, intx num_texcoords, intx num_normals,
+                      BuildState & state) const
+    {
+      Array<Vector3> const & vertices = state.elements.vertices;
+
+      if (!read_opts.ignore_texcoords || !read_opts.ignore_normals)  // use the VTN map
+      {
+        if (std::abs(vtn[0]) < 1 || std::abs(vtn[0]) > num_vertices)
+        {
+          THEA_WARNING << getName() << ": Vertex index " << vtn[0] << " out of bounds (#vertices = " << num_vertices << ')';
+          return false;
+        }
+
+        if (!read_opts.ignore_texcoords && std::abs(vtn[1]) > num_texcoords)
+        {
+          THEA_WARNING << getName() << ": Texture coordinate index " << vtn[1] << " out of bounds (#texcoords = "
+                       << num_texcoords << ')';
+          vtn[1] = 0;
+        }
+
+        if (!read_opts.ignore_normals && std::abs(vtn[2]) > num_normals)
+        {
+          THEA_WARNING << getName() << ": Normal index " << vtn[2] << " out of bounds (#normals = " << num_normals << ')';
+          vtn[2] = 0;
+        }
+
+        // Negative indices indicate counting from the last element. We'll subtract one eventually, so -1 should currently map
+        // to num_vertices.
+        if (vtn[0] < 0) vtn[0] = num_vertices  + 1 + vtn[0];
+        if (vtn[1] < 0) vtn[1] = num_texcoords + 1 + vtn[1];
+        if (vtn[2] < 0) vtn[2] = num_normals   + 1 + vtn[2];
+
+        // Add the vertex referenced by the triple to the mesh builder if it has not already been added
+        typename BuildState::VTNVertexMap::const_iterator existing = state.vtn_refs.find(vtn);
+        if (existing == state.vtn_refs.end())
+        {
+          Array<Vector2> const & texcoords = state.elements.texcoords;
+          Array<Vector3> const & normals = state.elements.normals;
+
+          typename Builder::VertexHandle vref = state.builder->addVertex(vertices[(size_t)vtn[0] - 1],
+                                                                         read_opts.store_vertex_indices ? vtn[0] - 1 : -1,
+                                                                         vtn[2] > 0 ? &normals[(size_t)vtn[2] - 1] : nullptr,
+                                                                         nullptr,  // color
+                                                                         vtn[1] > 0 ? &texcoords[(size_t)vtn[1] - 1]
+                                                                                    : nullptr);
+          if (state.callback)
+            state.callback->vertexRead(state.mesh.get(), vtn[0] - 1, vref);
+
+          state.vtn_refs[vtn] = vref;
+          state.face.push_back(vref);
         }
-        // Else ignore the line
+        else
+          state.face.push_back(existing->second);
       }
+      else
+      {
+        intx index = vtn[0];
+        if (std::abs(index) < 1 || std::abs(index) > num_vertices)
+        {
+          THEA_WARNING << getName() << ": Vertex index " << index << " out of bounds (#vertices = " << num_vertices << ')';
+          return false;
+        }
+
+        // OBJ indices start from 1. Negative indices indicate counting from the last element.
+        index = (index < 0 ? num_vertices + index : index - 1);
+
+        // Add the referenced vertex to the mesh builder if it has not already been added
+        typename BuildState::IndexVertexMap::const_iterator existing = state.vrefs.find(index);
+        if (existing == state.vrefs.end())
+        {
+          typename Builder::VertexHandle vref = state.builder->addVertex(vertices[(size_t)index],
+                                                                         (read_opts.store_vertex_indices ? index : -1));
+          if (state.callback)
+            state.callback->vertexRead(state.mesh.get(), index, vref);
 
-      // Add the final mesh to the mesh group
-      if (builder)
+          state.vrefs[index] = vref;
+          state.face.push_back(vref);
+        }
+        else
+          state.face.push_back(existing->second);
+      }
+
+      return true;
+    }
+
+    /** Finish the current mesh, if any, and start a new one for a group (possibly with an empty name). */
+    void beginGroup(std::string const & name, BuildState & state) const
+    {
+      // Add the previous mesh to the mesh group
+      if (state.builder)
       {
-        builder->end();
-        if (builder->numVertices() > 0 || !read_opts.skip_empty_meshes)
+        state.builder->end();
+        if (state.builder->numFaces() > 0 || !read_opts.skip_empty_meshes)
         {
           if (read_opts.verbose)
           {
-            THEA_CONSOLE << getName() << ": Mesh " << mesh->getName() << " has " << builder->numVertices() << " vertices and "
-                         << builder->numFaces() << " faces";
+            THEA_CONSOLE << getName() << ": Mesh " << state.mesh->getName() << " has " << state.builder->numVertices()
+                         << " vertices and " << state.builder->numFaces() << " faces";
           }
 
-          mesh_group.addMesh(mesh);
+          state.mesh_group.addMesh(state.mesh);
         }
       }
 
-      THEA_CONSOLE << getName() << ": Read " << mesh_group.numMeshes() << " submesh(es) with a total of " << vertices.size()
-                   << " vertices and " << num_faces << " faces";
+      state.group_name = name;
+      if (state.group_name.empty())
+        state.group_name = format("%s/AnonymousMesh%d", state.mesh_group.getName(), ++state.anon_index);
+
+      // Create a new mesh and a builder for it
+      state.mesh = MeshPtr(new Mesh(state.group_name));
+      state.vrefs.clear();  // start a new set of vertex handles for the new mesh
+      state.vtn_refs.clear();
+      state.bp = std::shared_ptr<Builder>(new Builder(state.mesh));  // old builder gets destroyed here
+      state.builder = state.bp.get();
+      state.builder->begin();
     }
 
-    void writeMeshGroup(MeshGroup const & mesh_group, BinaryOutputStream & output, bool write_block_header,
-                        WriteCallback * callback) const
+    /** Add the final mesh, if any, to the mesh group. */
+    void finish(BuildState & state) const
     {
-      Codec::BlockHeader bh(this->getMagic());
-      if (write_block_header)
-        bh.markAndSkip(output);
-
-      // No need to set endianness, OBJ is a purely text-based format
-
-      VertexIndexMap vertex_indices;
-      writeVertices(mesh_group, output, vertex_indices, callback);
+      if (state.builder)
+      {
+        state.builder->end();
+        if (state.builder->numVertices() > 0 || !read_opts.skip_empty_meshes)
+        {
+          if (read_opts.verbose)
+          {
+            THEA_CONSOLE << getName() << ": Mesh " << state.mesh->getName() << " has " << state.builder->numVertices()
+                         << " vertices and " << state.builder->numFaces() << " faces";
+          }
 
-      intx next_index = 0;
-      writeFaces(mesh_group, vertex_indices, output, callback, next_index);
+          state.mesh_group.addMesh(state.mesh);
+        }
+      }
 
-      if (write_block_header)
-        bh.calcAndWrite(output);
+      THEA_CONSOLE << getName() << ": Read " << state.mesh_group.numMeshes() << " submesh(es) with a total of "
+                   << state.elements.vertices.size() << " vertices and " << state.num_faces << " faces";
     }
 
-  private:
     /** Write out all the vertices from a mesh group and map them to indices. */
     void writeVertices(MeshGroup const & mesh_group, BinaryOutputStream & output, VertexIndexMap & vertex_indices,
                        WriteCallback * callback) const
@@ -616,6 +980,34 @@ class CodecOBJ : public CodecOBJBase<MeshT>
       }
     }
 
+    /** Write out all the vertices from a compact mesh and map them to indices. */
+    template < typename _MeshT, typename std::enable_if< Graphics::IsCompactMesh<_MeshT>::value, int >::type = 0 >
+    void writeVertices(_MeshT const & mesh, BinaryOutputStream & output, VertexIndexMap & vertex_indices,
+                       WriteCallback * callback) const
+    {
+      typedef std::pair<_MeshT const *, intx> CompactMeshVRef;
+      typename Mesh::PositionArray const & positions = mesh.getPositions();
+      intx vertex_index = (intx)vertex_indices.size() + 1;  // OBJ numbers vertices starting from 1
+
+      for (size_t i = 0; i < positions.size(); ++i, ++vertex_index)
+      {
+        Vector3 const & v = positions[i];
+        output.printf("v %f %f %f\n", v.x(), v.y(), v.z());
+        vertex_indices[CompactMeshVRef(&mesh, (intx)i)] = vertex_index;
+        if (callback) callback->vertexWritten(&mesh, vertex_index - 1, (intx)i);
+      }
+
+      if (!write_opts.ignore_normals && mesh.hasNormals())
+      {
+        typename Mesh::NormalArray const & normals = mesh.getNormals();
+        for (size_t i = 0; i < normals.size(); ++i)
+        {
+          Vector3 const & n = normals[i];
+          output.printf("vn %f %f %f\n", n.x(), n.y(), n.z());
+        }
+      }
+    }
+
     /** Write out all the faces from a mesh group. Returns the number of faces written. */
     void writeFaces(MeshGroup const & mesh_group, VertexIndexMap const & vertex_indices, BinaryOutputStream & output,
                     WriteCallback * callback, intx & next_index) const
@@ -722,6 +1114,45 @@ class CodecOBJ : public CodecOBJBase<MeshT>
       }
     }
 
+    /** Write out all the faces from a compact mesh. Returns the number of faces written. */
+    template < typename _MeshT, typename std::enable_if< Graphics::IsCompactMesh<_MeshT>::value, int >::type = 0 >
+    void writeFaces(_MeshT const & mesh, VertexIndexMap const & vertex_indices, BinaryOutputStream & output,
+                    WriteCallback * callback, intx & next_index) const
+    {
+      if (write_opts.skip_empty_meshes && mesh.numFaces() <= 0)
+        return;
+
+      if (!write_opts.flatten)
+        output.printf("\ng %s\n", mesh.getName());
+
+      typedef std::pair<_MeshT const *, intx> CompactMeshVRef;
+      bool write_normals = (!write_opts.ignore_normals && mesh.hasNormals());
+
+      intx num_faces = mesh.numFaces();
+      for (intx f = 0; f < num_faces; ++f)
+      {
+        uint32 const * face_vertices = mesh.getFaceVertices(f);
+        intx degree = mesh.numFaceVertices(f);
+
+        std::ostringstream os; os << 'f';
+        for (intx j = 0; j < degree; ++j)
+        {
+          typename VertexIndexMap::const_iterator ii = vertex_indices.find(CompactMeshVRef(&mesh, (intx)face_vertices[j]));
+          alwaysAssertM(ii != vertex_indices.end(), std::string(getName()) + ": Vertex index not found");
+
+          if (write_normals)
+            os << ' ' << ii->second << "//" << ii->second;
+          else
+            os << ' ' << ii->second;
+        }
+
+        os << '\n';
+        output.writeBytes((int64)os.str().length(), os.str().data());
+
+        if (callback) callback->faceWritten(&mesh, next_index++, f);
+      }
+    }
+
     ReadOptions read_opts;
     WriteOptions write_opts;
 
@@ -17,6 +17,7 @@
 
 #include "../Common.hpp"
 #include "../Array.hpp"
+#include "../LineScanner.hpp"
 #include "MeshGroup.hpp"
 #include "MeshCodec.hpp"
 #include <algorithm>
@@ -32,7 +33,8 @@ struct VertexIndexMap
 };
 
 template <typename MeshT>
-struct VertexIndexMap<MeshT, typename std::enable_if< Graphics::IsDisplayMesh<MeshT>::value >::type>
+struct VertexIndexMap<MeshT, typename std::enable_if< Graphics::IsDisplayMesh<MeshT>::value
+                                                   || Graphics::IsCompactMesh<MeshT>::value >::type>
 {
   typedef UnorderedMap<std::pair<MeshT const *, intx>, intx> type;
 };
@@ -188,19 +190,15 @@ class CodecOFF : public CodecOFFBase<MeshT>
     /** Read a mesh group in ASCII format. */
     void readAscii(MeshGroup & mesh_group, BinaryInputStream & in, ReadCallback * callback) const
     {
-      std::string line = trimWhitespace(in.readLine());
-      while (line.empty() || line[0] == '#')
-      {
-        if (in.hasMore())
-          line = trimWhitespace(in.readLine());
-        else
-          throw Error(std::string(getName()) + ": Unexpected end of input");
-      }
+      LineScanner scanner(in, 1);  // the header has already been read
+
+      if (!scanner.readNonEmptyLine('#'))
+        throw Error(std::string(getName()) + ": Unexpected end of input");
 
-      std::istringstream counts(line);
       intx num_vertices, num_faces, num_edges;
-      if (!(counts >> num_vertices >> num_faces >> num_edges))
-        throw Error(std::string(getName()) + ": Could not read mesh statistics on line '" + line + '\'');
+      if (!scanner.readInteger(num_vertices) || !scanner.readInteger(num_faces) || !scanner.readInteger(num_edges))
+        throw Error(getName() + format(": Could not read mesh statistics on line %ld: '%s'", scanner.getLineNumber(),
+                                       scanner.getLine().c_str()));
 
       THEA_CONSOLE << getName() << ": Mesh has " << num_vertices << " vertices, " << num_faces << " faces and " << num_edges
                    << " edges";
@@ -222,18 +220,12 @@ class CodecOFF : public CodecOFFBase<MeshT>
       double x, y, z;
       for (intx v = 0; v < num_vertices; ++v)
       {
-        std::string line = trimWhitespace(in.readLine());
-        while (line.empty() || line[0] == '#')
-        {
-          if (in.hasMore())
-            line = trimWhitespace(in.readLine());
-          else
-            throw Error(std::string(getName()) + ": Unexpected end of input");
-        }
+        if (!scanner.readNonEmptyLine('#'))
+          throw Error(std::string(getName()) + ": Unexpected end of input");
 
-        std::istringstream vstr(line);
-        if (!(vstr >> x >> y >> z))
-          throw Error(std::string(getName()) + ": Could not read vertex on line '" + line + '\'');
+        if (!scanner.readReal(x) || !scanner.readReal(y) || !scanner.readReal(z))
+          throw Error(getName() + format(": Could not read vertex on line %ld: '%s'", scanner.getLineNumber(),
+                                         scanner.getLine().c_str()));
 
         typename Builder::VertexHandle vref = builder.addVertex(Vector3((Real)x, (Real)y, (Real)z),
                                                                 (read_opts.store_vertex_indices ? v : -1));
@@ -248,18 +240,12 @@ class CodecOFF : public CodecOFFBase<MeshT>
       intx num_face_vertices;
       for (intx f = 0; f < num_faces; ++f)
       {
-        std::string line = trimWhitespace(in.readLine());
-        while (line.empty() || line[0] == '#')
-        {
-          if (in.hasMore())
-            line = trimWhitespace(in.readLine());
-          else
-            throw Error(std::string(getName()) + ": Unexpected end of input");
-        }
+        if (!scanner.readNonEmptyLine('#'))
+          throw Error(std::string(getName()) + ": Unexpected end of input");
 
-        std::istringstream vstr(line);
-        if (!(vstr >> num_face_vertices))
-          throw Error(std::string(getName()) + ": Could not read number of vertices in face on line '" + line + '\'');
+        if (!scanner.readInteger(num_face_vertices))
+          throw Error(getName() + format(": Could not read number of vertices in face on line %ld: '%s'",
+                                         scanner.getLineNumber(), scanner.getLine().c_str()));
 
         if (num_face_vertices > 0)
         {
@@ -268,13 +254,15 @@ class CodecOFF : public CodecOFFBase<MeshT>
           bool skip = false;
           for (intx v = 0; v < num_face_vertices && !skip; ++v)
           {
-            if (!(vstr >> index))
+            if (!scanner.readInteger(index))
             {
               if (read_opts.strict)
-                throw Error(std::string(getName()) + ": Could not read vertex index on line '" + line + '\'');
+                throw Error(getName() + format(": Could not read vertex index on line %ld: '%s'", scanner.getLineNumber(),
+                                               scanner.getLine().c_str()));
               else
               {
-                THEA_WARNING << getName() << ": Skipping face, could not read vertex index on line '" << line << '\'';
+                THEA_WARNING << getName() << ": Skipping face, could not read vertex index on line " << scanner.getLineNumber()
+                             << ": '" << scanner.getLine() << '\'';
                 skip = true; break;
               }
             }
@@ -282,12 +270,12 @@ class CodecOFF : public CodecOFFBase<MeshT>
             if (index < 0 || index >= (intx)vrefs.size())
             {
               if (read_opts.strict)
-                throw Error(getName() + format(": Vertex index %ld out of bounds (#vertices = %ld) on line '%s'",
-                                               index, (intx)vrefs.size(), line.c_str()));
+                throw Error(getName() + format(": Vertex index %ld out of bounds (#vertices = %ld) on line %ld: '%s'",
+                                               index, (intx)vrefs.size(), scanner.getLineNumber(), scanner.getLine().c_str()));
               else
               {
                 THEA_WARNING << getName() << ": Skipping face, vertex index " << index << " out of bounds (#vertices = "
-                             << vrefs.size() << ") on line '" << line << '\'';
+                             << vrefs.size() << ") on line " << scanner.getLineNumber() << ": '" << scanner.getLine() << '\'';
                 skip = true; break;
               }
             }
@@ -298,10 +286,12 @@ class CodecOFF : public CodecOFFBase<MeshT>
               if (face[w] == face[v])  // face has repeated vertices
               {
                 if (read_opts.strict)
-                  throw Error(std::string(getName()) + ": Face has repeated vertices on line '" + line + '\'');
+                  throw Error(getName() + format(": Face has repeated vertices on line %ld: '%s'", scanner.getLineNumber(),
+                                                 scanner.getLine().c_str()));
                 else
                 {
-                  THEA_WARNING << getName() << ": Skipping face with repeated vertices on line '" << line << '\'';
+                  THEA_WARNING << getName() << ": Skipping face with repeated vertices on line " << scanner.getLineNumber()
+                               << ": '" << scanner.getLine() << '\'';
                   skip = true; break;
                 }
               }
@@ -508,6 +498,33 @@ class CodecOFF : public CodecOFFBase<MeshT>
       }
     }
 
+    /** Write out all the vertices from a compact mesh and map them to indices. */
+    template < typename _MeshT, typename std::enable_if< Graphics::IsCompactMesh<_MeshT>::value, int >::type = 0 >
+    void writeVertices(_MeshT const & mesh, BinaryOutputStream & output, VertexIndexMap & vertex_indices,
+                       WriteCallback * callback) const
+    {
+      typedef std::pair<_MeshT const *, intx> CompactMeshVRef;
+      typename Mesh::PositionArray const & positions = mesh.getPositions();
+      intx vertex_index = (intx)vertex_indices.size();
+
+      for (size_t i = 0; i < positions.size(); ++i, ++vertex_index)
+      {
+        Vector3 const & v = positions[i];
+
+        if (write_opts.binary)
+        {
+          output.writeFloat32((float32)v.x());
+          output.writeFloat32((float32)v.y());
+          output.writeFloat32((float32)v.z());
+        }
+        else
+          output.printf("%f %f %f\n", v.x(), v.y(), v.z());
+
+        vertex_indices[CompactMeshVRef(&mesh, (intx)i)] = vertex_index;
+        if (callback) callback->vertexWritten(&mesh, vertex_index, (intx)i);
+      }
+    }
+
     /** Write out all the faces from a mesh group. */
     void writeFaces(MeshGroup const & mesh_group, VertexIndexMap const & vertex_indices, BinaryOutputStream & output,
                     WriteCallback * callback, intx & next_index) const
@@ -618,6 +635,52 @@ class CodecOFF : public CodecOFFBase<MeshT>
       }
     }
 
+    /** Write out all the faces from a compact mesh. */
+    template < typename _MeshT, typename std::enable_if< Graphics::IsCompactMesh<_MeshT>::value, int >::type = 0 >
+    void writeFaces(_MeshT const & mesh, VertexIndexMap const & vertex_indices, BinaryOutputStream & output,
+                    WriteCallback * callback, intx & next_index) const
+    {
+      typedef std::pair<_MeshT const *, intx> CompactMeshVRef;
+
+      intx num_faces = mesh.numFaces();
+      for (intx f = 0; f < num_faces; ++f)
+      {
+        uint32 const * face_vertices = mesh.getFaceVertices(f);
+        intx degree = mesh.numFaceVertices(f);
+
+        if (write_opts.binary)
+        {
+          output.writeInt32((int32)degree);
+          for (intx j = 0; j < degree; ++j)
+          {
+            typename VertexIndexMap::const_iterator ii = vertex_indices.find(CompactMeshVRef(&mesh, (intx)face_vertices[j]));
+            alwaysAssertM(ii != vertex_indices.end(), std::string(getName()) + ": Vertex index not found");
+
+            output.writeInt32((int32)ii->second);
+          }
+
+          output.writeInt32(0);  // no color components
+        }
+        else
+        {
+          std::ostringstream os; os << degree;
+
+          for (intx j = 0; j < degree; ++j)
+          {
+            typename VertexIndexMap::const_iterator ii = vertex_indices.find(CompactMeshVRef(&mesh, (intx)face_vertices[j]));
+            alwaysAssertM(ii != vertex_indices.end(), std::string(getName()) + ": Vertex index not found");
+
+            os << ' ' << ii->second;
+          }
+
+          os << '\n';
+          output.writeBytes((int64)os.str().length(), os.str().data());
+        }
+
+        if (callback) callback->faceWritten(&mesh, next_index++, f);
+      }
+    }
+
     ReadOptions read_opts;
     WriteOptions write_opts;
 
@@ -17,9 +17,14 @@
 
 #include "../Common.hpp"
 #include "../Array.hpp"
+#include "../LineScanner.hpp"
 #include "MeshGroup.hpp"
 #include "MeshCodec.hpp"
 #include <algorithm>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <utility>
 
 namespace Thea {
 
@@ -32,11 +37,20 @@ struct VertexIndexMap
 };
 
 template <typename MeshT>
-struct VertexIndexMap<MeshT, typename std::enable_if< Graphics::IsDisplayMesh<MeshT>::value >::type>
+struct VertexIndexMap<MeshT, typename std::enable_if< Graphics::IsDisplayMesh<MeshT>::value
+                                                   || Graphics::IsCompactMesh<MeshT>::value >::type>
 {
   typedef UnorderedMap<std::pair<MeshT const *, intx>, intx> type;
 };
 
+// Checks if a mesh builder can add blocks of vertices and triangles at once (see IncrementalMeshBuilder).
+template <typename BuilderT, typename Enable = void>
+struct HasBulkAddTriangles : public std::false_type {};
+
+template <typename BuilderT>
+struct HasBulkAddTriangles<BuilderT, decltype((void)std::declval<BuilderT &>().addTriangles((intx)0, (uint32 const *)0))>
+: public std::true_type {};
+
 } // namespace CodecPLYInternal
 
 /** %Codec for reading and writing Stanford PLY files. @see http://paulbourke.net/dataformats/ply/ */
@@ -136,11 +150,12 @@ class CodecPLY : public CodecPLYBase<MeshT>
     /** Information in the header of a PLY file. */
     struct Header
     {
-      Header() : binary(false), endianness(Endianness::LITTLE) {}
+      Header() : binary(false), endianness(Endianness::LITTLE), num_lines(0) {}
 
       bool binary;
       Endianness endianness;
       Array<ElementBlock> elem_blocks;
+      intx num_lines;  ///< Number of lines in the header, including the magic string.
 
     }; // struct Header
 
@@ -305,18 +320,33 @@ class CodecPLY : public CodecPLYBase<MeshT>
         throw Error(std::string(getName()) + ": Invalid PLY stream (does not start with 'ply')");
 
       header = Header();  // reset
+      header.num_lines = 1;
 
       bool first = true;
-      std::string line, field;
+      std::string raw_line, line, field;
       while (in.hasMore())
       {
-        line = trimWhitespace(in.readLine());
+        int64 line_start = in.getPosition();
+        raw_line = in.readLine();
+        line = trimWhitespace(raw_line);
+        header.num_lines++;
 
         if (line.empty())
           continue;
 
         if (line == "end_header")
+        {
+          // The header ends with exactly one line terminator. readLine() may have consumed one more newline character, which
+          // is actually the first byte of binary data, so consume the terminator again.
+          in.setPosition(line_start + (int64)raw_line.size());
+          if (in.hasMore() && in.readUInt8() == '\r' && in.hasMore())
+          {
+            if (in.readUInt8() != '\n')
+              in.skip(-1);
+          }
+
           return;
+        }
 
         std::istringstream line_in(line);
         if (!(line_in >> field))
@@ -419,7 +449,7 @@ class CodecPLY : public CodecPLYBase<MeshT>
       Array<typename Builder::VertexHandle> vrefs;
       Array<typename Builder::VertexHandle> face;
 
-      std::string line;
+      LineScanner scanner(in, header.num_lines);
       intx num_vertices = 0, num_faces = 0;
       for (size_t i = 0; i < header.elem_blocks.size(); ++i)
       {
@@ -430,21 +460,19 @@ class CodecPLY : public CodecPLYBase<MeshT>
         {
           do
           {
-            if (!in.hasMore())
+            if (!scanner.readLine())
               throw Error(std::string(getName()) + ": Unexpected end of input");
 
-            line = trimWhitespace(in.readLine());
-
-          } while (line.empty() || beginsWith(line, "comment"));
+          } while (scanner.lineEmpty() || scanner.lineBeginsWith("comment"));
 
           switch (block.type)
           {
             case ElementType::VERTEX:
             {
               double x, y, z;
-              std::istringstream vstr(line);
-              if (!(vstr >> x >> y >> z))
-                throw Error(std::string(getName()) + ": Could not read vertex on line '" + line + '\'');
+              if (!scanner.readReal(x) || !scanner.readReal(y) || !scanner.readReal(z))
+                throw Error(getName() + format(": Could not read vertex on line %ld: '%s'", scanner.getLineNumber(),
+                                               scanner.getLine().c_str()));
 
               typename Builder::VertexHandle vref = builder.addVertex(Vector3((Real)x, (Real)y, (Real)z),
                                                                       (read_opts.store_vertex_indices ? num_vertices : -1));
@@ -460,9 +488,9 @@ class CodecPLY : public CodecPLYBase<MeshT>
             case ElementType::FACE:
             {
               intx index, num_face_vertices;
-              std::istringstream vstr(line);
-              if (!(vstr >> num_face_vertices))
-                throw Error(std::string(getName()) + ": Could not read number of vertices in face on line '" + line + '\'');
+              if (!scanner.readInteger(num_face_vertices))
+                throw Error(getName() + format(": Could not read number of vertices in face on line %ld: '%s'",
+                                               scanner.getLineNumber(), scanner.getLine().c_str()));
 
               if (num_face_vertices > 0)
               {
@@ -471,13 +499,15 @@ class CodecPLY : public CodecPLYBase<MeshT>
                 bool skip = false;
                 for (intx v = 0; v < num_face_vertices && !skip; ++v)
                 {
-                  if (!(vstr >> index))
+                  if (!scanner.readInteger(index))
                   {
                     if (read_opts.strict)
-                      throw Error(std::string(getName()) + ": Could not read vertex index on line '" + line + '\'');
+                      throw Error(getName() + format(": Could not read vertex index on line %ld: '%s'",
+                                                     scanner.getLineNumber(), scanner.getLine().c_str()));
                     else
                     {
-                      THEA_WARNING << getName() << ": Skipping face, could not read vertex index on line '" << line << '\'';
+                      THEA_WARNING << getName() << ": Skipping face, could not read vertex index on line "
+                                   << scanner.getLineNumber() << ": '" << scanner.getLine() << '\'';
                       skip = true; break;
                     }
                   }
@@ -485,12 +515,14 @@ class CodecPLY : public CodecPLYBase<MeshT>
                   if (index < 0 || index >= (intx)vrefs.size())
                   {
                     if (read_opts.strict)
-                      throw Error(getName() + format(": Vertex index %ld out of bounds (#vertices = %ld) on line '%s'",
-                                                     index, (intx)vrefs.size(), line.c_str()));
+                      throw Error(getName() + format(": Vertex index %ld out of bounds (#vertices = %ld) on line %ld: '%s'",
+                                                     index, (intx)vrefs.size(), scanner.getLineNumber(),
+                                                     scanner.getLine().c_str()));
                     else
                     {
                       THEA_WARNING << getName() << ": Vertex index " << index << " out of bounds (#vertices = "
-                                   << vrefs.size() << ") on line '" << line << '\'';
+                                   << vrefs.size() << ") on line " << scanner.getLineNumber() << ": '" << scanner.getLine()
+                                   << '\'';
                       skip = true; break;
                     }
                   }
@@ -501,10 +533,12 @@ class CodecPLY : public CodecPLYBase<MeshT>
                     if (face[w] == face[v])  // face has repeated vertices
                     {
                       if (read_opts.strict)
-                        throw Error(std::string(getName()) + ": Face has repeated vertices on line '" + line + '\'');
+                        throw Error(getName() + format(": Face has repeated vertices on line %ld: '%s'",
+                                                       scanner.getLineNumber(), scanner.getLine().c_str()));
                       else
                       {
-                        THEA_WARNING << getName() << ": Skipping face with repeated vertices on line '" << line << '\'';
+                        THEA_WARNING << getName() << ": Skipping face with repeated vertices on line "
+                                     << scanner.getLineNumber() << ": '" << scanner.getLine() << '\'';
                         skip = true; break;
                       }
                     }
@@ -568,6 +602,9 @@ class CodecPLY : public CodecPLYBase<MeshT>
         items[i] = readBinaryNumber<T>(in, prop.item_type);
     }
 
+    /** Get the number of bytes in a binary-encoded scalar property. */
+    static int propertySize(PropertyType const & type) { return (type & 0xFF) / 8; }
+
     /** Skip over a binary-encoded property. */
     void skipBinaryProperty(BinaryInputStream & in, Property const & prop) const
     {
@@ -575,13 +612,297 @@ class CodecPLY : public CodecPLYBase<MeshT>
       {
         intx num_items = readBinaryNumber<intx>(in, prop.count_type);
         if (num_items >= 0)
-          in.skip(num_items * (prop.item_type & 0xFF));
+          in.skip(num_items * propertySize(prop.item_type));
       }
       else
-        in.skip(prop.type & 0xFF);
+        in.skip(propertySize(prop.type));
+    }
+
+    /** Decode a 32-bit value stored at \a p, reversing its bytes if \a swap is true. */
+    static uint32 decodeUInt32(uint8 const * p, bool swap)
+    {
+      uint32 u;
+      std::memcpy(&u, p, 4);
+      return swap ? ((u >> 24) | ((u >> 8) & 0x0000FF00) | ((u << 8) & 0x00FF0000) | (u << 24)) : u;
+    }
+
+    /** Decode an integer of the given type stored at \a p, reversing its bytes if \a swap is true. */
+    intx decodeInteger(uint8 const * p, PropertyType const & type, bool swap) const
+    {
+      switch (type)
+      {
+        case PropertyType::INT8:    return (intx)(int8)p[0];
+        case PropertyType::UINT8:   return (intx)p[0];
+        case PropertyType::INT16:
+        case PropertyType::UINT16:
+        {
+          uint16 u;
+          std::memcpy(&u, p, 2);
+          if (swap) u = (uint16)((u >> 8) | (u << 8));
+          return type == PropertyType::INT16 ? (intx)(int16)u : (intx)u;
+        }
+        case PropertyType::INT32:   return (intx)(int32)decodeUInt32(p, swap);
+        case PropertyType::UINT32:  return (intx)decodeUInt32(p, swap);
+        default: throw Error(std::string(getName()) + ": Unsupported integer type");
+      }
+    }
+
+    /**
+     * Get the number of bytes per element of a vertex block that can be decoded in bulk, i.e. all of whose properties are
+     * scalars and whose coordinates are 32-bit floats. Returns zero if the block cannot be decoded in bulk.
+     */
+    static intx packedVertexSize(ElementBlock const & block)
+    {
+      intx size = 0;
+      for (size_t k = 0; k < block.props.size(); ++k)
+      {
+        if (block.props[k].type == PropertyType::LIST || (k < 3 && block.props[k].type != PropertyType::FLOAT32))
+          return 0;
+
+        size += propertySize(block.props[k].type);
+      }
+
+      return size;
+    }
+
+    /**
+     * Check if a face block can be decoded in bulk, i.e. each face is only a list of 32-bit vertex indices, preceded by an
+     * integer count.
+     */
+    static bool isPackedFaceBlock(ElementBlock const & block)
+    {
+      if (block.props.size() != 1)
+        return false;
+
+      Property const & prop = block.props[0];
+      return (prop.item_type == PropertyType::INT32 || prop.item_type == PropertyType::UINT32)
+          && prop.count_type != PropertyType::FLOAT32 && prop.count_type != PropertyType::FLOAT64
+          && propertySize(prop.count_type) <= 4;
+    }
+
+    /**
+     * Add a face, specified by the indices of its vertices in the file, to the mesh. If an index is out of bounds or the face
+     * has repeated vertices, an error is thrown in strict mode, else the face is skipped with a warning.
+     */
+    void addFace(Builder & builder, Mesh * mesh, Array<intx> const & face_vertices,
+                 Array<typename Builder::VertexHandle> const & vrefs, Array<typename Builder::VertexHandle> & face,
+                 intx & num_faces, ReadCallback * callback) const
+    {
+      if (face_vertices.empty())
+        return;
+
+      face.resize(face_vertices.size());
+
+      for (size_t v = 0; v < face_vertices.size(); ++v)
+      {
+        intx index = face_vertices[v];
+        if (index < 0 || index >= (intx)vrefs.size())
+        {
+          if (read_opts.strict)
+            throw Error(getName() + format(": Vertex index %ld out of bounds (#vertices = %ld) in face %ld",
+                                           index, (intx)vrefs.size(), num_faces));
+
+          THEA_WARNING << getName() << ": Skipping face, vertex index " << index << " out of bounds (#vertices = "
+                                    << vrefs.size() << ')';
+          return;
+        }
+
+        face[v] = vrefs[(size_t)index];
+
+        for (size_t w = 0; w < v; ++w)
+          if (face[w] == face[v])  // face has repeated vertices
+          {
+            if (read_opts.strict)
+              throw Error(getName() + format(": Face %ld has repeated vertices", num_faces));
+
+            THEA_WARNING << getName() << ": Skipping face with repeated vertices";
+            return;
+          }
+      }
+
+      typename Builder::FaceHandle fref = builder.addFace(face.begin(), face.end(),
+                                                          (read_opts.store_face_indices ? num_faces : -1));
+      if (callback)
+        callback->faceRead(mesh, num_faces, fref);
+
+      num_faces++;
+    }
+
+    /** Add a batch of decoded vertices to a mesh whose builder supports bulk addition. */
+    void addVertexBatch(Builder & builder, Array<Vector3> const & positions, Array<typename Builder::VertexHandle> & vrefs,
+                        intx & num_vertices, std::true_type /* bulk */) const
+    {
+      typename Builder::VertexHandle first = builder.addVertices((intx)positions.size(), &positions[0],
+                                                                 (read_opts.store_vertex_indices ? num_vertices : -1));
+      for (size_t i = 0; i < positions.size(); ++i)
+        vrefs.push_back(first + (typename Builder::VertexHandle)i);
+
+      num_vertices += (intx)positions.size();
+    }
+
+    /** Add a batch of decoded vertices to a mesh, one at a time. */
+    void addVertexBatch(Builder & builder, Array<Vector3> const & positions, Array<typename Builder::VertexHandle> & vrefs,
+                        intx & num_vertices, std::false_type /* bulk */) const
+    {
+      for (size_t i = 0; i < positions.size(); ++i, ++num_vertices)
+        vrefs.push_back(builder.addVertex(positions[i], (read_opts.store_vertex_indices ? num_vertices : -1)));
+    }
+
+    /**
+     * Read a block of vertices whose properties are all scalars, starting with 32-bit float coordinates (see
+     * packedVertexSize()). Many vertices are read from the stream in one go, and their coordinates extracted in a tight loop.
+     * If they are the only properties and need no byte-swapping, they are copied straight from the stream.
+     */
+    void readPackedVertices(Builder & builder, BinaryInputStream & in, ElementBlock const & block, intx vertex_size,
+                            Array<typename Builder::VertexHandle> & vrefs, intx & num_vertices) const
+    {
+      typedef std::integral_constant<bool, CodecPLYInternal::HasBulkAddTriangles<Builder>::value> BulkTag;
+
+      static intx const MAX_BATCH_SIZE = 65536;
+      bool swap = (in.getEndianness() != Endianness::machine());
+      bool direct = (vertex_size == 12 && !swap && sizeof(Vector3) == 12 && std::is_same<Real, float32>::value);
+
+      Array<Vector3> positions;
+      Array<uint8> bytes;
+      for (intx done = 0; done < block.num_elems; )
+      {
+        intx n = std::min(block.num_elems - done, MAX_BATCH_SIZE);
+        positions.resize((size_t)n);
+
+        if (direct)
+          in.readBytes(12 * n, &positions[0]);
+        else
+        {
+          bytes.resize((size_t)(n * vertex_size));
+          in.readBytes((int64)bytes.size(), &bytes[0]);
+
+          uint8 const * p = &bytes[0];
+          for (size_t i = 0; i < positions.size(); ++i, p += vertex_size)
+            for (int c = 0; c < 3; ++c)
+            {
+              uint32 u = decodeUInt32(p + 4 * c, swap);
+              float32 f;
+              std::memcpy(&f, &u, 4);
+              positions[i][c] = (Real)f;
+            }
+        }
+
+        addVertexBatch(builder, positions, vrefs, num_vertices, BulkTag());
+        done += n;
+      }
+    }
+
+    /** Add a batch of valid triangles to a mesh whose builder supports bulk addition. Overwrites \a tris. */
+    void addTriangleBatch(Builder & builder, Array<uint32> & tris, Array<typename Builder::VertexHandle> const & vrefs,
+                          intx & num_faces, std::true_type /* bulk */) const
+    {
+      if (tris.empty())
+        return;
+
+      // Vertex handles of such meshes are integer indices, so the file indices can be replaced by them in place
+      for (size_t i = 0; i < tris.size(); ++i)
+        tris[i] = (uint32)vrefs[tris[i]];
+
+      intx num_tris = (intx)(tris.size() / 3);
+      builder.addTriangles(num_tris, &tris[0], (read_opts.store_face_indices ? num_faces : -1));
+      num_faces += num_tris;
+    }
+
+    /** Add a batch of valid triangles to a mesh, one at a time. */
+    void addTriangleBatch(Builder & builder, Array<uint32> & tris, Array<typename Builder::VertexHandle> const & vrefs,
+                          intx & num_faces, std::false_type /* bulk */) const
+    {
+      typename Builder::VertexHandle face[3];
+      for (size_t i = 0; i < tris.size(); i += 3, ++num_faces)
+      {
+        face[0] = vrefs[tris[i]]; face[1] = vrefs[tris[i + 1]]; face[2] = vrefs[tris[i + 2]];
+        builder.addFace(face, face + 3, (read_opts.store_face_indices ? num_faces : -1));
+      }
+    }
+
+    /**
+     * Read faces from a block of lists of 32-bit vertex indices (see isPackedFaceBlock()), as long as they are all triangles.
+     * Many faces are read from the stream in one go, and checked and passed on to the builder in batches. Invalid triangles
+     * are handled as in addFace(). Reading stops just before the first face that is not a triangle, which must be read
+     * separately along with the rest of the block.
+     *
+     * @return The number of faces read from the block.
+     */
+    intx readPackedTriangles(Builder & builder, Mesh * mesh, BinaryInputStream & in, ElementBlock const & block,
+                             Array<typename Builder::VertexHandle> const & vrefs, Array<typename Builder::VertexHandle> & face,
+                             intx & num_faces) const
+    {
+      typedef std::integral_constant<bool, CodecPLYInternal::HasBulkAddTriangles<Builder>::value> BulkTag;
+
+      static intx const MAX_BATCH_SIZE = 65536;
+      bool swap = (in.getEndianness() != Endianness::machine());
+      bool is_signed = (block.props[0].item_type == PropertyType::INT32);
+      intx count_size = propertySize(block.props[0].count_type);
+      intx tri_size = count_size + 12;
+      uint32 num_vrefs = (uint32)std::min(vrefs.size(), (size_t)std::numeric_limits<uint32>::max());
+
+      Array<uint8> bytes;
+      Array<uint32> tris;
+      Array<intx> bad_face(3);
+      intx num_read = 0;
+      while (num_read < block.num_elems)
+      {
+        // Never read past the end of the stream: the element-by-element reader reports truncated input
+        int64 chunk_start = in.getPosition();
+        intx n = std::min(block.num_elems - num_read, MAX_BATCH_SIZE);
+        n = (intx)std::min((int64)n, (in.size() - chunk_start) / tri_size);
+        if (n <= 0)
+          break;
+
+        bytes.resize((size_t)(n * tri_size));
+        in.readBytes((int64)bytes.size(), &bytes[0]);
+
+        tris.clear();
+        intx i = 0;
+        for (uint8 const * p = &bytes[0]; i < n; ++i, p += tri_size)
+        {
+          if (decodeInteger(p, block.props[0].count_type, swap) != 3)
+            break;
+
+          uint32 v0 = decodeUInt32(p + count_size, swap);
+          uint32 v1 = decodeUInt32(p + count_size + 4, swap);
+          uint32 v2 = decodeUInt32(p + count_size + 8, swap);
+
+          // A negative signed index becomes a large unsigned one, which fails the bounds check
+          if (v0 < num_vrefs && v1 < num_vrefs && v2 < num_vrefs && v0 != v1 && v1 != v2 && v2 != v0)
+          {
+            tris.push_back(v0); tris.push_back(v1); tris.push_back(v2);
+          }
+          else
+          {
+            addTriangleBatch(builder, tris, vrefs, num_faces, BulkTag());
+            tris.clear();
+
+            bad_face[0] = is_signed ? (intx)(int32)v0 : (intx)v0;
+            bad_face[1] = is_signed ? (intx)(int32)v1 : (intx)v1;
+            bad_face[2] = is_signed ? (intx)(int32)v2 : (intx)v2;
+            addFace(builder, mesh, bad_face, vrefs, face, num_faces, nullptr);
+          }
+        }
+
+        addTriangleBatch(builder, tris, vrefs, num_faces, BulkTag());
+        num_read += i;
+
+        if (i < n)  // found a face that is not a triangle, rewind to it
+        {
+          in.setPosition(chunk_start + i * tri_size);
+          break;
+        }
+      }
+
+      return num_read;
     }
 
-    /** Read a mesh group in binary format. */
+    /**
+     * Read a mesh group in binary format. Vertex blocks with 32-bit float coordinates and scalar properties, and face blocks
+     * of 32-bit vertex indices, are decoded in bulk (unless a callback is specified) and, if the builder supports it, passed
+     * to the mesh in large batches.
+     */
     void readBinary(MeshGroup & mesh_group, BinaryInputStream & in, Header const & header, ReadCallback * callback) const
     {
       // Create new mesh
@@ -593,6 +914,7 @@ class CodecPLY : public CodecPLYBase<MeshT>
 
       Array<typename Builder::VertexHandle> vrefs;
       Array<typename Builder::VertexHandle> face;
+      Array<intx> face_vertices;
 
       BinaryInputStream::EndiannessScope scope(in, header.endianness);
 
@@ -602,7 +924,24 @@ class CodecPLY : public CodecPLYBase<MeshT>
         ElementBlock const & block = header.elem_blocks[i];
         checkBlock(block);
 
-        for (intx j = 0; j < block.num_elems; ++j)
+        intx j = 0;
+        if (!callback)
+        {
+          if (block.type == ElementType::VERTEX)
+          {
+            intx vertex_size = packedVertexSize(block);
+            if (vertex_size > 0)
+            {
+              vrefs.reserve(vrefs.size() + (size_t)block.num_elems);
+              readPackedVertices(builder, in, block, vertex_size, vrefs, num_vertices);
+              j = block.num_elems;
+            }
+          }
+          else if (block.type == ElementType::FACE && isPackedFaceBlock(block))
+            j = readPackedTriangles(builder, mesh.get(), in, block, vrefs, face, num_faces);
+        }
+
+        for ( ; j < block.num_elems; ++j)
         {
           switch (block.type)
           {
@@ -613,7 +952,7 @@ class CodecPLY : public CodecPLYBase<MeshT>
               vertex[1] = readBinaryNumber<Real>(in, block.props[1].type);
               vertex[2] = readBinaryNumber<Real>(in, block.props[2].type);
 
-              for (size_t k = 3; k < block.props.size(); ++i)
+              for (size_t k = 3; k < block.props.size(); ++k)
                 skipBinaryProperty(in, block.props[k]);
 
               typename Builder::VertexHandle vref = builder.addVertex(vertex,
@@ -629,60 +968,20 @@ class CodecPLY : public CodecPLYBase<MeshT>
 
             case ElementType::FACE:
             {
-              Array<intx> face_vertices;
               readBinaryList(in, block.props[0], face_vertices);
 
-              if (!face_vertices.empty())
-              {
-                face.resize(face_vertices.size());
-
-                bool skip = false;
-                for (size_t v = 0; v < face_vertices.size() && !skip; ++v)
-                {
-                  intx index = face_vertices[v];
-                  if (index < 0 || index >= (intx)vrefs.size())
-                  {
-                    if (read_opts.strict)
-                      throw Error(getName() + format(": Vertex index %ld out of bounds (#vertices = %ld) in face %ld",
-                                                     index, (intx)vrefs.size(), num_faces));
-                    else
-                    {
-                      THEA_WARNING << getName() << ": Skipping face, vertex index " << index << " out of bounds (#vertices = "
-                                                << vrefs.size() << ')';
-                      skip = true; break;
-                    }
-                  }
-
-                  face[v] = vrefs[(size_t)index];
-
-                  for (size_t w = 0; w < v; ++w)
-                    if (face[w] == face[v])  // face has repeated vertices
-                    {
-                      if (read_opts.strict)
-                        throw Error(getName() + format(": Face %ld has repeated vertices", num_faces));
-                      else
-                      {
-                        THEA_WARNING << getName() << ": Skipping face with repeated vertices";
-                        skip = true; break;
-                      }
-                    }
-                }
-
-                if (!skip)
-                {
-                  typename Builder::FaceHandle fref = builder.addFace(face.begin(), face.end(),
-                                                                      (read_opts.store_face_indices ? num_faces : -1));
-                  if (callback)
-                    callback->faceRead(mesh.get(), num_faces, fref);
-
-                  num_faces++;
-                }
-              }
+              for (size_t k = 1; k < block.props.size(); ++k)
+                skipBinaryProperty(in, block.props[k]);
 
+              addFace(builder, mesh.get(), face_vertices, vrefs, face, num_faces, callback);
               break;
             }
 
-            default: {}
+            default:
+            {
+              for (size_t k = 0; k < block.props.size(); ++k)
+                skipBinaryProperty(in, block.props[k]);
+            }
           }
         }
       }
@@ -797,6 +1096,33 @@ class CodecPLY : public CodecPLYBase<MeshT>
       }
     }
 
+    /** Write out all the vertices from a compact mesh and map them to indices. */
+    template < typename _MeshT, typename std::enable_if< Graphics::IsCompactMesh<_MeshT>::value, int >::type = 0 >
+    void writeVertices(_MeshT const & mesh, BinaryOutputStream & output, VertexIndexMap & vertex_indices,
+                       WriteCallback * callback) const
+    {
+      typedef std::pair<_MeshT const *, intx> CompactMeshVRef;
+      typename Mesh::PositionArray const & positions = mesh.getPositions();
+      intx vertex_index = (intx)vertex_indices.size();
+
+      for (size_t i = 0; i < positions.size(); ++i, ++vertex_index)
+      {
+        Vector3 const & v = positions[i];
+
+        if (write_opts.binary)
+        {
+          output.writeFloat32((float32)v.x());
+          output.writeFloat32((float32)v.y());
+          output.writeFloat32((float32)v.z());
+        }
+        else
+          output.printf("%f %f %f\n", v.x(), v.y(), v.z());
+
+        vertex_indices[CompactMeshVRef(&mesh, (intx)i)] = vertex_index;
+        if (callback) callback->vertexWritten(&mesh, vertex_index, (intx)i);
+      }
+    }
+
     /** Write out all the faces from a mesh group. */
     void writeFaces(MeshGroup const & mesh_group, VertexIndexMap const & vertex_indices, BinaryOutputStream & output,
                     WriteCallback * callback, intx & next_index) const
@@ -903,6 +1229,50 @@ class CodecPLY : public CodecPLYBase<MeshT>
       }
     }
 
+    /** Write out all the faces from a compact mesh. */
+    template < typename _MeshT, typename std::enable_if< Graphics::IsCompactMesh<_MeshT>::value, int >::type = 0 >
+    void writeFaces(_MeshT const & mesh, VertexIndexMap const & vertex_indices, BinaryOutputStream & output,
+                    WriteCallback * callback, intx & next_index) const
+    {
+      typedef std::pair<_MeshT const *, intx> CompactMeshVRef;
+
+      intx num_faces = mesh.numFaces();
+      for (intx f = 0; f < num_faces; ++f)
+      {
+        uint32 const * face_vertices = mesh.getFaceVertices(f);
+        intx degree = mesh.numFaceVertices(f);
+
+        if (write_opts.binary)
+        {
+          output.writeInt32((int32)degree);
+          for (intx j = 0; j < degree; ++j)
+          {
+            typename VertexIndexMap::const_iterator ii = vertex_indices.find(CompactMeshVRef(&mesh, (intx)face_vertices[j]));
+            alwaysAssertM(ii != vertex_indices.end(), std::string(getName()) + ": Vertex index not found");
+
+            output.writeInt32((int32)ii->second);
+          }
+        }
+        else
+        {
+          std::ostringstream os; os << degree;
+
+          for (intx j = 0; j < degree; ++j)
+          {
+            typename VertexIndexMap::const_iterator ii = vertex_indices.find(CompactMeshVRef(&mesh, (intx)face_vertices[j]));
+            alwaysAssertM(ii != vertex_indices.end(), std::string(getName()) + ": Vertex index not found");
+
+            os << ' ' << ii->second;
+          }
+
+          os << '\n';
+          output.writeBytes((int64)os.str().length(), os.str().data());
+        }
+
+        if (callback) callback->faceWritten(&mesh, next_index++, f);
+      }
+    }
+
     ReadOptions read_opts;
     WriteOptions write_opts;
 
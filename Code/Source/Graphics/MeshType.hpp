@@ -30,6 +30,9 @@ THEA_HAS_TYPE(IsDCELMesh, DCEL_MESH_TAG)
 /** Concept of a display mesh. */
 THEA_HAS_TYPE(IsDisplayMesh, DISPLAY_MESH_TAG)
 
+/** Concept of a compact, index-based mesh. */
+THEA_HAS_TYPE(IsCompactMesh, COMPACT_MESH_TAG)
+
 } // namespace Graphics
 } // namespace Thea
 
@@ -0,0 +1,359 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_LineScanner_hpp__
+#define __Thea_LineScanner_hpp__
+
+#include "Common.hpp"
+#include "BinaryInputStream.hpp"
+#include "Noncopyable.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace Thea {
+
+/**
+ * Reads a text stream one line at a time and splits each line into whitespace-separated fields and numbers, without allocating
+ * any memory. Each line is scanned in place in the buffer of the underlying BinaryInputStream (see
+ * BinaryInputStream::readLineInPlace()), and numbers are parsed directly from the buffer, so reading a large text file
+ * involves no temporary strings or string streams. The scanner is intended for line-oriented formats such as OBJ, OFF and
+ * ASCII PLY.
+ *
+ * The current line is invalidated by the next call to readLine() or by any other operation on the stream. Since the scanner
+ * does not read ahead, it is safe to interleave its use with other reads from the stream between lines.
+ *
+ * Example:
+ * \code
+ * LineScanner scanner(in);
+ * while (scanner.readLine())
+ * {
+ *   double x, y, z;
+ *   if (!scanner.readReal(x) || !scanner.readReal(y) || !scanner.readReal(z))
+ *     throw Error(format("Could not read point on line %ld: '%s'", scanner.getLineNumber(), scanner.getLine().c_str()));
+ * }
+ * \endcode
+ */
+class LineScanner : private Noncopyable
+{
+  public:
+    /**
+     * Constructor. Lines are read from the current position of \a in_. If some lines have already been read from the stream
+     * (e.g. a file header), their number may be passed as \a num_lines_read so that reported line numbers are correct.
+     */
+    explicit LineScanner(BinaryInputStream & in_, intx num_lines_read = 0)
+    : in(in_), line_begin(nullptr), line_end(nullptr), cursor(nullptr), line_number(num_lines_read)
+    {}
+
+    /** Check if there are more lines to be read. */
+    bool hasMore() const { return in.hasMore(); }
+
+    /**
+     * Read the next line from the stream, with leading and trailing whitespace removed, and place the cursor at its beginning.
+     * Returns false, leaving the current line empty, if the end of the stream has been reached.
+     */
+    bool readLine()
+    {
+      if (!in.hasMore())
+      {
+        line_begin = line_end = cursor = nullptr;
+        return false;
+      }
+
+      int64 length = 0;
+      line_begin = in.readLineInPlace(length);
+      line_end = line_begin + length;
+      line_number++;
+
+      while (line_begin != line_end && isSpace(*line_begin)) ++line_begin;
+      while (line_end != line_begin && isSpace(line_end[-1])) --line_end;
+      cursor = line_begin;
+
+      return true;
+    }
+
+    /**
+     * Read lines until one is found that is not empty and does not begin with \a comment_char (if it is non-zero). Returns
+     * false if the end of the stream is reached first.
+     */
+    bool readNonEmptyLine(char comment_char = 0)
+    {
+      while (readLine())
+        if (line_begin != line_end && (comment_char == 0 || *line_begin != comment_char))
+          return true;
+
+      return false;
+    }
+
+    /** Get the number of lines read so far, which is the (1-based) number of the current line. */
+    intx getLineNumber() const { return line_number; }
+
+    /** Get a copy of the current (trimmed) line, typically for an error message. */
+    std::string getLine() const { return std::string(line_begin, line_end); }
+
+    /** Get a pointer to the first character of the current (trimmed) line. */
+    char const * lineBegin() const { return line_begin; }
+
+    /** Get a pointer to the position just beyond the last character of the current (trimmed) line. */
+    char const * lineEnd() const { return line_end; }
+
+    /** Get the number of characters in the current (trimmed) line. */
+    intx lineLength() const { return (intx)(line_end - line_begin); }
+
+    /** Check if the current line is empty. */
+    bool lineEmpty() const { return line_begin == line_end; }
+
+    /** Check if the current line begins with a given prefix. */
+    bool lineBeginsWith(char const * prefix) const
+    {
+      size_t len = std::strlen(prefix);
+      return (size_t)(line_end - line_begin) >= len && std::memcmp(line_begin, prefix, len) == 0;
+    }
+
+    /** Get a pointer to the current position of the cursor in the line. */
+    char const * getCursor() const { return cursor; }
+
+    /** Move the cursor to a position in the current line. */
+    void setCursor(char const * pos) { cursor = pos; }
+
+    /** Check if the cursor has reached the end of the current line. */
+    bool atEnd() const { return cursor == line_end; }
+
+    /** Get the character at the cursor, or zero if the cursor is at the end of the line. */
+    char peek() const { return cursor != line_end ? *cursor : 0; }
+
+    /** Move the cursor past the character under it, if it is \a c, and return true. Else return false. */
+    bool consume(char c)
+    {
+      if (cursor != line_end && *cursor == c)
+      {
+        ++cursor;
+        return true;
+      }
+
+      return false;
+    }
+
+    /** Move the cursor past any whitespace. Returns false if it reaches the end of the line. */
+    bool skipWhitespace()
+    {
+      while (cursor != line_end && isSpace(*cursor)) ++cursor;
+      return cursor != line_end;
+    }
+
+    /**
+     * Read the next whitespace-separated field of the current line. Sets \a begin and \a end to the bounds of the field in the
+     * line, and moves the cursor past it. Returns false if there are no more fields in the line.
+     */
+    bool readField(char const *& begin, char const *& end)
+    {
+      if (!skipWhitespace())
+        return false;
+
+      begin = cursor;
+      while (cursor != line_end && !isSpace(*cursor)) ++cursor;
+      end = cursor;
+
+      return true;
+    }
+
+    /** Get the rest of the line from the cursor onwards, with leading whitespace removed, and move the cursor to its end. */
+    std::string readRest()
+    {
+      skipWhitespace();
+      std::string rest(cursor, line_end);
+      cursor = line_end;
+      return rest;
+    }
+
+    /**
+     * Read an integer, optionally preceded by whitespace and a sign, from the cursor onwards, like <tt>operator&gt;&gt;</tt>
+     * on a stream. On success, moves the cursor past the number and returns true, else leaves the cursor unchanged and returns
+     * false.
+     */
+    bool readInteger(intx & value)
+    {
+      skipWhitespace();
+      return parseInteger(cursor, line_end, value);
+    }
+
+    /**
+     * Read a real number, optionally preceded by whitespace, from the cursor onwards, like <tt>operator&gt;&gt;</tt> on a
+     * stream. On success, moves the cursor past the number and returns true, else leaves the cursor unchanged and returns
+     * false.
+     */
+    bool readReal(double & value)
+    {
+      skipWhitespace();
+      return parseReal(cursor, line_end, value);
+    }
+
+    /**
+     * Parse an integer, with an optional sign, at the beginning of a range of characters. On success, advances \a begin past
+     * the number and returns true. Else, leaves \a begin unchanged and returns false.
+     */
+    static bool parseInteger(char const *& begin, char const * end, intx & value)
+    {
+      char const * p = begin;
+      bool negative = false;
+      if (p != end && (*p == '-' || *p == '+'))
+      {
+        negative = (*p == '-');
+        ++p;
+      }
+
+      char const * digits_begin = p;
+      uint64 u = 0;
+      for ( ; p != end && isDigit(*p); ++p)
+        u = 10 * u + (uint64)(*p - '0');
+
+      // Reject empty and (conservatively) overlong numbers that might have overflowed
+      if (p == digits_begin || p - digits_begin > 18)
+        return false;
+
+      value = negative ? -(intx)u : (intx)u;
+      begin = p;
+      return true;
+    }
+
+    /**
+     * Parse a real number in decimal notation at the beginning of a range of characters, with the same result as
+     * <tt>std::strtod</tt>. Numbers with at most 15 significant digits and small exponents -- the vast majority in practice --
+     * are converted exactly without any library call. On success, advances \a begin past the number and returns true. Else,
+     * leaves \a begin unchanged and returns false.
+     */
+    static bool parseReal(char const *& begin, char const * end, double & value)
+    {
+      static double const POW10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+      char const * p = begin;
+      bool negative = false;
+      if (p != end && (*p == '-' || *p == '+'))
+      {
+        negative = (*p == '-');
+        ++p;
+      }
+
+      uint64 mantissa = 0;
+      int num_sig_digits = 0, exponent = 0;
+      bool has_digits = false, exact = true;
+
+      // Accumulate up to 15 significant digits, which always fit exactly in a double. Any further digits must be zero for the
+      // fast path to be exact.
+      for ( ; p != end && isDigit(*p); ++p, has_digits = true)
+      {
+        if (num_sig_digits < 15)
+        {
+          mantissa = 10 * mantissa + (uint64)(*p - '0');
+          if (mantissa > 0) num_sig_digits++;
+        }
+        else
+        {
+          exponent++;
+          if (*p != '0') exact = false;
+        }
+      }
+
+      if (p != end && *p == '.')
+      {
+        for (++p; p != end && isDigit(*p); ++p, has_digits = true)
+        {
+          if (num_sig_digits < 15)
+          {
+            mantissa = 10 * mantissa + (uint64)(*p - '0');
+            if (mantissa > 0) num_sig_digits++;
+            exponent--;
+          }
+          else if (*p != '0')
+            exact = false;
+        }
+      }
+
+      if (!has_digits)
+        return parseRealSlow(begin, end, value);  // possibly "inf", "nan" etc
+
+      if (p != end && (*p == 'e' || *p == 'E'))
+      {
+        char const * q = p + 1;
+        bool negative_exp = false;
+        if (q != end && (*q == '-' || *q == '+'))
+        {
+          negative_exp = (*q == '-');
+          ++q;
+        }
+
+        if (q != end && isDigit(*q))
+        {
+          int e = 0;
+          for ( ; q != end && isDigit(*q); ++q)
+            if (e < 10000) e = 10 * e + (*q - '0');
+
+          exponent += (negative_exp ? -e : e);
+          p = q;
+        }
+      }
+
+      // The mantissa is below 2^53 and the power of ten is exactly representable, so a single floating-point operation gives
+      // the correctly rounded result
+      if (!exact || exponent < -22 || exponent > 22)
+        return parseRealSlow(begin, end, value);
+
+      double d = (double)mantissa;
+      d = (exponent < 0 ? d / POW10[-exponent] : d * POW10[exponent]);
+      value = negative ? -d : d;
+      begin = p;
+      return true;
+    }
+
+  private:
+    /** Check if a character is whitespace. */
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f'; }
+
+    /** Check if a character is a decimal digit. */
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    /** Parse a real number with <tt>std::strtod</tt>, which needs a null-terminated copy. */
+    static bool parseRealSlow(char const *& begin, char const * end, double & value)
+    {
+      static size_t const MAX_LENGTH = 511;
+
+      char buf[MAX_LENGTH + 1];
+      size_t n = 0;
+      for (char const * p = begin; p != end && n < MAX_LENGTH && !isSpace(*p); ++p, ++n)
+        buf[n] = *p;
+
+      buf[n] = 0;
+
+      char * num_end = nullptr;
+      double d = std::strtod(buf, &num_end);
+      if (num_end == buf)
+        return false;
+
+      value = d;
+      begin += (num_end - buf);
+      return true;
+    }
+
+    BinaryInputStream & in;   ///< The stream being read.
+    char const * line_begin;  ///< Beginning of the current line, in the stream's buffer.
+    char const * line_end;    ///< End of the current line.
+    char const * cursor;      ///< Current read position in the line.
+    intx line_number;         ///< Number of lines read so far.
+
+}; // class LineScanner
+
+} // namespace Thea
+
+#endif
@@ -0,0 +1,220 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#include "MemoryMappedFile.hpp"
+#include <algorithm>
+
+#ifdef THEA_WINDOWS
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace Thea {
+
+MemoryMappedFile::MemoryMappedFile()
+: ptr(nullptr), num_bytes(0), is_open(false)
+#ifdef THEA_WINDOWS
+, file_handle(nullptr), map_handle(nullptr)
+#endif
+{}
+
+MemoryMappedFile::MemoryMappedFile(std::string const & path_)
+: ptr(nullptr), num_bytes(0), is_open(false)
+#ifdef THEA_WINDOWS
+, file_handle(nullptr), map_handle(nullptr)
+#endif
+{
+  if (!open(path_))
+    throw Error("MemoryMappedFile: Could not map file '" + path_ + '\'');
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+  close();
+}
+
+bool
+MemoryMappedFile::open(std::string const & path_)
+{
+  close();
+
+#ifdef THEA_WINDOWS
+
+  HANDLE fh = CreateFileA(path_.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (fh == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(fh, &file_size))
+  {
+    CloseHandle(fh);
+    return false;
+  }
+
+  HANDLE mh = nullptr;
+  void * view = nullptr;
+  if (file_size.QuadPart > 0)  // empty files cannot be mapped
+  {
+    mh = CreateFileMappingA(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mh)
+    {
+      CloseHandle(fh);
+      return false;
+    }
+
+    view = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+      CloseHandle(mh);
+      CloseHandle(fh);
+      return false;
+    }
+  }
+
+  file_handle = fh;
+  map_handle = mh;
+  ptr = static_cast<uint8 const *>(view);
+  num_bytes = (int64)file_size.QuadPart;
+
+#else
+
+  int fd = ::open(path_.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    ::close(fd);
+    return false;
+  }
+
+  void * view = nullptr;
+  if (st.st_size > 0)  // empty files cannot be mapped
+  {
+    view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED)
+    {
+      ::close(fd);
+      return false;
+    }
+  }
+
+  ::close(fd);  // the mapping remains valid after the descriptor is closed
+
+  ptr = static_cast<uint8 const *>(view);
+  num_bytes = (int64)st.st_size;
+
+#endif
+
+  path = path_;
+  is_open = true;
+
+  return true;
+}
+
+void
+MemoryMappedFile::close()
+{
+  if (!is_open)
+    return;
+
+#ifdef THEA_WINDOWS
+  if (ptr) UnmapViewOfFile(ptr);
+  if (map_handle) CloseHandle(map_handle);
+  if (file_handle) CloseHandle(file_handle);
+  file_handle = map_handle = nullptr;
+#else
+  if (ptr) munmap(const_cast<uint8 *>(ptr), (size_t)num_bytes);
+#endif
+
+  path.clear();
+  ptr = nullptr;
+  num_bytes = 0;
+  is_open = false;
+}
+
+void
+MemoryMappedFile::prefetch(int64 offset, int64 num_bytes_) const
+{
+#ifndef THEA_WINDOWS
+  uint8 * start, * end;
+  if (getPageRange(offset, num_bytes_, start, end))
+    madvise(start, (size_t)(end - start), MADV_WILLNEED);
+#endif
+}
+
+void
+MemoryMappedFile::release(int64 offset, int64 num_bytes_) const
+{
+  uint8 * start, * end;
+  if (!getPageRange(offset, num_bytes_, start, end))
+    return;
+
+#ifdef THEA_WINDOWS
+  // Unlocking pages that are not locked removes them from the working set of the process
+  VirtualUnlock(start, (SIZE_T)(end - start));
+#else
+  madvise(start, (size_t)(end - start), MADV_DONTNEED);
+#endif
+}
+
+void
+MemoryMappedFile::adviseSequential() const
+{
+#ifndef THEA_WINDOWS
+  if (ptr)
+    madvise(const_cast<uint8 *>(ptr), (size_t)num_bytes, MADV_SEQUENTIAL);
+#endif
+}
+
+bool
+MemoryMappedFile::getPageRange(int64 offset, int64 num_bytes_, uint8 * & start, uint8 * & end) const
+{
+  if (!ptr || num_bytes_ <= 0 || offset >= num_bytes)
+    return false;
+
+  if (offset < 0)
+  {
+    num_bytes_ += offset;
+    offset = 0;
+  }
+
+  int64 last = std::min(offset + num_bytes_, num_bytes);
+  int64 page = pageSize();
+  offset -= offset % page;  // the mapping itself starts on a page boundary
+
+  start = const_cast<uint8 *>(ptr) + offset;
+  end = const_cast<uint8 *>(ptr) + last;
+  return end > start;
+}
+
+int64
+MemoryMappedFile::pageSize()
+{
+#ifdef THEA_WINDOWS
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int64)info.dwPageSize;
+#else
+  static int64 const page_size = (int64)sysconf(_SC_PAGESIZE);
+  return page_size;
+#endif
+}
+
+} // namespace Thea
@@ -0,0 +1,106 @@
+//============================================================================
+//
+// This file is part of the Thea toolkit.
+//
+// This software is distributed under the BSD license, as detailed in the
+// accompanying LICENSE.txt file. Portions are derived from other works:
+// their respective licenses and copyright information are reproduced in
+// LICENSE.txt and/or in the relevant source files.
+//
+// Author: Siddhartha Chaudhuri
+// First version: 2020
+//
+//============================================================================
+
+#ifndef __Thea_MemoryMappedFile_hpp__
+#define __Thea_MemoryMappedFile_hpp__
+
+#include "Common.hpp"
+#include "Noncopyable.hpp"
+
+namespace Thea {
+
+/**
+ * A read-only view of a file mapped into memory. The operating system pages in the contents of the file on demand, so opening
+ * even a very large file is nearly instantaneous, and the pages can be shared between processes mapping the same file.
+ */
+class THEA_API MemoryMappedFile : private Noncopyable
+{
+  public:
+    THEA_DECL_SMART_POINTERS(MemoryMappedFile)
+
+    /** Default constructor. Does not map any file. */
+    MemoryMappedFile();
+
+    /** Map a file into memory. Throws an error if the file cannot be mapped. */
+    explicit MemoryMappedFile(std::string const & path_);
+
+    /** Destructor. Unmaps the file. */
+    ~MemoryMappedFile();
+
+    /**
+     * Map a file into memory, unmapping any previously mapped file.
+     *
+     * @return True on success, false if the file could not be opened or mapped.
+     */
+    bool open(std::string const & path_);
+
+    /** Unmap the file, if any. */
+    void close();
+
+    /** Check if a file is currently mapped. */
+    bool isOpen() const { return is_open; }
+
+    /** Get the path of the mapped file. */
+    std::string const & getPath() const { return path; }
+
+    /** Get a pointer to the first byte of the mapped file, or null if the file is empty or no file is mapped. */
+    uint8 const * data() const { return ptr; }
+
+    /** Get the size of the mapped file in bytes. */
+    int64 size() const { return num_bytes; }
+
+    /**
+     * Hint that a range of bytes of the mapped file will be accessed soon, so the operating system can start reading it in. The
+     * range is clamped to the file. Has no effect if the platform does not support such hints.
+     */
+    void prefetch(int64 offset, int64 num_bytes_) const;
+
+    /**
+     * Hint that a range of bytes of the mapped file will not be accessed for a while, so the operating system can reclaim the
+     * memory holding it. The contents of the range remain valid: they will be read back from the file if they are accessed
+     * again. The range is clamped to the file. Has no effect if the platform does not support such hints.
+     */
+    void release(int64 offset, int64 num_bytes_) const;
+
+    /**
+     * Hint that the mapped file will be read mostly sequentially, from beginning to end, so the operating system can read ahead
+     * aggressively. Has no effect if the platform does not support such hints.
+     */
+    void adviseSequential() const;
+
+    /** Get the size of a virtual memory page in bytes. */
+    static int64 pageSize();
+
+  private:
+    /**
+     * Get the range of mapped addresses covering a byte range of the file, extended down to a page boundary. Returns false if
+     * the range is empty after clamping to the file.
+     */
+    bool getPageRange(int64 offset, int64 num_bytes_, uint8 * & start, uint8 * & end) const;
+
+    std::string path;    ///< Path to the mapped file.
+    uint8 const * ptr;   ///< Start of the mapped region.
+    int64 num_bytes;     ///< Size of the mapped region.
+    bool is_open;        ///< Is a file currently mapped?
+
+#ifdef THEA_WINDOWS
+    void * file_handle;  ///< Handle to the open file.
+    void * map_handle;   ///< Handle to the file mapping object.
+#endif
+
+}; // class MemoryMappedFile
+
+} // namespace Thea
+
+#endif
@@ -0,0 +1,770 @@
+#include "../Common.hpp"
+#include "../Algorithms/FlatKDTreeN.hpp"
+#include "../Algorithms/IntersectionTester.hpp"
+#include "../Algorithms/KDTreeN.hpp"
+#include "../Algorithms/MeshKDTree.hpp"
+#include "../Algorithms/MetricL2.hpp"
+#include "../Algorithms/PointTraitsN.hpp"
+#include "../Algorithms/RayIntersectionTester.hpp"
+#include "../Graphics/GeneralMesh.hpp"
+#include "../Ball3.hpp"
+#include "../BoundedSortedArrayN.hpp"
+#include "../Stopwatch.hpp"
+#include "../StringAlg.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <type_traits>
+
+#if !defined(THEA_LINUX) && !defined(THEA_WINDOWS)
+#  include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace Thea;
+using namespace Algorithms;
+
+// Benchmarks kd-tree construction and queries on synthetic datasets, and writes the results in a machine-readable format so
+// they can be tracked across versions. Usage:
+//
+//   TheaBenchKDTree [options]
+//
+// Options:
+//   --sizes n1,n2,...        Numbers of elements (points or triangles) to test (default 1e4,1e5,1e6). Values such as 1e8 are
+//                            accepted.
+//   --queries n              Number of queries of each type (default 10000).
+//   --datasets d1,d2,...     Any of uniform, clustered, surface (default all).
+//   --structures s1,s2,...   Any of kdtree, kdtree-flat, kdtree-flat-quantized, mesh, mesh-flat, mesh-packed
+//                            (default all).
+//   --seed n                 Seed for the dataset and query generators (default 1234).
+//   --format csv|json        Output format (default csv).
+//   --output path            Write results to this file instead of stdout.
+//
+// Each result row records the structure, dataset, number of elements, the query type, the total and per-query time, the
+// throughput, an estimate of the mean number of kd-tree nodes visited per query, the node memory of the tree and the peak
+// resident memory of the process since the construction of the tree began. For build rows, the throughput is in elements per
+// second.
+//
+// The estimated nodes visited (column est_nodes_visited_per_query) are NOT counted on the timed query path, which has no
+// instrumentation, but by a separate pass over the regular (pointer-based) tree on a subset of the queries. For nearest
+// neighbor queries, this is the best-bin-first search in exact mode (see KDTreeN::approxKClosestPairs), which returns the
+// same neighbors but may visit somewhat different nodes than the timed depth-first search. For range queries, it replays the
+// pruning of KDTreeN::processRangeUntil, and for rays, it counts the nodes whose bounds the ray enters before the first hit,
+// a lower bound for any front-to-back traversal. For mesh-packed, the estimate is always made on the regular tree, even for
+// the queries that are timed on the packed copy. No estimate is made for flattened trees: the column is left empty (null in
+// JSON).
+
+typedef KDTreeN<Vector3, 3> PointKDTree;
+typedef FlatKDTreeN<Vector3, 3> FlatPointKDTree;
+typedef Graphics::GeneralMesh<> Mesh;
+typedef MeshKDTree<Mesh> TriangleKDTree;
+typedef TriangleKDTree::FlatKDTree FlatTriangleKDTree;
+
+// Reproducible random number generation. The standard distributions are implementation-defined, so we map the raw output of
+// the (fully specified) Mersenne twister to values ourselves.
+class DatasetRandom
+{
+  public:
+    DatasetRandom(uint64 seed) : gen(seed) {}
+
+    // Uniform value in [0, 1).
+    Real uniform() { return (Real)((gen() >> 11) * (1.0 / 9007199254740992.0)); }
+
+    // Uniform point in the unit cube.
+    Vector3 uniformPoint() { return Vector3(uniform(), uniform(), uniform()); }
+
+    // Standard normal value (Box-Muller).
+    Real gaussian()
+    {
+      double u1 = 1.0 - (gen() >> 11) * (1.0 / 9007199254740992.0), u2 = (gen() >> 11) * (1.0 / 9007199254740992.0);
+      return (Real)(std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * Math::pi() * u2));
+    }
+
+    // Uniformly distributed unit vector.
+    Vector3 direction()
+    {
+      Vector3 d(gaussian(), gaussian(), gaussian());
+      Real len = d.norm();
+      return len > 0 ? Vector3(d / len) : Vector3(1, 0, 0);
+    }
+
+  private:
+    std::mt19937_64 gen;
+
+}; // class DatasetRandom
+
+//=============================================================================================================================
+// Datasets
+//=============================================================================================================================
+
+static int const NUM_CLUSTERS = 64;
+static Real const CLUSTER_SIGMA = 0.02f;
+static Real const TORUS_MAJOR_RADIUS = 0.35f;
+static Real const TORUS_MINOR_RADIUS = 0.15f;
+
+// Point on the benchmark torus, centered in the unit cube, for parameters in [0, 1) x [0, 1).
+Vector3
+torusPoint(Real u, Real v)
+{
+  Real a = (Real)(2 * Math::pi() * u), b = (Real)(2 * Math::pi() * v);
+  Real r = TORUS_MAJOR_RADIUS + TORUS_MINOR_RADIUS * std::cos(b);
+  return Vector3(0.5f + r * std::cos(a), 0.5f + r * std::sin(a), 0.5f + TORUS_MINOR_RADIUS * std::sin(b));
+}
+
+// A distribution of points in the unit cube: uniform, a mixture of Gaussian clusters, or samples of a torus surface.
+class PointDistribution
+{
+  public:
+    PointDistribution(string const & type_, uint64 seed) : type(type_)
+    {
+      DatasetRandom rng(seed ^ 0x5bd1e995);
+      for (int i = 0; i < NUM_CLUSTERS; ++i)
+        cluster_centers[i] = Vector3::Constant(0.1f) + 0.8f * rng.uniformPoint();
+    }
+
+    Vector3 sample(DatasetRandom & rng) const
+    {
+      if (type == "clustered")
+      {
+        Vector3 const & c = cluster_centers[(int)(rng.uniform() * NUM_CLUSTERS) % NUM_CLUSTERS];
+        return c + CLUSTER_SIGMA * Vector3(rng.gaussian(), rng.gaussian(), rng.gaussian());
+      }
+      else if (type == "surface")
+        return torusPoint(rng.uniform(), rng.uniform());
+      else
+        return rng.uniformPoint();
+    }
+
+  private:
+    string type;
+    Vector3 cluster_centers[NUM_CLUSTERS];
+
+}; // class PointDistribution
+
+// Generate a mesh with approximately the specified number of triangles. For the surface dataset this is a tessellated torus,
+// for the others a soup of small triangles centered at points drawn from the distribution.
+void
+generateMesh(string const & dataset, PointDistribution const & dist, intx num_triangles, DatasetRandom & rng, Mesh & mesh)
+{
+  mesh.clear();
+  Mesh::Vertex * face[3];
+
+  if (dataset == "surface")
+  {
+    intx nu = std::max((intx)3, (intx)std::sqrt(num_triangles * TORUS_MAJOR_RADIUS / (2 * TORUS_MINOR_RADIUS)));
+    intx nv = std::max((intx)3, num_triangles / (2 * nu));
+
+    Array<Mesh::Vertex *> vertices((size_t)(nu * nv));
+    for (intx i = 0; i < nu; ++i)
+      for (intx j = 0; j < nv; ++j)
+        vertices[(size_t)(i * nv + j)] = mesh.addVertex(torusPoint(i / (Real)nu, j / (Real)nv));
+
+    for (intx i = 0; i < nu; ++i)
+      for (intx j = 0; j < nv; ++j)
+      {
+        Mesh::Vertex * v00 = vertices[(size_t)(i * nv + j)];
+        Mesh::Vertex * v01 = vertices[(size_t)(i * nv + (j + 1) % nv)];
+        Mesh::Vertex * v10 = vertices[(size_t)(((i + 1) % nu) * nv + j)];
+        Mesh::Vertex * v11 = vertices[(size_t)(((i + 1) % nu) * nv + (j + 1) % nv)];
+
+        face[0] = v00; face[1] = v10; face[2] = v11; mesh.addFace(face, face + 3);
+        face[0] = v00; face[1] = v11; face[2] = v01; mesh.addFace(face, face + 3);
+      }
+  }
+  else
+  {
+    // Side length chosen so the total area is roughly independent of the number of triangles
+    Real size = (Real)(2.0 / std::pow((double)num_triangles, 1.0 / 3.0));
+    for (intx i = 0; i < num_triangles; ++i)
+    {
+      Vector3 c = dist.sample(rng);
+      for (int j = 0; j < 3; ++j)
+        face[j] = mesh.addVertex(c + size * (rng.uniformPoint() - Vector3::Constant(0.5f)));
+
+      mesh.addFace(face, face + 3);
+    }
+  }
+}
+
+//=============================================================================================================================
+// Memory usage
+//=============================================================================================================================
+
+#if defined(THEA_LINUX)
+
+// Read a memory field, in kB, from /proc/self/status.
+int64
+readProcStatus(char const * field)
+{
+  FILE * f = std::fopen("/proc/self/status", "r");
+  if (!f) return -1;
+
+  int64 value = -1;
+  size_t len = std::strlen(field);
+  char line[256];
+  while (std::fgets(line, sizeof(line), f))
+    if (std::strncmp(line, field, len) == 0 && line[len] == ':')
+    {
+      value = 1024 * (int64)std::atoll(line + len + 1);
+      break;
+    }
+
+  std::fclose(f);
+  return value;
+}
+
+#endif
+
+// Reset the peak resident memory counter of the process, if the platform allows it.
+void
+resetPeakMemory()
+{
+#if defined(THEA_LINUX)
+  FILE * f = std::fopen("/proc/self/clear_refs", "w");
+  if (f)
+  {
+    std::fputs("5", f);
+    std::fclose(f);
+  }
+#endif
+}
+
+// Get the peak resident memory of the process, in bytes, or a negative value if it cannot be determined.
+int64
+peakMemory()
+{
+#if defined(THEA_LINUX)
+  return readProcStatus("VmHWM");
+#elif defined(THEA_WINDOWS)
+  return -1;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+#  if defined(THEA_MAC)
+  return (int64)usage.ru_maxrss;  // bytes
+#  else
+  return 1024 * (int64)usage.ru_maxrss;  // kB
+#  endif
+#endif
+}
+
+// Get the number of bytes used by the nodes of a pointer-based kd-tree, including the element indices stored at each node.
+template <typename NodeT>
+size_t
+nodeMemoryUsage(NodeT const * node)
+{
+  if (!node) return 0;
+
+  return sizeof(NodeT) + (size_t)node->numElementIndices() * sizeof(typename PointKDTree::ElementIndex)
+       + nodeMemoryUsage(node->getLowChild()) + nodeMemoryUsage(node->getHighChild());
+}
+
+template <typename T, typename A> size_t treeMemoryUsage(KDTreeN<T, 3, Real, A> const & tree)
+{ return nodeMemoryUsage(tree.getRoot()); }
+
+template <typename T> size_t treeMemoryUsage(FlatKDTreeN<T, 3, Real> const & tree) { return tree.getNodeMemoryUsage(); }
+
+//=============================================================================================================================
+// Nodes visited (estimated separately from the timed queries)
+//=============================================================================================================================
+
+// Estimate the nodes visited by a k-nearest neighbors query.
+template <int K, typename T, typename A>
+double
+knnNodesVisited(KDTreeN<T, 3, Real, A> const & tree, Array<Vector3> const & queries, size_t num_queries)
+{
+  typedef KDTreeN<T, 3, Real, A> TreeT;
+
+  intx num_nodes = 0;
+  for (size_t i = 0; i < num_queries; ++i)
+  {
+    BoundedSortedArrayN<K, typename TreeT::NeighborPair> nbrs;
+    typename TreeT::QueryStats stats;
+    tree.template approxKClosestPairs<MetricL2>(queries[i], nbrs, TreeT::ApproxQueryOptions::defaults(), -1, false, &stats);
+    num_nodes += stats.num_nodes_visited;
+  }
+
+  return num_nodes / (double)num_queries;
+}
+
+template <int K, typename T> double knnNodesVisited(FlatKDTreeN<T, 3, Real> const & tree, Array<Vector3> const & queries,
+                                                    size_t num_queries)
+{ return -1; }
+
+// Count the nodes visited by a ball range query below a node, mirroring KDTreeN::processRangeUntil().
+template <typename NodeT>
+intx
+rangeNodesVisited(NodeT const * node, Ball3 const & ball)
+{
+  if (!IntersectionTester::intersects<3, Real>(ball, node->getBounds()))
+    return 1;
+
+  if (node->isLeaf() || (node->numElementIndices() > 0 && ball.contains(node->getBounds())))
+    return 1;
+
+  return 1 + rangeNodesVisited(node->getLowChild(), ball) + rangeNodesVisited(node->getHighChild(), ball);
+}
+
+template <typename T, typename A>
+double
+rangeNodesVisited(KDTreeN<T, 3, Real, A> const & tree, Array<Vector3> const & queries, Real radius, size_t num_queries)
+{
+  if (!tree.getRoot()) return 0;
+
+  intx num_nodes = 0;
+  for (size_t i = 0; i < num_queries; ++i)
+    num_nodes += rangeNodesVisited(tree.getRoot(), Ball3(queries[i], radius));
+
+  return num_nodes / (double)num_queries;
+}
+
+template <typename T> double rangeNodesVisited(FlatKDTreeN<T, 3, Real> const & tree, Array<Vector3> const & queries,
+                                               Real radius, size_t num_queries)
+{ return -1; }
+
+// Count the nodes below a node whose bounds are entered by a ray no later than a given time (negative for unbounded).
+template <typename NodeT>
+intx
+rayNodesVisited(NodeT const * node, Ray3 const & ray, Real max_time)
+{
+  if (!node || node->getBounds().rayIntersectionTime(ray, max_time) < 0)
+    return 0;
+
+  return 1 + rayNodesVisited(node->getLowChild(), ray, max_time) + rayNodesVisited(node->getHighChild(), ray, max_time);
+}
+
+template <typename T, typename A>
+double
+rayNodesVisited(KDTreeN<T, 3, Real, A> const & tree, Array<Ray3> const & rays, size_t num_queries)
+{
+  intx num_nodes = 0;
+  for (size_t i = 0; i < num_queries; ++i)
+  {
+    Real t = tree.template rayIntersectionTime<RayIntersectionTester>(rays[i]);
+    num_nodes += rayNodesVisited(tree.getRoot(), rays[i], t);
+  }
+
+  return num_nodes / (double)num_queries;
+}
+
+template <typename T> double rayNodesVisited(FlatKDTreeN<T, 3, Real> const & tree, Array<Ray3> const & rays,
+                                             size_t num_queries)
+{ return -1; }
+
+//=============================================================================================================================
+// Results
+//=============================================================================================================================
+
+// A single benchmark measurement.
+struct Result
+{
+  string structure;
+  string dataset;
+  intx num_elements;
+  intx num_nodes;
+  size_t node_bytes;
+  string query;
+  intx num_queries;
+  double secs;
+  double est_nodes_visited;  // estimated, not counted on the timed path; negative if not estimated
+  int64 peak_rss_bytes;  // negative if not measured
+  double checksum;
+};
+
+// Collects measurements and writes them out.
+class ResultWriter
+{
+  public:
+    ResultWriter(string const & format_, uint64 seed_) : format(format_), seed(seed_) {}
+
+    void add(Result const & r)
+    {
+      results.push_back(r);
+
+      // Progress goes to stderr so that it does not get mixed with the results written to stdout
+      cerr << "  " << left << setw(24) << r.structure << setw(10) << r.dataset << setw(10) << r.num_elements << setw(10)
+           << r.query << right << setw(14) << fixed << setprecision(1) << 1.0e9 * r.secs / r.num_queries << " ns/item";
+      if (r.est_nodes_visited >= 0) cerr << "   " << setw(8) << r.est_nodes_visited << " nodes/query (est.)";
+      cerr << endl;
+    }
+
+    void write(std::ostream & out) const
+    {
+      out << setprecision(9);
+
+      if (format == "json")
+      {
+        out << "{\n  \"benchmark\": \"TheaBenchKDTree\",\n  \"seed\": " << seed << ",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+          Result const & r = results[i];
+          out << (i > 0 ? ",\n" : "\n") << "    { \"structure\": \"" << r.structure << "\", \"dataset\": \"" << r.dataset
+              << "\", \"num_elements\": " << r.num_elements << ", \"num_nodes\": " << r.num_nodes << ", \"node_bytes\": "
+              << r.node_bytes << ", \"query\": \"" << r.query << "\", \"num_queries\": " << r.num_queries
+              << ", \"total_secs\": " << r.secs << ", \"throughput_per_sec\": " << throughput(r) << ", \"ns_per_query\": "
+              << 1.0e9 * r.secs / r.num_queries << ", \"est_nodes_visited_per_query\": ";
+          if (r.est_nodes_visited >= 0) out << r.est_nodes_visited; else out << "null";
+          out << ", \"peak_rss_bytes\": ";
+          if (r.peak_rss_bytes >= 0) out << r.peak_rss_bytes; else out << "null";
+          out << ", \"checksum\": " << r.checksum << " }";
+        }
+        out << "\n  ]\n}" << endl;
+      }
+      else
+      {
+        out << "structure,dataset,num_elements,num_nodes,node_bytes,query,num_queries,total_secs,throughput_per_sec,"
+               "ns_per_query,est_nodes_visited_per_query,peak_rss_bytes,checksum\n";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+          Result const & r = results[i];
+          out << r.structure << ',' << r.dataset << ',' << r.num_elements << ',' << r.num_nodes << ',' << r.node_bytes << ','
+              << r.query << ',' << r.num_queries << ',' << r.secs << ',' << throughput(r) << ','
+              << 1.0e9 * r.secs / r.num_queries << ',';
+          if (r.est_nodes_visited >= 0) out << r.est_nodes_visited;
+          out << ',';
+          if (r.peak_rss_bytes >= 0) out << r.peak_rss_bytes;
+          out << ',' << r.checksum << '\n';
+        }
+        out.flush();
+      }
+    }
+
+  private:
+    static double throughput(Result const & r) { return r.secs > 0 ? r.num_queries / r.secs : 0; }
+
+    string format;
+    uint64 seed;
+    Array<Result> results;
+
+}; // class ResultWriter
+
+//=============================================================================================================================
+// Benchmarks
+//=============================================================================================================================
+
+// Number of queries over which nodes visited are estimated (the estimate is deterministic, so a subset suffices).
+static size_t const MAX_STATS_QUERIES = 1000;
+
+// Shared context for benchmarking a single tree.
+struct BenchContext
+{
+  string structure;
+  string dataset;
+  Array<Vector3> const * queries;
+  Array<Ray3> const * rays;
+  Real range_radius;
+  ResultWriter * writer;
+};
+
+// Record a measurement for a tree.
+template <typename TreeT>
+void
+record(BenchContext const & ctx, TreeT const & tree, string const & query, intx num_queries, double secs,
+       double est_nodes_visited, double checksum)
+{
+  Result r;
+  r.structure = ctx.structure;
+  r.dataset = ctx.dataset;
+  r.num_elements = tree.numElements();
+  r.num_nodes = tree.numNodes();
+  r.node_bytes = treeMemoryUsage(tree);
+  r.query = query;
+  r.num_queries = num_queries;
+  r.secs = secs;
+  r.est_nodes_visited = est_nodes_visited;
+  r.peak_rss_bytes = peakMemory();
+  r.checksum = checksum;
+
+  ctx.writer->add(r);
+}
+
+// Time k-nearest neighbor queries.
+template <int K, typename TreeT>
+void
+benchKnn(BenchContext const & ctx, TreeT const & tree)
+{
+  Array<Vector3> const & queries = *ctx.queries;
+  Stopwatch timer;
+
+  double checksum = 0;
+  timer.tick();
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      BoundedSortedArrayN<K, typename TreeT::NeighborPair> nbrs;
+      tree.template kClosestPairs<MetricL2>(queries[i], nbrs);
+      if (!nbrs.isEmpty()) checksum += nbrs.last().template getDistance<MetricL2>();
+    }
+  timer.tock();
+
+  record(ctx, tree, "knn-" + std::to_string(K), (intx)queries.size(), timer.elapsedTime(),
+         knnNodesVisited<K>(tree, queries, std::min(queries.size(), MAX_STATS_QUERIES)), checksum);
+}
+
+// Run the proximity and range benchmarks on a tree.
+template <typename TreeT>
+void
+benchPointQueries(BenchContext const & ctx, TreeT const & tree)
+{
+  Array<Vector3> const & queries = *ctx.queries;
+  size_t num_stats_queries = std::min(queries.size(), MAX_STATS_QUERIES);
+  Stopwatch timer;
+
+  double checksum = 0;
+  timer.tick();
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      double dist = 0;
+      tree.template closestElement<MetricL2>(queries[i], -1, &dist);
+      checksum += dist;
+    }
+  timer.tock();
+  record(ctx, tree, "nn", (intx)queries.size(), timer.elapsedTime(), knnNodesVisited<1>(tree, queries, num_stats_queries),
+         checksum);
+
+  benchKnn<1>(ctx, tree);
+  benchKnn<8>(ctx, tree);
+  benchKnn<64>(ctx, tree);
+
+  checksum = 0;
+  Array<intx> in_range;
+  timer.tick();
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      tree.template rangeQueryIndices<IntersectionTester>(Ball3(queries[i], ctx.range_radius), in_range);
+      checksum += in_range.size();
+    }
+  timer.tock();
+  record(ctx, tree, "range", (intx)queries.size(), timer.elapsedTime(),
+         rangeNodesVisited(tree, queries, ctx.range_radius, num_stats_queries), checksum);
+}
+
+// Run the ray benchmark on a tree.
+template <typename TreeT>
+void
+benchRayQueries(BenchContext const & ctx, TreeT const & tree)
+{
+  Array<Ray3> const & rays = *ctx.rays;
+  Stopwatch timer;
+
+  double checksum = 0;
+  timer.tick();
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+      Real t = tree.template rayIntersectionTime<RayIntersectionTester>(rays[i]);
+      if (t >= 0) checksum += t;
+    }
+  timer.tock();
+  record(ctx, tree, "ray", (intx)rays.size(), timer.elapsedTime(),
+         rayNodesVisited(tree, rays, std::min(rays.size(), MAX_STATS_QUERIES)), checksum);
+}
+
+// Ray queries are only run on triangle trees.
+template <typename TreeT> void benchRayQueries(BenchContext const & ctx, TreeT const & tree, std::true_type)
+{ benchRayQueries(ctx, tree); }
+
+template <typename TreeT> void benchRayQueries(BenchContext const & ctx, TreeT const & tree, std::false_type) {}
+
+// Time the flattening of a tree and benchmark the result.
+template <typename FlatTreeT, bool CastRays, typename TreeT>
+void
+benchFlat(BenchContext const & ctx, TreeT const & tree, bool quantize)
+{
+  resetPeakMemory();
+
+  Stopwatch timer;
+  timer.tick();
+    FlatTreeT flat_tree(tree, quantize);
+  timer.tock();
+
+  record(ctx, flat_tree, "build", flat_tree.numElements(), timer.elapsedTime(), -1, (double)flat_tree.numNodes());
+  benchPointQueries(ctx, flat_tree);
+  benchRayQueries(ctx, flat_tree, std::integral_constant<bool, CastRays>());
+}
+
+// Check if a comma-separated list of options includes a value.
+bool
+contains(Array<string> const & list, string const & value)
+{
+  return std::find(list.begin(), list.end(), value) != list.end();
+}
+
+int
+usage(char const * prog)
+{
+  THEA_ERROR << "Usage: " << prog << " [--sizes n1,n2,...] [--queries n] [--datasets uniform,clustered,surface] "
+                "[--structures kdtree,kdtree-flat,kdtree-flat-quantized,mesh,mesh-flat,mesh-packed] [--seed n] "
+                "[--format csv|json] [--output path]";
+  return -1;
+}
+
+int
+main(int argc, char * argv[])
+{
+  Array<string> size_strs, datasets, structures;
+  stringSplit("1e4,1e5,1e6", ',', size_strs);
+  stringSplit("uniform,clustered,surface", ',', datasets);
+  stringSplit("kdtree,kdtree-flat,kdtree-flat-quantized,mesh,mesh-flat,mesh-packed", ',', structures);
+  intx num_queries = 10000;
+  uint64 seed = 1234;
+  string format = "csv", output_path;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (i + 1 >= argc) return usage(argv[0]);
+
+    string val = argv[++i];
+    if      (arg == "--sizes")       { size_strs.clear(); stringSplit(val, ',', size_strs); }
+    else if (arg == "--queries")     num_queries = (intx)std::atof(val.c_str());
+    else if (arg == "--datasets")    { datasets.clear(); stringSplit(val, ',', datasets); }
+    else if (arg == "--structures")  { structures.clear(); stringSplit(val, ',', structures); }
+    else if (arg == "--seed")        seed = (uint64)std::atoll(val.c_str());
+    else if (arg == "--format")      format = toLower(val);
+    else if (arg == "--output")      output_path = val;
+    else return usage(argv[0]);
+  }
+
+  Array<intx> sizes;
+  for (size_t i = 0; i < size_strs.size(); ++i)
+  {
+    intx n = (intx)std::atof(size_strs[i].c_str());  // accept scientific notation
+    if (n <= 0) return usage(argv[0]);
+    sizes.push_back(n);
+  }
+
+  for (size_t i = 0; i < datasets.size(); ++i)
+    if (datasets[i] != "uniform" && datasets[i] != "clustered" && datasets[i] != "surface")
+      return usage(argv[0]);
+
+  if (num_queries <= 0 || (format != "csv" && format != "json"))
+    return usage(argv[0]);
+
+  bool bench_points = contains(structures, "kdtree") || contains(structures, "kdtree-flat")
+                   || contains(structures, "kdtree-flat-quantized");
+  bool bench_mesh = contains(structures, "mesh") || contains(structures, "mesh-flat") || contains(structures, "mesh-packed");
+
+  ResultWriter writer(format, seed);
+
+  for (size_t di = 0; di < datasets.size(); ++di)
+    for (size_t si = 0; si < sizes.size(); ++si)
+    {
+      string const & dataset = datasets[di];
+      intx n = sizes[si];
+
+      // Each dataset/size combination gets its own deterministic streams, so results do not depend on which combinations are run
+      uint64 stream_seed = seed + 1000003 * (uint64)(di + 1) + (uint64)n;
+      PointDistribution dist(dataset, seed);
+      DatasetRandom query_rng(stream_seed ^ 0x9e3779b97f4a7c15ULL);
+
+      Array<Vector3> queries((size_t)num_queries);
+      for (size_t i = 0; i < queries.size(); ++i)
+        queries[i] = dist.sample(query_rng);
+
+      Array<Ray3> rays((size_t)num_queries);
+      for (size_t i = 0; i < rays.size(); ++i)
+        rays[i] = Ray3(dist.sample(query_rng), query_rng.direction());
+
+      BenchContext ctx;
+      ctx.dataset = dataset;
+      ctx.queries = &queries;
+      ctx.rays = &rays;
+      ctx.range_radius = (Real)std::cbrt(8.0 * 3.0 / (4.0 * Math::pi() * n));  // ~8 results per query for uniform points
+      ctx.writer = &writer;
+
+      cerr << "Dataset " << dataset << ", " << n << " elements, " << num_queries << " queries" << endl;
+
+      if (bench_points)
+      {
+        DatasetRandom rng(stream_seed);
+        Array<Vector3> points((size_t)n);
+        for (size_t i = 0; i < points.size(); ++i)
+          points[i] = dist.sample(rng);
+
+        resetPeakMemory();
+
+        PointKDTree kdtree;
+        Stopwatch timer;
+        timer.tick();
+          kdtree.init(points.begin(), points.end());
+        timer.tock();
+
+        ctx.structure = "kdtree";
+        if (contains(structures, "kdtree"))
+        {
+          record(ctx, kdtree, "build", n, timer.elapsedTime(), -1, (double)kdtree.numNodes());
+          benchPointQueries(ctx, kdtree);
+        }
+
+        ctx.structure = "kdtree-flat";
+        if (contains(structures, "kdtree-flat"))
+          benchFlat<FlatPointKDTree, false>(ctx, kdtree, false);
+
+        ctx.structure = "kdtree-flat-quantized";
+        if (contains(structures, "kdtree-flat-quantized"))
+          benchFlat<FlatPointKDTree, false>(ctx, kdtree, true);
+      }
+
+      if (bench_mesh)
+      {
+        DatasetRandom rng(stream_seed);
+        Mesh mesh;
+        generateMesh(dataset, dist, n, rng, mesh);
+
+        resetPeakMemory();
+
+        TriangleKDTree kdtree;
+        Stopwatch timer;
+        timer.tick();
+          kdtree.add(mesh);
+          kdtree.init();
+        timer.tock();
+
+        ctx.structure = "mesh";
+        if (contains(structures, "mesh"))
+        {
+          record(ctx, kdtree, "build", kdtree.numElements(), timer.elapsedTime(), -1, (double)kdtree.numNodes());
+          benchPointQueries(ctx, kdtree);
+          benchRayQueries(ctx, kdtree);
+        }
+
+        ctx.structure = "mesh-flat";
+        if (contains(structures, "mesh-flat"))
+          benchFlat<FlatTriangleKDTree, true>(ctx, kdtree, false);
+
+        ctx.structure = "mesh-packed";
+        if (contains(structures, "mesh-packed"))
+        {
+          resetPeakMemory();
+
+          timer.tick();
+            kdtree.enablePackedTriangles();
+          timer.tock();
+
+          record(ctx, kdtree, "build", kdtree.numElements(), timer.elapsedTime(), -1, (double)kdtree.numNodes());
+          benchPointQueries(ctx, kdtree);
+          benchRayQueries(ctx, kdtree);
+        }
+      }
+    }
+
+  if (output_path.empty())
+    writer.write(cout);
+  else
+  {
+    ofstream out(output_path.c_str());
+    if (!out)
+    {
+      THEA_ERROR << "Could not open output file '" << output_path << '\'';
+      return -1;
+    }
+
+    writer.write(out);
+  }
+
+  return 0;
+}
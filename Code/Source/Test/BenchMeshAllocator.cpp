@@ -0,0 +1,362 @@
+#include "../Common.hpp"
+#include "../FilePath.hpp"
+#include "../ArenaAllocator.hpp"
+#include "../Graphics/GeneralMesh.hpp"
+#include "../Graphics/MeshGroup.hpp"
+#include "../Stopwatch.hpp"
+#include "../StringAlg.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+using namespace Thea;
+using namespace Graphics;
+
+// Benchmarks the time to load, copy and destroy GeneralMesh objects with the default allocator and with ArenaAllocator, and
+// writes the results in a machine-readable format so they can be tracked across versions. Usage:
+//
+//   TheaBenchMeshAllocator [options]
+//
+// Options:
+//   --sizes n1,n2,...        Numbers of triangles in the synthetic meshes (default 1e4,1e5,1e6). Values such as 1e7 are
+//                            accepted. Pass an empty list to benchmark only input files.
+//   --inputs p1,p2,...       Mesh files to be loaded and benchmarked as well, in any format supported by MeshGroup.
+//   --allocators a1,a2,...   Any of std, arena (default both).
+//   --repeats n              Number of times each measurement is repeated, the fastest run being reported (default 3).
+//   --format csv|json        Output format (default csv).
+//   --output path            Write results to this file instead of stdout.
+//
+// The synthetic meshes are tessellated tori, built vertex by vertex and face by face, so "load" measures mesh construction
+// alone. For input files it also includes parsing. "copy" measures GeneralMesh::copyTo into an empty mesh, and "destroy" the
+// destruction of the loaded meshes. Each result row records the allocator, the dataset, the numbers of vertices and faces, the
+// operation, its time, and for the arena, the number of bytes reserved by it.
+
+typedef GeneralMesh<Graphics::NullAttribute, Graphics::NullAttribute, Graphics::NullAttribute, std::allocator>  StdMesh;
+typedef GeneralMesh<Graphics::NullAttribute, Graphics::NullAttribute, Graphics::NullAttribute, ArenaAllocator>  ArenaMesh;
+
+static Real const TORUS_MAJOR_RADIUS = 0.35f;
+static Real const TORUS_MINOR_RADIUS = 0.15f;
+
+// Point on the benchmark torus, centered in the unit cube, for parameters in [0, 1) x [0, 1).
+Vector3
+torusPoint(Real u, Real v)
+{
+  Real a = (Real)(2 * Math::pi() * u), b = (Real)(2 * Math::pi() * v);
+  Real r = TORUS_MAJOR_RADIUS + TORUS_MINOR_RADIUS * std::cos(b);
+  return Vector3(0.5f + r * std::cos(a), 0.5f + r * std::sin(a), 0.5f + TORUS_MINOR_RADIUS * std::sin(b));
+}
+
+// Generate a tessellated torus with approximately the specified number of triangles.
+template <typename MeshT>
+void
+generateTorus(intx num_triangles, MeshT & mesh)
+{
+  typedef typename MeshT::Vertex Vertex;
+
+  intx nu = std::max((intx)3, (intx)std::sqrt(num_triangles * TORUS_MAJOR_RADIUS / (2 * TORUS_MINOR_RADIUS)));
+  intx nv = std::max((intx)3, num_triangles / (2 * nu));
+
+  Array<Vertex *> vertices((size_t)(nu * nv));
+  for (intx i = 0; i < nu; ++i)
+    for (intx j = 0; j < nv; ++j)
+      vertices[(size_t)(i * nv + j)] = mesh.addVertex(torusPoint(i / (Real)nu, j / (Real)nv));
+
+  Vertex * face[3];
+  for (intx i = 0; i < nu; ++i)
+    for (intx j = 0; j < nv; ++j)
+    {
+      Vertex * v00 = vertices[(size_t)(i * nv + j)];
+      Vertex * v01 = vertices[(size_t)(i * nv + (j + 1) % nv)];
+      Vertex * v10 = vertices[(size_t)(((i + 1) % nu) * nv + j)];
+      Vertex * v11 = vertices[(size_t)(((i + 1) % nu) * nv + (j + 1) % nv)];
+
+      face[0] = v00; face[1] = v10; face[2] = v11; mesh.addFace(face, face + 3);
+      face[0] = v00; face[1] = v11; face[2] = v01; mesh.addFace(face, face + 3);
+    }
+}
+
+//=============================================================================================================================
+// Results
+//=============================================================================================================================
+
+// A single benchmark measurement.
+struct Result
+{
+  string allocator;
+  string dataset;
+  intx num_vertices;
+  intx num_faces;
+  string operation;
+  double secs;
+  int64 arena_bytes;  // negative if not applicable
+};
+
+// Collects measurements and writes them out.
+class ResultWriter
+{
+  public:
+    ResultWriter(string const & format_) : format(format_) {}
+
+    void add(Result const & r)
+    {
+      results.push_back(r);
+
+      // Progress goes to stderr so that it does not get mixed with the results written to stdout
+      cerr << "  " << left << setw(8) << r.allocator << setw(24) << r.dataset << setw(10) << r.num_faces << setw(10)
+           << r.operation << right << setw(12) << fixed << setprecision(2) << 1000 * r.secs << " ms" << endl;
+    }
+
+    void write(std::ostream & out) const
+    {
+      out << setprecision(9);
+
+      if (format == "json")
+      {
+        out << "{\n  \"benchmark\": \"TheaBenchMeshAllocator\",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+          Result const & r = results[i];
+          out << (i > 0 ? ",\n" : "\n") << "    { \"allocator\": \"" << r.allocator << "\", \"dataset\": \"" << r.dataset
+              << "\", \"num_vertices\": " << r.num_vertices << ", \"num_faces\": " << r.num_faces << ", \"operation\": \""
+              << r.operation << "\", \"total_secs\": " << r.secs << ", \"arena_bytes\": ";
+          if (r.arena_bytes >= 0) out << r.arena_bytes; else out << "null";
+          out << " }";
+        }
+        out << "\n  ]\n}" << endl;
+      }
+      else
+      {
+        out << "allocator,dataset,num_vertices,num_faces,operation,total_secs,arena_bytes\n";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+          Result const & r = results[i];
+          out << r.allocator << ',' << r.dataset << ',' << r.num_vertices << ',' << r.num_faces << ',' << r.operation << ','
+              << r.secs << ',';
+          if (r.arena_bytes >= 0) out << r.arena_bytes;
+          out << '\n';
+        }
+        out.flush();
+      }
+    }
+
+  private:
+    string format;
+    Array<Result> results;
+
+}; // class ResultWriter
+
+//=============================================================================================================================
+// Benchmarks
+//=============================================================================================================================
+
+// Get the number of bytes reserved by the arena of an allocator, or -1 if it does not use an arena.
+template <typename AllocatorT> int64 arenaBytes(AllocatorT const & alloc) { return -1; }
+
+template <typename T>
+int64
+arenaBytes(ArenaAllocator<T> const & alloc)
+{
+  return alloc.getArena() ? (int64)alloc.getArena()->numReservedBytes() : -1;
+}
+
+// Accumulates the numbers of vertices and faces, and the bytes reserved by arenas, over the meshes of a group.
+template <typename MeshT>
+struct MeshStats
+{
+  MeshStats() : num_vertices(0), num_faces(0), arena_bytes(-1) {}
+
+  bool operator()(MeshT const & mesh)
+  {
+    num_vertices += mesh.numVertices();
+    num_faces += mesh.numFaces();
+
+    int64 bytes = arenaBytes(mesh.getAllocator());
+    if (bytes >= 0) arena_bytes = std::max(arena_bytes, (int64)0) + bytes;
+
+    return false;
+  }
+
+  intx num_vertices;
+  intx num_faces;
+  int64 arena_bytes;
+};
+
+// Copies each mesh of a group into a new mesh of another group.
+template <typename MeshT>
+struct MeshCopier
+{
+  MeshCopier(MeshGroup<MeshT> * dst_) : dst(dst_) {}
+
+  bool operator()(MeshT const & mesh)
+  {
+    typename MeshT::Ptr copy(new MeshT(mesh.getName()));
+    mesh.copyTo(*copy);
+    dst->addMesh(copy);
+
+    return false;
+  }
+
+  MeshGroup<MeshT> * dst;
+};
+
+// Load a dataset: a synthetic torus with the given number of triangles if \a path is empty, else the mesh file at \a path.
+template <typename MeshT>
+void
+loadDataset(string const & path, intx num_triangles, MeshGroup<MeshT> & group)
+{
+  if (path.empty())
+  {
+    typename MeshT::Ptr mesh(new MeshT("Torus"));
+    generateTorus(num_triangles, *mesh);
+    group.addMesh(mesh);
+  }
+  else
+    group.load(path);
+}
+
+// Benchmark loading, copying and destroying a dataset with a given mesh type, and record the fastest of several runs.
+template <typename MeshT>
+void
+benchDataset(string const & allocator, string const & dataset, string const & path, intx num_triangles, intx num_repeats,
+             ResultWriter & writer)
+{
+  double load_secs = std::numeric_limits<double>::max(), copy_secs = load_secs, destroy_secs = load_secs;
+  MeshStats<MeshT> stats;
+  Stopwatch timer;
+
+  for (intx i = 0; i < num_repeats; ++i)
+  {
+    MeshGroup<MeshT> * group = new MeshGroup<MeshT>;
+    timer.tick();
+      loadDataset(path, num_triangles, *group);
+    timer.tock();
+    load_secs = std::min(load_secs, timer.elapsedTime());
+
+    MeshGroup<MeshT> * copy = new MeshGroup<MeshT>;
+    timer.tick();
+      group->forEachMeshUntil(MeshCopier<MeshT>(copy));
+    timer.tock();
+    copy_secs = std::min(copy_secs, timer.elapsedTime());
+
+    stats = MeshStats<MeshT>();
+    group->forEachMeshUntil(std::ref(stats));
+
+    delete copy;
+
+    timer.tick();
+      delete group;
+    timer.tock();
+    destroy_secs = std::min(destroy_secs, timer.elapsedTime());
+  }
+
+  Result r;
+  r.allocator = allocator;
+  r.dataset = dataset;
+  r.num_vertices = stats.num_vertices;
+  r.num_faces = stats.num_faces;
+  r.arena_bytes = stats.arena_bytes;
+
+  r.operation = "load";     r.secs = load_secs;     writer.add(r);
+  r.operation = "copy";     r.secs = copy_secs;     writer.add(r);
+  r.operation = "destroy";  r.secs = destroy_secs;  writer.add(r);
+}
+
+bool
+contains(Array<string> const & list, string const & value)
+{
+  return std::find(list.begin(), list.end(), value) != list.end();
+}
+
+int
+usage(char const * prog)
+{
+  THEA_ERROR << "Usage: " << prog << " [--sizes n1,n2,...] [--inputs path1,path2,...] [--allocators std,arena] [--repeats n] "
+                "[--format csv|json] [--output path]";
+  return -1;
+}
+
+int
+main(int argc, char * argv[])
+{
+  Array<string> size_strs, inputs, allocators;
+  stringSplit("1e4,1e5,1e6", ',', size_strs);
+  stringSplit("std,arena", ',', allocators);
+  intx num_repeats = 3;
+  string format = "csv", output_path;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (i + 1 >= argc) return usage(argv[0]);
+
+    string val = argv[++i];
+    if      (arg == "--sizes")       { size_strs.clear(); stringSplit(val, ',', size_strs, /* skip_empty_fields = */ true); }
+    else if (arg == "--inputs")      { inputs.clear(); stringSplit(val, ',', inputs, /* skip_empty_fields = */ true); }
+    else if (arg == "--allocators")  { allocators.clear(); stringSplit(val, ',', allocators); }
+    else if (arg == "--repeats")     num_repeats = (intx)std::atof(val.c_str());
+    else if (arg == "--format")      format = toLower(val);
+    else if (arg == "--output")      output_path = val;
+    else return usage(argv[0]);
+  }
+
+  // Synthetic datasets have empty paths
+  Array<string> datasets, paths;
+  Array<intx> sizes;
+  for (size_t i = 0; i < size_strs.size(); ++i)
+  {
+    intx n = (intx)std::atof(size_strs[i].c_str());  // accept scientific notation
+    if (n <= 0) return usage(argv[0]);
+
+    datasets.push_back("torus-" + std::to_string(n));
+    paths.push_back("");
+    sizes.push_back(n);
+  }
+
+  for (size_t i = 0; i < inputs.size(); ++i)
+  {
+    datasets.push_back(FilePath::objectName(inputs[i]));
+    paths.push_back(inputs[i]);
+    sizes.push_back(0);
+  }
+
+  for (size_t i = 0; i < allocators.size(); ++i)
+    if (allocators[i] != "std" && allocators[i] != "arena")
+      return usage(argv[0]);
+
+  if (num_repeats <= 0 || (format != "csv" && format != "json"))
+    return usage(argv[0]);
+
+  ResultWriter writer(format);
+
+  for (size_t i = 0; i < datasets.size(); ++i)
+  {
+    cerr << "Dataset " << datasets[i] << endl;
+
+    if (contains(allocators, "std"))
+      benchDataset<StdMesh>("std", datasets[i], paths[i], sizes[i], num_repeats, writer);
+
+    if (contains(allocators, "arena"))
+      benchDataset<ArenaMesh>("arena", datasets[i], paths[i], sizes[i], num_repeats, writer);
+  }
+
+  if (output_path.empty())
+    writer.write(cout);
+  else
+  {
+    ofstream out(output_path.c_str());
+    if (!out)
+    {
+      THEA_ERROR << "Could not open output file '" << output_path << '\'';
+      return -1;
+    }
+
+    writer.write(out);
+  }
+
+  return 0;
+}
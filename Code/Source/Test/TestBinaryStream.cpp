@@ -0,0 +1,225 @@
+#include "../Common.hpp"
+#include "../Array.hpp"
+#include "../BinaryInputStream.hpp"
+#include "../FileSystem.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+using namespace std;
+using namespace Thea;
+
+void testBinaryInputStream();
+
+int
+main(int argc, char * argv[])
+{
+  try
+  {
+    testBinaryInputStream();
+  }
+  THEA_STANDARD_CATCH_BLOCKS(return -1;, ERROR, "%s", "An error occurred")
+
+  // Hooray, all tests passed
+  cout << "BinaryStream: Test completed" << endl;
+  return 0;
+}
+
+// Larger than the initial buffer of a stream that is not memory-mapped (50MB), so such a stream has to reload its buffer and
+// copy sub-streams
+static int64 const FILE_SIZE = 60000000 + 12345;
+
+// The byte at a given position of the test file.
+uint8
+byteAt(int64 i)
+{
+  return (uint8)(((uint64)i * 2654435761ULL) >> 11);
+}
+
+// The little-endian 32-bit integer at a given position of the test file.
+uint32
+uint32At(int64 i)
+{
+  return (uint32)byteAt(i) | ((uint32)byteAt(i + 1) << 8) | ((uint32)byteAt(i + 2) << 16) | ((uint32)byteAt(i + 3) << 24);
+}
+
+// Check that a block of bytes matches the test file at a given position.
+void
+checkBytes(uint8 const * bytes, int64 n, int64 pos, string const & what)
+{
+  for (int64 i = 0; i < n; ++i)
+    if (bytes[i] != byteAt(pos + i))
+      throw Error(format("%s: Byte %ld is %d, expected %d", what.c_str(), (long)(pos + i), (int)bytes[i],
+                         (int)byteAt(pos + i)));
+}
+
+// Check that an operation on a stream throws an error, e.g. because it reads past the end of the stream.
+template <typename F>
+void
+checkThrows(F f, string const & what)
+{
+  bool thrown = false;
+  try { f(); } catch (Error const &) { thrown = true; }
+
+  if (!thrown)
+    throw Error(what + ": Expected an error");
+}
+
+// Check random access to a stream, which must be positioned at its beginning, with contents starting at byte \a offset of
+// the test file.
+void
+checkSeeking(BinaryInputStream & in, int64 offset, string const & what)
+{
+  int64 n = in.size();
+  int64 const POSITIONS[] = { 0, 1, n / 2, n - 4, 7, n / 3 + 1, n - 4, 0 };  // includes long backward seeks
+
+  for (size_t i = 0; i < sizeof(POSITIONS) / sizeof(POSITIONS[0]); ++i)
+  {
+    in.setPosition(POSITIONS[i]);
+    uint32 value = in.readUInt32();
+    if (value != uint32At(offset + POSITIONS[i]) || in.getPosition() != POSITIONS[i] + 4)
+      throw Error(format("%s: Wrong value read at position %ld", what.c_str(), (long)POSITIONS[i]));
+  }
+
+  in.reset();
+  if (in.getPosition() != 0 || in.readUInt8() != byteAt(offset))
+    throw Error(what + ": Wrong value read after reset");
+
+  in.skip(n / 2 - 1);
+  if (in.getPosition() != n / 2 || in.readUInt8() != byteAt(offset + n / 2))
+    throw Error(what + ": Wrong value read after skip");
+
+  {
+    BinaryInputStream::EndiannessScope scope(in, Endianness::BIG);
+    in.setPosition(n / 4);
+    uint32 expected = uint32At(offset + n / 4);
+    expected = (expected >> 24) | ((expected >> 8) & 0xFF00) | ((expected << 8) & 0xFF0000) | (expected << 24);
+    if (in.readUInt32() != expected)
+      throw Error(what + ": Wrong big-endian value read");
+  }
+
+  // Reading or seeking past the end must fail, but seeking to the end is allowed
+  in.setPosition(n);
+  if (in.hasMore())
+    throw Error(what + ": Stream has more data at its end");
+
+  checkThrows([&]() { in.readUInt8(); }, what + " (read at end)");
+  checkThrows([&]() { in.setPosition(n + 1); }, what + " (seek past end)");
+  checkThrows([&]() { in.skip(1); }, what + " (skip past end)");
+
+  in.setPosition(n - 3);
+  checkThrows([&]() { in.readUInt32(); }, what + " (read across end)");
+
+  in.reset();
+  checkThrows([&]() { in.skip(n + 1); }, what + " (skip past end from start)");
+
+  in.reset();
+}
+
+// Check the file read as a memory-mapped or a buffered stream.
+void
+checkStream(string const & path, bool memory_map)
+{
+  string what = (memory_map ? "Mapped stream" : "Buffered stream");
+
+  BinaryInputStream in(path, Endianness::LITTLE, memory_map);
+  if (in.size() != FILE_SIZE)
+    throw Error(what + ": Wrong size");
+
+#ifndef THEA_WINDOWS
+  if (in.isMemoryMapped() != memory_map)
+    throw Error(what + ": File was not opened in the requested mode");
+#endif
+
+  // Read the whole file sequentially in chunks that straddle the end of the initial buffer of a buffered stream
+  {
+    static int64 const CHUNK_SIZE = 999983;
+    Array<uint8> chunk((size_t)CHUNK_SIZE);
+    for (int64 pos = 0; pos < FILE_SIZE; pos += CHUNK_SIZE)
+    {
+      int64 n = std::min(CHUNK_SIZE, FILE_SIZE - pos);
+      in.readBytes(n, &chunk[0]);
+      checkBytes(&chunk[0], n, pos, what);
+    }
+  }
+
+  in.reset();
+  checkSeeking(in, 0, what);
+
+  // Sub-streams are views of a mapped file, and copies of part of a buffered file. Take one near the end of the file, after
+  // the end of the initial buffer of a buffered stream.
+  static int64 const SUB_OFFSET = FILE_SIZE - 5000000 - 17, SUB_SIZE = 4000000;
+  in.setPosition(SUB_OFFSET);
+  BinaryInputStream sub(in, SUB_SIZE);
+  string sub_what = what + " (sub-stream)";
+  if (sub.size() != SUB_SIZE || in.getPosition() != SUB_OFFSET + SUB_SIZE || in.readUInt32() != uint32At(SUB_OFFSET + SUB_SIZE))
+    throw Error(sub_what + ": Source stream is not positioned after the sub-stream");
+
+#ifndef THEA_WINDOWS
+  if (sub.isMemoryMapped() != memory_map)
+    throw Error(sub_what + ": Sub-stream of a mapped file is not a view");
+#endif
+
+  // The first read must return the start of the block, not reload the block from the start of the file
+  if (sub.readUInt32() != uint32At(SUB_OFFSET))
+    throw Error(sub_what + ": Wrong first value read");
+
+  sub.reset();
+  checkBytes(sub.readBytesInPlace(SUB_SIZE), SUB_SIZE, SUB_OFFSET, sub_what);
+  checkThrows([&]() { sub.readUInt8(); }, sub_what + " (read at end)");
+
+  sub.reset();
+  checkSeeking(sub, SUB_OFFSET, sub_what);
+
+  // A sub-stream of a sub-stream starting part of the way into it
+  static int64 const SUB_SUB_OFFSET = 1234567, SUB_SUB_SIZE = 1000000;
+  sub.setPosition(SUB_SUB_OFFSET);
+  BinaryInputStream sub_sub(sub, SUB_SUB_SIZE);
+  string sub_sub_what = what + " (nested sub-stream)";
+  if (sub.getPosition() != SUB_SUB_OFFSET + SUB_SUB_SIZE)
+    throw Error(sub_sub_what + ": Source stream is not positioned after the sub-stream");
+
+#ifndef THEA_WINDOWS
+  if (sub_sub.isMemoryMapped() != memory_map)
+    throw Error(sub_sub_what + ": Sub-stream of a mapped file is not a view");
+#endif
+
+  checkBytes(sub_sub.readBytesInPlace(SUB_SUB_SIZE), SUB_SUB_SIZE, SUB_OFFSET + SUB_SUB_OFFSET, sub_sub_what);
+  sub_sub.reset();
+  checkSeeking(sub_sub, SUB_OFFSET + SUB_SUB_OFFSET, sub_sub_what);
+
+  // The rest of the outer sub-stream is unaffected, and the sub-streams cannot be read beyond their ends
+  if (sub.readUInt32() != uint32At(SUB_OFFSET + SUB_SUB_OFFSET + SUB_SUB_SIZE))
+    throw Error(sub_what + ": Wrong value read after nested sub-stream");
+
+  sub.reset();
+  sub.skip(SUB_SIZE - 2);
+  checkThrows([&]() { sub.readUInt32(); }, sub_what + " (read across end after reset)");
+  checkThrows([&]() { BinaryInputStream too_long(sub, 3); }, sub_what + " (nested sub-stream past end)");
+
+  cout << what << " read correctly (" << FILE_SIZE << " bytes)" << endl;
+}
+
+void
+testBinaryInputStream()
+{
+  string path = "test_binary_stream.bin";
+  {
+    Array<uint8> data((size_t)FILE_SIZE);
+    for (int64 i = 0; i < FILE_SIZE; ++i)
+      data[(size_t)i] = byteAt(i);
+
+    FILE * file = fopen(path.c_str(), "wb");
+    if (!file || fwrite(&data[0], 1, data.size(), file) != data.size())
+      throw Error("Could not write test file");
+
+    fclose(file);
+  }
+
+  // Mapped and buffered streams must behave identically
+  checkStream(path, true);
+  checkStream(path, false);
+
+  FileSystem::remove(path);
+}
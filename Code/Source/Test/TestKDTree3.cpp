@@ -1,14 +1,27 @@
 #include "../Common.hpp"
+#include "../Algorithms/DynamicKDTreeN.hpp"
+#include "../Algorithms/FlatKDTreeN.hpp"
+#include "../Algorithms/HashGridN.hpp"
 #include "../Algorithms/IntersectionTester.hpp"
 #include "../Algorithms/KDTreeN.hpp"
 #include "../Algorithms/MetricL2.hpp"
+#include "../Algorithms/OutOfCoreKDTreeN.hpp"
 #include "../Algorithms/PointTraitsN.hpp"
 #include "../Algorithms/RayIntersectionTester.hpp"
 #include "../AxisAlignedBox3.hpp"
 #include "../Ball3.hpp"
+#include "../BoundedSortedArray.hpp"
 #include "../BoundedSortedArrayN.hpp"
+#include "../Box3.hpp"
+#include "../FileSystem.hpp"
+#include "../Stopwatch.hpp"
+#include "../ThreadGroup.hpp"
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -19,6 +32,23 @@ using namespace Algorithms;
 
 void testPointKDTree();
 void testTriangleKDTree();
+void testParallelKDTree();
+void testSplitPolicies();
+void testRayPackets();
+void testConcurrentQueries();
+void testFlatKDTree();
+void testSavedFlatKDTree();
+void testRefit();
+void testDynamicKDTree();
+void testDualTreeQueries();
+void testApproxQueries();
+void testTriangleRangeQueries();
+void testMortonKDTree();
+void testOutOfCoreKDTree();
+void testAggregateQueries();
+void testHashGrid();
+void testTreeCollision();
+void testLargeKQueries();
 
 int
 main(int argc, char * argv[])
@@ -28,6 +58,40 @@ main(int argc, char * argv[])
     testPointKDTree();
     cout << endl;
     testTriangleKDTree();
+    cout << endl;
+    testParallelKDTree();
+    cout << endl;
+    testSplitPolicies();
+    cout << endl;
+    testRayPackets();
+    cout << endl;
+    testConcurrentQueries();
+    cout << endl;
+    testFlatKDTree();
+    cout << endl;
+    testSavedFlatKDTree();
+    cout << endl;
+    testRefit();
+    cout << endl;
+    testDynamicKDTree();
+    cout << endl;
+    testDualTreeQueries();
+    cout << endl;
+    testApproxQueries();
+    cout << endl;
+    testTriangleRangeQueries();
+    cout << endl;
+    testMortonKDTree();
+    cout << endl;
+    testOutOfCoreKDTree();
+    cout << endl;
+    testAggregateQueries();
+    cout << endl;
+    testHashGrid();
+    cout << endl;
+    testTreeCollision();
+    cout << endl;
+    testLargeKQueries();
   }
   THEA_STANDARD_CATCH_BLOCKS(return -1;, ERROR, "%s", "An error occurred")
 
@@ -406,3 +470,1668 @@ testTriangleKDTree()
   else
     cout << "Ray does not intersect any triangle in the kd-tree" << endl;
 }
+
+// Check if two subtrees have identical structure and element indices.
+template <typename NodeT>
+bool
+sameSubtree(NodeT const * a, NodeT const * b)
+{
+  if (!a || !b)
+    return !a && !b;
+
+  if (a->getDepth() != b->getDepth()
+   || a->numElementIndices() != b->numElementIndices()
+   || !std::equal(a->elementIndicesBegin(), a->elementIndicesEnd(), b->elementIndicesBegin())
+   || (a->getBounds().getLow() - b->getBounds().getLow()).squaredNorm() > 0
+   || (a->getBounds().getHigh() - b->getBounds().getHigh()).squaredNorm() > 0)
+    return false;
+
+  return sameSubtree(a->getLowChild(), b->getLowChild()) && sameSubtree(a->getHighChild(), b->getHighChild());
+}
+
+void
+testParallelKDTree()
+{
+  cout << "=================================\n"
+       << "Testing parallel kd-tree building\n"
+       << "=================================" << endl;
+
+  static int const NUM_POINTS = 200000;
+  Array<Vector3> points((size_t)NUM_POINTS);
+  for (size_t i = 0; i < points.size(); ++i)
+    points[i] = Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  for (int save_memory = 0; save_memory < 2; ++save_memory)
+  {
+    KDTree serial_kdtree;
+    serial_kdtree.init(points.begin(), points.end(), -1, -1, (bool)save_memory);
+
+    KDTree parallel_kdtree;
+    parallel_kdtree.setMaxBuildThreads(4);
+    parallel_kdtree.init(points.begin(), points.end(), -1, -1, (bool)save_memory);
+
+    if (parallel_kdtree.numNodes() != serial_kdtree.numNodes()
+     || !sameSubtree(parallel_kdtree.getRoot(), serial_kdtree.getRoot()))
+      throw Error(format("Parallel and serial kd-trees differ (save_memory = %d)", save_memory));
+
+    cout << "Parallel and serial kd-trees are identical (save_memory = " << save_memory << ", " << serial_kdtree.numNodes()
+         << " nodes)" << endl;
+  }
+}
+
+void
+testSplitPolicies()
+{
+  cout << "=======================================\n"
+       << "Testing kd-tree split policies for rays\n"
+       << "=======================================" << endl;
+
+  // Small triangles, clustered unevenly so the policies produce different trees
+  static int const NUM_TRIANGLES = 20000;
+  vector<MyCustomTriangle> triangles;
+  for (int i = 0; i < NUM_TRIANGLES; ++i)
+  {
+    Real s = (i % 4 == 0 ? 1 : 0.1f);
+    Vector3 c(s * rand() / (Real)RAND_MAX, s * rand() / (Real)RAND_MAX, s * rand() / (Real)RAND_MAX);
+    Vector3 v[3];
+    for (int j = 0; j < 3; ++j)
+      v[j] = c + 0.01f * Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+    triangles.push_back(MyCustomTriangle(MyCustomTriangleVertexTriple("", v[0], v[1], v[2])));
+  }
+
+  static int const NUM_RAYS = 2000;
+  Array<Ray3> rays;
+  for (int i = 0; i < NUM_RAYS; ++i)
+    rays.push_back(Ray3(Vector3(-0.1f, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX),
+                        Vector3(1, 0.2f * (rand() / (Real)RAND_MAX - 0.5f), 0.2f * (rand() / (Real)RAND_MAX - 0.5f))));
+
+  typedef KDTreeN<MyCustomTriangle, 3> KDTree;
+  KDTree::SplitPolicy policies[] = { KDTree::SplitPolicy::MEDIAN, KDTree::SplitPolicy::OBJECT_MEDIAN, KDTree::SplitPolicy::SAH,
+                                     KDTree::SplitPolicy::MORTON };
+
+  Array<Real> reference_times;
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p)
+  {
+    KDTree kdtree;
+    kdtree.setSplitPolicy(policies[p]);
+    kdtree.init(triangles.begin(), triangles.end());
+
+    Array<Real> times;
+    for (size_t i = 0; i < rays.size(); ++i)
+      times.push_back(kdtree.rayIntersectionTime<RayIntersectionTester>(rays[i]));
+
+    if (p == 0)
+      reference_times = times;
+    else
+    {
+      for (size_t i = 0; i < times.size(); ++i)
+        if (std::abs(times[i] - reference_times[i]) > 1.0e-5f)
+          throw Error(format("Ray %ld has hit time %g with split policy '%s', but %g with split policy '%s'", (long)i,
+                             (double)times[i], policies[p].toString().c_str(), (double)reference_times[i],
+                             policies[0].toString().c_str()));
+    }
+
+    cout << "Split policy '" << policies[p].toString() << "': " << kdtree.numNodes() << " nodes, expected traversal cost "
+         << kdtree.expectedTraversalCost() << endl;
+  }
+
+  cout << "All split policies give the same ray hits" << endl;
+}
+
+void
+testRayPackets()
+{
+  cout << "=============================\n"
+       << "Testing packet ray traversal\n"
+       << "=============================" << endl;
+
+  static int const NUM_TRIANGLES = 20000;
+  vector<MyCustomTriangle> triangles;
+  for (int i = 0; i < NUM_TRIANGLES; ++i)
+  {
+    Vector3 c(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+    Vector3 v[3];
+    for (int j = 0; j < 3; ++j)
+      v[j] = c + 0.02f * Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+    triangles.push_back(MyCustomTriangle(MyCustomTriangleVertexTriple("", v[0], v[1], v[2])));
+  }
+
+  typedef KDTreeN<MyCustomTriangle, 3> KDTree;
+  KDTree kdtree(triangles.begin(), triangles.end());
+
+  // Bundles of coherent rays from common origins, followed by incoherent rays, including some along coordinate axes
+  static int const NUM_RAYS = 4001;
+  Array<Ray3> rays;
+  for (int i = 0; i < NUM_RAYS; ++i)
+  {
+    if (i < NUM_RAYS / 2)
+    {
+      Vector3 origin = Vector3(0.5f, 0.5f, 0.5f) + 0.1f * Vector3::Constant((Real)(i / 32));
+      rays.push_back(Ray3(origin, Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, 1)));
+    }
+    else if (i % 10 == 0)
+    {
+      Vector3 dir = Vector3::Zero(); dir[i % 3] = (i % 20 == 0 ? 1 : -1);
+      rays.push_back(Ray3(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX), dir));
+    }
+    else
+      rays.push_back(Ray3(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX),
+                          Vector3(rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f)));
+  }
+
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    Real max_time = (pass == 0 ? -1 : 0.3f);
+
+    Array<RayStructureIntersection3> isecs(rays.size());
+    Array<Real> times(rays.size());
+    kdtree.rayStructureIntersections<RayIntersectionTester>(&rays[0], (intx)rays.size(), &isecs[0], max_time);
+    kdtree.rayIntersectionTimes<RayIntersectionTester>(&rays[0], (intx)rays.size(), &times[0], max_time);
+
+    intx num_hits = 0;
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+      RayStructureIntersection3 isec = kdtree.rayStructureIntersection<RayIntersectionTester>(rays[i], max_time);
+      Real time = kdtree.rayIntersectionTime<RayIntersectionTester>(rays[i], max_time);
+      if (isec.getElementIndex() != isecs[i].getElementIndex()
+       || std::abs(isec.getTime() - isecs[i].getTime()) > 1.0e-6f
+       || std::abs(time - times[i]) > 1.0e-6f)
+        throw Error(format("Packet and single-ray results differ for ray %ld: element %ld at time %g vs element %ld at time %g",
+                           (long)i, (long)isecs[i].getElementIndex(), (double)isecs[i].getTime(),
+                           (long)isec.getElementIndex(), (double)isec.getTime()));
+
+      if (isec.isValid()) num_hits++;
+    }
+
+    cout << "Packet and single-ray results are identical (max_time = " << max_time << ", " << num_hits << " of " << rays.size()
+         << " rays hit)" << endl;
+  }
+}
+
+// Allows only points whose first coordinate lies in a slab.
+struct SlabFilter : public Filter<Vector3>
+{
+  SlabFilter(Real lo_, Real hi_) : lo(lo_), hi(hi_) {}
+  bool allows(Vector3 const & p) const { return p[0] >= lo && p[0] <= hi; }
+
+  Real lo, hi;
+};
+
+// Finds the nearest neighbors of a set of queries in a shared kd-tree, with a different filter for each query.
+struct ConcurrentNNQueries
+{
+  typedef KDTreeN<Vector3, 3> KDTree;
+
+  ConcurrentNNQueries(KDTree const * kdtree_, Array<Vector3> const * queries_, size_t begin_, size_t end_,
+                      Array<intx> * results_)
+  : kdtree(kdtree_), queries(queries_), begin(begin_), end(end_), results(results_) {}
+
+  void operator()()
+  {
+    for (size_t i = begin; i < end; ++i)
+    {
+      SlabFilter filter((i % 10) / (Real)10, (i % 10 + 1) / (Real)10);
+      (*results)[i] = kdtree->closestElement<MetricL2>((*queries)[i], -1, nullptr, nullptr, &filter);
+    }
+  }
+
+  KDTree const * kdtree;
+  Array<Vector3> const * queries;
+  size_t begin, end;
+  Array<intx> * results;
+};
+
+void
+testConcurrentQueries()
+{
+  cout << "=====================================\n"
+       << "Testing concurrent queries on kd-tree\n"
+       << "=====================================" << endl;
+
+  static int const NUM_POINTS = 50000;
+  static int const NUM_QUERIES = 20000;
+  static int const NUM_THREADS = 4;
+
+  Array<Vector3> points, queries;
+  for (int i = 0; i < NUM_POINTS; ++i)
+    points.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+  for (int i = 0; i < NUM_QUERIES; ++i)
+    queries.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  KDTree kdtree(points.begin(), points.end());
+  kdtree.enableNearestNeighborAcceleration();
+  kdtree.prepareForConcurrentQueries<MetricL2>();
+
+  // Reference results with the filter stack, computed serially
+  Array<intx> expected((size_t)NUM_QUERIES);
+  for (size_t i = 0; i < queries.size(); ++i)
+  {
+    SlabFilter filter((i % 10) / (Real)10, (i % 10 + 1) / (Real)10);
+    kdtree.pushFilter(&filter);
+      expected[i] = kdtree.closestElement<MetricL2>(queries[i]);
+    kdtree.popFilter();
+  }
+
+  Array<intx> results((size_t)NUM_QUERIES, -1);
+  ThreadGroup threads;
+  for (int t = 0; t < NUM_THREADS; ++t)
+    threads.addThread(new std::thread(ConcurrentNNQueries(&kdtree, &queries, t * queries.size() / NUM_THREADS,
+                                                          (t + 1) * queries.size() / NUM_THREADS, &results)));
+  threads.joinAll();
+
+  for (size_t i = 0; i < queries.size(); ++i)
+    if (results[i] != expected[i])
+      throw Error(format("Concurrent query %ld returned element %ld instead of %ld", (long)i, (long)results[i],
+                         (long)expected[i]));
+
+  cout << "Concurrent filtered queries from " << NUM_THREADS << " threads match serial queries with the filter stack" << endl;
+}
+
+void
+testFlatKDTree()
+{
+  cout << "=========================\n"
+       << "Testing flattened kd-tree\n"
+       << "=========================" << endl;
+
+  static int const NUM_POINTS = 50000;
+  static int const NUM_QUERIES = 2000;
+  static int const K = 8;
+
+  Array<Vector3> points, queries;
+  for (int i = 0; i < NUM_POINTS; ++i)
+    points.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+  for (int i = 0; i < NUM_QUERIES; ++i)
+    queries.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  typedef FlatKDTreeN<Vector3, 3> FlatKDTree;
+  typedef BoundedSortedArrayN<K, KDTree::NeighborPair> NeighborSet;
+  KDTree kdtree(points.begin(), points.end());
+
+  for (int quantize = 0; quantize < 2; ++quantize)
+  {
+    FlatKDTree flat_kdtree(kdtree, (bool)quantize);
+    if (flat_kdtree.numElements() != kdtree.numElements() || flat_kdtree.numNodes() != kdtree.numNodes())
+      throw Error("Flattened kd-tree has a different number of elements or nodes");
+
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      // Nearest neighbor, with and without a filter
+      SlabFilter filter((i % 10) / (Real)10, (i % 10 + 1) / (Real)10);
+      for (int f = 0; f < 2; ++f)
+      {
+        Filter<Vector3> const * fp = (f == 0 ? nullptr : &filter);
+        intx expected = kdtree.closestElement<MetricL2>(queries[i], -1, nullptr, nullptr, fp);
+        intx nn = flat_kdtree.closestElement<MetricL2>(queries[i], -1, nullptr, nullptr, fp);
+        if (nn < 0 || flat_kdtree.getSourceIndex(nn) != expected)
+          throw Error(format("Flattened kd-tree returned nearest neighbor %ld instead of %ld for query %ld", (long)nn,
+                             (long)expected, (long)i));
+      }
+
+      // k nearest neighbors
+      NeighborSet expected_nbrs, nbrs;
+      kdtree.kClosestPairs<MetricL2>(queries[i], expected_nbrs);
+      flat_kdtree.kClosestPairs<MetricL2>(queries[i], nbrs);
+      if (nbrs.size() != expected_nbrs.size())
+        throw Error(format("Flattened kd-tree returned %ld neighbors instead of %ld", (long)nbrs.size(),
+                           (long)expected_nbrs.size()));
+
+      for (intx j = 0; j < nbrs.size(); ++j)
+        if (flat_kdtree.getSourceIndex(nbrs[j].getTargetIndex()) != expected_nbrs[j].getTargetIndex())
+          throw Error(format("Neighbor %ld of query %ld differs between flattened and pointer kd-trees", (long)j, (long)i));
+
+      // Range query
+      Ball3 ball(queries[i], 0.05f);
+      Array<intx> expected_in_range, in_range;
+      kdtree.rangeQueryIndices<IntersectionTester>(ball, expected_in_range);
+      flat_kdtree.rangeQueryIndices<IntersectionTester>(ball, in_range);
+      for (size_t j = 0; j < in_range.size(); ++j)
+        in_range[j] = flat_kdtree.getSourceIndex(in_range[j]);
+
+      std::sort(expected_in_range.begin(), expected_in_range.end());
+      std::sort(in_range.begin(), in_range.end());
+      if (in_range != expected_in_range)
+        throw Error(format("Range query %ld differs between flattened and pointer kd-trees", (long)i));
+    }
+
+    cout << "Flattened kd-tree (quantized bounds = " << quantize << ", " << flat_kdtree.getNodeMemoryUsage()
+         << " bytes of nodes) matches pointer kd-tree on proximity and range queries" << endl;
+  }
+
+  // Ray queries on triangles
+  static int const NUM_TRIANGLES = 20000;
+  static int const NUM_RAYS = 2000;
+
+  vector<MyCustomTriangle> triangles;
+  for (int i = 0; i < NUM_TRIANGLES; ++i)
+  {
+    Vector3 c(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+    Vector3 v[3];
+    for (int j = 0; j < 3; ++j)
+      v[j] = c + 0.02f * Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+    triangles.push_back(MyCustomTriangle(MyCustomTriangleVertexTriple("", v[0], v[1], v[2])));
+  }
+
+  Array<Ray3> rays;
+  for (int i = 0; i < NUM_RAYS; ++i)
+    rays.push_back(Ray3(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX),
+                        Vector3(rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f)));
+
+  KDTreeN<MyCustomTriangle, 3> tri_kdtree(triangles.begin(), triangles.end());
+  for (int quantize = 0; quantize < 2; ++quantize)
+  {
+    FlatKDTreeN<MyCustomTriangle, 3> flat_tri_kdtree(tri_kdtree, (bool)quantize);
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+      RayStructureIntersection3 expected = tri_kdtree.rayStructureIntersection<RayIntersectionTester>(rays[i]);
+      RayStructureIntersection3 isec = flat_tri_kdtree.rayStructureIntersection<RayIntersectionTester>(rays[i]);
+      if (expected.isValid() != isec.isValid()
+       || (isec.isValid() && (flat_tri_kdtree.getSourceIndex(isec.getElementIndex()) != expected.getElementIndex()
+                           || std::abs(isec.getTime() - expected.getTime()) > 1.0e-6f)))
+        throw Error(format("Ray %ld hits differ between flattened and pointer kd-trees", (long)i));
+    }
+
+    cout << "Flattened kd-tree (quantized bounds = " << quantize << ") matches pointer kd-tree on ray queries" << endl;
+  }
+}
+
+// Copy a file, replacing the first occurrence of a block of bytes with another block of the same size. Returns false if the
+// block is not found.
+bool
+copyAndPatchFile(string const & src_path, string const & dst_path, void const * old_bytes, void const * new_bytes, size_t n)
+{
+  ifstream in(src_path.c_str(), ios::binary);
+  string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  size_t pos = data.find(string(static_cast<char const *>(old_bytes), n));
+  if (pos == string::npos)
+    return false;
+
+  std::memcpy(&data[pos], new_bytes, n);
+  ofstream out(dst_path.c_str(), ios::binary);
+  out.write(data.data(), (streamsize)data.size());
+  return (bool)out;
+}
+
+void
+testSavedFlatKDTree()
+{
+  cout << "======================================\n"
+       << "Testing saved and mapped flat kd-trees\n"
+       << "======================================" << endl;
+
+  static int const NUM_POINTS = 20000;
+  static int const NUM_QUERIES = 1000;
+  static uint64 const HASH = 0x1234567890abcdefULL;
+  string path = "TestKDTree3_saved.kdtree";
+
+  Array<Vector3> points, queries;
+  for (int i = 0; i < NUM_POINTS; ++i)
+    points.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+  for (int i = 0; i < NUM_QUERIES; ++i)
+    queries.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  // Points are stored in the file and used in place after mapping
+  KDTreeN<Vector3, 3> kdtree(points.begin(), points.end());
+  for (int quantize = 0; quantize < 2; ++quantize)
+  {
+    FlatKDTreeN<Vector3, 3> flat_kdtree(kdtree, (bool)quantize);
+    if (!flat_kdtree.save(path, HASH))
+      throw Error("Could not save flattened point kd-tree");
+
+    FlatKDTreeN<Vector3, 3> loaded;
+    if (loaded.load(path, HASH + 1))
+      throw Error("Saved kd-tree was loaded in spite of a hash mismatch");
+
+    if (!loaded.load(path, HASH) || !loaded.isMapped())
+      throw Error("Could not load saved point kd-tree");
+
+    if (loaded.numNodes() != flat_kdtree.numNodes() || loaded.numElements() != flat_kdtree.numElements()
+     || loaded.hasQuantizedBounds() != (bool)quantize)
+      throw Error("Loaded point kd-tree differs from saved tree");
+
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      intx nn = loaded.closestElement<MetricL2>(queries[i]);
+      if (nn < 0 || loaded.getSourceIndex(nn) != kdtree.closestElement<MetricL2>(queries[i]))
+        throw Error(format("Loaded point kd-tree returned wrong nearest neighbor for query %ld", (long)i));
+    }
+
+    cout << "Saved and mapped point kd-tree (quantized bounds = " << quantize << ", " << FileSystem::fileSize(path)
+         << " bytes) matches the original" << endl;
+  }
+
+  // A file with a node that references a missing child or elements, with an out-of-range source index, or with a header whose
+  // section sizes overflow, must be rejected
+  {
+    FlatKDTreeN<Vector3, 3> saved;
+    if (!saved.load(path, HASH))
+      throw Error("Could not load saved point kd-tree");
+
+    typedef FlatKDTreeN<Vector3, 3>::Node FlatNode;
+    FlatNode const * nodes = saved.getNodes();
+    intx leaf = 0;
+    while (!nodes[leaf].isLeaf()) ++leaf;
+
+    FlatNode bad_nodes[2] = { nodes[0], nodes[leaf] };
+    bad_nodes[0].hi = (uint32)saved.numNodes();
+    bad_nodes[1].num_elems = (uint32)(saved.numElements() - nodes[leaf].first_elem + 1);
+
+    uint32 src_indices[8], bad_src_indices[8];
+    for (int i = 0; i < 8; ++i)
+      src_indices[i] = bad_src_indices[i] = (uint32)saved.getSourceIndex(i);
+
+    bad_src_indices[0] = (uint32)NUM_POINTS;
+
+    // The consecutive node and element counts in the header. With 2^62 more elements, the sizes of the source index and
+    // element arrays wrap around to their original values when computed in 64 bits.
+    uint64 counts[2] = { (uint64)saved.numNodes(), (uint64)NUM_POINTS };
+    uint64 bad_counts[2] = { counts[0], counts[1] + ((uint64)1 << 62) };
+
+    string bad_path = "TestKDTree3_saved_bad.kdtree";
+    for (int i = 0; i < 4; ++i)
+    {
+      bool patched = (i < 2 ? copyAndPatchFile(path, bad_path, (i == 0 ? &nodes[0] : &nodes[leaf]), &bad_nodes[i],
+                                               sizeof(FlatNode))
+                            : (i == 2 ? copyAndPatchFile(path, bad_path, src_indices, bad_src_indices, sizeof(src_indices))
+                                      : copyAndPatchFile(path, bad_path, counts, bad_counts, sizeof(counts))));
+      if (!patched)
+        throw Error("Could not find data to corrupt in saved kd-tree file");
+
+      FlatKDTreeN<Vector3, 3> bad_kdtree;
+      if (bad_kdtree.load(bad_path, HASH))
+        throw Error(format("Saved kd-tree with invalid data %d was loaded", i));
+    }
+
+    FileSystem::remove(bad_path);
+    cout << "Saved kd-trees with invalid nodes, source indices or section sizes are rejected" << endl;
+  }
+
+  // Triangles are not stored in the file, and must be supplied again when loading
+  static int const NUM_TRIANGLES = 10000;
+  static int const NUM_RAYS = 1000;
+
+  vector<MyCustomTriangle> triangles;
+  for (int i = 0; i < NUM_TRIANGLES; ++i)
+  {
+    Vector3 c(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+    Vector3 v[3];
+    for (int j = 0; j < 3; ++j)
+      v[j] = c + 0.02f * Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+    triangles.push_back(MyCustomTriangle(MyCustomTriangleVertexTriple("", v[0], v[1], v[2])));
+  }
+
+  KDTreeN<MyCustomTriangle, 3> tri_kdtree(triangles.begin(), triangles.end());
+  if (!FlatKDTreeN<MyCustomTriangle, 3>(tri_kdtree).save(path, HASH))
+    throw Error("Could not save flattened triangle kd-tree");
+
+  FlatKDTreeN<MyCustomTriangle, 3> loaded;
+  if (loaded.load(path, HASH))
+    throw Error("Saved triangle kd-tree was loaded without the source triangles");
+
+  if (!loaded.load(path, HASH, &triangles[0], (intx)triangles.size()))
+    throw Error("Could not load saved triangle kd-tree");
+
+  for (int i = 0; i < NUM_RAYS; ++i)
+  {
+    Ray3 ray(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX),
+             Vector3(rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f));
+    RayStructureIntersection3 expected = tri_kdtree.rayStructureIntersection<RayIntersectionTester>(ray);
+    RayStructureIntersection3 isec = loaded.rayStructureIntersection<RayIntersectionTester>(ray);
+    if (expected.isValid() != isec.isValid()
+     || (isec.isValid() && loaded.getSourceIndex(isec.getElementIndex()) != expected.getElementIndex()))
+      throw Error(format("Ray %d hits differ between loaded and original triangle kd-trees", i));
+  }
+
+  cout << "Saved and mapped triangle kd-tree matches the original" << endl;
+
+  loaded.clear();
+  FileSystem::remove(path);
+}
+
+// Check if two subtrees have the same bounds at every node.
+template <typename NodeT>
+bool
+sameSubtreeBounds(NodeT const * a, NodeT const * b)
+{
+  if (!a || !b) return a == b;
+
+  return (a->getBounds().getLow() - b->getBounds().getLow()).squaredNorm() < 1.0e-12
+      && (a->getBounds().getHigh() - b->getBounds().getHigh()).squaredNorm() < 1.0e-12
+      && sameSubtreeBounds(a->getLowChild(), b->getLowChild())
+      && sameSubtreeBounds(a->getHighChild(), b->getHighChild());
+}
+
+void
+testRefit()
+{
+  cout << "=====================\n"
+       << "Testing kd-tree refit\n"
+       << "=====================" << endl;
+
+  static int const NUM_POINTS = 50000;
+  static int const NUM_QUERIES = 1000;
+
+  Array<Vector3> points, queries;
+  for (int i = 0; i < NUM_POINTS; ++i)
+    points.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+  for (int i = 0; i < NUM_QUERIES; ++i)
+    queries.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  KDTree built(points.begin(), points.end());
+
+  // Refitting the unchanged elements reproduces the bounds of construction, serially and in parallel
+  for (int parallel = 0; parallel < 2; ++parallel)
+  {
+    KDTree kdtree(points.begin(), points.end());
+    kdtree.setMaxBuildThreads(parallel ? 4 : 1);
+    double quality = kdtree.refit(true);
+    if (!sameSubtreeBounds(kdtree.getRoot(), built.getRoot()) || std::abs(quality - 1) > 1.0e-6)
+      throw Error(format("Refitting unchanged elements changed the kd-tree (parallel = %d)", parallel));
+  }
+
+  // Deform the points smoothly, then shuffle them, refitting each time
+  Array<Vector3> deformed(points.size()), shuffled(points.size());
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    Vector3 const & p = points[i];
+    deformed[i] = Vector3(p[0] + 0.1f * std::sin(3 * p[1]), p[1] * (1 + 0.2f * p[2]), p[2]);
+    shuffled[i] = points[(i * 7919) % points.size()];
+  }
+
+  Array<Vector3> const * targets[2] = { &deformed, &shuffled };
+  for (int t = 0; t < 2; ++t)
+  {
+    for (int parallel = 0; parallel < 2; ++parallel)
+    {
+      KDTree kdtree(points.begin(), points.end());
+      kdtree.setMaxBuildThreads(parallel ? 4 : 1);
+      double quality = kdtree.refit(targets[t]->begin(), targets[t]->end(), true);
+
+      for (size_t i = 0; i < queries.size(); ++i)
+      {
+        intx nn = kdtree.closestElement<MetricL2>(queries[i]);
+
+        intx expected = -1;
+        Real min_sqdist = -1;
+        for (size_t j = 0; j < targets[t]->size(); ++j)
+        {
+          Real sqdist = ((*targets[t])[j] - queries[i]).squaredNorm();
+          if (expected < 0 || sqdist < min_sqdist)
+          {
+            expected = (intx)j;
+            min_sqdist = sqdist;
+          }
+        }
+
+        if (nn != expected)
+          throw Error(format("Refitted kd-tree returned nearest neighbor %ld instead of %ld", (long)nn, (long)expected));
+      }
+
+      if (parallel)
+        cout << (t == 0 ? "Deformed" : "Shuffled") << " points: refitted kd-tree returns correct neighbors, quality ratio "
+             << quality << endl;
+    }
+  }
+}
+
+// Rejects points in the lower half of the unit cube.
+struct UpperHalfFilter : public Filter<Vector3>
+{
+  bool allows(Vector3 const & p) const { return p[2] >= 0.5f; }
+};
+
+void
+testDynamicKDTree()
+{
+  cout << "=======================\n"
+       << "Testing dynamic kd-tree\n"
+       << "=======================" << endl;
+
+  static int const NUM_OPS = 20000;
+  static int const NUM_QUERIES = 200;
+  static int const K = 8;
+
+  typedef DynamicKDTreeN<Vector3, 3> DynamicKDTree;
+  DynamicKDTree kdtree;
+
+  // Reference copy of the live points, indexed by handle
+  Array<Vector3> ref_points;
+  Array<bool> ref_live;
+  Array<intx> live_handles;
+
+  for (int op = 0; op < NUM_OPS; ++op)
+  {
+    // Insert twice as often as we remove, so the tree grows
+    if (live_handles.empty() || rand() % 3 != 0)
+    {
+      Vector3 p(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+      intx handle = kdtree.insert(p);
+      if (kdtree.contains(handle) && handle < (intx)ref_live.size() && ref_live[(size_t)handle])
+        throw Error("Dynamic kd-tree reused the handle of a live element");
+
+      if (handle >= (intx)ref_points.size())
+      {
+        ref_points.resize((size_t)handle + 1);
+        ref_live.resize((size_t)handle + 1, false);
+      }
+
+      ref_points[(size_t)handle] = p;
+      ref_live[(size_t)handle] = true;
+      live_handles.push_back(handle);
+    }
+    else
+    {
+      size_t i = (size_t)rand() % live_handles.size();
+      intx handle = live_handles[i];
+      if (!kdtree.remove(handle) || kdtree.remove(handle))
+        throw Error("Dynamic kd-tree did not remove an element exactly once");
+
+      ref_live[(size_t)handle] = false;
+      live_handles[i] = live_handles.back();
+      live_handles.pop_back();
+    }
+  }
+
+  if (kdtree.numElements() != (intx)live_handles.size())
+    throw Error("Dynamic kd-tree has the wrong number of elements");
+
+  for (size_t i = 0; i < live_handles.size(); ++i)
+    if (kdtree.getElement(live_handles[i]) != ref_points[(size_t)live_handles[i]])
+      throw Error("Dynamic kd-tree returned the wrong element for a handle");
+
+  for (int q = 0; q < NUM_QUERIES; ++q)
+  {
+    Vector3 query(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+    // Brute-force neighbors, sorted by distance
+    Array< std::pair<Real, intx> > sorted;
+    for (size_t i = 0; i < live_handles.size(); ++i)
+      sorted.push_back(std::make_pair((ref_points[(size_t)live_handles[i]] - query).squaredNorm(), live_handles[i]));
+    std::sort(sorted.begin(), sorted.end());
+
+    intx nn = kdtree.closestElement<MetricL2>(query);
+    if (nn != sorted[0].second)
+      throw Error(format("Dynamic kd-tree returned nearest neighbor %ld instead of %ld", (long)nn, (long)sorted[0].second));
+
+    BoundedSortedArrayN<K, DynamicKDTree::NeighborPair> nbrs;
+    kdtree.kClosestPairs<MetricL2>(query, nbrs);
+    if (nbrs.size() != K)
+      throw Error("Dynamic kd-tree returned too few nearest neighbors");
+
+    for (int i = 0; i < K; ++i)
+      if (nbrs[i].getTargetIndex() != sorted[(size_t)i].second)
+        throw Error(format("Dynamic kd-tree returned the wrong %d'th nearest neighbor", i));
+
+    Ball3 ball(query, 0.1f);
+    Array<intx> in_range;
+    kdtree.rangeQueryIndices<IntersectionTester>(ball, in_range);
+    std::sort(in_range.begin(), in_range.end());
+
+    Array<intx> expected_in_range;
+    for (size_t i = 0; i < sorted.size() && sorted[i].first <= 0.01f; ++i)
+      expected_in_range.push_back(sorted[i].second);
+    std::sort(expected_in_range.begin(), expected_in_range.end());
+
+    if (in_range != expected_in_range)
+      throw Error("Dynamic kd-tree returned the wrong elements in range");
+
+    // The short form with a filter must mean the same as it does for KDTreeN
+    UpperHalfFilter filter;
+    BoundedSortedArrayN<K, DynamicKDTree::NeighborPair> filtered_nbrs;
+    kdtree.kClosestPairs<MetricL2>(query, filtered_nbrs, -1, false, &filter);
+
+    Array<intx> expected_filtered;
+    for (size_t i = 0; i < sorted.size() && (int)expected_filtered.size() < K; ++i)
+      if (filter.allows(ref_points[(size_t)sorted[i].second]))
+        expected_filtered.push_back(sorted[i].second);
+
+    if (filtered_nbrs.size() != (int)expected_filtered.size())
+      throw Error("Dynamic kd-tree returned the wrong number of filtered nearest neighbors");
+
+    for (int i = 0; i < filtered_nbrs.size(); ++i)
+      if (filtered_nbrs[i].getTargetIndex() != expected_filtered[(size_t)i])
+        throw Error(format("Dynamic kd-tree returned the wrong %d'th filtered nearest neighbor", i));
+
+    // With the query index set, the query and target of each pair are swapped
+    BoundedSortedArrayN<K, DynamicKDTree::NeighborPair> swapped_nbrs;
+    kdtree.kClosestPairs<MetricL2>(query, swapped_nbrs, -1, false, true, 7);
+    for (int i = 0; i < swapped_nbrs.size(); ++i)
+      if (swapped_nbrs[i].getQueryIndex() != nbrs[i].getTargetIndex() || swapped_nbrs[i].getTargetIndex() != 7)
+        throw Error("Dynamic kd-tree did not swap query and target indices");
+  }
+
+  cout << "Dynamic kd-tree with " << kdtree.numElements() << " elements in " << kdtree.numLevels()
+       << " levels returns correct neighbors and ranges" << endl;
+}
+
+void
+testDualTreeQueries()
+{
+  cout << "=============================\n"
+       << "Testing dual-tree kd-tree ops\n"
+       << "=============================" << endl;
+
+  static int const NUM_QUERY_POINTS = 20000;
+  static int const NUM_TARGET_POINTS = 15000;
+  static int const K = 4;
+
+  Array<Vector3> query_points, target_points;
+  for (int i = 0; i < NUM_QUERY_POINTS; ++i)
+    query_points.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+  for (int i = 0; i < NUM_TARGET_POINTS; ++i)
+    target_points.push_back(Vector3(0.5f * rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  typedef BoundedSortedArrayN<K, KDTree::NeighborPair> NeighborSet;
+
+  KDTree query_kdtree(query_points.begin(), query_points.end());
+  KDTree target_kdtree(target_points.begin(), target_points.end());
+
+  UpperHalfFilter filter;
+  for (int filtered = 0; filtered < 2; ++filtered)
+  {
+    Filter<Vector3> const * target_filter = (filtered ? &filter : nullptr);
+
+    // All k-nearest neighbors, checked against independent queries
+    Stopwatch timer;
+    Array<NeighborSet> all_nbrs;
+    timer.tick();
+      query_kdtree.allKClosestPairs<MetricL2>(target_kdtree, all_nbrs, -1, false, nullptr, target_filter);
+    timer.tock();
+    double dual_time = timer.elapsedTime();
+
+    Array<NeighborSet> single_nbrs(query_points.size());
+    timer.tick();
+      for (size_t i = 0; i < query_points.size(); ++i)
+        target_kdtree.kClosestPairs<MetricL2>(query_points[i], single_nbrs[i], -1, false, target_filter);
+    timer.tock();
+    double single_time = timer.elapsedTime();
+
+    double max_min = -1;
+    KDTree::NeighborPair closest(-1);
+    for (size_t i = 0; i < query_points.size(); ++i)
+    {
+      if (all_nbrs[i].size() != K || single_nbrs[i].size() != K)
+        throw Error(format("Dual-tree query found %d neighbors instead of %d", all_nbrs[i].size(), K));
+
+      for (int j = 0; j < K; ++j)
+      {
+        if (all_nbrs[i][j].getQueryIndex() != (intx)i
+         || std::abs(all_nbrs[i][j].getMonotoneApproxDistance() - single_nbrs[i][j].getMonotoneApproxDistance()) > 1.0e-6)
+          throw Error(format("Dual-tree query returned the wrong %d'th neighbor of point %ld", j, (long)i));
+      }
+
+      double nn_mad = single_nbrs[i][0].getMonotoneApproxDistance();
+      max_min = std::max(max_min, nn_mad);
+      if (!closest.isValid() || nn_mad < closest.getMonotoneApproxDistance())
+        closest = KDTree::NeighborPair((intx)i, single_nbrs[i][0].getTargetIndex(), nn_mad);
+    }
+
+    // Closest pair and Hausdorff distance, checked against the results of the independent queries
+    KDTree::NeighborPair dual_closest = query_kdtree.dualTreeClosestPair<MetricL2>(target_kdtree, -1, false, nullptr,
+                                                                                    target_filter);
+    if (std::abs(dual_closest.getMonotoneApproxDistance() - closest.getMonotoneApproxDistance()) > 1.0e-6
+     || (query_points[(size_t)dual_closest.getQueryIndex()]
+       - target_points[(size_t)dual_closest.getTargetIndex()]).squaredNorm() > closest.getMonotoneApproxDistance() + 1.0e-6)
+      throw Error("Dual-tree query returned the wrong closest pair");
+
+    double hausdorff = query_kdtree.hausdorffDistance<MetricL2>(target_kdtree, nullptr, target_filter);
+    if (std::abs(hausdorff - std::sqrt(max_min)) > 1.0e-5)
+      throw Error(format("Dual-tree query returned Hausdorff distance %lf instead of %lf", hausdorff, std::sqrt(max_min)));
+
+    cout << "Dual-tree queries (filtered = " << filtered << ") correct: all-" << K << "NN in " << 1000 * dual_time
+         << "ms vs " << 1000 * single_time << "ms for independent queries, Hausdorff distance " << hausdorff << endl;
+  }
+}
+
+void
+testApproxQueries()
+{
+  cout << "==========================================\n"
+       << "Testing approximate kd-tree queries (32-D)\n"
+       << "==========================================" << endl;
+
+  static int const D = 32;
+  static int const NUM_POINTS = 20000;
+  static int const NUM_QUERIES = 200;
+  static int const K = 5;
+
+  typedef Vector<D, Real> VectorD;
+  typedef KDTreeN<VectorD, D> KDTree;
+  typedef BoundedSortedArrayN<K, KDTree::NeighborPair> NeighborSet;
+
+  // Clustered data, as for descriptors
+  Array<VectorD> centers, points, queries;
+  for (int i = 0; i < 50; ++i)
+    centers.push_back(VectorD::Random());
+  for (int i = 0; i < NUM_POINTS + NUM_QUERIES; ++i)
+  {
+    VectorD p = centers[(size_t)(rand() % (int)centers.size())] + 0.3f * VectorD::Random();
+    (i < NUM_POINTS ? points : queries).push_back(p);
+  }
+
+  KDTree kdtree(points.begin(), points.end());
+
+  double const EPSILON = 0.5;
+  intx const MAX_LEAVES = 32;
+  KDTree::ApproxQueryOptions const options[3] = { KDTree::ApproxQueryOptions(),
+                                                  KDTree::ApproxQueryOptions().setEpsilon(EPSILON),
+                                                  KDTree::ApproxQueryOptions().setMaxLeaves(MAX_LEAVES) };
+  char const * names[3] = { "exact", "epsilon = 0.5", "max leaves = 32" };
+
+  for (int o = 0; o < 3; ++o)
+  {
+    double sum_leaves = 0, sum_elems = 0, sum_recall = 0;
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      NeighborSet exact, approx;
+      kdtree.kClosestPairs<MetricL2>(queries[i], exact);
+
+      KDTree::QueryStats stats;
+      kdtree.approxKClosestPairs<MetricL2>(queries[i], approx, options[o], -1, false, &stats);
+      if (approx.size() != K)
+        throw Error(format("Approximate query (%s) returned %d neighbors instead of %d", names[o], approx.size(), K));
+
+      for (int j = 0; j < K; ++j)
+      {
+        double exact_dist = std::sqrt(exact[j].getMonotoneApproxDistance());
+        double approx_dist = std::sqrt(approx[j].getMonotoneApproxDistance());
+
+        if (o == 0 && std::abs(approx_dist - exact_dist) > 1.0e-5)
+          throw Error(format("Approximate query with default options returned the wrong %d'th neighbor", j));
+
+        if (o == 1 && approx_dist > (1 + EPSILON) * exact_dist + 1.0e-5)
+          throw Error(format("Approximate query (%s) returned a %d'th neighbor that is too far", names[o], j));
+
+        for (int m = 0; m < K; ++m)
+          if (approx[j].getTargetIndex() == exact[m].getTargetIndex())
+          {
+            sum_recall += 1.0 / (K * NUM_QUERIES);
+            break;
+          }
+      }
+
+      if (o == 2 && stats.num_leaves_visited > MAX_LEAVES)
+        throw Error(format("Approximate query (%s) visited %ld leaves", names[o], (long)stats.num_leaves_visited));
+
+      sum_leaves += stats.num_leaves_visited;
+      sum_elems += stats.num_elems_tested;
+    }
+
+    cout << "Approximate queries (" << names[o] << "): average " << sum_leaves / NUM_QUERIES << " leaves and "
+         << sum_elems / NUM_QUERIES << " elements visited, recall " << sum_recall << endl;
+  }
+
+  // Approximate closest element agrees with the approximate set of neighbors
+  double dist = -1;
+  intx nn = kdtree.approxClosestElement<MetricL2>(queries[0], options[2], -1, &dist);
+  NeighborSet approx;
+  kdtree.approxKClosestPairs<MetricL2>(queries[0], approx, options[2]);
+  if (nn < 0 || std::abs(dist - std::sqrt(approx[0].getMonotoneApproxDistance())) > 1.0e-5)
+    throw Error("Approximate closest element does not match approximate neighbors");
+}
+
+// Reference triangle-box intersection test: clip the triangle against the slabs of the box and check if anything remains.
+bool
+triangleIntersectsBoxByClipping(Array<Vector3> poly, AxisAlignedBox3 const & box)
+{
+  for (int axis = 0; axis < 3 && !poly.empty(); ++axis)
+    for (int side = 0; side < 2 && !poly.empty(); ++side)
+    {
+      // Keep the part of the polygon with sign * (p[axis] - bound) <= 0
+      Real bound = (side == 0 ? box.getHigh()[axis] : box.getLow()[axis]);
+      Real sign = (side == 0 ? 1 : -1);
+
+      Array<Vector3> clipped;
+      for (size_t i = 0; i < poly.size(); ++i)
+      {
+        Vector3 const & a = poly[i];
+        Vector3 const & b = poly[(i + 1) % poly.size()];
+        Real da = sign * (a[axis] - bound), db = sign * (b[axis] - bound);
+
+        if (da <= 0) clipped.push_back(a);
+        if ((da < 0 && db > 0) || (da > 0 && db < 0))
+          clipped.push_back(a + (da / (da - db)) * (b - a));
+      }
+
+      poly.swap(clipped);
+    }
+
+  return !poly.empty();
+}
+
+void
+testTriangleRangeQueries()
+{
+  cout << "=======================================\n"
+       << "Testing range queries on triangle trees\n"
+       << "=======================================" << endl;
+
+  static int const NUM_TRIANGLES = 5000;
+  static int const NUM_QUERIES = 200;
+
+  typedef Triangle3<TriangleLocalVertexTriple3> Triangle;
+  typedef KDTreeN<Triangle, 3> KDTree;
+
+  Array<Triangle> triangles;
+  for (int i = 0; i < NUM_TRIANGLES; ++i)
+  {
+    Vector3 c(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+    triangles.push_back(Triangle(TriangleLocalVertexTriple3(c + 0.05f * Vector3::Random(), c + 0.05f * Vector3::Random(),
+                                                            c + 0.05f * Vector3::Random())));
+  }
+
+  KDTree kdtree(triangles.begin(), triangles.end());
+
+  intx num_ball_hits = 0, num_aab_hits = 0, num_box_hits = 0;
+  for (int q = 0; q < NUM_QUERIES; ++q)
+  {
+    Vector3 c(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+    Ball3 ball(c, 0.05f);
+    AxisAlignedBox3 aab(c - 0.04f * Vector3(1, 2, 1), c + 0.04f * Vector3(2, 1, 1));
+    Box3 box(AxisAlignedBox3(-0.03f * Vector3(1, 2, 3), 0.03f * Vector3(1, 2, 3)),
+             CoordinateFrame3(RigidTransform3::translation(c) * RigidTransform3::rotationAxisAngle(Vector3(1, 1, 0).normalized(), 0.7f)));
+
+    Array<intx> ball_result, aab_result, box_result;
+    kdtree.rangeQueryIndices<IntersectionTester>(ball, ball_result);
+    kdtree.rangeQueryIndices<IntersectionTester>(aab, aab_result);
+    kdtree.rangeQueryIndices<IntersectionTester>(box, box_result);
+
+    std::sort(ball_result.begin(), ball_result.end());
+    std::sort(aab_result.begin(), aab_result.end());
+    std::sort(box_result.begin(), box_result.end());
+
+    // Brute-force reference results. The box references clip the triangle in the local frame of the box.
+    Array<intx> ball_expected, aab_expected, box_expected;
+    for (size_t i = 0; i < triangles.size(); ++i)
+    {
+      Triangle const & tri = triangles[i];
+      if (tri.squaredDistance(c) <= 0.05f * 0.05f)
+        ball_expected.push_back((intx)i);
+
+      Array<Vector3> verts(3), local_verts(3);
+      for (int j = 0; j < 3; ++j)
+      {
+        verts[(size_t)j] = tri.getVertex(j);
+        local_verts[(size_t)j] = box.getLocalFrame().pointToObjectSpace(tri.getVertex(j));
+      }
+
+      if (triangleIntersectsBoxByClipping(verts, aab))
+        aab_expected.push_back((intx)i);
+
+      if (triangleIntersectsBoxByClipping(local_verts, box.getLocalAAB()))
+        box_expected.push_back((intx)i);
+    }
+
+    if (ball_result != ball_expected)
+      throw Error(format("Ball query on triangle kd-tree returned %ld triangles instead of %ld", (long)ball_result.size(),
+                         (long)ball_expected.size()));
+
+    if (aab_result != aab_expected)
+      throw Error(format("Axis-aligned box query on triangle kd-tree returned %ld triangles instead of %ld",
+                         (long)aab_result.size(), (long)aab_expected.size()));
+
+    if (box_result != box_expected)
+      throw Error(format("Oriented box query on triangle kd-tree returned %ld triangles instead of %ld",
+                         (long)box_result.size(), (long)box_expected.size()));
+
+    num_ball_hits += (intx)ball_result.size();
+    num_aab_hits += (intx)aab_result.size();
+    num_box_hits += (intx)box_result.size();
+  }
+
+  cout << "Range queries on triangle kd-tree match brute force (" << num_ball_hits << " ball, " << num_aab_hits
+       << " axis-aligned box and " << num_box_hits << " oriented box hits)" << endl;
+}
+
+void
+testMortonKDTree()
+{
+  cout << "==================================\n"
+       << "Testing Morton-order kd-tree build\n"
+       << "==================================" << endl;
+
+  // Clustered points, so that the Morton splits are unbalanced
+  static int const NUM_POINTS = 200000;
+  Array<Vector3> points((size_t)NUM_POINTS);
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    Real s = (i % 4 == 0 ? 1 : 0.05f);
+    points[i] = s * Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+  }
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  Stopwatch timer;
+
+  KDTree median_kdtree;
+  median_kdtree.setMaxBuildThreads(4);
+  timer.tick();
+  median_kdtree.init(points.begin(), points.end());
+  timer.tock();
+  cout << "Median build: " << 1000 * timer.elapsedTime() << "ms, " << median_kdtree.numNodes() << " nodes" << endl;
+
+  static int const NUM_QUERIES = 1000;
+  Array<Vector3> queries((size_t)NUM_QUERIES);
+  for (size_t i = 0; i < queries.size(); ++i)
+    queries[i] = Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+  for (int save_memory = 0; save_memory < 2; ++save_memory)
+  {
+    KDTree serial_kdtree;
+    serial_kdtree.setSplitPolicy(KDTree::SplitPolicy::MORTON);
+    serial_kdtree.setMaxBuildThreads(1);
+    timer.tick();
+    serial_kdtree.init(points.begin(), points.end(), -1, -1, (bool)save_memory);
+    timer.tock();
+    double serial_time = timer.elapsedTime();
+
+    KDTree parallel_kdtree;
+    parallel_kdtree.setSplitPolicy(KDTree::SplitPolicy::MORTON);
+    parallel_kdtree.setMaxBuildThreads(4);
+    timer.tick();
+    parallel_kdtree.init(points.begin(), points.end(), -1, -1, (bool)save_memory);
+    timer.tock();
+    double parallel_time = timer.elapsedTime();
+
+    if (parallel_kdtree.numNodes() != serial_kdtree.numNodes()
+     || !sameSubtree(parallel_kdtree.getRoot(), serial_kdtree.getRoot()))
+      throw Error(format("Parallel and serial Morton kd-trees differ (save_memory = %d)", save_memory));
+
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      Real query_radius = (i % 2 == 0 ? 0.01f : 0.05f);
+      intx nn = parallel_kdtree.closestElement<MetricL2>(queries[i]);
+      intx expected_nn = median_kdtree.closestElement<MetricL2>(queries[i]);
+      if (nn < 0 || (points[(size_t)nn] - queries[i]).squaredNorm() != (points[(size_t)expected_nn] - queries[i]).squaredNorm())
+        throw Error(format("Morton kd-tree returned the wrong nearest neighbor for query %ld", (long)i));
+
+      Ball3 ball(queries[i], query_radius);
+      Array<intx> in_range, expected_in_range;
+      parallel_kdtree.rangeQueryIndices<IntersectionTester>(ball, in_range);
+      median_kdtree.rangeQueryIndices<IntersectionTester>(ball, expected_in_range);
+      std::sort(in_range.begin(), in_range.end());
+      std::sort(expected_in_range.begin(), expected_in_range.end());
+      if (in_range != expected_in_range)
+        throw Error(format("Morton kd-tree returned the wrong elements in range for query %ld", (long)i));
+    }
+
+    cout << "Morton build (save_memory = " << save_memory << "): " << 1000 * serial_time << "ms serial, "
+         << 1000 * parallel_time << "ms parallel, " << parallel_kdtree.numNodes() << " nodes, matches median kd-tree" << endl;
+  }
+}
+
+void
+testOutOfCoreKDTree()
+{
+  cout << "===========================\n"
+       << "Testing out-of-core kd-tree\n"
+       << "===========================" << endl;
+
+  static int const NUM_POINTS = 100000;
+  static int const NUM_QUERIES = 500;
+  static int const K = 8;
+  string path = "TestKDTree3_ooc.kdtree";
+
+  Array<Vector3> points, queries;
+  for (int i = 0; i < NUM_POINTS; ++i)
+  {
+    Real s = (i % 4 == 0 ? 1 : 0.1f);
+    points.push_back(s * Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+  }
+  for (int i = 0; i < NUM_QUERIES; ++i)
+    queries.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  KDTree kdtree(points.begin(), points.end());
+
+  typedef OutOfCoreKDTreeN<Vector3, 3> OutOfCoreKDTree;
+  static int64 const CACHE_BUDGET = 64 * 1024;
+
+  // The first build holds all points in memory. The second has a tiny memory budget, so the points are spilled to disk and
+  // split among temporary files over several passes.
+  OutOfCoreKDTree::BuildOptions options[2];
+  options[0].setBucketBytes(4096);
+  options[1].setBucketBytes(4096).setMemoryBudget(64 * 1024).setMaxPartitions(4).setMaxSamples(2000);
+
+  for (int b = 0; b < 2; ++b)
+  {
+    if (!OutOfCoreKDTree::build(points.begin(), points.end(), path, options[b]))
+      throw Error("Could not build out-of-core kd-tree");
+
+    OutOfCoreKDTree ooc_kdtree;
+    if (!ooc_kdtree.open(path, CACHE_BUDGET))
+      throw Error("Could not open out-of-core kd-tree");
+
+    if (ooc_kdtree.numElements() != NUM_POINTS)
+      throw Error("Out-of-core kd-tree has the wrong number of elements");
+
+    // The stored elements should be a permutation of the input
+    Array<int> seen((size_t)NUM_POINTS, 0);
+    for (intx i = 0; i < ooc_kdtree.numElements(); ++i)
+    {
+      intx src = ooc_kdtree.getSourceIndex(i);
+      if (src < 0 || src >= NUM_POINTS || seen[(size_t)src]++ || ooc_kdtree.getElement(i) != points[(size_t)src])
+        throw Error("Out-of-core kd-tree does not store a permutation of the input");
+    }
+
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+      intx nn = ooc_kdtree.closestElement<MetricL2>(queries[i]);
+      intx expected_nn = kdtree.closestElement<MetricL2>(queries[i]);
+      if (nn < 0 || (ooc_kdtree.getElement(nn) - queries[i]).squaredNorm() != (points[(size_t)expected_nn] - queries[i]).squaredNorm())
+        throw Error(format("Out-of-core kd-tree returned the wrong nearest neighbor for query %ld", (long)i));
+
+      BoundedSortedArrayN<K, OutOfCoreKDTree::NeighborPair> nbrs;
+      BoundedSortedArrayN<K, KDTree::NeighborPair> expected_nbrs;
+      ooc_kdtree.kClosestPairs<MetricL2>(queries[i], nbrs);
+      kdtree.kClosestPairs<MetricL2>(queries[i], expected_nbrs);
+      if (nbrs.size() != expected_nbrs.size())
+        throw Error("Out-of-core kd-tree returned the wrong number of nearest neighbors");
+
+      for (int j = 0; j < nbrs.size(); ++j)
+        if (std::abs(nbrs[j].getMonotoneApproxDistance() - expected_nbrs[j].getMonotoneApproxDistance()) > 1.0e-10)
+          throw Error(format("Out-of-core kd-tree returned the wrong %ld'th nearest neighbor", (long)j));
+
+      Ball3 ball(queries[i], 0.05f);
+      Array<intx> in_range, expected_in_range;
+      ooc_kdtree.rangeQueryIndices<IntersectionTester>(ball, in_range);
+      kdtree.rangeQueryIndices<IntersectionTester>(ball, expected_in_range);
+      for (size_t j = 0; j < in_range.size(); ++j)
+        in_range[j] = ooc_kdtree.getSourceIndex(in_range[j]);
+
+      std::sort(in_range.begin(), in_range.end());
+      std::sort(expected_in_range.begin(), expected_in_range.end());
+      if (in_range != expected_in_range)
+        throw Error(format("Out-of-core kd-tree returned the wrong elements in range for query %ld", (long)i));
+
+      if (ooc_kdtree.getResidentBytes() > CACHE_BUDGET)
+        throw Error("Out-of-core kd-tree exceeded its cache budget");
+    }
+
+    cout << "Out-of-core kd-tree (memory budget " << options[b].getMemoryBudget() << " bytes) with " << ooc_kdtree.numBuckets()
+         << " buckets matches in-memory kd-tree, " << ooc_kdtree.numBucketLoads() << " bucket loads" << endl;
+  }
+
+  // A file with a node that references a missing child, bucket or elements, or a leaf that does not match its bucket, must be
+  // rejected
+  {
+    OutOfCoreKDTree ooc_kdtree;
+    if (!ooc_kdtree.open(path))
+      throw Error("Could not open out-of-core kd-tree");
+
+    OutOfCoreKDTree::Node const * nodes = ooc_kdtree.getNodes();
+    intx leaf = 0;
+    while (!nodes[leaf].isLeaf()) ++leaf;
+
+    // The first leaf is not the last one, so the tampered count and first element still lie within the elements of the tree,
+    // and only the check against the bucket fails
+    OutOfCoreKDTree::Node bad_nodes[5] = { nodes[0], nodes[leaf], nodes[leaf], nodes[leaf], nodes[leaf] };
+    bad_nodes[0].hi = (uint32)ooc_kdtree.numNodes();
+    bad_nodes[1].bucket = (uint32)ooc_kdtree.numBuckets();
+    bad_nodes[2].first_elem = (uint64)(ooc_kdtree.numElements() - (intx)nodes[leaf].num_elems + 1);
+    bad_nodes[3].num_elems++;
+    bad_nodes[4].first_elem++;
+
+    string bad_path = "TestKDTree3_ooc_bad.kdtree";
+    for (int i = 0; i < 5; ++i)
+    {
+      if (!copyAndPatchFile(path, bad_path, (i == 0 ? &nodes[0] : &nodes[leaf]), &bad_nodes[i], sizeof(bad_nodes[i])))
+        throw Error("Could not find node in out-of-core kd-tree file");
+
+      OutOfCoreKDTree bad_kdtree;
+      if (bad_kdtree.open(bad_path))
+        throw Error(format("Out-of-core kd-tree with invalid node %d was opened", i));
+    }
+
+    FileSystem::remove(bad_path);
+    cout << "Out-of-core kd-trees with invalid nodes are rejected" << endl;
+  }
+
+  FileSystem::remove(path);
+}
+
+void
+testAggregateQueries()
+{
+  cout << "===========================================\n"
+       << "Testing aggregate range queries on kd-trees\n"
+       << "===========================================" << endl;
+
+  static int const NUM_POINTS = 200000;
+  static int const NUM_QUERIES = 200;
+
+  Array<Vector3> points;
+  for (int i = 0; i < NUM_POINTS; ++i)
+    points.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  typedef KDTreeN<Vector3, 3> PlainKDTree;
+  typedef KDTreeN< Vector3, 3, Real, KDTreeAggregateN<3> > AggregateKDTree;
+  PlainKDTree plain_kdtree(points.begin(), points.end());
+
+  Stopwatch timer;
+  for (int save_memory = 0; save_memory < 2; ++save_memory)
+  {
+    AggregateKDTree kdtree(points.begin(), points.end(), -1, -1, (bool)save_memory);
+
+    // Move the points after building, to check that refitting updates the aggregates
+    if (save_memory)
+    {
+      for (size_t i = 0; i < points.size(); ++i)
+        points[i] = Vector3(points[i][1], points[i][2], points[i][0]);
+
+      for (intx i = 0; i < kdtree.numElements(); ++i)
+        const_cast<Vector3 &>(kdtree.getElements()[i]) = points[(size_t)i];
+
+      kdtree.refit();
+      plain_kdtree.init(points.begin(), points.end());
+    }
+
+    double aggregate_time = 0, plain_time = 0;
+    for (int q = 0; q < NUM_QUERIES; ++q)
+    {
+      Vector3 center(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+      Real radius = (q % 2 == 0 ? 0.05f : 0.4f);
+      Ball3 ball(center, radius);
+
+      // Brute-force statistics
+      intx expected_count = 0;
+      Vector<3, double> expected_sum = Vector<3, double>::Zero();
+      for (size_t i = 0; i < points.size(); ++i)
+        if ((points[i] - center).squaredNorm() <= radius * radius)
+        {
+          expected_count++;
+          expected_sum += points[i].cast<double>();
+        }
+
+      timer.tick();
+      AggregateKDTree::Aggregate agg = kdtree.rangeAggregate<IntersectionTester>(ball);
+      timer.tock();
+      aggregate_time += timer.elapsedTime();
+
+      timer.tick();
+      PlainKDTree::Aggregate plain_agg = plain_kdtree.rangeAggregate<IntersectionTester>(ball);
+      timer.tock();
+      plain_time += timer.elapsedTime();
+
+      // Points exactly on the boundary of the ball may be classified differently, so allow a tiny discrepancy
+      if (std::abs(agg.numElements() - expected_count) > 1 || plain_agg.numElements() != agg.numElements())
+        throw Error(format("Aggregate range query %d counted %ld points (%ld without node aggregates), expected %ld", q,
+                           (long)agg.numElements(), (long)plain_agg.numElements(), (long)expected_count));
+
+      if ((agg.getSum() - expected_sum).norm() > 1.0e-3 * (1 + expected_sum.norm())
+       || (plain_agg.getSum() - agg.getSum()).norm() > 1.0e-6 * (1 + expected_sum.norm()))
+        throw Error(format("Aggregate range query %d returned the wrong sum", q));
+
+      if (kdtree.rangeCount<IntersectionTester>(ball) != agg.numElements()
+       || (kdtree.rangeCentroid<IntersectionTester>(ball) - agg.getCentroid()).squaredNorm() > 0)
+        throw Error(format("Aggregate range query %d: count or centroid inconsistent with aggregate", q));
+
+      // Filters disable the use of node aggregates
+      UpperHalfFilter filter;
+      Array<intx> filtered_in_range;
+      kdtree.rangeQueryIndices<IntersectionTester>(ball, filtered_in_range, true, &filter);
+      if (kdtree.rangeCount<IntersectionTester>(ball, &filter) != (intx)filtered_in_range.size())
+        throw Error(format("Filtered aggregate range query %d returned the wrong count", q));
+    }
+
+    cout << "Aggregate range queries (save_memory = " << save_memory << ") are correct: " << 1000 * aggregate_time
+         << "ms with node aggregates vs " << 1000 * plain_time << "ms without" << endl;
+  }
+}
+
+// Check that a hash grid returns the same results as a kd-tree on the same points.
+template <typename GridT>
+void
+checkHashGrid(string const & name, GridT const & grid, KDTreeN<Vector3, 3> const & kdtree, Array<Vector3> const & queries)
+{
+  typedef BoundedSortedArrayN<8, KDTreeN<Vector3, 3>::NeighborPair> NeighborSet;
+
+  UpperHalfFilter filter;
+  for (size_t q = 0; q < queries.size(); ++q)
+  {
+    Vector3 const & query = queries[q];
+
+    for (int use_filter = 0; use_filter < 2; ++use_filter)
+    {
+      Filter<Vector3> const * f = (use_filter ? &filter : nullptr);
+
+      double grid_dist = -1, kdtree_dist = -1;
+      intx grid_nn = grid.template closestElement<MetricL2>(query, -1, &grid_dist, nullptr, f);
+      intx kdtree_nn = kdtree.closestElement<MetricL2>(query, -1, &kdtree_dist, nullptr, f);
+      if ((grid_nn < 0) != (kdtree_nn < 0) || std::abs(grid_dist - kdtree_dist) > 1.0e-6)
+        throw Error(format("%s: Nearest neighbor of query %d is at distance %lf, expected %lf", name.c_str(), (int)q, grid_dist,
+                           kdtree_dist));
+
+      // Distance-bounded query
+      double bound = 0.01;
+      grid_nn = grid.template closestElement<MetricL2>(query, bound, nullptr, nullptr, f);
+      kdtree_nn = kdtree.closestElement<MetricL2>(query, bound, nullptr, nullptr, f);
+      if ((grid_nn < 0) != (kdtree_nn < 0))
+        throw Error(format("%s: Bounded nearest neighbor query %d disagrees with kd-tree", name.c_str(), (int)q));
+
+      NeighborSet grid_nbrs, kdtree_nbrs;
+      grid.template kClosestPairs<MetricL2>(query, grid_nbrs, -1, false, f);
+      kdtree.kClosestPairs<MetricL2>(query, kdtree_nbrs, -1, false, f);
+      if (grid_nbrs.size() != kdtree_nbrs.size())
+        throw Error(format("%s: Query %d found %d neighbors, expected %d", name.c_str(), (int)q, (int)grid_nbrs.size(),
+                           (int)kdtree_nbrs.size()));
+
+      for (int i = 0; i < grid_nbrs.size(); ++i)
+        if (std::abs(grid_nbrs[i].getDistance<MetricL2>() - kdtree_nbrs[i].getDistance<MetricL2>()) > 1.0e-6)
+          throw Error(format("%s: Neighbor %d of query %d has the wrong distance", name.c_str(), i, (int)q));
+
+      // A small range, and one large enough that the grid tests every element
+      for (int r = 0; r < 2; ++r)
+      {
+        Ball3 ball(query, (r == 0 ? 0.03f : 0.8f));
+        Array<intx> grid_in_range, kdtree_in_range;
+        grid.template rangeQueryIndices<IntersectionTester>(ball, grid_in_range, true, f);
+        kdtree.rangeQueryIndices<IntersectionTester>(ball, kdtree_in_range, true, f);
+
+        std::sort(grid_in_range.begin(), grid_in_range.end());
+        std::sort(kdtree_in_range.begin(), kdtree_in_range.end());
+        if (grid_in_range != kdtree_in_range)
+          throw Error(format("%s: Range query %d returned %d points, expected %d", name.c_str(), (int)q,
+                             (int)grid_in_range.size(), (int)kdtree_in_range.size()));
+      }
+    }
+  }
+}
+
+void
+testHashGrid()
+{
+  cout << "==================\n"
+       << "Testing hash grids\n"
+       << "==================" << endl;
+
+  static int const NUM_POINTS = 100000;
+  static int const NUM_QUERIES = 300;
+  static Real const RANGE_RADIUS = 0.01f;
+
+  typedef HashGridN<Vector3, 3> HashGrid;
+
+  Array<Vector3> queries;
+  for (int i = 0; i < NUM_QUERIES; ++i)  // some queries lie outside the bounds of the points
+    queries.push_back(Vector3(2 * rand() / (Real)RAND_MAX - 0.5f, 2 * rand() / (Real)RAND_MAX - 0.5f,
+                              2 * rand() / (Real)RAND_MAX - 0.5f));
+
+  for (int surface = 0; surface < 2; ++surface)
+  {
+    // Points in a cube, or on a sphere
+    Array<Vector3> points;
+    for (int i = 0; i < NUM_POINTS; ++i)
+    {
+      Vector3 p(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+      if (surface)
+      {
+        p -= Vector3::Constant(0.5f);
+        p = Vector3::Constant(0.5f) + 0.4f * p / std::max(p.norm(), (Real)1.0e-6f);
+      }
+
+      points.push_back(p);
+    }
+
+    string dataset = (surface ? "sphere" : "cube");
+    KDTreeN<Vector3, 3> kdtree(points.begin(), points.end());
+
+    HashGrid grid(points.begin(), points.end());
+    if (grid.numElements() != NUM_POINTS)
+      throw Error(dataset + ": Hash grid has the wrong number of elements");
+
+    checkHashGrid(dataset + " (auto cell size)", grid, kdtree, queries);
+    cout << "Hash grid on " << dataset << " with automatic cell size " << grid.getCellSize() << " is correct" << endl;
+
+    HashGrid fixed_grid(points.begin(), points.end(), 2 * RANGE_RADIUS);
+    checkHashGrid(dataset + " (fixed cell size)", fixed_grid, kdtree, queries);
+
+    HashGrid parallel_grid;
+    parallel_grid.setMaxBuildThreads(4);
+    parallel_grid.init(points.begin(), points.end());
+    if (parallel_grid.getCellSize() != grid.getCellSize())
+      throw Error(dataset + ": Parallel and serial builds chose different cell sizes");
+
+    checkHashGrid(dataset + " (parallel)", parallel_grid, kdtree, queries);
+
+    // Compare the speed of fixed-radius queries centered at the points
+    Stopwatch timer;
+    Array<intx> in_range;
+    double grid_time = 0, kdtree_time = 0;
+    size_t grid_count = 0, kdtree_count = 0;
+
+    timer.tick();
+      for (int i = 0; i < NUM_POINTS; i += 10)
+      {
+        fixed_grid.rangeQueryIndices<IntersectionTester>(Ball3(points[(size_t)i], RANGE_RADIUS), in_range);
+        grid_count += in_range.size();
+      }
+    timer.tock();
+    grid_time = timer.elapsedTime();
+
+    timer.tick();
+      for (int i = 0; i < NUM_POINTS; i += 10)
+      {
+        kdtree.rangeQueryIndices<IntersectionTester>(Ball3(points[(size_t)i], RANGE_RADIUS), in_range);
+        kdtree_count += in_range.size();
+      }
+    timer.tock();
+    kdtree_time = timer.elapsedTime();
+
+    if (grid_count != kdtree_count)
+      throw Error(dataset + ": Hash grid and kd-tree returned different numbers of points in fixed-radius queries");
+
+    cout << "Fixed-radius queries on " << dataset << ": " << 1000 * grid_time << "ms with hash grid vs " << 1000 * kdtree_time
+         << "ms with kd-tree" << endl;
+  }
+
+  // Queries on an empty grid find nothing
+  HashGrid empty_grid;
+  Array<intx> in_range;
+  empty_grid.rangeQueryIndices<IntersectionTester>(Ball3(Vector3::Zero(), 1), in_range);
+  if (empty_grid.closestElement<MetricL2>(Vector3::Zero()) >= 0 || !in_range.empty())
+    throw Error("Queries on an empty hash grid returned results");
+}
+
+// Generate small random triangles in the unit cube
+Array<LocalTriangle3>
+randomSmallTriangles(int num_triangles, Real size)
+{
+  Array<LocalTriangle3> tris;
+  for (int i = 0; i < num_triangles; ++i)
+  {
+    Vector3 base(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+    Vector3 v[3];
+    for (int j = 0; j < 3; ++j)
+      v[j] = base + size * Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+
+    tris.push_back(LocalTriangle3(v[0], v[1], v[2]));
+  }
+
+  return tris;
+}
+
+// Apply a transform to triangles
+Array<LocalTriangle3>
+transformTriangles(Array<LocalTriangle3> const & tris, AffineTransform3 const & tr)
+{
+  Array<LocalTriangle3> result;
+  for (size_t i = 0; i < tris.size(); ++i)
+    result.push_back(LocalTriangle3(tr * tris[i].getVertex(0), tr * tris[i].getVertex(1), tr * tris[i].getVertex(2)));
+
+  return result;
+}
+
+void
+testTreeCollision()
+{
+  cout << "===================================\n"
+       << "Testing kd-tree vs kd-tree collision\n"
+       << "===================================" << endl;
+
+  static int const NUM_TRIANGLES = 1500;
+
+  typedef KDTreeN<LocalTriangle3, 3> KDTree;
+  Array<LocalTriangle3> tris0 = randomSmallTriangles(NUM_TRIANGLES, 0.2f);
+  Array<LocalTriangle3> tris1 = randomSmallTriangles(NUM_TRIANGLES, 0.2f);
+
+  KDTree kdtree0(tris0.begin(), tris0.end());
+  KDTree kdtree1(tris1.begin(), tris1.end());
+
+  // Rotate each set of triangles around the center of the unit cube, and translate it
+  AffineTransform3 to_center = AffineTransform3::translation(-0.5f, -0.5f, -0.5f);
+  AffineTransform3 tr0 = AffineTransform3::translation(0.6f, 0.4f, 0.5f)
+                       * AffineTransform3::rotationAxisAngle(Vector3(1, 2, 3), 0.7f) * to_center;
+  for (int separated = 0; separated < 2; ++separated)
+  {
+    AffineTransform3 tr1 = AffineTransform3::translation(separated ? 2.5f : 0.5f, 0.5f, 0.4f)
+                         * AffineTransform3::rotationAxisAngle(Vector3(-2, 1, 1), 1.3f) * to_center;
+    kdtree0.setTransform(tr0);
+    kdtree1.setTransform(tr1);
+
+    // Brute-force intersecting pairs and closest pair of the transformed triangles
+    Array<LocalTriangle3> world0 = transformTriangles(tris0, tr0), world1 = transformTriangles(tris1, tr1);
+    Array< std::pair<intx, intx> > bf_pairs;
+    double bf_min_sqdist = -1;
+    Stopwatch timer;
+    timer.tick();
+      for (size_t i = 0; i < world0.size(); ++i)
+        for (size_t j = 0; j < world1.size(); ++j)
+        {
+          if (world0[i].intersects(world1[j]))
+            bf_pairs.push_back(std::make_pair((intx)i, (intx)j));
+
+          double sqdist = world0[i].squaredDistance(world1[j]);
+          if (bf_min_sqdist < 0 || sqdist < bf_min_sqdist)
+            bf_min_sqdist = sqdist;
+        }
+    timer.tock();
+    double bf_time = timer.elapsedTime();
+
+    timer.tick();
+      Array< std::pair<intx, intx> > pairs;
+      kdtree0.intersectingPairs<IntersectionTester>(kdtree1, pairs);
+    timer.tock();
+    double tree_time = timer.elapsedTime();
+
+    std::sort(pairs.begin(), pairs.end());
+    if (pairs != bf_pairs)
+      throw Error(format("Tree-tree query found %ld intersecting pairs instead of %ld", (long)pairs.size(),
+                         (long)bf_pairs.size()));
+
+    if (kdtree0.intersects<IntersectionTester>(kdtree1) != !bf_pairs.empty())
+      throw Error("Tree-tree intersection test returned the wrong result");
+
+    if (!bf_pairs.empty()
+     && (kdtree0.intersectingPairs<IntersectionTester>(kdtree1, pairs, 1) != 1
+      || !std::binary_search(bf_pairs.begin(), bf_pairs.end(), pairs[0])))
+      throw Error("Tree-tree query did not stop after the requested number of pairs");
+
+    // Minimum separation, and early-out distance checks on either side of it
+    double min_dist = std::sqrt(bf_min_sqdist);
+    KDTree::NeighborPair closest = kdtree0.dualTreeClosestPair<MetricL2>(kdtree1);
+    if (std::abs(closest.getDistance<MetricL2>() - min_dist) > 1.0e-5)
+      throw Error(format("Tree-tree query returned minimum separation %lf instead of %lf", closest.getDistance<MetricL2>(),
+                         min_dist));
+
+    KDTree::NeighborPair witness(-1);
+    if (!kdtree0.withinDistance<MetricL2>(kdtree1, min_dist + 0.01, &witness)
+     || witness.getDistance<MetricL2>() > min_dist + 0.01 + 1.0e-5
+     || std::abs((world0[(size_t)witness.getQueryIndex()].squaredDistance(world1[(size_t)witness.getTargetIndex()])
+                - witness.getMonotoneApproxDistance())) > 1.0e-5)
+      throw Error("Tree-tree query did not find a pair within the minimum separation distance");
+
+    if (min_dist > 1.0e-3 && kdtree0.withinDistance<MetricL2>(kdtree1, 0.9 * min_dist))
+      throw Error("Tree-tree query found a pair closer than the minimum separation distance");
+
+    cout << "Tree-tree queries (separated = " << separated << ") correct: " << bf_pairs.size()
+         << " intersecting pairs in " << 1000 * tree_time << "ms vs " << 1000 * bf_time << "ms for brute force, minimum"
+         << " separation " << min_dist << endl;
+  }
+
+  kdtree0.clearTransform();
+  kdtree1.clearTransform();
+}
+
+void
+testLargeKQueries()
+{
+  cout << "===================================\n"
+       << "Testing large-k queries on kd-trees\n"
+       << "===================================" << endl;
+
+  static int const NUM_POINTS = 100000;
+  static int const NUM_QUERIES = 200;
+  static int const K = 1000;
+
+  Array<Vector3> points;
+  for (int i = 0; i < NUM_POINTS; ++i)
+    points.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  Array<Vector3> queries;
+  for (int i = 0; i < NUM_QUERIES; ++i)
+    queries.push_back(Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX));
+
+  typedef KDTreeN<Vector3, 3> KDTree;
+  KDTree kdtree(points.begin(), points.end());
+
+  UpperHalfFilter filter;
+  for (int filtered = 0; filtered < 2; ++filtered)
+    for (int bounded = 0; bounded < 2; ++bounded)
+    {
+      // Roughly half the queries have fewer than K neighbors within the bound
+      double dist_bound = (bounded ? 0.14 : -1);
+      Filter<Vector3> const * f = (filtered ? &filter : nullptr);
+
+      Stopwatch timer;
+      typedef BoundedSortedArray<KDTree::NeighborPair> NeighborSet;
+      Array<NeighborSet> sorted_nbrs(queries.size(), NeighborSet(K));
+      timer.tick();
+        for (size_t i = 0; i < queries.size(); ++i)
+          kdtree.kClosestPairs<MetricL2>(queries[i], sorted_nbrs[i], dist_bound, false, f);
+      timer.tock();
+      double sorted_time = timer.elapsedTime();
+
+      Array<KDTree::NeighborPair> heap_nbrs;
+      double heap_time = 0;
+      for (int sort = 1; sort >= 0; --sort)
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+          timer.tick();
+            intx num_nbrs = kdtree.kClosestPairs<MetricL2>(queries[i], K, heap_nbrs, dist_bound, (sort != 0), true, f);
+          timer.tock();
+          if (sort) heap_time += timer.elapsedTime();
+
+          NeighborSet const & expected = sorted_nbrs[i];
+          if (num_nbrs != expected.size() || (intx)heap_nbrs.size() != num_nbrs)
+            throw Error(format("Heap-based k-NN query found %ld neighbors instead of %d", (long)num_nbrs, expected.size()));
+
+          if (!sort)
+          {
+            Array<KDTree::NeighborPair> tmp = heap_nbrs;
+            std::sort(tmp.begin(), tmp.end());
+            heap_nbrs = tmp;
+          }
+
+          for (int j = 0; j < expected.size(); ++j)
+          {
+            KDTree::NeighborPair const & pair = heap_nbrs[(size_t)j];
+            if (std::abs(pair.getMonotoneApproxDistance() - expected[j].getMonotoneApproxDistance()) > 1.0e-6
+             || (points[(size_t)pair.getTargetIndex()] - queries[i]).squaredNorm() != pair.getMonotoneApproxDistance()
+             || (pair.getTargetPoint() - points[(size_t)pair.getTargetIndex()]).squaredNorm() > 1.0e-10
+             || (f && !f->allows(points[(size_t)pair.getTargetIndex()])))
+              throw Error(format("Heap-based k-NN query returned the wrong %d'th neighbor (sort = %d)", j, sort));
+          }
+        }
+
+      cout << "Heap-based " << K << "-NN queries (filtered = " << filtered << ", bounded = " << bounded << ") correct: "
+           << 1000 * heap_time << "ms vs " << 1000 * sorted_time << "ms with a sorted array" << endl;
+    }
+}
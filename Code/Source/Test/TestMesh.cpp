@@ -1,24 +1,41 @@
 #define TEST_GENERAL_MESH
 #define TEST_DCEL_MESH
+#define TEST_COMPACT_MESH
+#define TEST_ARENA_MESH
+#define TEST_BINARY_PLY
+#define TEST_PARALLEL_OBJ
+#define TEST_TEXT_FORMATS
+#define TEST_PACKED_MESH_KDTREE
 #define TEST_CONNECTED_COMPONENTS
 #define TEST_MANIFOLD
 #define TEST_IMLS
 #define TEST_ABSTRACT_MESH
 
 #include "../Common.hpp"
+#include "../ArenaAllocator.hpp"
+#include "../Graphics/CompactMesh.hpp"
 #include "../Graphics/DCELMesh.hpp"
 #include "../Graphics/DisplayMesh.hpp"
 #include "../Graphics/GeneralMesh.hpp"
+#include "../Graphics/MeshCodecOBJ.hpp"
+#include "../Graphics/MeshCodecOFF.hpp"
+#include "../Graphics/MeshCodecPLY.hpp"
 #include "../Graphics/MeshType.hpp"
 #include "../Algorithms/ConnectedComponents.hpp"
 #include "../Algorithms/IMLSSurface.hpp"
 #include "../Algorithms/ImplicitSurfaceMesher.hpp"
 #include "../Algorithms/MeshKDTree.hpp"
+#include "../Algorithms/MetricL2.hpp"
+#include "../Algorithms/RayIntersectionTester.hpp"
 #include "../Application.hpp"
 #include "../Array.hpp"
 #include "../FilePath.hpp"
 #include "../FileSystem.hpp"
+#include "../LineScanner.hpp"
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -30,10 +47,17 @@ using namespace Graphics;
 
 typedef GeneralMesh<> GM;
 typedef DCELMesh<> DM;
+typedef GeneralMesh<Graphics::NullAttribute, Graphics::NullAttribute, Graphics::NullAttribute, ArenaAllocator> AM;
 
 void testMesh(int argc, char * argv[]);
 void testGeneralMesh(int argc, char * argv[]);
 void testDCELMesh(int argc, char * argv[]);
+void testCompactMesh(int argc, char * argv[]);
+void testArenaMesh(int argc, char * argv[]);
+void testBinaryPLY(int argc, char * argv[]);
+void testParallelOBJ(int argc, char * argv[]);
+void testTextFormats(int argc, char * argv[]);
+void testPackedMeshKDTree(int argc, char * argv[]);
 void testManifold(int argc, char * argv[]);
 void testIMLS(int argc, char * argv[]);
 void testAbstractMesh(int argc, char * argv[]);
@@ -66,6 +90,12 @@ testMesh(int argc, char * argv[])
 {
   testGeneralMesh(argc, argv);
   testDCELMesh(argc, argv);
+  testCompactMesh(argc, argv);
+  testArenaMesh(argc, argv);
+  testBinaryPLY(argc, argv);
+  testParallelOBJ(argc, argv);
+  testTextFormats(argc, argv);
+  testPackedMeshKDTree(argc, argv);
   testManifold(argc, argv);
   testIMLS(argc, argv);
   testAbstractMesh(argc, argv);
@@ -111,6 +141,832 @@ testDCELMesh(int argc, char * argv[])
 #endif
 }
 
+void
+testCompactMesh(int argc, char * argv[])
+{
+#ifdef TEST_COMPACT_MESH
+
+  // Load the same model through the codecs into both representations
+  string model_path = FilePath::concat(data_dir, "teapot.obj");
+
+  MeshGroup<GM> gen_mg("General Mesh Group");
+  gen_mg.load(model_path);
+  GM const & gen_mesh = **gen_mg.meshesBegin();
+
+  MeshGroup<CompactMesh> cmp_mg("Compact Mesh Group");
+  cmp_mg.load(model_path);
+  CompactMesh const & loaded = **cmp_mg.meshesBegin();
+
+  if (loaded.numVertices() != gen_mesh.numVertices() || loaded.numFaces() != gen_mesh.numFaces())
+    throw Error("Compact mesh loaded from file does not match general mesh");
+
+  // Round-trip through the general mesh representation
+  CompactMesh::Ptr mesh(new CompactMesh("Compact Mesh"));
+  mesh->fromGeneralMesh(gen_mesh);
+
+  GM round_trip;
+  mesh->toGeneralMesh(round_trip);
+  if (round_trip.numVertices() != gen_mesh.numVertices() || round_trip.numFaces() != gen_mesh.numFaces()
+   || round_trip.numEdges() != gen_mesh.numEdges())
+    throw Error("Compact mesh does not round-trip through general mesh");
+
+  auto gfi = gen_mesh.facesBegin();
+  for (intx f = 0; f < mesh->numFaces(); ++f, ++gfi)
+  {
+    CompactMesh::Face face = mesh->getFace(f);
+    if (face.numVertices() != gfi->numVertices()
+     || (face.getVertexPosition(0) - (*gfi->verticesBegin())->getPosition()).squaredNorm() > 1.0e-10f)
+      throw Error("Compact mesh face does not match general mesh face");
+  }
+
+  // Averaged vertex normals are weighted by face area: a vertex shared by a large triangle with normal +Z and a small one with
+  // normal +X gets a normal close to +Z
+  {
+    CompactMesh folded("Folded");
+    Vector3 const POINTS[] = { Vector3(0, 0, 0), Vector3(10, 0, 0), Vector3(0, 10, 0), Vector3(0, 1, 0), Vector3(0, 0, 1) };
+    for (int i = 0; i < 5; ++i)
+      folded.addVertex(POINTS[i]);
+
+    intx const LARGE[] = { 0, 1, 2 }, SMALL[] = { 0, 3, 4 };
+    folded.addFace(3, LARGE);
+    folded.addFace(3, SMALL);
+    folded.computeAveragedVertexNormals();
+
+    Vector3 expected = (100 * Vector3(0, 0, 1) + Vector3(1, 0, 0)).normalized();
+    if ((folded.getNormal(0) - expected).squaredNorm() > 1.0e-10f)
+      throw Error("Compact mesh vertex normals are not weighted by face area");
+  }
+
+  // Every edge of the general mesh with exactly two incident faces must show up as a pair of opposite halfedges
+  intx num_paired = 0;
+  for (intx h = 0; h < mesh->numHalfedges(); ++h)
+  {
+    intx opp = mesh->getOppositeHalfedge(h);
+    if (opp < 0) continue;
+
+    if (mesh->getOppositeHalfedge(opp) != h
+     || mesh->getHalfedgeOrigin(opp) != mesh->getHalfedgeEnd(h)
+     || mesh->getHalfedgeEnd(opp) != mesh->getHalfedgeOrigin(h))
+      throw Error("Compact mesh has inconsistent halfedge pairing");
+
+    num_paired++;
+  }
+
+  intx num_interior_edges = 0;
+  for (auto ei = gen_mesh.edgesBegin(); ei != gen_mesh.edgesEnd(); ++ei)
+    if (ei->numFaces() == 2) num_interior_edges++;
+
+  if (num_paired != 2 * num_interior_edges)
+    throw Error("Compact mesh halfedge pairs do not match general mesh edges");
+
+  for (intx v = 0; v < mesh->numVertices(); ++v)
+  {
+    uint32 const * vf = mesh->getVertexFaces(v);
+    for (intx i = 0; i < mesh->numVertexFaces(v); ++i)
+    {
+      CompactMesh::Face face = mesh->getFace((intx)vf[i]);
+      bool found = false;
+      for (intx j = 0; j < face.numVertices() && !found; ++j)
+        found = (face.getVertexIndex(j) == v);
+
+      if (!found)
+        throw Error("Compact mesh vertex-face adjacency is wrong");
+    }
+  }
+
+  // Closest points from kd-trees on both representations must agree
+  Algorithms::MeshKDTree<GM> gen_kdtree;
+  gen_kdtree.add(const_cast<GM &>(gen_mesh));
+  gen_kdtree.init();
+
+  Algorithms::MeshKDTree<CompactMesh> cmp_kdtree;
+  cmp_kdtree.add(*mesh);
+  cmp_kdtree.init();
+
+  AxisAlignedBox3 const & bounds = mesh->getBounds();
+  for (int i = 0; i < 1000; ++i)
+  {
+    Vector3 p = bounds.getLow() + Vector3(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX)
+                                  .cwiseProduct(bounds.getExtent());
+    double gen_dist = -1, cmp_dist = -1;
+    gen_kdtree.closestElement<MetricL2>(p, -1, &gen_dist);
+    intx index = cmp_kdtree.closestElement<MetricL2>(p, -1, &cmp_dist);
+    if (index < 0 || std::fabs(gen_dist - cmp_dist) > 1.0e-5)
+      throw Error("Compact mesh kd-tree returned the wrong closest triangle");
+  }
+
+  // Write and read back
+  MeshGroup<CompactMesh> out_mg("Compact Mesh Group");
+  out_mg.addMesh(mesh);
+  out_mg.save("compact_mesh.off");
+
+  MeshGroup<CompactMesh> in_mg("Compact Mesh Group");
+  in_mg.load("compact_mesh.off");
+  CompactMesh const & reloaded = **in_mg.meshesBegin();
+  if (reloaded.getFaceVertexIndices() != mesh->getFaceVertexIndices()
+   || reloaded.getFaceOffsets() != mesh->getFaceOffsets())
+    throw Error("Compact mesh did not survive being saved and loaded");
+
+  // Mixed face degrees: a quad and a pentagon sharing an edge
+  CompactMesh mixed("Mixed Compact Mesh");
+  for (int i = 0; i < 7; ++i)
+    mixed.addVertex(Vector3((Real)(i % 4), (Real)(i / 4), 0));
+
+  intx quad[] = { 0, 1, 5, 4 }, pentagon[] = { 1, 2, 3, 6, 5 };
+  mixed.addFace(4, quad);
+  mixed.addFace(5, pentagon);
+
+  MeshTriangles<CompactMesh> mixed_tris;
+  mixed_tris.add(mixed);
+  if (mixed.getQuadMatrix()->cols() != 1 || mixed.getTriangleMatrix()->cols() != 3 || mixed_tris.numTriangles() != 5
+   || mixed.getOppositeHalfedge(1) != 8 || mixed.getOppositeHalfedge(0) != -1)
+    throw Error("Compact mesh with mixed face degrees is wrong");
+
+  // Meshes with faces of a single degree wrap their face index array directly instead of packing a copy
+  CompactMesh quads("Quad Compact Mesh");
+  for (int i = 0; i < 7; ++i)
+    quads.addVertex(Vector3((Real)(i % 4), (Real)(i / 4), 0));
+
+  intx quad2[] = { 1, 2, 6, 5 };
+  quads.addFace(4, quad);
+  quads.addFace(4, quad2);
+
+  if (loaded.getTriangleMatrix()->data() != loaded.getFaceVertices(0) || loaded.getQuadMatrix()->cols() != 0
+   || quads.getQuadMatrix()->data() != quads.getFaceVertices(0) || quads.getQuadMatrix()->cols() != 2
+   || quads.getTriangleMatrix()->cols() != 0)
+    throw Error("Compact mesh with faces of a single degree does not wrap its face indices");
+
+  cout << "Compact mesh with " << mesh->numVertices() << " vertices and " << mesh->numFaces() << " faces matches general mesh ("
+       << num_paired / 2 << " interior edges)" << endl;
+
+#endif
+}
+
+#ifdef TEST_ARENA_MESH
+// A face attribute that owns heap memory, so meshes using it cannot skip destroying their faces.
+struct LabelAttribute : public Graphics::NullAttribute
+{
+  string label;
+};
+#endif
+
+void
+testArenaMesh(int argc, char * argv[])
+{
+#ifdef TEST_ARENA_MESH
+
+  string model_path = FilePath::concat(data_dir, "teapot.obj");
+
+  MeshGroup<GM> gen_mg("General Mesh Group");
+  gen_mg.load(model_path);
+  GM const & gen_mesh = **gen_mg.meshesBegin();
+
+  MeshGroup<AM> arena_mg("Arena Mesh Group");
+  arena_mg.load(model_path);
+  AM & mesh = **arena_mg.meshesBegin();
+
+  if (mesh.numVertices() != gen_mesh.numVertices() || mesh.numFaces() != gen_mesh.numFaces()
+   || mesh.numEdges() != gen_mesh.numEdges())
+    throw Error("Mesh with arena allocator does not match mesh with default allocator");
+
+  // Every mesh draws from its own arena
+  MemoryArena * arena = mesh.getAllocator().getArena();
+  if (!arena || arena->numLiveBlocks() <= 0)
+    throw Error("Mesh with arena allocator does not allocate from an arena");
+
+  AM copy;
+  mesh.copyTo(copy);
+  MemoryArena * copy_arena = copy.getAllocator().getArena();
+  if (copy.numVertices() != mesh.numVertices() || copy.numFaces() != mesh.numFaces() || copy.numEdges() != mesh.numEdges()
+   || !copy_arena || copy_arena == arena || copy_arena->numLiveBlocks() != arena->numLiveBlocks())
+    throw Error("Mesh with arena allocator was not copied correctly");
+
+  for (AM::FaceConstIterator fi = copy.facesBegin(); fi != copy.facesEnd(); ++fi)
+    for (AM::Face::VertexConstIterator fvi = fi->verticesBegin(); fvi != fi->verticesEnd(); ++fvi)
+      if (!(*fvi)->hasIncidentFace(&(*fi)))
+        throw Error("Copy of mesh with arena allocator has inconsistent adjacencies");
+
+  // Clearing the mesh releases its whole arena in one go, after which the mesh can be reused
+  mesh.clear();
+  if (!mesh.isEmpty() || arena->numLiveBlocks() != 0 || arena->numChunks() != 0)
+    throw Error("Mesh with arena allocator did not release its arena when cleared");
+
+  copy.copyTo(mesh);
+  if (mesh.numVertices() != copy.numVertices() || mesh.numFaces() != copy.numFaces() || mesh.numEdges() != copy.numEdges()
+   || mesh.getAllocator().getArena() != arena || arena->numLiveBlocks() != copy_arena->numLiveBlocks())
+    throw Error("Mesh with arena allocator could not be reused after it was cleared");
+
+  // Copying into a non-empty mesh releases its previous contents in bulk as well
+  copy.copyTo(mesh);
+  if (mesh.numFaces() != copy.numFaces() || arena->numLiveBlocks() != copy_arena->numLiveBlocks())
+    throw Error("Mesh with arena allocator was not copied correctly into a non-empty mesh");
+
+  // Removing elements from a mesh returns their blocks to the arena individually
+  intx num_blocks = arena->numLiveBlocks();
+  mesh.removeFace(&(*mesh.facesBegin()));
+  if (arena->numLiveBlocks() >= num_blocks)
+    throw Error("Mesh with arena allocator did not return the blocks of a removed face to the arena");
+
+  // A mesh with attributes that must be destroyed is cleared element by element
+  {
+    typedef GeneralMesh<Graphics::NullAttribute, Graphics::NullAttribute, LabelAttribute, ArenaAllocator> AttribMesh;
+    AttribMesh attrib_mesh;
+    AttribMesh::Vertex * vertices[3];
+    for (int i = 0; i < 3; ++i)
+      vertices[i] = attrib_mesh.addVertex(Vector3((Real)i, (Real)(i * i), 0));
+
+    AttribMesh::Face * face = attrib_mesh.addFace(vertices, vertices + 3);
+    face->attr().label = string(100, 'x');
+    MemoryArena * attrib_arena = attrib_mesh.getAllocator().getArena();
+    size_t num_chunks = attrib_arena->numChunks();
+    attrib_mesh.clear();
+    if (attrib_arena->numLiveBlocks() != 0 || attrib_arena->numChunks() != num_chunks)
+      throw Error("Mesh with arena allocator and non-trivial attributes was not cleared element by element");
+  }
+
+  cout << "Mesh with arena allocator matches general mesh (" << copy_arena->numChunks() << " chunks, "
+       << copy_arena->numLiveBlocks() << " blocks)" << endl;
+
+#endif
+}
+
+#ifdef TEST_BINARY_PLY
+template <typename MeshT>
+void
+checkBinaryPLY(string const & path, GM const & expected)
+{
+  MeshGroup<MeshT> mg("Binary PLY Mesh Group");
+  mg.load(path);
+  if (mg.numMeshes() != 1)
+    throw Error("Binary PLY file was not loaded as a single mesh");
+
+  MeshT const & mesh = **mg.meshesBegin();
+  if (mesh.numVertices() != expected.numVertices() || mesh.numFaces() != expected.numFaces())
+    throw Error(string(mesh.getName()) + ": Binary PLY file was not loaded correctly");
+
+  auto verts = Math::mapTo< Matrix3X const >(*mesh.getVertexMatrix());
+  auto expected_verts = Math::mapTo< Matrix3X const >(*expected.getVertexMatrix());
+  if (verts != expected_verts)
+    throw Error(string(mesh.getName()) + ": Vertices of binary PLY file were not loaded correctly");
+
+  auto tris = Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*mesh.getTriangleMatrix());
+  auto expected_tris = Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*expected.getTriangleMatrix());
+  if (tris != expected_tris)
+    throw Error(string(mesh.getName()) + ": Triangles of binary PLY file were not loaded correctly");
+}
+
+// Write a value to a binary stream, reversing its bytes if \a swap is true.
+template <typename T>
+void
+writeBinaryValue(ostream & out, T value, bool swap)
+{
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  if (swap) std::reverse(bytes, bytes + sizeof(T));
+  out.write(bytes, sizeof(T));
+}
+
+// Write a binary PLY file with float coordinates, optionally followed by other scalar vertex properties, and faces with 32-bit
+// vertex indices.
+void
+writeBinaryPLY(string const & path, Array<Vector3> const & vertices, Array< Array<int32> > const & faces, bool big_endian,
+               bool extra_vertex_props)
+{
+  bool swap = (big_endian != (Endianness::machine() == Endianness::BIG));
+
+  ofstream out(path.c_str(), ios::binary);
+  out << "ply\nformat " << (big_endian ? "binary_big_endian" : "binary_little_endian") << " 1.0\n"
+      << "element vertex " << vertices.size() << "\nproperty float x\nproperty float y\nproperty float z\n";
+  if (extra_vertex_props)
+    out << "property uchar red\nproperty uchar green\nproperty uchar blue\nproperty float confidence\n";
+
+  out << "element face " << faces.size() << "\nproperty list uchar int vertex_indices\nend_header\n";
+
+  for (size_t i = 0; i < vertices.size(); ++i)
+  {
+    for (int j = 0; j < 3; ++j)
+      writeBinaryValue(out, (float32)vertices[i][j], swap);
+
+    if (extra_vertex_props)
+    {
+      for (int j = 0; j < 3; ++j)
+        writeBinaryValue(out, (uint8)(i + j), swap);
+
+      writeBinaryValue(out, (float32)i, swap);
+    }
+  }
+
+  for (size_t i = 0; i < faces.size(); ++i)
+  {
+    writeBinaryValue(out, (uint8)faces[i].size(), swap);
+    for (size_t j = 0; j < faces[i].size(); ++j)
+      writeBinaryValue(out, faces[i][j], swap);
+  }
+}
+
+// A callback that does nothing, but prevents elements from being read in bulk.
+struct NullReadCallback : public MeshGroup<CompactMesh>::ReadCallback {};
+
+// Load a binary PLY file in bulk, and check that the result is the same as when each element is read separately (which is
+// done when a callback is supplied).
+void
+checkBinaryPLYInBulk(string const & path, Array<Vector3> const & vertices, intx num_expected_faces)
+{
+  NullReadCallback null_callback;
+  MeshGroup<CompactMesh> ref_mg("Element-by-element Mesh Group"), bulk_mg("Bulk Mesh Group");
+  ref_mg.load(path, Codec_AUTO(), &null_callback);
+  bulk_mg.load(path);
+
+  MeshGroup<GM> gen_mg("General Mesh Group");
+  gen_mg.load(path);
+
+  if (ref_mg.numMeshes() != 1 || bulk_mg.numMeshes() != 1 || gen_mg.numMeshes() != 1)
+    throw Error(path + ": Binary PLY file was not loaded as a single mesh");
+
+  CompactMesh const & ref = **ref_mg.meshesBegin();
+  CompactMesh const & bulk = **bulk_mg.meshesBegin();
+  GM const & gen = **gen_mg.meshesBegin();
+
+  Matrix3X expected_verts(3, (intx)vertices.size());
+  for (size_t i = 0; i < vertices.size(); ++i)
+    expected_verts.col((intx)i) = vertices[i];
+
+  if (ref.numVertices() != (intx)vertices.size() || ref.numFaces() != num_expected_faces
+   || Math::mapTo< Matrix3X const >(*ref.getVertexMatrix()) != expected_verts)
+    throw Error(path + ": Binary PLY file was not loaded correctly");
+
+  if (Math::mapTo< Matrix3X const >(*bulk.getVertexMatrix()) != expected_verts
+   || bulk.getFaceOffsets() != ref.getFaceOffsets() || bulk.getFaceVertexIndices() != ref.getFaceVertexIndices())
+    throw Error(path + ": Binary PLY file was not loaded correctly in bulk into a compact mesh");
+
+  if (gen.numVertices() != ref.numVertices() || gen.numFaces() != ref.numFaces()
+   || Math::mapTo< Matrix3X const >(*gen.getVertexMatrix()) != expected_verts
+   || Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*gen.getTriangleMatrix())
+   != Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*ref.getTriangleMatrix())
+   || Math::mapTo< Matrix<4, Eigen::Dynamic, uint32> const >(*gen.getQuadMatrix())
+   != Math::mapTo< Matrix<4, Eigen::Dynamic, uint32> const >(*ref.getQuadMatrix()))
+    throw Error(path + ": Binary PLY file was not loaded correctly in batches into a general mesh");
+}
+#endif
+
+void
+testBinaryPLY(int argc, char * argv[])
+{
+#ifdef TEST_BINARY_PLY
+
+  string model_path = FilePath::concat(data_dir, "teapot.obj");
+  string ply_path = "test_binary.ply";
+
+  MeshGroup<GM> src_mg("General Mesh Group");
+  src_mg.load(model_path);
+  src_mg.save(ply_path, CodecPLY<GM>(CodecPLY<GM>::ReadOptions::defaults(), CodecPLY<GM>::WriteOptions().setBinary(true)));
+
+  // General meshes are built one element at a time, compact and display meshes from whole blocks of vertices and triangles
+  MeshGroup<GM> gen_mg("General Mesh Group");
+  gen_mg.load(ply_path);
+  GM const & gen_mesh = **gen_mg.meshesBegin();
+  if (gen_mesh.numVertices() != (**src_mg.meshesBegin()).numVertices()
+   || gen_mesh.numFaces() != (**src_mg.meshesBegin()).numFaces())
+    throw Error("Binary PLY file was not loaded correctly");
+
+  checkBinaryPLY<CompactMesh>(ply_path, gen_mesh);
+  checkBinaryPLY<DisplayMesh>(ply_path, gen_mesh);
+
+  cout << "Binary PLY file loaded identically in bulk (" << gen_mesh.numVertices() << " vertices, " << gen_mesh.numFaces()
+       << " faces)" << endl;
+
+  // A grid large enough to need several batches of vertices and triangles. The faces switch from triangles to quads partway
+  // through, so the reader has to rewind and finish the block element by element, and then switch back to triangles.
+  static int const N = 300;
+  Array<Vector3> grid_verts;
+  for (int i = 0; i < N; ++i)
+    for (int j = 0; j < N; ++j)
+      grid_verts.push_back(Vector3((Real)i, (Real)j, (Real)(0.25 * ((i * j) % 7))));
+
+  Array< Array<int32> > grid_faces;
+  for (int i = 0; i + 1 < N; ++i)
+    for (int j = 0; j + 1 < N; ++j)
+    {
+      int32 a = i * N + j, b = a + N, c = b + 1, d = a + 1;
+      if (i == 2 * N / 3)
+      {
+        int32 quad[] = { a, b, c, d };
+        grid_faces.push_back(Array<int32>(quad, quad + 4));
+      }
+      else
+      {
+        int32 tri0[] = { a, b, c }, tri1[] = { a, c, d };
+        grid_faces.push_back(Array<int32>(tri0, tri0 + 3));
+        grid_faces.push_back(Array<int32>(tri1, tri1 + 3));
+      }
+    }
+
+  // Big-endian files are byte-swapped, and extra vertex properties prevent coordinates from being copied directly
+  for (int big_endian = 0; big_endian < 2; ++big_endian)
+    for (int extra_vertex_props = 0; extra_vertex_props < 2; ++extra_vertex_props)
+    {
+      writeBinaryPLY(ply_path, grid_verts, grid_faces, (bool)big_endian, (bool)extra_vertex_props);
+      checkBinaryPLYInBulk(ply_path, grid_verts, (intx)grid_faces.size());
+    }
+
+  // Triangles with out-of-range vertex indices are skipped with a warning, or raise an error in strict mode
+  Array< Array<int32> > bad_faces = grid_faces;
+  bad_faces[100][1] = (int32)grid_verts.size();
+  bad_faces[70000][2] = -1;
+  writeBinaryPLY(ply_path, grid_verts, bad_faces, false, false);
+  checkBinaryPLYInBulk(ply_path, grid_verts, (intx)grid_faces.size() - 2);
+
+  bool strict_error = false;
+  try
+  {
+    MeshGroup<CompactMesh> strict_mg("Strict Mesh Group");
+    strict_mg.load(ply_path, CodecPLY<CompactMesh>(CodecPLY<CompactMesh>::ReadOptions().setStrict(true)));
+  }
+  catch (Error const & e)
+  {
+    strict_error = (string(e.what()).find("out of bounds") != string::npos);
+  }
+
+  if (!strict_error)
+    throw Error("Out-of-range vertex index in binary PLY file was not reported in strict mode");
+
+  cout << "Binary PLY files with byte-swapping, extra vertex properties, mixed faces and bad indices loaded identically in "
+          "bulk" << endl;
+
+#endif
+}
+
+#ifdef TEST_PARALLEL_OBJ
+// Records every element reported while reading a mesh group, in order.
+struct ReadRecorder : public MeshGroup<CompactMesh>::ReadCallback
+{
+  Array<string> events;
+
+  void vertexRead(CompactMesh * mesh, intx index, CompactMesh::VertexHandle vertex)
+  {
+    events.push_back(format("v %s %ld %ld", mesh->getName(), (long)index, (long)vertex));
+  }
+
+  void faceRead(CompactMesh * mesh, intx index, CompactMesh::FaceHandle face)
+  {
+    events.push_back(format("f %s %ld %ld", mesh->getName(), (long)index, (long)face));
+  }
+};
+#endif
+
+void
+testParallelOBJ(int argc, char * argv[])
+{
+#ifdef TEST_PARALLEL_OBJ
+
+  // Write a grid large enough to be split into several blocks, in two groups, the second using relative vertex indices and
+  // both using Windows-style line endings
+  static int const N = 400;
+  string obj_path = "test_parallel.obj";
+  {
+    ofstream out(obj_path.c_str(), ios::binary);
+    for (int i = 0; i < N; ++i)
+      for (int j = 0; j < N; ++j)
+        out << "v " << i << ' ' << j << ' ' << (i * j) % 7 << "\r\n";
+
+    int num_verts = N * N;
+    for (int i = 0; i + 1 < N; ++i)
+    {
+      if (i == 0 || i == N / 2) out << "g Half" << i << "\r\n";
+      for (int j = 0; j + 1 < N; ++j)
+      {
+        int a = i * N + j + 1, b = a + N, c = b + 1, d = a + 1;
+        if (i < N / 2)
+          out << "f " << a << ' ' << b << ' ' << c << ' ' << d << "\r\n";
+        else
+          out << "f " << a - num_verts - 1 << ' ' << b - num_verts - 1 << ' ' << c - num_verts - 1 << "\r\n";
+      }
+    }
+  }
+
+  typedef CodecOBJ<CompactMesh> OBJCodec;
+  MeshGroup<CompactMesh> seq_mg("Sequential Mesh Group"), par_mg("Parallel Mesh Group");
+  ReadRecorder seq_events, par_events;
+  seq_mg.load(obj_path, OBJCodec(OBJCodec::ReadOptions().setMaxThreads(1)), &seq_events);
+  par_mg.load(obj_path, OBJCodec(OBJCodec::ReadOptions().setMaxThreads(4)), &par_events);
+
+  // Vertices and faces must be reported in the same order, with the same source indices and handles
+  if (seq_events.events.empty() || par_events.events != seq_events.events)
+    throw Error("Parallel read of OBJ file did not report the same elements as sequential read");
+
+  if (seq_mg.numMeshes() != 2 || par_mg.numMeshes() != seq_mg.numMeshes())
+    throw Error("OBJ file was not split into the same meshes by sequential and parallel reads");
+
+  for (auto si = seq_mg.meshesBegin(); si != seq_mg.meshesEnd(); ++si)
+  {
+    CompactMesh const & seq_mesh = **si;
+    auto pi = par_mg.meshesBegin();
+    while (pi != par_mg.meshesEnd() && string((*pi)->getName()) != seq_mesh.getName()) ++pi;
+    if (pi == par_mg.meshesEnd())
+      throw Error(string(seq_mesh.getName()) + ": Mesh not found in parallel read of OBJ file");
+
+    CompactMesh const & par_mesh = **pi;
+    if (par_mesh.numVertices() != seq_mesh.numVertices() || par_mesh.numFaces() != seq_mesh.numFaces())
+      throw Error(string(seq_mesh.getName()) + ": Parallel read of OBJ file has the wrong size");
+
+    auto seq_verts = Math::mapTo< Matrix3X const >(*seq_mesh.getVertexMatrix());
+    auto par_verts = Math::mapTo< Matrix3X const >(*par_mesh.getVertexMatrix());
+    auto seq_tris = Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*seq_mesh.getTriangleMatrix());
+    auto par_tris = Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*par_mesh.getTriangleMatrix());
+    auto seq_quads = Math::mapTo< Matrix<4, Eigen::Dynamic, uint32> const >(*seq_mesh.getQuadMatrix());
+    auto par_quads = Math::mapTo< Matrix<4, Eigen::Dynamic, uint32> const >(*par_mesh.getQuadMatrix());
+    if (seq_tris.cols() + seq_quads.cols() != seq_mesh.numFaces())
+      throw Error(string(seq_mesh.getName()) + ": Faces of OBJ file are not all triangles and quads");
+
+    if (par_verts != seq_verts || par_tris != seq_tris || par_quads != seq_quads)
+      throw Error(string(seq_mesh.getName()) + ": Parallel read of OBJ file does not match sequential read");
+  }
+
+  cout << "OBJ file read identically in parallel (" << seq_mg.numMeshes() << " meshes, " << seq_events.events.size()
+       << " elements reported)" << endl;
+
+#endif
+}
+
+#ifdef TEST_TEXT_FORMATS
+// Check that LineScanner parses a real number exactly like strtod does, consuming the same characters.
+void
+checkParseReal(char const * s)
+{
+  char const * p = s;
+  double value = 0;
+  bool ok = LineScanner::parseReal(p, s + strlen(s), value);
+
+  char * expected_end = nullptr;
+  double expected = std::strtod(s, &expected_end);
+  bool expected_ok = (expected_end != s);
+
+  bool same_value = std::isnan(expected) ? std::isnan(value) : (std::memcmp(&value, &expected, sizeof(double)) == 0);
+  if (ok != expected_ok || (ok && (p != expected_end || !same_value)) || (!ok && p != s))
+    throw Error(format("LineScanner: Real number '%s' was parsed as %.17g (%ld chars), expected %.17g (%ld chars)", s,
+                       value, (long)(p - s), expected, (long)(expected_end - s)));
+}
+
+// Check the result of LineScanner::parseInteger() on a string. If \a expected_length is zero, parsing should fail.
+void
+checkParseInteger(char const * s, intx expected_value, intx expected_length)
+{
+  char const * p = s;
+  intx value = 0;
+  bool ok = LineScanner::parseInteger(p, s + strlen(s), value);
+  if (ok != (expected_length > 0) || (ok && value != expected_value) || p - s != expected_length)
+    throw Error(format("LineScanner: Integer '%s' was parsed as %ld (%ld chars)", s, (long)value, (long)(p - s)));
+}
+
+// Write a mesh file and check that loading it fails with an error message containing a given string.
+template <typename MeshT>
+void
+checkLoadError(string const & path, string const & contents, string const & expected_error, Codec const & codec = Codec_AUTO())
+{
+  {
+    ofstream out(path.c_str(), ios::binary);
+    out << contents;
+  }
+
+  try
+  {
+    MeshGroup<MeshT> mg("Invalid Mesh Group");
+    mg.load(path, codec);
+  }
+  catch (Error const & e)
+  {
+    if (string(e.what()).find(expected_error) == string::npos)
+      throw Error(path + ": Expected error containing '" + expected_error + "', got '" + e.what() + '\'');
+
+    return;
+  }
+
+  throw Error(path + ": Invalid file was loaded without error");
+}
+#endif
+
+void
+testTextFormats(int argc, char * argv[])
+{
+#ifdef TEST_TEXT_FORMATS
+
+  // Real numbers must be parsed like strtod, whether or not the fast path applies
+  static char const * REALS[] = {
+    "0", "-0", "+0.0", "1", "-17", "+1.5", "3.", ".25", "-.5", "0.1", "0.000123456", "1e10", "1E-5", "-2.5e+3", "7e22", "7e23",
+    "1e-22", "1e-23", "123456789012345", "1234567890123456", "12345678901234567890123", "0.12345678901234567890",
+    "9007199254740993", "1e308", "1e309", "-1e400", "1e-320", "4.9e-324", "1e-400", "1e", "1e+", "2E-x", "1.5abc", "12,5",
+    "1.2.3", "--1", "+-1", "-", "+", ".", "e5", "abc", "", "inf", "-INF", "Infinity", "infinite", "nan", "-NaN", "nanx"
+  };
+  for (size_t i = 0; i < sizeof(REALS) / sizeof(REALS[0]); ++i)
+    checkParseReal(REALS[i]);
+
+  // Integers take an optional sign, stop at the first non-digit, and overlong ones are rejected
+  checkParseInteger("0", 0, 1);
+  checkParseInteger("-42", -42, 3);
+  checkParseInteger("+7", 7, 2);
+  checkParseInteger("123abc", 123, 3);
+  checkParseInteger("1.5", 1, 1);
+  checkParseInteger("-1e3", -1, 2);
+  checkParseInteger("999999999999999999", 999999999999999999LL, 18);
+  checkParseInteger("-999999999999999999", -999999999999999999LL, 19);
+  checkParseInteger("1234567890123456789", 0, 0);
+  checkParseInteger("00000000000000000000001", 0, 0);
+  checkParseInteger("", 0, 0);
+  checkParseInteger("-", 0, 0);
+  checkParseInteger("+-3", 0, 0);
+  checkParseInteger(" 5", 0, 0);
+  checkParseInteger("x1", 0, 0);
+
+  // Lines may end with LF, CR or CRLF, and are trimmed. Blank lines are counted in line numbers.
+  {
+    string text = "a\r\nb\rc\n\n  d 1.5 -2e3 xyz \r\n\r\n# comment\n\tf";
+    BinaryInputStream in((uint8 const *)text.data(), (int64)text.size(), Endianness::LITTLE, false);
+    LineScanner scanner(in);
+
+    static char const * LINES[] = { "a", "b", "c", "", "d 1.5 -2e3 xyz", "", "# comment", "f" };
+    for (intx i = 0; i < (intx)(sizeof(LINES) / sizeof(LINES[0])); ++i)
+    {
+      if (!scanner.readLine() || scanner.getLine() != LINES[i] || scanner.getLineNumber() != i + 1)
+        throw Error(format("LineScanner: Line %ld was read as '%s' (line number %ld)", (long)(i + 1),
+                           scanner.getLine().c_str(), (long)scanner.getLineNumber()));
+
+      if (i == 4)
+      {
+        char const * field_begin = nullptr, * field_end = nullptr;
+        double x = 0, y = 0, z = 0;
+        if (!scanner.readField(field_begin, field_end) || string(field_begin, field_end) != "d"
+         || !scanner.readReal(x) || !scanner.readReal(y) || x != 1.5 || y != -2000 || scanner.readReal(z)
+         || scanner.readRest() != "xyz" || !scanner.atEnd())
+          throw Error("LineScanner: Fields were not read correctly");
+      }
+    }
+
+    if (scanner.readLine() || scanner.hasMore())
+      throw Error("LineScanner: Read past the end of the input");
+
+    BinaryInputStream in2((uint8 const *)text.data(), (int64)text.size(), Endianness::LITTLE, false);
+    LineScanner scanner2(in2);
+    for (int i = 0; i < 5; ++i) scanner2.readNonEmptyLine('#');
+    if (scanner2.getLine() != "f" || scanner2.getLineNumber() != 8 || scanner2.readNonEmptyLine('#'))
+      throw Error("LineScanner: Blank lines and comments were not skipped correctly");
+  }
+
+  // An ASCII PLY file with mixed line endings, blank lines and comments
+  static string const PLY_HEADER = "ply\r\nformat ascii 1.0\r\ncomment test\r\nelement vertex 4\r\nproperty float x\r\n"
+                                   "property float y\r\nproperty float z\r\nelement face 2\r\n"
+                                   "property list uchar int vertex_indices\r\nend_header\r\n";
+  string ply_path = "test_ascii.ply";
+  {
+    ofstream out(ply_path.c_str(), ios::binary);
+    out << PLY_HEADER << "0 0 0\r\n\r\n1 0.5 -2.5e-1\r0 1e1 0\n  \ncomment inline\n1 1 1\r\n3 0 1 2\r\n3 2 1 3";
+  }
+
+  MeshGroup<CompactMesh> ply_mg("ASCII PLY Mesh Group");
+  ply_mg.load(ply_path);
+  if (ply_mg.numMeshes() != 1)
+    throw Error("ASCII PLY file was not loaded as a single mesh");
+
+  CompactMesh const & ply_mesh = **ply_mg.meshesBegin();
+  Matrix3X expected_verts(3, 4);
+  expected_verts << 0, 1, 0, 1,
+                    0, 0.5, 10, 1,
+                    0, -0.25, 0, 1;
+  Matrix<3, Eigen::Dynamic, uint32> expected_tris(3, 2);
+  expected_tris << 0, 2,
+                   1, 1,
+                   2, 3;
+  if (ply_mesh.numVertices() != 4 || ply_mesh.numFaces() != 2
+   || Math::mapTo< Matrix3X const >(*ply_mesh.getVertexMatrix()) != expected_verts
+   || Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*ply_mesh.getTriangleMatrix()) != expected_tris)
+    throw Error("ASCII PLY file was not loaded correctly");
+
+  // A larger model written as ASCII PLY and read back
+  {
+    MeshGroup<GM> src_mg("General Mesh Group");
+    src_mg.load(FilePath::concat(data_dir, "teapot.obj"));
+    src_mg.save(ply_path, CodecPLY<GM>(CodecPLY<GM>::ReadOptions::defaults(), CodecPLY<GM>::WriteOptions().setBinary(false)));
+
+    MeshGroup<CompactMesh> mg("ASCII PLY Mesh Group");
+    mg.load(ply_path);
+    GM const & src_mesh = **src_mg.meshesBegin();
+    CompactMesh const & mesh = **mg.meshesBegin();
+    if (mg.numMeshes() != 1 || mesh.numVertices() != src_mesh.numVertices() || mesh.numFaces() != src_mesh.numFaces()
+     || Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*mesh.getTriangleMatrix())
+     != Math::mapTo< Matrix<3, Eigen::Dynamic, uint32> const >(*src_mesh.getTriangleMatrix()))
+      throw Error("ASCII PLY file was not read back correctly");
+  }
+
+  // Errors must report the line number in the file, counting header, blank and comment lines and all kinds of line endings
+  checkLoadError<CompactMesh>(ply_path, PLY_HEADER + "0 0 0\r\n\r\n1 0 0\r0 1 x\n1 1 1\n3 0 1 2\n3 2 1 3\n",
+                              "Could not read vertex on line 14: '0 1 x'");
+  checkLoadError<CompactMesh>(ply_path, PLY_HEADER + "0 0 0\n1 0 0\r\n0 1 0\r1 1 1\n\n3 0 1\n3 2 1 3\n",
+                              "Could not read vertex index on line 16: '3 0 1'",
+                              CodecPLY<CompactMesh>(CodecPLY<CompactMesh>::ReadOptions().setStrict(true)));
+  checkLoadError<CompactMesh>("test_ascii.off", "OFF\r\n3 1 0\r\n\r\n# comment\n0 0 0\r1 0 0\n0 1 x\n3 0 1 2\n",
+                              "Could not read vertex on line 7: '0 1 x'");
+  checkLoadError<CompactMesh>("test_ascii.obj", "v 0 0 0\r\n\r\n# comment\rv 1 0 0\nv 0 1 zz\r\nf 1 2 3\n",
+                              "Could not read vertex position on line 5: 'v 0 1 zz'");
+
+  cout << "Text mesh formats parsed correctly" << endl;
+
+#endif
+}
+
+void
+testPackedMeshKDTree(int argc, char * argv[])
+{
+#ifdef TEST_PACKED_MESH_KDTREE
+
+  // A soup of random triangles
+  static int const NUM_TRIANGLES = 20000;
+  static int const NUM_QUERIES = 5000;
+
+  GM mesh("Random triangles");
+  GM::Vertex * face[3];
+  for (int i = 0; i < NUM_TRIANGLES; ++i)
+  {
+    Vector3 c(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+    for (int j = 0; j < 3; ++j)
+      face[j] = mesh.addVertex(c + 0.05f * Vector3(rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f,
+                                                   rand() / (Real)RAND_MAX - 0.5f));
+
+    mesh.addFace(face, face + 3);
+  }
+
+  Algorithms::MeshKDTree<GM> kdtree, packed_kdtree;
+  kdtree.add(mesh);
+  kdtree.init();
+  packed_kdtree.add(mesh);
+  packed_kdtree.init();
+  packed_kdtree.enablePackedTriangles();
+
+  for (int transformed = 0; transformed < 2; ++transformed)
+  {
+    if (transformed)
+    {
+      AffineTransform3 tr = AffineTransform3::translation(0.1f, -0.2f, 0.3f)
+                          * AffineTransform3::rotationAxisAngle(Vector3(1, 1, 0), 0.5f);
+      kdtree.setTransform(tr);
+      packed_kdtree.setTransform(tr);
+    }
+
+    int num_hits = 0;
+    Array<Ray3> rays;
+    Array<RayStructureIntersection3> isecs;
+    for (int i = 0; i < NUM_QUERIES; ++i)
+    {
+      Vector3 p(rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX, rand() / (Real)RAND_MAX);
+      Vector3 dir(rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f, rand() / (Real)RAND_MAX - 0.5f);
+      Ray3 ray(p - dir, dir);
+      rays.push_back(ray);
+
+      RayStructureIntersection3 isec = kdtree.rayStructureIntersection<RayIntersectionTester>(ray);
+      RayStructureIntersection3 packed_isec = packed_kdtree.rayStructureIntersection<RayIntersectionTester>(ray);
+      if (isec.isValid() != packed_isec.isValid()
+       || (isec.isValid() && (std::fabs(isec.getTime() - packed_isec.getTime()) > 1.0e-4f
+                           || (isec.getNormal() - packed_isec.getNormal()).squaredNorm() > 1.0e-6f)))
+        throw Error("Packed mesh kd-tree returned the wrong ray intersection");
+
+      // The returned index must refer to the hit triangle of the mesh
+      if (packed_isec.isValid() && !transformed
+       && std::fabs(packed_kdtree.getElements()[packed_isec.getElementIndex()].rayIntersectionTime(ray)
+                  - packed_isec.getTime()) > 1.0e-4f)
+        throw Error("Packed mesh kd-tree returned the wrong triangle index for a ray intersection");
+
+      if (isec.isValid()) num_hits++;
+      isecs.push_back(packed_isec);
+
+      double dist = -1, packed_dist = -1;
+      Vector3 cp = Vector3::Zero(), packed_cp = Vector3::Zero();
+      intx index = kdtree.closestElement<MetricL2>(p, -1, &dist, &cp);
+      intx packed_index = packed_kdtree.closestElement<MetricL2>(p, -1, &packed_dist, &packed_cp);
+      if (index < 0 || packed_index < 0 || std::fabs(dist - packed_dist) > 1.0e-5 || (cp - packed_cp).squaredNorm() > 1.0e-8
+       || (!transformed && std::fabs(packed_kdtree.getElements()[packed_index].distance(p) - packed_dist) > 1.0e-5))
+        throw Error("Packed mesh kd-tree returned the wrong closest triangle");
+    }
+
+    // Batched ray queries must match the individual queries
+    Array<Real> batch_times(rays.size());
+    Array<RayStructureIntersection3> batch_isecs(rays.size());
+    packed_kdtree.rayIntersectionTimes<RayIntersectionTester>(&rays[0], (intx)rays.size(), &batch_times[0]);
+    packed_kdtree.rayStructureIntersections<RayIntersectionTester>(&rays[0], (intx)rays.size(), &batch_isecs[0]);
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+      if (batch_times[i] != isecs[i].getTime()
+       || batch_isecs[i].isValid() != isecs[i].isValid()
+       || (isecs[i].isValid() && (batch_isecs[i].getTime() != isecs[i].getTime()
+                               || batch_isecs[i].getElementIndex() != isecs[i].getElementIndex()
+                               || batch_isecs[i].getNormal() != isecs[i].getNormal())))
+        throw Error("Packed mesh kd-tree returned the wrong batched ray intersection");
+    }
+
+    cout << "Packed mesh kd-tree (transformed = " << transformed << ") matches regular kd-tree on " << NUM_QUERIES
+         << " ray (" << num_hits << " hits) and closest-point queries" << endl;
+  }
+
+#endif
+}
+
 #ifdef TEST_MANIFOLD
 bool isManifold(GM const & mesh)
 {
@@ -341,6 +1197,7 @@ testAbstractMesh(int argc, char * argv[])
   saveAbstractMesh<GM>         (model_path, "abstract_gen.obj");
   saveAbstractMesh<DM>         (model_path, "abstract_dcel.obj");
   saveAbstractMesh<DisplayMesh>(model_path, "abstract_disp.obj");
+  saveAbstractMesh<CompactMesh>(model_path, "abstract_cmp.obj");
 #endif
 }
 
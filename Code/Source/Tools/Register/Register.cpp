@@ -209,9 +209,7 @@ findNeighbors(SampleArray const & samples, KDTree const & kdtree, NeighborSets &
   for (size_t i = 0; i < samples.size(); ++i)
   {
     NNFilter filter(samples[i].n, samples[i].label);
-    const_cast<KDTree &>(kdtree).pushFilter(&filter);
-      kdtree.kClosestPairs<MetricL2>(samples[i].p, init_nbrs);
-    const_cast<KDTree &>(kdtree).popFilter();
+    kdtree.kClosestPairs<MetricL2>(samples[i].p, init_nbrs, -1, false, &filter);
 
     for (int j = 0; j < init_nbrs.size() && nbrs[i].size() < MAX_NBRS; ++j)
     {
@@ -261,9 +259,7 @@ updateOffsets(SampleArray const & src_samples, KDTree const & tgt_kdtree, Offset
     Vector3 offset_p = src_samples[i].p + src_offsets[i].d();
 
     NNFilter filter(src_samples[i].n, src_samples[i].label);
-    const_cast<KDTree &>(tgt_kdtree).pushFilter(&filter);
-      intx nn_index = tgt_kdtree.closestElement<MetricL2>(offset_p);
-    const_cast<KDTree &>(tgt_kdtree).popFilter();
+    intx nn_index = tgt_kdtree.closestElement<MetricL2>(offset_p, -1, nullptr, nullptr, &filter);
 
     if (nn_index >= 0)
     {
@@ -758,9 +754,7 @@ alignNonRigid(SampleArray & samples1, SampleArray & samples2, Array<Vector3> con
       for (size_t i = 0; i < samples1.size(); ++i)
       {
         NNFilter filter(samples1[i].n, samples1[i].label);
-        offset_kdtree2.pushFilter(&filter);
-          intx nn_index = offset_kdtree2.closestElement<MetricL2>(samples1[i].p);
-        offset_kdtree2.popFilter();
+        intx nn_index = offset_kdtree2.closestElement<MetricL2>(samples1[i].p, -1, nullptr, nullptr, &filter);
 
         if (nn_index >= 0)
           offsets1[i].set(0.5f * offsets1[i].d() - 0.5f * offsets2[(size_t)nn_index].d());
@@ -1152,9 +1146,7 @@ main(int argc, char * argv[])
 
       Vector3 deformed_p1 = p1 + offsets1[i].d();
       NNFilterLabelOnly filter(samples1[i].label);
-      kdtree2.pushFilter(&filter);
-        intx nn_index = kdtree2.closestElement<MetricL2>(deformed_p1);
-      kdtree2.popFilter();
+      intx nn_index = kdtree2.closestElement<MetricL2>(deformed_p1, -1, nullptr, nullptr, &filter);
 
       if (nn_index < 0)
       {
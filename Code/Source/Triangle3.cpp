@@ -945,6 +945,54 @@ rayTriangleIntersectionTime(Ray3 const & ray, Vector3 const & v0, Vector3 const
   return -1;
 }
 
+bool
+triangleIntersectsAxisAlignedBox(Vector3 const & v0, Vector3 const & v1, Vector3 const & v2, Vector3 const & box_center,
+                                 Vector3 const & box_half_extent)
+{
+  // Separating axis test from Tomas Akenine-Moller, "Fast 3D Triangle-Box Overlap Testing", Journal of Graphics Tools, 6(1),
+  // 2001. The triangle and box are disjoint iff their projections are disjoint on one of 13 axes: the 3 box face normals, the
+  // triangle normal, and the 9 cross products of a box edge direction with a triangle edge.
+
+  // Move the box to the origin
+  Vector3 const p[3] = { v0 - box_center, v1 - box_center, v2 - box_center };
+  Vector3 const & h = box_half_extent;
+
+  // Box face normals, i.e. the bounding box of the triangle against the box
+  for (int i = 0; i < 3; ++i)
+  {
+    if (std::min(std::min(p[0][i], p[1][i]), p[2][i]) > h[i]
+     || std::max(std::max(p[0][i], p[1][i]), p[2][i]) < -h[i])
+      return false;
+  }
+
+  // Cross products of the coordinate axes and the triangle edges
+  Vector3 const e[3] = { p[1] - p[0], p[2] - p[1], p[0] - p[2] };
+  for (int i = 0; i < 3; ++i)  // triangle edge
+  {
+    for (int j = 0; j < 3; ++j)  // box axis
+    {
+      // The axis is unit_j x e[i]
+      int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+      Real a1 = -e[i][j2], a2 = e[i][j1];  // components of the axis along j1 and j2 (the component along j is zero)
+
+      Real d0 = a1 * p[0][j1] + a2 * p[0][j2];
+      Real d1 = a1 * p[1][j1] + a2 * p[1][j2];
+      Real d2 = a1 * p[2][j1] + a2 * p[2][j2];
+      Real r = h[j1] * std::abs(a1) + h[j2] * std::abs(a2);
+
+      if (std::min(std::min(d0, d1), d2) > r || std::max(std::max(d0, d1), d2) < -r)
+        return false;
+    }
+  }
+
+  // Triangle normal: check if the plane of the triangle separates the corners of the box
+  Vector3 n = e[0].cross(e[1]);
+  Real r = h[0] * std::abs(n[0]) + h[1] * std::abs(n[1]) + h[2] * std::abs(n[2]);
+  Real d = n.dot(p[0]);  // the plane is n.x = d
+
+  return std::abs(d) <= r;
+}
+
 } // namespace Triangle3Internal
 
 } // namespace Thea
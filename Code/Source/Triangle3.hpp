@@ -117,6 +117,10 @@ THEA_API Vector3 closestPointOnTrianglePerimeter(Vector3 const & v0,
 // Intersection time of a ray with a triangle. Returns a negative value if the ray does not intersect the triangle.
 THEA_API Real rayTriangleIntersectionTime(Ray3 const & ray, Vector3 const & v0, Vector3 const & edge01, Vector3 const & edge02);
 
+// Check if a triangle intersects an axis-aligned box, specified by its center and half-extent.
+THEA_API bool triangleIntersectsAxisAlignedBox(Vector3 const & v0, Vector3 const & v1, Vector3 const & v2,
+                                               Vector3 const & box_center, Vector3 const & box_half_extent);
+
 } // namespace Triangle3Internal
 
 /**
@@ -289,13 +293,40 @@ class /* THEA_DLL_LOCAL */ Triangle3Base : public RayIntersectable3
     }
 
     /** Check if the triangle intersects a ball. */
-    bool intersects(Ball3 const & ball) const { throw Error("Triangle3: Intersection with ball not implemented"); }
+    bool intersects(Ball3 const & ball) const
+    {
+      // Quick rejection if the ball is too far from the plane of the triangle
+      Real r = ball.getRadius();
+      if (std::abs(getPlane().signedDistance(ball.getCenter())) > r)
+        return false;
+
+      return squaredDistance(ball.getCenter()) <= r * r;
+    }
 
     /** Check if the triangle intersects an axis-aligned box. */
-    bool intersects(AxisAlignedBox3 const & aab) const { throw Error("Triangle3: Intersection with AAB not implemented"); }
+    bool intersects(AxisAlignedBox3 const & aab) const
+    {
+      if (aab.isNull())
+        return false;
+
+      return Triangle3Internal::triangleIntersectsAxisAlignedBox(getVertex(0), getVertex(1), getVertex(2), aab.getCenter(),
+                                                                 0.5f * aab.getExtent());
+    }
 
     /** Check if the triangle intersects an oriented box. */
-    bool intersects(Box3 const & box) const { throw Error("Triangle3: Intersection with oriented box not implemented"); }
+    bool intersects(Box3 const & box) const
+    {
+      AxisAlignedBox3 const & local_aab = box.getLocalAAB();
+      if (local_aab.isNull())
+        return false;
+
+      // Test the triangle against the axis-aligned box in the local frame of the box
+      CoordinateFrame3 const & frame = box.getLocalFrame();
+      return Triangle3Internal::triangleIntersectsAxisAlignedBox(frame.pointToObjectSpace(getVertex(0)),
+                                                                 frame.pointToObjectSpace(getVertex(1)),
+                                                                 frame.pointToObjectSpace(getVertex(2)),
+                                                                 local_aab.getCenter(), 0.5f * local_aab.getExtent());
+    }
 
     /** Check if the triangle contains a point. */
     bool contains(Vector3 const & p) const